@@ -0,0 +1,171 @@
+/*
+    Example compares adaptive anti-aliasing with full supersampling of every
+     pixel: render cost & error against high-sample reference
+
+	cpp math utilities
+    Copyright (C) 2019-3041  bitrate16
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cmath>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include "RayTrace.h"
+#include "RayTraceRenderer.h"
+#include "lodepng.h"
+
+using namespace spaint;
+using namespace cppmath;
+using namespace raytrace;
+
+#define WIDTH 300
+#define HEIGHT 300
+#define THREAD_COUNT 4
+// Side of sub-pixel grid of reference
+#define REFERENCE_GRID 8
+// Each render is repeated to measure time
+#define RUNS 3
+// Allowed error of adaptive anti-aliasing relative to full supersampling
+#define MAX_ERROR_RATIO 1.1
+// Write images into current directory
+// #define WRITE_IMAGES
+
+// bash c.sh "-lpthread" example/raytrace_adaptive_aa
+
+void create_scene(RayTrace& rt) {
+	rt.set_background(Color(30, 30, 50));
+	RayTraceScene& scene = rt.get_scene();
+	scene.use_shadows = 1;
+
+	UVPlane* floor_plane = new UVPlane(vec3(0, -60, 0), vec3(0, 1, 0));
+	floor_plane->material.color = Color::WHITE;
+	floor_plane->uv_map = [](double u, double v) -> Color {
+		return ((int) std::floor(u / 25.0) + (int) std::floor(v / 25.0)) & 1 ? Color::WHITE : Color(60, 60, 60);
+	};
+	scene.addObject(floor_plane);
+
+	Color colors[3] = { Color::RED, Color::GREEN, Color::BLUE };
+	for (int i = 0; i < 9; ++i) {
+		Sphere* s = new Sphere(vec3(-80 + (i % 3) * 80, -30 + (i / 3) * 50, 250 + (i % 2) * 60), 22);
+		s->material.color = colors[i % 3];
+		scene.addObject(s);
+	}
+
+	for (int i = 0; i < 6; ++i) {
+		vec3 c(-100 + i * 40, 70, 220);
+		Triangle* t = new Triangle(c + vec3(-15, -12, 0), c + vec3(15, -12, 5), c + vec3(2, 14, -5));
+		t->material.color = colors[(i + 1) % 3];
+		scene.addObject(t);
+	}
+
+	Sphere* light = new Sphere(vec3(-100, 250, 100), 5);
+	light->material.color = Color::WHITE;
+	light->material.luminosity = 1.0;
+	light->material.surface_visible = 0;
+	scene.addObject(light);
+
+	scene.build();
+};
+
+// Average of REFERENCE_GRID * REFERENCE_GRID sub-pixel samples as r, g, b
+std::vector<double> render_reference(RayTrace& rt) {
+	std::vector<double> reference((size_t) WIDTH * HEIGHT * 3, 0.0);
+	Renderer renderer(rt, THREAD_COUNT);
+	renderer.run([&rt, &reference](const Tile& t, int) {
+		for (int y = t.y; y < t.y + t.height; ++y)
+			for (int x = t.x; x < t.x + t.width; ++x) {
+				double sum[3] = { 0.0, 0.0, 0.0 };
+				for (int j = 0; j < REFERENCE_GRID; ++j)
+					for (int i = 0; i < REFERENCE_GRID; ++i) {
+						Color c = rt.hitColorAt(x, y, (i + 0.5) / REFERENCE_GRID - 0.5, (j + 0.5) / REFERENCE_GRID - 0.5);
+						sum[0] += c.r;
+						sum[1] += c.g;
+						sum[2] += c.b;
+					}
+				size_t p = (size_t) y * WIDTH + x;
+				for (int k = 0; k < 3; ++k)
+					reference[3 * p + k] = sum[k] / (REFERENCE_GRID * REFERENCE_GRID);
+			}
+	});
+	return reference;
+};
+
+// Render frame RUNS times, returns fastest time
+double render(Renderer& renderer, std::vector<unsigned int>& frame) {
+	double best = 0.0;
+	for (int i = 0; i < RUNS; ++i) {
+		auto start = std::chrono::steady_clock::now();
+		renderer.render(frame.data());
+		double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		best = i ? std::min(best, time) : time;
+	}
+	return best;
+};
+
+// Mean absolute difference of channels with reference
+double error(const std::vector<double>& reference, const std::vector<unsigned int>& frame) {
+	double sum = 0.0;
+	for (size_t p = 0; p < frame.size(); ++p)
+		for (int k = 0; k < 3; ++k)
+			sum += std::abs(reference[3 * p + k] - (double) ((frame[p] >> (8 * k)) & 0xFF));
+	return sum / (frame.size() * 3.0);
+};
+
+int main() {
+	RayTrace rt(Camera(WIDTH, HEIGHT));
+	create_scene(rt);
+
+	std::vector<double> reference = render_reference(rt);
+	std::vector<unsigned int> frame(WIDTH * HEIGHT);
+	Renderer renderer(rt, THREAD_COUNT);
+
+	rt.adaptive_aa = 0;
+	double plain_time = render(renderer, frame);
+	double plain_error = error(reference, frame);
+
+	// Supersample every pixel
+	rt.adaptive_aa = 1;
+	int threshold = rt.aa_threshold;
+	double budget = rt.aa_budget;
+	rt.aa_threshold = 0;
+	rt.aa_budget = 1.0;
+	double full_time = render(renderer, frame);
+	double full_error = error(reference, frame);
+
+	rt.aa_threshold = threshold;
+	rt.aa_budget = budget;
+	double adaptive_time = render(renderer, frame);
+	double adaptive_error = error(reference, frame);
+	double refined = (double) renderer.get_refined_pixels() / (WIDTH * HEIGHT);
+	// Primary rays per pixel
+	double full_rays = 1.0 + rt.aa_grid * rt.aa_grid;
+	double adaptive_rays = 1.0 + refined * rt.aa_grid * rt.aa_grid;
+
+	printf("%-10s %8s %6s %6s %8s\n", "", "time, s", "cost", "rays", "error");
+	printf("%-10s %8.3f %5.2fx %6.2f %8.3f\n", "no aa", plain_time, 1.0, 1.0, plain_error);
+	printf("%-10s %8.3f %5.2fx %6.2f %8.3f\n", "full", full_time, full_time / plain_time, full_rays, full_error);
+	printf("%-10s %8.3f %5.2fx %6.2f %8.3f, %.1f%% pixels refined\n", "adaptive", adaptive_time, adaptive_time / plain_time, adaptive_rays, adaptive_error, refined * 100.0);
+
+	bool quality = adaptive_error <= MAX_ERROR_RATIO * full_error;
+	printf("adaptive error %s %.0f%% of full supersampling at %.0f%% of it's rays\n", quality ? "within" : "exceeds", MAX_ERROR_RATIO * 100.0, adaptive_rays / full_rays * 100.0);
+
+#ifdef WRITE_IMAGES
+	lodepng_encode32_file("adaptive_aa.png", (const unsigned char*) frame.data(), WIDTH, HEIGHT);
+#endif
+
+	return quality ? 0 : 1;
+};
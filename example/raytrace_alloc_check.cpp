@@ -0,0 +1,127 @@
+/*
+    Example counts heap allocations made while rendering a frame
+
+	cpp math utilities
+    Copyright (C) 2019-3041  bitrate16
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <new>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+
+#include "RayTrace.h"
+
+using namespace spaint;
+using namespace cppmath;
+using namespace raytrace;
+
+#define WIDTH 64
+#define HEIGHT 64
+#define SCALE 4
+
+// bash c.sh "" example/raytrace_alloc_check
+
+// Counting allocator: every global operator new increments counter
+std::atomic<long> allocations(0);
+
+// Sized deletes of standard library forward to unsized ones. Replacements are not
+//  inlined, so compiler does not pair malloc() and free() inside them with
+//  operators of caller (-Wmismatched-new-delete).
+__attribute__((noinline)) void* operator new(size_t size) {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	void* p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+};
+
+void* operator new[](size_t size) {
+	return operator new(size);
+};
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+	free(p);
+};
+
+__attribute__((noinline)) void operator delete[](void* p) noexcept {
+	free(p);
+};
+
+void create_scene(RayTrace& rt) {
+	rt.camera = Camera(WIDTH, HEIGHT);
+	rt.set_background(Color::BLACK);
+	rt.get_scene().use_shadows          = 1;
+	rt.get_scene().diffuse_light        = 1;
+	rt.get_scene().random_diffuse_ray   = 1;
+	rt.get_scene().random_diffuse_count = 4;
+	rt.get_scene().average_light_points = 1;
+	rt.get_scene().MAX_RAY_DEPTH        = 3;
+
+	Plane* floor_plane = new Plane(vec3(0, -50, 0) * SCALE, vec3(0, 1, 0));
+	floor_plane->material.color = Color::WHITE;
+	rt.get_scene().addObject(floor_plane);
+
+	Sphere* light_sphere = new Sphere(vec3(0, 20, 80) * SCALE, 10 * SCALE);
+	light_sphere->material.color = Color::WHITE;
+	light_sphere->material.luminosity = 1.0;
+	light_sphere->material.surface_visible = 0;
+	light_sphere->setLightSectorsCount(4);
+	rt.get_scene().addObject(light_sphere);
+
+	Sphere* glass_sphere = new Sphere(vec3(-5, -5, 50) * SCALE, 10 * SCALE);
+	glass_sphere->material.color = Color::WHITE;
+	glass_sphere->material.refract = 0.9;
+	glass_sphere->material.refract_val = 3.3;
+	glass_sphere->material.reflect = 0.1;
+	glass_sphere->material.diffuse = 0.1;
+	rt.get_scene().addObject(glass_sphere);
+
+	Sphere* mirror_sphere = new Sphere(vec3(10, 0, 100) * SCALE, 10 * SCALE);
+	mirror_sphere->material.color = Color::WHITE;
+	mirror_sphere->material.reflect = 0.9;
+	mirror_sphere->material.diffuse = 0.1;
+	rt.get_scene().addObject(mirror_sphere);
+
+	UVSphere* uv_sphere = new UVSphere(vec3(30, 20, 90) * SCALE, 10 * SCALE);
+	uv_sphere->uv_map = [](double u, double) -> Color {
+		return (int) (u * 4) % 2 ? Color::MAGENTA : Color::WHITE;
+	};
+	rt.get_scene().addObject(uv_sphere);
+
+	Triangle* triangle = new Triangle(vec3(-30, -30, 110) * SCALE, vec3(-10, -30, 110) * SCALE, vec3(-20, -10, 110) * SCALE);
+	triangle->material.color = Color::YELLOW;
+	rt.get_scene().addObject(triangle);
+
+	rt.get_scene().build();
+};
+
+int main() {
+	RayTrace rt;
+	create_scene(rt);
+
+	long before = allocations.load();
+
+	for (int y = 0; y < rt.get_height(); ++y)
+		for (int x = 0; x < rt.get_width(); ++x)
+			rt.hitColorAt(x, y);
+
+	long count = allocations.load() - before;
+
+	printf("%ld allocations for %d pixels (%.3f per pixel)\n", count, WIDTH * HEIGHT, (double) count / (WIDTH * HEIGHT));
+
+	return count ? 1 : 0;
+};
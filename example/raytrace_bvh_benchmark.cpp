@@ -0,0 +1,112 @@
+/*
+    Example compares BVH ray queries with linear scan over scene objects
+
+	cpp math utilities
+    Copyright (C) 2019-3041  bitrate16
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+#include "RayTrace.h"
+
+using namespace spaint;
+using namespace cppmath;
+using namespace raytrace;
+
+// Resolution of probing rays grid
+#define WIDTH 64
+#define HEIGHT 64
+
+// bash c.sh "" example/raytrace_bvh_benchmark
+
+// Fill scene with count random primitives in box in front of camera
+void create_scene(RayTrace& rt, int count, bool triangles) {
+	std::mt19937 gen(count);
+	std::uniform_real_distribution<double> pos(-100.0, 100.0);
+	std::uniform_real_distribution<double> depth(100.0, 400.0);
+	std::uniform_real_distribution<double> offset(-5.0, 5.0);
+
+	// Keep primitives size relative to density
+	double size = 40.0 / std::cbrt((double) count);
+
+	rt.camera = Camera(WIDTH, HEIGHT);
+	rt.set_background(Color::BLACK);
+
+	for (int i = 0; i < count; ++i) {
+		vec3 c(pos(gen), pos(gen), depth(gen));
+
+		// Flat emissive material to measure intersection cost only
+		ObjectMaterial material;
+		material.color = Color::WHITE;
+		material.diffuse = 0.0;
+		material.luminosity = 1.0;
+
+		if (triangles) {
+			Triangle* t = new Triangle(c + vec3(offset(gen), offset(gen), offset(gen)) * size,
+									   c + vec3(offset(gen), offset(gen), offset(gen)) * size,
+									   c + vec3(offset(gen), offset(gen), offset(gen)) * size);
+			t->setMaterial(material);
+			rt.get_scene().addObject(t);
+		} else {
+			Sphere* s = new Sphere(c, size);
+			s->setMaterial(material);
+			rt.get_scene().addObject(s);
+		}
+	}
+};
+
+// Render frame & return time in seconds
+double render(RayTrace& rt, int& hits) {
+	hits = 0;
+	auto start = std::chrono::steady_clock::now();
+
+	for (int y = 0; y < rt.get_height(); ++y)
+		for (int x = 0; x < rt.get_width(); ++x)
+			if (rt.hitColorAt(x, y) != rt.get_background())
+				++hits;
+
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+};
+
+int main() {
+	int counts[] = { 10, 1000, 100000 };
+
+	printf("%-10s %8s %12s %12s %12s %10s\n", "primitive", "count", "build (ms)", "linear (ms)", "bvh (ms)", "speedup");
+
+	for (int t = 0; t < 2; ++t)
+		for (int count : counts) {
+			RayTrace rt;
+			create_scene(rt, count, t);
+
+			int linear_hits, bvh_hits;
+			double linear_time = render(rt, linear_hits);
+
+			auto start = std::chrono::steady_clock::now();
+			rt.get_scene().build();
+			double build_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			double bvh_time = render(rt, bvh_hits);
+
+			printf("%-10s %8d %12.3f %12.3f %12.3f %9.1fx\n", t ? "triangle" : "sphere", count, build_time * 1000.0, linear_time * 1000.0, bvh_time * 1000.0, linear_time / bvh_time);
+
+			if (linear_hits != bvh_hits)
+				printf("  hit count mismatch: %d linear, %d bvh\n", linear_hits, bvh_hits);
+		}
+
+	return 0;
+};
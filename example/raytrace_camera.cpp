@@ -0,0 +1,131 @@
+/*
+    Example renders same scene with flat, perspective & orthographic cameras looking
+     at it from the side and compares precomputed camera rays with per-ray computation
+
+	cpp math utilities
+    Copyright (C) 2019-3041  bitrate16
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "RayTrace.h"
+#include "RayTraceRenderer.h"
+#include "lodepng.h"
+
+using namespace spaint;
+using namespace cppmath;
+using namespace raytrace;
+
+#define WIDTH 400
+#define HEIGHT 300
+#define THREAD_COUNT 4
+
+// bash c.sh "-lpthread" example/raytrace_camera
+
+void create_scene(RayTrace& rt) {
+	RayTraceScene& scene = rt.get_scene();
+	scene.use_shadows = 1;
+
+	Plane* floor_plane = new Plane(vec3(0, -20, 0), vec3(0, 1, 0));
+	floor_plane->material.color = Color::WHITE;
+	scene.addObject(floor_plane);
+
+	Color colors[3] = { Color::RED, Color::GREEN, Color::BLUE };
+	for (int i = 0; i < 9; ++i) {
+		Sphere* s = new Sphere(vec3(-40 + (i % 3) * 40, -5, 120 + (i / 3) * 40), 15);
+		s->material.color = colors[i % 3];
+		scene.addObject(s);
+	}
+
+	Sphere* light = new Sphere(vec3(-50, 100, 60), 5);
+	light->material.color = Color::WHITE;
+	light->material.luminosity = 1.0;
+	light->material.surface_visible = 0;
+	scene.addObject(light);
+
+	scene.build();
+};
+
+void save(RayTrace& rt, const std::string& filename) {
+	std::vector<unsigned int> frame(rt.get_width() * rt.get_height());
+	Renderer(rt, THREAD_COUNT).render(frame.data());
+	lodepng_encode32_file(filename.c_str(), (const unsigned char*) frame.data(), rt.get_width(), rt.get_height());
+};
+
+// Generate all rays of frame & return time in seconds, sum keeps generation from being optimized out
+double generate(RayTrace& rt, bool precomputed, double& sum) {
+	std::vector<ray> rays(rt.get_width());
+	auto start = std::chrono::steady_clock::now();
+
+	for (int y = 0; y < rt.get_height(); ++y) {
+		if (precomputed)
+			rt.primary_rays(0, y, rt.get_width(), 1, rays.data());
+		else
+			for (int x = 0; x < rt.get_width(); ++x)
+				rays[x] = rt.get_camera().ray_at(x, y);
+		for (const ray& r : rays)
+			sum += r.B.x;
+	}
+
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+};
+
+// Check that precomputed rays match rays computed one by one
+bool compare(RayTrace& rt) {
+	rt.update_camera();
+	for (int y = 0; y < rt.get_height(); ++y)
+		for (int x = 0; x < rt.get_width(); ++x) {
+			ray a = rt.primary_ray(x, y);
+			ray b = rt.get_camera().ray_at(x, y);
+			if (!(a.A == b.A) || !(a.B == b.B))
+				return 0;
+		}
+	return 1;
+};
+
+int main() {
+	RayTrace rt(Camera(WIDTH, HEIGHT));
+	rt.set_background(Color(30, 30, 50));
+	create_scene(rt);
+
+	const char* names[3] = { "flat", "perspective", "orthographic" };
+	for (int mode = 0; mode < 3; ++mode) {
+		rt.camera = Camera(WIDTH, HEIGHT);
+		if (mode == 1)
+			rt.camera.set_fov(60);
+		else if (mode == 2)
+			rt.camera.set_orthographic(200);
+
+		// Flat projection keeps original view, other cameras look at the scene from above the side
+		if (mode) {
+			rt.camera.location = vec3(150, 80, 20);
+			rt.camera.look_at(vec3(0, -5, 160));
+		}
+
+		double sum = 0.0;
+		rt.update_camera();
+		double precomputed_time = generate(rt, 1, sum);
+		double computed_time = generate(rt, 0, sum);
+
+		save(rt, std::string("camera_") + names[mode] + ".png");
+		printf("%-12s precomputed %7.3f ms, per ray %7.3f ms, %s\n", names[mode], precomputed_time * 1000.0, computed_time * 1000.0, compare(rt) ? "rays match" : "rays differ");
+	}
+
+	return 0;
+};
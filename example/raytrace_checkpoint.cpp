@@ -0,0 +1,147 @@
+/*
+    Example interrupts tile & progressive renders, resumes them from checkpoint
+     and compares result with uninterrupted render
+
+	cpp math utilities
+    Copyright (C) 2019-3041  bitrate16
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+
+#include "RayTrace.h"
+#include "RayTraceRenderer.h"
+#include "RayTraceProgressive.h"
+#include "RayTraceCheckpoint.h"
+
+using namespace spaint;
+using namespace cppmath;
+using namespace raytrace;
+
+#define WIDTH 256
+#define HEIGHT 256
+#define THREAD_COUNT 4
+#define CHECKPOINT "raytrace_checkpoint.bin"
+// Tile render is cancelled after this many tiles to simulate crash
+#define CRASH_TILES 20
+#define SAMPLES 8
+
+// bash c.sh "-lpthread" example/raytrace_checkpoint
+
+void create_scene(RayTrace& rt) {
+	RayTraceScene& scene = rt.get_scene();
+	scene.use_shadows = 1;
+	scene.random_diffuse_ray = 1;
+	scene.random_diffuse_count = 4;
+	scene.sample_sequence = SampleSequence::SOBOL;
+	scene.MAX_RAY_DEPTH = 3;
+
+	Plane* floor_plane = new Plane(vec3(0, -40, 0), vec3(0, 1, 0));
+	floor_plane->material.color = Color::WHITE;
+	floor_plane->material.diffuse = 1.0;
+	scene.addObject(floor_plane);
+
+	Color colors[3] = { Color::RED, Color::GREEN, Color::BLUE };
+	for (int i = 0; i < 6; ++i) {
+		Sphere* s = new Sphere(vec3(-50 + i * 20, -25, 150 + (i % 2) * 30), 15);
+		s->material.color = colors[i % 3];
+		s->material.diffuse = 1.0;
+		scene.addObject(s);
+	}
+
+	Sphere* light = new Sphere(vec3(0, 80, 100), 10);
+	light->material.color = Color::WHITE;
+	light->material.luminosity = 1.0;
+	light->material.surface_visible = 0;
+	scene.addObject(light);
+
+	scene.build();
+};
+
+int main() {
+	RayTrace rt(Camera(WIDTH, HEIGHT));
+	rt.set_background(Color::BLACK);
+	create_scene(rt);
+	std::remove(CHECKPOINT);
+
+	// T I L E S
+
+	std::vector<unsigned int> reference(WIDTH * HEIGHT), frame(WIDTH * HEIGHT, 0);
+	Renderer(rt, THREAD_COUNT).render(reference.data());
+
+	// First run stops after few tiles, checkpoint keeps tiles finished before stop
+	{
+		Renderer renderer(rt, THREAD_COUNT);
+		renderer.on_tile = [&renderer](const Tile&) {
+			if (renderer.get_finished_tiles() >= CRASH_TILES)
+				renderer.cancel();
+		};
+
+		Checkpointer checkpointer(CHECKPOINT, 0.01);
+		bool finished = checkpointer.render(renderer, frame.data());
+		printf("tiles: first run %s, %d of %d tiles finished, %d checkpoints written\n", finished ? "finished" : "interrupted",
+			renderer.get_finished_tiles(), renderer.get_total_tiles(), checkpointer.get_written());
+	}
+
+	// Second run starts with empty frame & renders only missing tiles
+	{
+		std::fill(frame.begin(), frame.end(), 0);
+		Renderer renderer(rt, THREAD_COUNT);
+		std::atomic<int> rendered(0);
+		renderer.on_tile = [&rendered](const Tile&) {
+			++rendered;
+		};
+
+		Checkpointer checkpointer(CHECKPOINT);
+		bool finished = checkpointer.render(renderer, frame.data());
+		printf("tiles: second run %s, %d tiles resumed, %d rendered, frame %s\n", finished ? "finished" : "interrupted",
+			checkpointer.get_resumed(), rendered.load(), frame == reference ? "matches uninterrupted render" : "differs");
+	}
+
+	// P R O G R E S S I V E
+
+	std::vector<unsigned int> progressive_reference(WIDTH * HEIGHT), progressive_frame(WIDTH * HEIGHT);
+	{
+		ProgressiveRenderer progressive(rt, THREAD_COUNT);
+		progressive.render(SAMPLES);
+		progressive.resolve(progressive_reference.data());
+	}
+
+	// First run adds half of samples, then new renderer continues from checkpoint
+	{
+		ProgressiveRenderer progressive(rt, THREAD_COUNT);
+		Checkpointer checkpointer(CHECKPOINT, 0.0);
+		int samples = checkpointer.render(progressive, SAMPLES / 2);
+		printf("progressive: first run %d samples, %d checkpoints written\n", samples, checkpointer.get_written());
+	}
+
+	{
+		ProgressiveRenderer progressive(rt, THREAD_COUNT);
+		Checkpointer checkpointer(CHECKPOINT);
+		auto start = std::chrono::steady_clock::now();
+		int samples = checkpointer.render(progressive, SAMPLES);
+		double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		progressive.resolve(progressive_frame.data());
+		printf("progressive: second run %d samples resumed, %d samples total in %.3f s, frame %s\n", checkpointer.get_resumed(), samples, time,
+			progressive_frame == progressive_reference ? "matches uninterrupted render" : "differs");
+	}
+
+	std::remove(CHECKPOINT);
+	return 0;
+};
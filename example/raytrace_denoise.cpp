@@ -0,0 +1,164 @@
+/*
+    Example renders noisy preview with 1/8 of diffuse samples, denoises it with
+     guided a-trous filter and compares both with full sample render
+
+	cpp math utilities
+    Copyright (C) 2019-3041  bitrate16
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cmath>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+
+#include "RayTrace.h"
+#include "RayTraceRenderer.h"
+#include "RayTraceDenoise.h"
+#include "lodepng.h"
+
+using namespace spaint;
+using namespace cppmath;
+using namespace raytrace;
+
+#define WIDTH 320
+#define HEIGHT 240
+#define THREAD_COUNT 4
+#define REFERENCE_SAMPLES 32
+#define PREVIEW_SAMPLES (REFERENCE_SAMPLES / 8)
+#define DENOISE_RUNS 10
+// Write images of each stage into current directory
+// #define WRITE_IMAGES
+
+// bash c.sh "-lpthread" example/raytrace_denoise
+
+typedef std::chrono::steady_clock timer;
+
+double seconds_since(timer::time_point start) {
+	return std::chrono::duration<double>(timer::now() - start).count();
+};
+
+void create_scene(RayTrace& rt) {
+	rt.set_background(Color(20, 20, 30));
+	RayTraceScene& scene = rt.get_scene();
+	scene.use_shadows = 1;
+	scene.diffuse_light = 1;
+	scene.random_diffuse_ray = 1;
+	scene.MAX_RAY_DEPTH = 3;
+
+	UVPlane* floor_plane = new UVPlane(vec3(0, -40, 0), vec3(0, 1, 0));
+	floor_plane->material.color = Color::WHITE;
+	floor_plane->material.diffuse = 1.0;
+	floor_plane->uv_map = [](double u, double v) -> Color {
+		return ((int) std::floor(u / 20.0) + (int) std::floor(v / 20.0)) & 1 ? Color::WHITE : Color(120, 120, 120);
+	};
+	scene.addObject(floor_plane);
+
+	Color colors[3] = { Color::RED, Color::GREEN, Color::BLUE };
+	for (int i = 0; i < 6; ++i) {
+		Sphere* s = new Sphere(vec3(-50 + i * 20, -25, 150 + (i % 2) * 30), 15);
+		s->material.color = colors[i % 3];
+		s->material.diffuse = 1.0;
+		scene.addObject(s);
+	}
+
+	Sphere* light = new Sphere(vec3(0, 80, 100), 10);
+	light->material.color = Color::WHITE;
+	light->material.luminosity = 1.0;
+	light->material.surface_visible = 0;
+	scene.addObject(light);
+
+	scene.build();
+};
+
+// Root mean square error of color channels
+double rmse(const std::vector<unsigned int>& a, const std::vector<unsigned int>& b) {
+	double sum = 0.0;
+	for (size_t i = 0; i < a.size(); ++i)
+		for (int shift = 0; shift < 24; shift += 8) {
+			double d = (double) ((a[i] >> shift) & 0xFF) - (double) ((b[i] >> shift) & 0xFF);
+			sum += d * d;
+		}
+	return std::sqrt(sum / (a.size() * 3));
+};
+
+double psnr(double rmse) {
+	return 20.0 * std::log10(255.0 / std::max(rmse, 1e-9));
+};
+
+int main() {
+	RayTrace rt(Camera(WIDTH, HEIGHT));
+	create_scene(rt);
+	Renderer renderer(rt, THREAD_COUNT);
+
+	std::vector<unsigned int> reference(WIDTH * HEIGHT), preview(WIDTH * HEIGHT), denoised(WIDTH * HEIGHT), scalar(WIDTH * HEIGHT);
+
+	rt.get_scene().random_diffuse_count = REFERENCE_SAMPLES;
+	auto start = timer::now();
+	renderer.render(reference.data());
+	double reference_time = seconds_since(start);
+
+	rt.get_scene().random_diffuse_count = PREVIEW_SAMPLES;
+	start = timer::now();
+	renderer.render(preview.data());
+	double preview_time = seconds_since(start);
+
+	Denoiser denoiser;
+	denoiser.thread_count = THREAD_COUNT;
+	start = timer::now();
+	denoiser.trace_guides(renderer);
+	double guides_time = seconds_since(start);
+
+	// Best of several runs, first run allocates planes
+	double denoise_time = 1e9;
+	for (int i = 0; i < DENOISE_RUNS; ++i) {
+		start = timer::now();
+		denoiser.denoise(preview.data(), denoised.data());
+		denoise_time = std::min(denoise_time, seconds_since(start));
+	}
+
+	denoiser.level = simd::SCALAR;
+	start = timer::now();
+	denoiser.denoise(preview.data(), scalar.data());
+	double scalar_time = seconds_since(start);
+
+	double megapixels = WIDTH * HEIGHT / 1e6;
+	printf("reference %d samples: %8.3f ms\n", REFERENCE_SAMPLES, reference_time * 1000.0);
+	printf("preview   %d samples:  %8.3f ms\n", PREVIEW_SAMPLES, preview_time * 1000.0);
+	printf("guides:               %8.3f ms\n", guides_time * 1000.0);
+	printf("denoise:              %8.3f ms, %.3f ms per megapixel\n", denoise_time * 1000.0, denoise_time * 1000.0 / megapixels);
+	printf("denoise scalar:       %8.3f ms, %.3f ms per megapixel\n", scalar_time * 1000.0, scalar_time * 1000.0 / megapixels);
+
+	double preview_error = rmse(preview, reference), denoised_error = rmse(denoised, reference);
+	printf("preview  RMSE %6.3f, PSNR %6.2f dB\n", preview_error, psnr(preview_error));
+	printf("denoised RMSE %6.3f, PSNR %6.2f dB\n", denoised_error, psnr(denoised_error));
+
+	bool same = scalar == denoised;
+	printf("scalar filter %s\n", same ? "matches vector filter" : "differs from vector filter");
+
+#ifdef WRITE_IMAGES
+	std::vector<unsigned int> albedo(WIDTH * HEIGHT), normal(WIDTH * HEIGHT), depth(WIDTH * HEIGHT);
+	denoiser.get_guides(albedo.data(), normal.data(), depth.data());
+	lodepng_encode32_file("denoise_reference.png", (const unsigned char*) reference.data(), WIDTH, HEIGHT);
+	lodepng_encode32_file("denoise_preview.png", (const unsigned char*) preview.data(), WIDTH, HEIGHT);
+	lodepng_encode32_file("denoise_denoised.png", (const unsigned char*) denoised.data(), WIDTH, HEIGHT);
+	lodepng_encode32_file("denoise_albedo.png", (const unsigned char*) albedo.data(), WIDTH, HEIGHT);
+	lodepng_encode32_file("denoise_normal.png", (const unsigned char*) normal.data(), WIDTH, HEIGHT);
+	lodepng_encode32_file("denoise_depth.png", (const unsigned char*) depth.data(), WIDTH, HEIGHT);
+#endif
+
+	return same && denoised_error < preview_error ? 0 : 1;
+};
@@ -0,0 +1,236 @@
+/*
+    Example renders frame on forked worker processes & compares it with frame
+     rendered in this process, then renders with slow worker to show rebalancing
+
+	cpp math utilities
+    Copyright (C) 2019-3041  bitrate16
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <thread>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+#include "RayTrace.h"
+#include "RayTraceRenderer.h"
+#include "RayTraceOutput.h"
+#include "RayTraceDistributed.h"
+#include "lodepng.h"
+
+using namespace spaint;
+using namespace cppmath;
+using namespace raytrace;
+
+#define WIDTH 320
+#define HEIGHT 240
+// Largest number of worker processes, runs use 1, 2, 4 ... MAX_WORKERS
+#define MAX_WORKERS 4
+#define FILENAME_PNG "raytrace_distributed.png"
+
+// bash c.sh "-lpthread" example/raytrace_distributed
+// Worker mode: raytrace_distributed --worker, serves coordinator on stdin & stdout
+
+typedef std::chrono::steady_clock timer;
+
+double seconds_since(timer::time_point start) {
+	return std::chrono::duration<double>(timer::now() - start).count();
+};
+
+void create_scene(RayTrace& rt) {
+	rt.set_background(Color::BLACK);
+	RayTraceScene& scene = rt.get_scene();
+	scene.use_shadows = 1;
+	scene.soft_shadows = 1;
+	scene.random_diffuse_ray = 1;
+	scene.random_diffuse_count = 4;
+	scene.sample_sequence = SampleSequence::SOBOL;
+	scene.MAX_RAY_DEPTH = 3;
+
+	Plane* floor_plane = new Plane(vec3(0, -40, 0), vec3(0, 1, 0));
+	floor_plane->material.color = Color::WHITE;
+	floor_plane->material.diffuse = 1.0;
+	scene.addObject(floor_plane);
+
+	Color colors[3] = { Color::RED, Color::GREEN, Color::BLUE };
+	for (int i = 0; i < 6; ++i) {
+		Sphere* s = new Sphere(vec3(-50 + i * 20, -25, 150 + (i % 2) * 30), 15);
+		s->material.color = colors[i % 3];
+		s->material.diffuse = 0.8;
+		s->material.reflect = 0.2;
+		scene.addObject(s);
+	}
+
+	Sphere* light = new Sphere(vec3(0, 80, 100), 10);
+	light->material.color = Color::WHITE;
+	light->material.luminosity = 1.0;
+	light->material.surface_visible = 0;
+	light->setLightSectorsCount(4);
+	scene.addObject(light);
+
+	scene.build();
+};
+
+std::string tiles_string(const std::vector<int>& tiles) {
+	std::string s;
+	for (int t : tiles)
+		s += (s.empty() ? "" : " ") + std::to_string(t);
+	return s;
+};
+
+// Size of corrupt message headers, allocating it would fail
+#define CORRUPT_SIZE (1ull << 62)
+
+// Worker answers message with corrupt size by ERROR instead of allocating payload
+bool worker_rejects_corrupt_size() {
+	using namespace distributed;
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+		return 0;
+
+	fflush(nullptr);
+	pid_t pid = fork();
+	if (pid == 0) {
+		::close(fds[0]);
+		DistributedWorker::serve(fds[1], fds[1]);
+		_exit(0);
+	}
+	::close(fds[1]);
+
+	MessageHeader header = { SCENE, 1, CORRUPT_SIZE };
+	bool rejected = write_all(fds[0], &header, sizeof(header)) && read_all(fds[0], &header, sizeof(header)) && header.type == ERROR;
+	::close(fds[0]);
+	waitpid(pid, nullptr, 0);
+	return rejected;
+};
+
+// Coordinator drops worker sending result with corrupt size & throws std::runtime_error
+bool coordinator_rejects_corrupt_size(RayTrace& rt) {
+	using namespace distributed;
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+		return 0;
+
+	// Fake worker accepts scene & answers first tile with corrupt result
+	fflush(nullptr);
+	pid_t pid = fork();
+	if (pid == 0) {
+		::close(fds[0]);
+		MessageHeader header;
+		std::vector<char> payload;
+		while (read_all(fds[1], &header, sizeof(header))) {
+			payload.resize(header.size);
+			if (!read_all(fds[1], payload.data(), payload.size()))
+				break;
+			if (header.type == SCENE)
+				write_message(fds[1], READY, header.frame, nullptr, 0);
+			else if (header.type == TILE) {
+				MessageHeader result = { RESULT, header.frame, CORRUPT_SIZE };
+				write_all(fds[1], &result, sizeof(result));
+				break;
+			}
+		}
+		_exit(0);
+	}
+	::close(fds[1]);
+
+	bool rejected = 0;
+	{
+		DistributedRenderer distributed(rt);
+		distributed.add_worker(fds[0]);
+		std::vector<unsigned int> frame(WIDTH * HEIGHT);
+		try {
+			distributed.render(frame.data());
+		} catch (const std::runtime_error&) {
+			rejected = distributed.get_worker_count() == 0;
+		}
+	}
+	waitpid(pid, nullptr, 0);
+	return rejected;
+};
+
+int main(int argc, char** argv) {
+	if (argc > 1 && !strcmp(argv[1], "--worker")) {
+		DistributedWorker::serve(0, 1);
+		return 0;
+	}
+
+	RayTrace rt(Camera(WIDTH, HEIGHT));
+	create_scene(rt);
+
+	std::vector<unsigned int> reference(WIDTH * HEIGHT), frame(WIDTH * HEIGHT);
+	auto start = timer::now();
+	Renderer(rt, 1).render(reference.data());
+	double single_time = seconds_since(start);
+	printf("%u hardware threads\n", std::thread::hardware_concurrency());
+	printf("this process, 1 thread: %8.3f ms\n", single_time * 1000.0);
+
+	bool all_same = 1;
+	for (int n = 1; n <= MAX_WORKERS; n *= 2) {
+		DistributedRenderer distributed(rt);
+		distributed.spawn(n);
+
+		start = timer::now();
+		distributed.send_scene();
+		double send_time = seconds_since(start);
+
+		std::fill(frame.begin(), frame.end(), 0);
+		start = timer::now();
+		distributed.render(frame.data());
+		double time = seconds_since(start);
+
+		bool same = frame == reference;
+		all_same &= same;
+		printf("%d workers: scene %6.3f ms, render %8.3f ms, %.2fx, tiles [%s], %s\n", n, send_time * 1000.0, time * 1000.0, single_time / time,
+			tiles_string(distributed.get_rendered_tiles()).c_str(), same ? "same image" : "different image");
+	}
+
+	// Lowest priority worker started as separate program gets little CPU time,
+	//  idle workers take copies of it's tiles
+	{
+		DistributedRenderer distributed(rt);
+		distributed.spawn(2);
+		distributed.spawn({ "nice", "-n", "19", argv[0], "--worker" });
+
+		PngSink sink(FILENAME_PNG);
+		start = timer::now();
+		distributed.render(sink);
+		double time = seconds_since(start);
+
+		unsigned char* image = nullptr;
+		unsigned width, height;
+		bool same = !lodepng_decode32_file(&image, &width, &height, FILENAME_PNG) && width == WIDTH && height == HEIGHT
+			&& !memcmp(image, reference.data(), reference.size() * 4);
+		free(image);
+		std::remove(FILENAME_PNG);
+		all_same &= same;
+		printf("slow worker: render %8.3f ms into png, tiles [%s], %d duplicated, %s\n", time * 1000.0,
+			tiles_string(distributed.get_rendered_tiles()).c_str(), distributed.get_duplicated_tiles(), same ? "same image" : "different image");
+	}
+
+	bool worker_rejected = worker_rejects_corrupt_size();
+	bool coordinator_rejected = coordinator_rejects_corrupt_size(rt);
+	printf("corrupt message size: worker %s, coordinator %s\n", worker_rejected ? "replied error" : "did not reply error",
+		coordinator_rejected ? "dropped worker" : "did not drop worker");
+
+	return all_same && worker_rejected && coordinator_rejected ? 0 : 1;
+};
@@ -0,0 +1,135 @@
+/*
+    Example compares single precision intersection kernels of spheres & triangles
+     with double precision: throughput & rays whose closest primitive changed
+
+	cpp math utilities
+    Copyright (C) 2019-3041  bitrate16
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+#include <cstdlib>
+
+#include "RayTrace.h"
+
+using namespace spaint;
+using namespace cppmath;
+using namespace raytrace;
+
+// Number of primitives of each type in kernel benchmark
+#define PRIMITIVES 4096
+// Number of probing rays in kernel benchmark
+#define RAYS 1024
+
+// bash c.sh "" example/raytrace_float
+
+// Run f until at least 0.2s passed, returns calls per second
+template<typename F>
+double measure(F&& f) {
+	long long calls = 0;
+	auto start = std::chrono::steady_clock::now();
+	double elapsed = 0.0;
+
+	do {
+		f();
+		++calls;
+		elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	} while (elapsed < 0.2);
+
+	return calls / elapsed;
+};
+
+// Closest hit of coherent rays against same primitives in both precisions.
+// Returns 1 if float SIMD kernels find same primitives as scalar float code.
+bool benchmark_kernels() {
+	std::mt19937 gen(16);
+	std::uniform_real_distribution<double> pos(-100.0, 100.0);
+	std::uniform_real_distribution<double> depth(100.0, 400.0);
+	std::uniform_real_distribution<double> offset(-20.0, 20.0);
+
+	SphereSoA spheres;
+	SphereSoAf spheres_f;
+	TriangleSoA triangles;
+	TriangleSoAf triangles_f;
+	for (int i = 0; i < PRIMITIVES; ++i) {
+		vec3 c(pos(gen), pos(gen), depth(gen));
+		spheres.add(c, 10.0, 1, i);
+		spheres_f.add(c, 10.0, 1, i);
+
+		vec3 a = c + vec3(offset(gen), offset(gen), offset(gen));
+		vec3 b = c + vec3(offset(gen), offset(gen), offset(gen));
+		vec3 d = c + vec3(offset(gen), offset(gen), offset(gen));
+		vec3 n = vec3::cross(b - a, d - a).norm();
+		triangles.add(a, b, d, n, 1, i);
+		triangles_f.add(a, b, d, n, 1, i);
+	}
+
+	std::vector<ray> rays;
+	for (int i = 0; i < RAYS; ++i)
+		rays.push_back(ray(vec3(), vec3((i % 32 - 16) / 64.0, (i / 32 - 16) / 64.0, 1.0).norm()));
+
+	printf("%-10s %-8s %18s %18s %10s %10s\n", "primitive", "kernel", "double, tests/s", "float, tests/s", "speedup", "mismatch");
+
+	std::vector<int> reference(RAYS), result(RAYS), scalar_result(RAYS);
+	bool match = 1;
+	for (int p = 0; p < 2; ++p)
+		for (int level = simd::SCALAR; level <= simd::AVX2; ++level) {
+			simd::Kernels kernels((simd::Level) level);
+			if (kernels.level != level)
+				continue;
+
+			double rate[2];
+			for (int precision = 0; precision < 2; ++precision) {
+				std::vector<int>& out = precision ? result : reference;
+				rate[precision] = (double) RAYS * PRIMITIVES * measure([&]() {
+					for (int r = 0; r < RAYS; ++r) {
+						double t = std::numeric_limits<double>::infinity();
+						out[r] = -1;
+						if (p && precision)
+							kernels.triangles_closest_f(triangles_f, 0, PRIMITIVES, rays[r].A, rays[r].B, t, out[r]);
+						else if (p)
+							kernels.triangles_closest(triangles, 0, PRIMITIVES, rays[r].A, rays[r].B, t, out[r]);
+						else if (precision)
+							kernels.spheres_closest_f(spheres_f, 0, PRIMITIVES, rays[r].A, rays[r].B, t, out[r]);
+						else
+							kernels.spheres_closest(spheres, 0, PRIMITIVES, rays[r].A, rays[r].B, t, out[r]);
+					}
+				});
+			}
+
+			// Rays whose closest primitive changed with precision
+			int mismatch = 0;
+			for (int r = 0; r < RAYS; ++r)
+				mismatch += reference[r] != result[r];
+
+			printf("%-10s %-8s %18.3e %18.3e %9.2fx %10d\n", p ? "triangle" : "sphere", simd::level_name(kernels.level), rate[0], rate[1], rate[1] / rate[0], mismatch);
+
+			if (level == simd::SCALAR)
+				scalar_result = result;
+			else
+				match = match && result == scalar_result;
+		}
+
+	return match;
+};
+
+int main() {
+	bool match = benchmark_kernels();
+	printf("\nfloat SIMD kernels %s scalar\n", match ? "match" : "differ from");
+	return match ? 0 : 1;
+};
@@ -214,7 +214,10 @@ int main() {
 		red_sphere->center.x = (10 * std::cos(angle)) * SCALE;
 		*/
 		
-		uv_sphere->center.y = (20 + 20 * std::sin(angle)) * SCALE;
+		uv_sphere->set(vec3(uv_sphere->center.x, (20 + 20 * std::sin(angle)) * SCALE, uv_sphere->center.z), uv_sphere->radius);
+		
+		// Refit moved objects in BVH
+		rt.get_scene().update();
 		
 		for (int x = 0; x < rt.get_width(); ++x)
 			for (int y = 0; y < rt.get_height(); ++y) {
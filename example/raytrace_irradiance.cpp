@@ -0,0 +1,159 @@
+/*
+    Example compares diffuse interreflection computed for every hit with
+     irradiance interpolated from irradiance cache
+
+	cpp math utilities
+    Copyright (C) 2019-3041  bitrate16
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <vector>
+#include <cstdlib>
+
+#include "RayTrace.h"
+#include "RayTraceRenderer.h"
+#include "RayTraceProgressive.h"
+#include "lodepng.h"
+
+using namespace spaint;
+using namespace cppmath;
+using namespace raytrace;
+
+#define WIDTH 200
+#define HEIGHT 200
+#define THREAD_COUNT 4
+// Samples of progressive renders with cosine weighted rays
+#define PROGRESSIVE_SAMPLES 32
+// Write both images into current directory
+// #define WRITE_IMAGES
+
+// bash c.sh "-lpthread" example/raytrace_irradiance
+
+void create_scene(RayTrace& rt) {
+	RayTraceScene& scene = rt.get_scene();
+	scene.use_shadows = 1;
+	scene.diffuse_light = 1;
+	scene.horisontal_diffuse_count = 8;
+	scene.vertical_diffuse_count = 3;
+	scene.MAX_RAY_DEPTH = 3;
+	// Room is made of unbounded planes, so radius is set in world units
+	scene.irradiance_max_radius = 200.0;
+	scene.irradiance_min_radius = 5.0;
+
+	vec3 planes[5][2] = {
+		{ vec3(0, -200, 0), vec3(0, 1, 0) },
+		{ vec3(-200, 0, 0), vec3(1, 0, 0) },
+		{ vec3(200, 0, 0), vec3(-1, 0, 0) },
+		{ vec3(0, 0, 600), vec3(0, 0, -1) },
+		{ vec3(0, 200, 0), vec3(0, -1, 0) }
+	};
+	Color colors[5] = { Color::WHITE, Color::BLUE, Color::RED, Color::WHITE, Color::WHITE };
+
+	for (int i = 0; i < 5; ++i) {
+		Plane* p = new Plane(planes[i][0], planes[i][1]);
+		p->material.color = colors[i];
+		scene.addObject(p);
+	}
+
+	for (int i = 0; i < 4; ++i) {
+		Sphere* s = new Sphere(vec3(-120 + i * 80, -150, 350 + (i % 2) * 80), 50);
+		s->material.color = i % 2 ? Color::GREEN : Color::WHITE;
+		scene.addObject(s);
+	}
+
+	Sphere* light = new Sphere(vec3(0, 150, 350), 20);
+	light->material.color = Color::WHITE;
+	light->material.luminosity = 1.0;
+	light->material.surface_visible = 0;
+	scene.addObject(light);
+
+	scene.build();
+};
+
+double render(RayTrace& rt, std::vector<unsigned int>& frame) {
+	Renderer renderer(rt, THREAD_COUNT);
+	auto start = std::chrono::steady_clock::now();
+	renderer.render(frame.data());
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+};
+
+// Mean absolute difference of channels
+double difference(const std::vector<unsigned int>& a, const std::vector<unsigned int>& b) {
+	double sum = 0.0;
+	for (size_t i = 0; i < a.size(); ++i)
+		for (int c = 0; c < 24; c += 8)
+			sum += std::abs((int) ((a[i] >> c) & 0xFF) - (int) ((b[i] >> c) & 0xFF));
+	return sum / (a.size() * 3.0);
+};
+
+// Progressive samples trace single diffuse ray, they must converge to
+//  same image with irradiance cache as without it
+bool progressive_converges(RayTrace& rt) {
+	RayTraceScene& scene = rt.get_scene();
+	scene.cosine_diffuse_ray = 1;
+	scene.random_diffuse_count = 16;
+
+	std::vector<unsigned int> reference(WIDTH * HEIGHT), frame(WIDTH * HEIGHT);
+	scene.use_irradiance_cache = 0;
+	ProgressiveRenderer progressive(rt, THREAD_COUNT);
+	progressive.render(PROGRESSIVE_SAMPLES);
+	progressive.resolve(reference.data());
+
+	scene.use_irradiance_cache = 1;
+	scene.reset_irradiance();
+	progressive.reset();
+	progressive.render(PROGRESSIVE_SAMPLES);
+	progressive.resolve(frame.data());
+
+	double diff = difference(reference, frame);
+	printf("progressive, %d samples: %6zu records, mean difference %.2f\n", PROGRESSIVE_SAMPLES, scene.get_irradiance_cache().size(), diff);
+
+	scene.cosine_diffuse_ray = 0;
+	return diff < 1.0;
+};
+
+int main() {
+	RayTrace rt(Camera(WIDTH, HEIGHT));
+	rt.set_background(Color::BLACK);
+	create_scene(rt);
+	RayTraceScene& scene = rt.get_scene();
+
+	std::vector<unsigned int> reference(WIDTH * HEIGHT);
+	double reference_time = render(rt, reference);
+	printf("no cache:          %8.3f s\n", reference_time);
+
+	std::vector<unsigned int> frame(WIDTH * HEIGHT);
+	scene.use_irradiance_cache = 1;
+	for (double error : { 0.4, 0.2, 0.1 }) {
+		scene.irradiance_error = error;
+		// Apply error & drop records of previous render
+		scene.reset_irradiance();
+		double time = render(rt, frame);
+		printf("cache, error %.2f: %8.3f s, %6zu records, mean difference %.2f\n", error, time, scene.get_irradiance_cache().size(), difference(reference, frame));
+	}
+
+	// Second frame of same scene reuses records of first
+	double time = render(rt, frame);
+	printf("cached frame:      %8.3f s, %6zu records\n", time, scene.get_irradiance_cache().size());
+
+#ifdef WRITE_IMAGES
+	lodepng_encode32_file("irradiance_reference.png", (const unsigned char*) reference.data(), WIDTH, HEIGHT);
+	lodepng_encode32_file("irradiance_cached.png", (const unsigned char*) frame.data(), WIDTH, HEIGHT);
+#endif
+
+	return progressive_converges(rt) ? 0 : 1;
+};
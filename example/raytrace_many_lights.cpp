@@ -0,0 +1,119 @@
+/*
+    Example compares full light point enumeration with sampling of light points by power
+     in a room lit by many area lights
+
+	cpp math utilities
+    Copyright (C) 2019-3041  bitrate16
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <vector>
+#include <cstdlib>
+
+#include "RayTrace.h"
+#include "RayTraceRenderer.h"
+
+using namespace spaint;
+using namespace cppmath;
+using namespace raytrace;
+
+#define WIDTH 200
+#define HEIGHT 200
+// Lights are placed in LIGHTS x LIGHTS grid under the ceiling
+#define LIGHTS 6
+// Sectors of each light sphere, gives LIGHT_SECTORS * (LIGHT_SECTORS - 1) + 2 points
+#define LIGHT_SECTORS 4
+#define THREAD_COUNT 4
+
+// bash c.sh "-lpthread" example/raytrace_many_lights
+
+void create_scene(RayTrace& rt) {
+	RayTraceScene& scene = rt.get_scene();
+	scene.use_shadows = 1;
+	scene.average_light_points = 1;
+
+	vec3 planes[5][2] = {
+		{ vec3(0, -200, 0), vec3(0, 1, 0) },
+		{ vec3(-200, 0, 0), vec3(1, 0, 0) },
+		{ vec3(200, 0, 0), vec3(-1, 0, 0) },
+		{ vec3(0, 0, 600), vec3(0, 0, -1) },
+		{ vec3(0, 200, 0), vec3(0, -1, 0) }
+	};
+	Color colors[5] = { Color::WHITE, Color::BLUE, Color::RED, Color::WHITE, Color::WHITE };
+
+	for (int i = 0; i < 5; ++i) {
+		Plane* p = new Plane(planes[i][0], planes[i][1]);
+		p->material.color = colors[i];
+		scene.addObject(p);
+	}
+
+	for (int i = 0; i < 8; ++i) {
+		Sphere* s = new Sphere(vec3(-150 + i * 45, -170, 350 + (i % 3) * 60), 30);
+		s->material.color = i % 2 ? Color::GREEN : Color::WHITE;
+		scene.addObject(s);
+	}
+
+	// Lights of different power
+	for (int y = 0; y < LIGHTS; ++y)
+		for (int x = 0; x < LIGHTS; ++x) {
+			Sphere* s = new Sphere(vec3(-150 + x * 300.0 / (LIGHTS - 1), 170, 200 + y * 350.0 / (LIGHTS - 1)), 8);
+			s->material.color = Color::WHITE;
+			s->material.luminosity = (x + y) % 3 ? 0.1 : 0.6;
+			s->material.surface_visible = 0;
+			s->setLightSectorsCount(LIGHT_SECTORS);
+			scene.addObject(s);
+		}
+
+	scene.build();
+};
+
+double render(RayTrace& rt, std::vector<unsigned int>& frame) {
+	Renderer renderer(rt, THREAD_COUNT);
+	auto start = std::chrono::steady_clock::now();
+	renderer.render(frame.data());
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+};
+
+// Mean absolute difference of channels
+double difference(const std::vector<unsigned int>& a, const std::vector<unsigned int>& b) {
+	double sum = 0.0;
+	for (size_t i = 0; i < a.size(); ++i)
+		for (int c = 0; c < 24; c += 8)
+			sum += std::abs((int) ((a[i] >> c) & 0xFF) - (int) ((b[i] >> c) & 0xFF));
+	return sum / (a.size() * 3.0);
+};
+
+int main() {
+	RayTrace rt(Camera(WIDTH, HEIGHT));
+	rt.set_background(Color::BLACK);
+	create_scene(rt);
+
+	printf("%d lights, %d light points\n", rt.get_scene().get_light_count(), LIGHTS * LIGHTS * (LIGHT_SECTORS * (LIGHT_SECTORS - 1) + 2));
+
+	std::vector<unsigned int> reference(WIDTH * HEIGHT);
+	double reference_time = render(rt, reference);
+	printf("all points:  %8.3f s\n", reference_time);
+
+	for (int samples : { 4, 16, 64 }) {
+		std::vector<unsigned int> frame(WIDTH * HEIGHT);
+		rt.get_scene().light_samples = samples;
+		double time = render(rt, frame);
+		printf("%2d samples:  %8.3f s, mean difference %.2f\n", samples, time, difference(reference, frame));
+	}
+
+	return 0;
+};
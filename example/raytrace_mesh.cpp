@@ -0,0 +1,143 @@
+/*
+    Example loads triangle mesh from Wavefront OBJ and compares it with scene of Triangle objects
+
+	cpp math utilities
+    Copyright (C) 2019-3041  bitrate16
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#include "RayTrace.h"
+#include "RayTraceMesh.h"
+
+using namespace spaint;
+using namespace cppmath;
+using namespace raytrace;
+
+// Resolution of probing rays grid
+#define WIDTH 128
+#define HEIGHT 128
+// Number of sphere segments in generated mesh
+#define SEGMENTS 512
+
+// bash c.sh "" example/raytrace_mesh
+// bash c.sh "" example/raytrace_mesh model.obj
+
+// Write sphere of quads with vertex normals as OBJ
+void write_sphere_obj(const std::string& filename, int segments) {
+	FILE* f = fopen(filename.c_str(), "w");
+	if (!f)
+		return;
+
+	int rings = segments / 2;
+	for (int r = 0; r <= rings; ++r)
+		for (int s = 0; s < segments; ++s) {
+			double theta = 3.14159265358979323846 * r / rings;
+			double phi = 2.0 * 3.14159265358979323846 * s / segments;
+			double x = std::sin(theta) * std::cos(phi);
+			double y = std::cos(theta);
+			double z = std::sin(theta) * std::sin(phi);
+			fprintf(f, "v %.6f %.6f %.6f\nvn %.6f %.6f %.6f\n", x * 40.0, y * 40.0, z * 40.0 + 150.0, x, y, z);
+		}
+
+	for (int r = 0; r < rings; ++r)
+		for (int s = 0; s < segments; ++s) {
+			int a = r * segments + s + 1;
+			int b = r * segments + (s + 1) % segments + 1;
+			int c = (r + 1) * segments + (s + 1) % segments + 1;
+			int d = (r + 1) * segments + s + 1;
+			fprintf(f, "f %d//%d %d//%d %d//%d %d//%d\n", a, a, b, b, c, c, d, d);
+		}
+
+	fclose(f);
+};
+
+// Probe grid of rays & return time in seconds
+double render(RayTrace& rt, int& hits) {
+	hits = 0;
+	auto start = std::chrono::steady_clock::now();
+
+	for (int y = 0; y < rt.get_height(); ++y)
+		for (int x = 0; x < rt.get_width(); ++x)
+			if (rt.hitColorAt(x, y) != rt.get_background())
+				++hits;
+
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+};
+
+template<typename F>
+double measure(F&& f) {
+	auto start = std::chrono::steady_clock::now();
+	f();
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+};
+
+int main(int argc, char** argv) {
+	std::string filename = "mesh.obj";
+	if (argc > 1)
+		filename = argv[1];
+	else
+		write_sphere_obj(filename, SEGMENTS);
+
+	// Flat emissive material to measure intersection cost only
+	ObjectMaterial material;
+	material.color = Color::WHITE;
+	material.diffuse = 0.0;
+	material.luminosity = 1.0;
+
+	Mesh* mesh = new Mesh();
+	double load_time = measure([&]() {
+		mesh->load_obj(filename);
+	});
+	mesh->setMaterial(material);
+
+	printf("%d vertices, %d faces\n", (int) mesh->vertices.size(), mesh->face_count());
+	printf("mesh:      load & build %10.3f ms, %8.1f bytes per face\n", load_time * 1000.0, mesh->get_memory_size() / (double) mesh->face_count());
+
+	RayTrace mesh_rt(Camera(WIDTH, HEIGHT));
+	mesh_rt.set_background(Color::BLACK);
+	mesh_rt.get_scene().addObject(mesh);
+	mesh_rt.get_scene().build();
+
+	// Same faces as separate objects
+	RayTrace triangles_rt(Camera(WIDTH, HEIGHT));
+	triangles_rt.set_background(Color::BLACK);
+	double setup_time = measure([&]() {
+		for (int f = 0; f < mesh->face_count(); ++f) {
+			Triangle* t = new Triangle(mesh->vertices[mesh->indices[3 * f + 0]], mesh->vertices[mesh->indices[3 * f + 1]], mesh->vertices[mesh->indices[3 * f + 2]]);
+			t->setMaterial(material);
+			triangles_rt.get_scene().addObject(t);
+		}
+		triangles_rt.get_scene().build();
+	});
+
+	// Object, it's heap block header and pointer in scene, compiled TriangleSoA entry, BVH node and index pair per object
+	double triangle_bytes = sizeof(Triangle) + 16 + sizeof(SceneObject*) + 15 * sizeof(double) + sizeof(uint8_t) + sizeof(int) + sizeof(BVH::Node) * 2 + sizeof(int) * 2;
+	printf("triangles: setup & build %9.3f ms, %8.1f bytes per face\n", setup_time * 1000.0, triangle_bytes);
+
+	int mesh_hits, triangles_hits;
+	double mesh_time = render(mesh_rt, mesh_hits);
+	double triangles_time = render(triangles_rt, triangles_hits);
+
+	printf("render %dx%d: mesh %.3f ms, triangles %.3f ms\n", WIDTH, HEIGHT, mesh_time * 1000.0, triangles_time * 1000.0);
+
+	if (mesh_hits != triangles_hits)
+		printf("hit count mismatch: %d mesh, %d triangles\n", mesh_hits, triangles_hits);
+
+	return 0;
+};
@@ -0,0 +1,141 @@
+/*
+    Example animates few spheres in large scene and compares BVH refit by
+     RayTraceScene::update() with full rebuild of every frame
+
+	cpp math utilities
+    Copyright (C) 2019-3041  bitrate16
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cmath>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "RayTrace.h"
+
+using namespace spaint;
+using namespace cppmath;
+using namespace raytrace;
+
+// Resolution of probing rays grid
+#define WIDTH 64
+#define HEIGHT 64
+// Number of static spheres
+#define COUNT 100000
+// Number of moving spheres
+#define MOVING 16
+#define FRAMES 200
+
+// bash c.sh "" example/raytrace_refit
+
+// Fill scene with random spheres in box in front of camera, returns moving spheres
+std::vector<Sphere*> create_scene(RayTrace& rt) {
+	std::mt19937 gen(COUNT);
+	std::uniform_real_distribution<double> pos(-100.0, 100.0);
+	std::uniform_real_distribution<double> depth(100.0, 400.0);
+
+	rt.camera = Camera(WIDTH, HEIGHT);
+	rt.set_background(Color::BLACK);
+
+	// Flat emissive material to measure intersection cost only
+	ObjectMaterial material;
+	material.color = Color::WHITE;
+	material.diffuse = 0.0;
+	material.luminosity = 1.0;
+
+	// Moving mirrors do not emit, so lights are not updated
+	ObjectMaterial mirror;
+	mirror.diffuse = 0.0;
+	mirror.reflect = 1.0;
+
+	std::vector<Sphere*> moving;
+	for (int i = 0; i < COUNT + MOVING; ++i) {
+		Sphere* s = new Sphere(vec3(pos(gen), pos(gen), depth(gen)), i < COUNT ? 40.0 / std::cbrt((double) COUNT) : 5.0);
+		s->setMaterial(i < COUNT ? material : mirror);
+		rt.get_scene().addObject(s);
+		if (i >= COUNT)
+			moving.push_back(s);
+	}
+
+	rt.get_scene().build();
+	return moving;
+};
+
+// Move spheres along circles through the scene
+void animate(std::vector<Sphere*>& moving, int frame) {
+	for (int i = 0; i < (int) moving.size(); ++i) {
+		double angle = 0.05 * frame + i;
+		moving[i]->set(vec3(80.0 * std::cos(angle), 80.0 * std::sin(angle * 0.7), 250.0 + 100.0 * std::sin(angle)), moving[i]->radius);
+	}
+};
+
+// Render frame & return time in seconds
+double render(RayTrace& rt, std::vector<Color>& frame) {
+	auto start = std::chrono::steady_clock::now();
+
+	for (int y = 0; y < rt.get_height(); ++y)
+		for (int x = 0; x < rt.get_width(); ++x)
+			frame[x + y * WIDTH] = rt.hitColorAt(x, y);
+
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+};
+
+template<typename F>
+double measure(F&& f) {
+	auto start = std::chrono::steady_clock::now();
+	f();
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+};
+
+int main() {
+	RayTrace refit_rt, rebuild_rt;
+	std::vector<Sphere*> refit_moving = create_scene(refit_rt);
+	std::vector<Sphere*> rebuild_moving = create_scene(rebuild_rt);
+
+	std::vector<Color> refit_frame(WIDTH * HEIGHT), rebuild_frame(WIDTH * HEIGHT);
+	double update_time = 0.0, build_time = 0.0;
+	double refit_render_time = 0.0, rebuild_render_time = 0.0;
+	int rebuilds = 0, mismatches = 0;
+
+	for (int f = 0; f < FRAMES; ++f) {
+		animate(refit_moving, f);
+		animate(rebuild_moving, f);
+
+		update_time += measure([&]() {
+			rebuilds += refit_rt.get_scene().update();
+		});
+		build_time += measure([&]() {
+			rebuild_rt.get_scene().build();
+		});
+
+		refit_render_time += render(refit_rt, refit_frame);
+		rebuild_render_time += render(rebuild_rt, rebuild_frame);
+
+		if (refit_frame != rebuild_frame)
+			++mismatches;
+	}
+
+	printf("%d spheres, %d moving, %d frames\n", COUNT + MOVING, MOVING, FRAMES);
+	printf("update:  %10.3f ms per frame, render %8.3f ms, %d rebuilds, final cost %.2f of %.2f\n", update_time * 1000.0 / FRAMES, refit_render_time * 1000.0 / FRAMES, rebuilds,
+		refit_rt.get_scene().get_bvh().get_cost(), refit_rt.get_scene().get_bvh().get_build_cost());
+	printf("build:   %10.3f ms per frame, render %8.3f ms\n", build_time * 1000.0 / FRAMES, rebuild_render_time * 1000.0 / FRAMES);
+
+	if (mismatches)
+		printf("%d frames differ\n", mismatches);
+
+	return 0;
+};
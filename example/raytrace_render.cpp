@@ -111,6 +111,8 @@ public:
 		glass_sphere->material.refract_val = 0.5;
 		glass_sphere->material.reflect = 0.1;
 		rt.get_scene().addObject(glass_sphere);
+		
+		rt.get_scene().build();
 	};
 	
 	void encodeOneStep(const char* filename, const unsigned char* image, unsigned width, unsigned height) {
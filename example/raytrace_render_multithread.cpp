@@ -26,11 +26,12 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
-#include <thread>
-#include <condition_variable>
-#include <mutex>
-
 #include "RayTrace.h"
+#include "RayTraceRenderer.h"
+#include "RayTraceProgressive.h"
+#include "RayTraceWavefront.h"
+#include "RayTraceCheckpoint.h"
+#include "RayTraceOutput.h"
 #include "lodepng.h"
 #include "rawb.h"
 
@@ -40,6 +41,8 @@ using namespace raytrace;
 
 #define FILENAME "output/aframe.png"
 #define FILENAME_BINARY "output/aframe.rawb"
+// Written when compiled with -DRAYTRACE_STATS
+#define FILENAME_STATS "output/aframe_stats.json"
 
 #define THREAD_COUNT 4
 
@@ -47,65 +50,48 @@ using namespace raytrace;
 
 // #define ANTI_ALIASING
 
+// Accumulate cheap samples until sample count or time budget in seconds is reached
+// #define PROGRESSIVE
+#define PROGRESSIVE_SAMPLES 64
+#define PROGRESSIVE_TIME 60.0
+
+// Trace rays of tile in waves, gives same image
+// #define WAVEFRONT
+
+// Save finished tiles or progressive samples every CHECKPOINT_INTERVAL seconds,
+//  restarted render continues from checkpoint
+// #define CHECKPOINT "output/aframe.checkpoint"
+#define CHECKPOINT_INTERVAL 60.0
+
+// Write finished tiles straight into FILENAME or FILENAME_BINARY without frame buffer,
+//  so frame size is not bounded by memory
+// #define STREAMING
+
 #define WIDTH 1000
 #define HEIGHT 1000
 #define SCALE 4
 
 // bash c.sh "-lpthread" example/raytrace_render_multithread
-
-class tracer;
-
-void worker_function(tracer* t, int thread_id);
+// bash c.sh "-lpthread -DRAYTRACE_STATS" example/raytrace_render_multithread
 
 class tracer {
 	
 public:
 	
-	// 1. All threads waits for main to pause on start
-	// 2. Main waits all threads to stop after work
-	std::mutex waiter;
-	std::condition_variable cv;
-	
-	// Protect coords
-	std::mutex index_access;
-	int x = 0;
-	int y = 0;
-	
-	bool written = 0;
-	
-	// Array of threads
-	std::thread* threads[THREAD_COUNT];
-	
 	// Output array
 	unsigned int* frame;
 	
-	// Number of finished threads
-	int finshed_threads = 0;
-	
 	RayTrace rt;
 	
-#ifdef WRITE_BINARY
-	// Format: Order test: 0x01020304[4B], rawb::pixel_type::ABGR[1B], WIDTH[4B], HEIGHT[4B], ABGR[4B * WIDTH * HEIGHT]
-	std::ofstream binary_file;
-#endif
-	
 	tracer() {
-		
-		// INIT THREADS
-		
-	#ifdef WRITE_BINARY
-		binary_file = std::ofstream(FILENAME_BINARY, std::ofstream::binary);
-	#endif
-		
+	#ifndef STREAMING
 		frame = (unsigned int*) malloc((size_t) WIDTH * (size_t) HEIGHT * (size_t) 4);
+	#else
+		frame = nullptr;
+	#endif
 		
 		create_scene();
-	
-		for (int i = 0; i < THREAD_COUNT; ++i)
-			threads[i] = new std::thread(worker_function, this, i);
-		
-		for (int i = 0; i < THREAD_COUNT; ++i)
-			threads[i]->join();
+		rt.get_scene().build();
 	};
 	
 	void create_scene() {
@@ -119,6 +105,7 @@ public:
 		rt.get_scene().use_shadows          = 1;
 		rt.get_scene().soft_shadows_scale   = 0.5;
 		rt.get_scene().random_diffuse_ray   = 1;
+		rt.get_scene().sample_sequence      = SampleSequence::SOBOL;
 		rt.get_scene().average_light_points = 1;
 		rt.get_scene().GI_color             = spaint::Color(1.0);
 		rt.get_scene().GI_intensivity       = 0.05;
@@ -411,14 +398,7 @@ public:
 	};
 	
 	~tracer() {
-		for (int i = 0; i < THREAD_COUNT; ++i)
-			delete threads[i];
-			
 		free(frame);
-	#ifdef WRITE_BINARY
-		binary_file.flush();
-		binary_file.close();
-	#endif
 	};
 	
 	void encodeOneStep(const char* filename, const unsigned char* image, unsigned width, unsigned height) {
@@ -428,85 +408,105 @@ public:
 		/*if there's an error, display it*/
 		if(error) printf("error %u: %s\n", error, lodepng_error_text(error));
 	};
-};
-
-void worker_function(tracer* t, int thread_id) {
-	std::cout << "Thread " << thread_id << " created" << std::endl;
 	
-	// Do rendering
-	while (1) {
-		t->index_access.lock();
-		
-		// If render is finished, dump file
-		if (t->y >= t->rt.get_height() + THREAD_COUNT - 1) {
-			++t->finshed_threads;
-			
-			if (!t->written) {
-				t->written = 1;
-				std::cout << "DONE\n";
-				
-			#ifndef WRITE_BINARY
-				t->encodeOneStep(FILENAME, (unsigned char*) t->frame, WIDTH, HEIGHT);
-			#else
-				uint32_t order_test = 0x01020304;
-				uint32_t width = WIDTH;
-				uint32_t height = HEIGHT;
-				uint8_t pix_type = rawb::pixel_type::ABGR;
-				t->binary_file.write((char*) &order_test, 4);
-				t->binary_file.write((char*) &width, 4);
-				t->binary_file.write((char*) &height, 4);
-				t->binary_file.write((char*) &pix_type, 1);
-				t->binary_file.write((char*) t->frame, (size_t) WIDTH * (size_t) HEIGHT * (size_t) 4);
-				t->binary_file.flush();
-			#endif
-			
-				std::cout << "WRITTEN\n";
-				
-				exit(0);
-			}
-			
-			std::cout << "Thread " << thread_id << " stopped" << std::endl;
-			return;
-		} else if (t->y >= t->rt.get_height()) {
-			++t->y;
-			t->index_access.unlock();
-			break;
-		}
+	void render() {
+		Renderer renderer(rt, THREAD_COUNT);
 		
-		std::cout << (t->y + 1) << " / " << t->rt.get_width() << std::endl;
-		
-		int y = t->y;
-		++t->y;
+		renderer.on_tile = [&renderer](const Tile&) {
+			int done = renderer.get_finished_tiles();
+			if (done % 64 == 0 || done == renderer.get_total_tiles())
+				std::cout << (std::to_string(done) + " / " + std::to_string(renderer.get_total_tiles()) + "\n");
+		};
 		
-		t->index_access.unlock();
+		struct stat st;
+		if (stat("output", &st) == -1) 
+			mkdir("output", 0700);
 		
-#ifdef ANTI_ALIASING
-		for (int x = 0; x < t->rt.get_width(); ++x) {
-			Color frag;
-			frag.add_off_range(t->rt.hitColorAt(x + 1, y + 1));
-			frag.add_off_range(t->rt.hitColorAt(x + 1, y + 0));
-			frag.add_off_range(t->rt.hitColorAt(x + 0, y + 1));
-			frag.add_off_range(t->rt.hitColorAt(x + 0, y + 0));
-			
-			frag.scale(0.25);
-			
-			frag.a = 255;
-			t->frame[x + y * WIDTH] = frag.abgr();
-		}
+#if defined(STREAMING)
+	#ifndef WRITE_BINARY
+		PngSink sink(FILENAME);
+	#else
+		RawbSink sink(FILENAME_BINARY);
+	#endif
+		renderer.render(sink);
+		const RenderStats& stats = renderer.get_stats();
+#elif defined(PROGRESSIVE)
+		ProgressiveRenderer progressive(rt, THREAD_COUNT);
+	#ifdef CHECKPOINT
+		Checkpointer checkpointer(CHECKPOINT, CHECKPOINT_INTERVAL);
+		checkpointer.render(progressive, PROGRESSIVE_SAMPLES, PROGRESSIVE_TIME);
+		std::cout << ("resumed " + std::to_string(checkpointer.get_resumed()) + " samples, " + std::to_string(progressive.get_samples()) + " total\n");
+	#else
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(PROGRESSIVE_TIME));
+		while (progressive.get_samples() < PROGRESSIVE_SAMPLES && progressive.add_sample(deadline))
+			std::cout << ("sample " + std::to_string(progressive.get_samples()) + "\n");
+	#endif
+		progressive.resolve(frame);
+		const RenderStats& stats = progressive.get_renderer().get_stats();
+#elif defined(ANTI_ALIASING)
+		// Supersample only edges & high contrast pixels
+		rt.adaptive_aa = 1;
+		renderer.render(frame);
+		std::cout << ("refined " + std::to_string(renderer.get_refined_pixels()) + " pixels\n");
+		const RenderStats& stats = renderer.get_stats();
+#elif defined(WAVEFRONT)
+		WavefrontRenderer wavefront(rt, THREAD_COUNT);
+		Renderer& tiles = wavefront.get_renderer();
+		tiles.on_tile = [&tiles](const Tile& t) {
+			int done = tiles.get_finished_tiles();
+			if (done % 64 == 0 || done == tiles.get_total_tiles())
+				std::cout << (std::to_string(done) + " / " + std::to_string(tiles.get_total_tiles()) + "\n");
+		};
+		wavefront.render(frame);
+		const RenderStats& stats = wavefront.get_renderer().get_stats();
+#elif defined(CHECKPOINT)
+		Checkpointer checkpointer(CHECKPOINT, CHECKPOINT_INTERVAL);
+		checkpointer.render(renderer, frame);
+		std::cout << ("resumed " + std::to_string(checkpointer.get_resumed()) + " tiles\n");
+		const RenderStats& stats = renderer.get_stats();
 #else
-		for (int x = 0; x < t->rt.get_width(); ++x) {
-			Color frag = t->rt.hitColorAt(x, y);
-			frag.a = 255;
-			t->frame[x + y * WIDTH] = frag.abgr();
-		}
+		renderer.render(frame);
+		const RenderStats& stats = renderer.get_stats();
 #endif
-	}
+		
+		std::cout << "DONE\n";
+		
+	#if defined(STREAMING)
+		// Already written by sink
+	#elif !defined(WRITE_BINARY)
+		encodeOneStep(FILENAME, (unsigned char*) frame, WIDTH, HEIGHT);
+	#else
+		// Format: Order test: 0x01020304[4B], rawb::pixel_type::ABGR[1B], WIDTH[4B], HEIGHT[4B], ABGR[4B * WIDTH * HEIGHT]
+		std::ofstream binary_file(FILENAME_BINARY, std::ofstream::binary);
+		uint32_t order_test = 0x01020304;
+		uint32_t width = WIDTH;
+		uint32_t height = HEIGHT;
+		uint8_t pix_type = rawb::pixel_type::ABGR;
+		binary_file.write((char*) &order_test, 4);
+		binary_file.write((char*) &width, 4);
+		binary_file.write((char*) &height, 4);
+		binary_file.write((char*) &pix_type, 1);
+		binary_file.write((char*) frame, (size_t) WIDTH * (size_t) HEIGHT * (size_t) 4);
+		binary_file.flush();
+		binary_file.close();
+	#endif
+	
+	#ifdef RAYTRACE_STATS
+		std::ofstream stats_file(FILENAME_STATS);
+		stats_file << stats.to_json();
+		std::cout << (std::to_string(stats.total_rays()) + " rays\n");
+	#else
+		(void) stats;
+	#endif
+	
+		std::cout << "WRITTEN\n";
+	};
 };
 
 int main() {
 	
 	tracer t;
+	t.render();
 	
 	return 0;
 };
-
@@ -0,0 +1,219 @@
+/*
+    Example checks sample sequences: points of each sequence must cover
+     whole domain, and low-discrepancy sequences must render diffuse light
+     with lower error than independent random samples. Also compares
+     cosine weighted diffuse rays with deterministic pattern of rays
+
+	cpp math utilities
+    Copyright (C) 2019-3041  bitrate16
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cmath>
+#include <chrono>
+#include <cstdio>
+#include <limits>
+#include <vector>
+
+#include "RayTrace.h"
+#include "RayTraceRenderer.h"
+#include "RayTraceProgressive.h"
+
+using namespace spaint;
+using namespace cppmath;
+using namespace raytrace;
+
+#define WIDTH 120
+#define HEIGHT 90
+#define THREAD_COUNT 4
+// Diffuse rays per hit of compared images
+#define SAMPLES 10
+// Rays per hit of deterministic pattern & of cosine weighted rays compared with it
+#define GRID_RAYS 64
+#define COSINE_RAYS 4
+// Samples of reference image & diffuse rays per hit of each sample
+#define REFERENCE_SAMPLES 128
+#define REFERENCE_DIFFUSE 4
+// Pixels averaged by check of sample means
+#define MEAN_PIXELS 20000
+// Allowed deviation of mean of sample coordinates from 0.5
+#define MEAN_TOLERANCE 0.005
+
+// bash c.sh "-lpthread" example/raytrace_sampler
+
+const SampleSequence sequences[] = { SampleSequence::RANDOM, SampleSequence::STRATIFIED, SampleSequence::HALTON, SampleSequence::SOBOL };
+const char* sequence_names[] = { "random", "stratified", "halton", "sobol" };
+
+// Mean of u & v of count points over many pixels must be 0.5 for every sequence,
+//  otherwise part of domain is never sampled and estimate is biased
+bool check_means() {
+	bool valid = 1;
+	for (int s = 0; s < 4; ++s)
+		for (int count : { 2, 3, 4, 5, 6, 7, 8, 12, 13 }) {
+			Sampler sampler(sequences[s], 1);
+			double sum_u = 0.0, sum_v = 0.0;
+			for (int p = 0; p < MEAN_PIXELS; ++p) {
+				sampler.start(p % 200, p / 200);
+				int dimension = sampler.next_dimension();
+				for (int i = 0; i < count; ++i) {
+					double u, v;
+					sampler.sample_2d(dimension, i, count, u, v);
+					sum_u += u;
+					sum_v += v;
+				}
+			}
+
+			double mean_u = sum_u / ((double) MEAN_PIXELS * count);
+			double mean_v = sum_v / ((double) MEAN_PIXELS * count);
+			if (std::abs(mean_u - 0.5) > MEAN_TOLERANCE || std::abs(mean_v - 0.5) > MEAN_TOLERANCE) {
+				printf("%-10s count %2d: mean (%.3f, %.3f)\n", sequence_names[s], count, mean_u, mean_v);
+				valid = 0;
+			}
+		}
+
+	printf("sample means %s\n", valid ? "are 0.5" : "are biased");
+	return valid;
+};
+
+void create_scene(RayTrace& rt) {
+	rt.set_background(Color::BLACK);
+	RayTraceScene& scene = rt.get_scene();
+	scene.use_shadows = 1;
+	scene.diffuse_light = 1;
+	scene.cosine_diffuse_ray = 1;
+	scene.russian_roulette_depth = -1;
+	scene.MAX_RAY_DEPTH = 2;
+
+	vec3 planes[5][2] = {
+		{ vec3(0, -200, 0), vec3(0, 1, 0) },
+		{ vec3(-200, 0, 0), vec3(1, 0, 0) },
+		{ vec3(200, 0, 0), vec3(-1, 0, 0) },
+		{ vec3(0, 0, 600), vec3(0, 0, -1) },
+		{ vec3(0, 200, 0), vec3(0, -1, 0) }
+	};
+	Color colors[5] = { Color::WHITE, Color::BLUE, Color::RED, Color::WHITE, Color::WHITE };
+
+	for (int i = 0; i < 5; ++i) {
+		Plane* p = new Plane(planes[i][0], planes[i][1]);
+		p->material.color = colors[i];
+		scene.addObject(p);
+	}
+
+	for (int i = 0; i < 4; ++i) {
+		Sphere* s = new Sphere(vec3(-120 + i * 80, -150, 350 + (i % 2) * 80), 50);
+		s->material.color = i % 2 ? Color::GREEN : Color::WHITE;
+		scene.addObject(s);
+	}
+
+	Sphere* light = new Sphere(vec3(0, 150, 350), 20);
+	light->material.color = Color::WHITE;
+	light->material.luminosity = 1.0;
+	light->material.surface_visible = 0;
+	scene.addObject(light);
+
+	scene.build();
+};
+
+double render(RayTrace& rt, std::vector<unsigned int>& frame) {
+	Renderer renderer(rt, THREAD_COUNT);
+	auto start = std::chrono::steady_clock::now();
+	renderer.render(frame.data());
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+};
+
+// Root mean square difference of channels
+double rmse(const std::vector<unsigned int>& a, const std::vector<unsigned int>& b) {
+	double sum = 0.0;
+	for (size_t i = 0; i < a.size(); ++i)
+		for (int c = 0; c < 24; c += 8) {
+			double d = (double) ((a[i] >> c) & 0xFF) - (double) ((b[i] >> c) & 0xFF);
+			sum += d * d;
+		}
+	return std::sqrt(sum / (a.size() * 3.0));
+};
+
+// Cosine weighted rays must reach lower error than GRID_RAYS deterministic
+//  pattern with COSINE_RAYS rays in less time, and error must fall with ray count.
+// Reference is average of cosine weighted rays, so error of pattern is mostly it's bias.
+bool compare_diffuse_modes(RayTrace& rt, const std::vector<unsigned int>& reference) {
+	RayTraceScene& scene = rt.get_scene();
+	std::vector<unsigned int> frame(WIDTH * HEIGHT);
+
+	scene.cosine_diffuse_ray = 0;
+	scene.horisontal_diffuse_count = GRID_RAYS / 4;
+	scene.vertical_diffuse_count = 4;
+	double grid_time = render(rt, frame);
+	double grid_error = rmse(reference, frame);
+	printf("\ngrid       %2d rays: %8.3f s, rmse %6.3f\n", GRID_RAYS, grid_time, grid_error);
+
+	scene.cosine_diffuse_ray = 1;
+	scene.sample_sequence = SampleSequence::RANDOM;
+	double cosine_time = 0.0, cosine_error = 0.0, previous_error = std::numeric_limits<double>::infinity();
+	bool falls = 1;
+	for (int count = 1; count <= SAMPLES; count *= 2) {
+		scene.random_diffuse_count = count;
+		double time = render(rt, frame);
+		double error = rmse(reference, frame);
+		printf("cosine     %2d rays: %8.3f s, rmse %6.3f\n", count, time, error);
+
+		falls = falls && error < previous_error;
+		previous_error = error;
+		if (count == COSINE_RAYS) {
+			cosine_time = time;
+			cosine_error = error;
+		}
+	}
+
+	bool better = cosine_error < grid_error && cosine_time < grid_time;
+	printf("cosine %d rays %s grid %d rays, error %s with ray count\n", COSINE_RAYS, better ? "beat" : "do not beat", GRID_RAYS, falls ? "falls" : "does not fall");
+	return better && falls;
+};
+
+int main() {
+	bool means = check_means();
+
+	RayTrace rt(Camera(WIDTH, HEIGHT));
+	create_scene(rt);
+	RayTraceScene& scene = rt.get_scene();
+
+	// Reference accumulates many independent samples with few rays, because
+	//  cost of single sample grows with square of diffuse rays per hit
+	std::vector<unsigned int> reference(WIDTH * HEIGHT), frame(WIDTH * HEIGHT);
+	ProgressiveRenderer progressive(rt, THREAD_COUNT);
+	progressive.diffuse_count = REFERENCE_DIFFUSE;
+	auto start = std::chrono::steady_clock::now();
+	progressive.render(REFERENCE_SAMPLES);
+	progressive.resolve(reference.data());
+	double reference_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	printf("\nreference, %d x %d rays: %8.3f s\n", REFERENCE_SAMPLES, REFERENCE_DIFFUSE, reference_time);
+
+	scene.random_diffuse_count = SAMPLES;
+	double error[4];
+	for (int s = 0; s < 4; ++s) {
+		scene.sample_sequence = sequences[s];
+		double time = render(rt, frame);
+		error[s] = rmse(reference, frame);
+		printf("%-10s %d rays: %8.3f s, rmse %6.3f, %.2fx of random\n", sequence_names[s], SAMPLES, time, error[s], error[s] / error[0]);
+	}
+
+	bool converge = 1;
+	for (int s = 1; s < 4; ++s)
+		converge = converge && error[s] < error[0];
+	printf("sequences %s random\n", converge ? "beat" : "do not beat");
+
+	bool modes = compare_diffuse_modes(rt, reference);
+
+	return means && converge && modes ? 0 : 1;
+};
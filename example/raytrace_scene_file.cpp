@@ -0,0 +1,233 @@
+/*
+    Example saves built scene into binary scene file, loads it into another tracer
+     without building and compares load time & rendered images
+
+	cpp math utilities
+    Copyright (C) 2019-3041  bitrate16
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <stdexcept>
+
+#include "RayTrace.h"
+#include "RayTraceMesh.h"
+#include "RayTraceRenderer.h"
+#include "RayTraceSceneFile.h"
+
+using namespace spaint;
+using namespace cppmath;
+using namespace raytrace;
+
+#define WIDTH 320
+#define HEIGHT 240
+#define THREAD_COUNT 4
+#define SCENE_FILE "raytrace_scene_file.rtsc"
+#define MALFORMED_FILE "raytrace_scene_file_malformed.rtsc"
+// Position of arrays in file: nodes of all mesh BVHs & nodes of scene BVH
+#define MESH_NODES_ARRAY 10
+#define SCENE_NODES_ARRAY 20
+// Number of loose spheres & triangles
+#define PRIMITIVES 50000
+// Number of sphere segments in generated mesh
+#define SEGMENTS 512
+
+// bash c.sh "-lpthread" example/raytrace_scene_file
+
+typedef std::chrono::steady_clock timer;
+
+double seconds_since(timer::time_point start) {
+	return std::chrono::duration<double>(timer::now() - start).count();
+};
+
+// Sphere of quads split into triangles with vertex normals
+Mesh* sphere_mesh(const vec3& center, double radius, int segments) {
+	Mesh* mesh = new Mesh();
+	int rings = segments / 2;
+	for (int r = 0; r <= rings; ++r)
+		for (int s = 0; s < segments; ++s) {
+			double theta = 3.14159265358979323846 * r / rings;
+			double phi = 2.0 * 3.14159265358979323846 * s / segments;
+			vec3 n(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+			mesh->add_vertex(center + n * radius);
+			mesh->add_normal(n);
+		}
+
+	for (int r = 0; r < rings; ++r)
+		for (int s = 0; s < segments; ++s) {
+			int a = r * segments + s;
+			int b = r * segments + (s + 1) % segments;
+			int c = a + segments;
+			int d = b + segments;
+			mesh->add_triangle(a, c, d, a, c, d);
+			mesh->add_triangle(a, d, b, a, d, b);
+		}
+
+	mesh->material.color = Color(200, 200, 255);
+	mesh->material.reflect = 0.3;
+	return mesh;
+};
+
+void create_scene(RayTrace& rt) {
+	rt.set_background(Color(30, 30, 50));
+	RayTraceScene& scene = rt.get_scene();
+	scene.use_shadows = 1;
+
+	UVPlane* floor_plane = new UVPlane(vec3(0, -160, 0), vec3(0, 1, 0));
+	floor_plane->material.color = Color::WHITE;
+	floor_plane->uv_map = [](double u, double v) -> Color {
+		return ((int) std::floor(u / 40.0) + (int) std::floor(v / 40.0)) & 1 ? Color::WHITE : Color(90, 90, 90);
+	};
+	floor_plane->bake_texture(64, 64, 80.0);
+	scene.addObject(floor_plane);
+
+	std::mt19937 gen(PRIMITIVES);
+	std::uniform_real_distribution<double> pos(-150.0, 150.0);
+	std::uniform_real_distribution<double> depth(150.0, 600.0);
+	std::uniform_real_distribution<double> offset(-6.0, 6.0);
+
+	Color colors[3] = { Color::RED, Color::GREEN, Color::BLUE };
+	for (int i = 0; i < PRIMITIVES; ++i) {
+		vec3 c(pos(gen), pos(gen), depth(gen));
+		Sphere* s = new Sphere(c, 2.0);
+		s->material.color = colors[i % 3];
+		scene.addObject(s);
+
+		Triangle* t = new Triangle(c + vec3(offset(gen), offset(gen), offset(gen)),
+								   c + vec3(offset(gen), offset(gen), offset(gen)),
+								   c + vec3(offset(gen), offset(gen), offset(gen)));
+		t->material.color = Color::WHITE;
+		scene.addObject(t);
+	}
+
+	scene.addObject(sphere_mesh(vec3(0, -60, 350), 80, SEGMENTS));
+
+	Sphere* light = new Sphere(vec3(-100, 300, 0), 5);
+	light->material.color = Color::WHITE;
+	light->material.luminosity = 1.0;
+	light->material.surface_visible = 0;
+	scene.addObject(light);
+};
+
+std::vector<unsigned int> render(RayTrace& rt) {
+	std::vector<unsigned int> frame(WIDTH * HEIGHT);
+	Renderer(rt, THREAD_COUNT).render(frame.data());
+	return frame;
+};
+
+// Save scene & rewrite BVH nodes stored in array of file into chain of inner nodes with
+//  leaf as left child. Chain passes range checks, so only it's depth makes load fail.
+// Returns 1 if load rejects file as too deep.
+bool rejects_deep_bvh(RayTrace& rt, int array, size_t node_count) {
+	SceneFile::save(MALFORMED_FILE, rt);
+
+	// Header: magic, version, byte order, flags [4B each], table offset [8B], array count [8B]
+	FILE* f = fopen(MALFORMED_FILE, "r+b");
+	uint64_t table_offset, entry[2];
+	bool patched = f
+		&& !fseek(f, 16, SEEK_SET) && fread(&table_offset, sizeof(table_offset), 1, f) == 1
+		&& !fseek(f, table_offset + array * sizeof(entry), SEEK_SET) && fread(entry, sizeof(entry), 1, f) == 1
+		&& entry[1] == node_count * sizeof(BVH::Node);
+
+	if (patched) {
+		std::vector<BVH::Node> nodes(node_count);
+		for (size_t n = 0; n < node_count; ++n) {
+			nodes[n].bounds = AABB(vec3(-1000.0), vec3(1000.0));
+			bool inner = n % 2 == 0 && n + 2 < node_count;
+			nodes[n].offset = inner ? n + 2 : 0;
+			nodes[n].count = inner ? 0 : 1;
+		}
+		patched = !fseek(f, entry[0], SEEK_SET) && fwrite(nodes.data(), sizeof(BVH::Node), node_count, f) == node_count;
+	}
+	if (f)
+		fclose(f);
+
+	bool rejected = 0;
+	if (patched)
+		try {
+			RayTrace loaded;
+			SceneFile::load(MALFORMED_FILE, loaded);
+		} catch (const std::runtime_error& e) {
+			rejected = std::string(e.what()) == "BVH is too deep";
+		}
+
+	std::remove(MALFORMED_FILE);
+	return rejected;
+};
+
+// Scene with mesh & loose spheres, both BVHs have enough nodes for chain deeper than BVH::STACK_SIZE
+bool rejects_malformed() {
+	RayTrace rt(Camera(WIDTH, HEIGHT));
+	Mesh* mesh = sphere_mesh(vec3(0, 0, 300), 50, 48);
+	rt.get_scene().addObject(mesh);
+	for (int i = 0; i < 1000; ++i)
+		rt.get_scene().addObject(new Sphere(vec3(i % 40 * 10 - 200, i / 40 * 10 - 125, 400), 3));
+	rt.get_scene().build();
+
+	bool mesh_rejected = rejects_deep_bvh(rt, MESH_NODES_ARRAY, mesh->get_bvh().get_nodes().size());
+	bool scene_rejected = rejects_deep_bvh(rt, SCENE_NODES_ARRAY, rt.get_scene().get_bvh().get_nodes().size());
+	printf("too deep mesh BVH %s\n", mesh_rejected ? "rejected" : "accepted");
+	printf("too deep scene BVH %s\n", scene_rejected ? "rejected" : "accepted");
+	return mesh_rejected && scene_rejected;
+};
+
+int main() {
+	RayTrace original(Camera(WIDTH, HEIGHT));
+	auto start = timer::now();
+	create_scene(original);
+	original.get_scene().build();
+	double build_time = seconds_since(start);
+
+	start = timer::now();
+	SceneFile::save(SCENE_FILE, original);
+	double save_time = seconds_since(start);
+
+	RayTrace loaded;
+	start = timer::now();
+	SceneFile::load(SCENE_FILE, loaded);
+	double load_time = seconds_since(start);
+
+	FILE* f = fopen(SCENE_FILE, "rb");
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fclose(f);
+
+	printf("%d objects, %d mesh faces, file %.1f MB\n", loaded.get_scene().get_object_count(), SEGMENTS * SEGMENTS, size / 1048576.0);
+	printf("create & build: %8.3f ms\n", build_time * 1000.0);
+	printf("save:           %8.3f ms\n", save_time * 1000.0);
+	printf("load:           %8.3f ms, %.1fx faster than build\n", load_time * 1000.0, build_time / load_time);
+
+	bool same = render(original) == render(loaded);
+	printf("loaded scene %s\n", same ? "renders same image" : "renders different image");
+
+	// Moved object is refitted into loaded BVH, mapped primitives are changed only in memory
+	for (RayTrace* rt : { &original, &loaded }) {
+		Sphere* s = (Sphere*) rt->get_scene().get_object(1);
+		s->set(vec3(0, 0, 160), 30.0);
+		rt->get_scene().update();
+	}
+	bool same_moved = render(original) == render(loaded);
+	printf("moved object %s\n", same_moved ? "renders same image" : "renders different image");
+
+	std::remove(SCENE_FILE);
+
+	bool rejected = rejects_malformed();
+	return same && same_moved && rejected ? 0 : 1;
+};
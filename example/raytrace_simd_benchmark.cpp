@@ -0,0 +1,173 @@
+/*
+    Example measures throughput of SIMD intersection kernels against virtual SceneObject::hit
+
+	cpp math utilities
+    Copyright (C) 2019-3041  bitrate16
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+#include "RayTrace.h"
+
+using namespace spaint;
+using namespace cppmath;
+using namespace raytrace;
+
+// Number of primitives of each type
+#define PRIMITIVES 4096
+// Number of probing rays
+#define RAYS 1024
+
+// bash c.sh "" example/raytrace_simd_benchmark
+
+std::vector<SceneObject*> spheres_objects;
+std::vector<SceneObject*> triangles_objects;
+SphereSoA spheres;
+TriangleSoA triangles;
+std::vector<ray> rays;
+
+void create_primitives() {
+	std::mt19937 gen(16);
+	std::uniform_real_distribution<double> pos(-100.0, 100.0);
+	std::uniform_real_distribution<double> depth(100.0, 400.0);
+	std::uniform_real_distribution<double> offset(-20.0, 20.0);
+
+	for (int i = 0; i < PRIMITIVES; ++i) {
+		vec3 c(pos(gen), pos(gen), depth(gen));
+
+		Sphere* s = new Sphere(c, 10.0);
+		spheres.add(s->center, s->radius, 1, i);
+		spheres_objects.push_back(s);
+
+		Triangle* t = new Triangle(c + vec3(offset(gen), offset(gen), offset(gen)),
+								   c + vec3(offset(gen), offset(gen), offset(gen)),
+								   c + vec3(offset(gen), offset(gen), offset(gen)));
+		triangles.add(t->A, t->B, t->C, t->normal, 1, i);
+		triangles_objects.push_back(t);
+	}
+
+	// Coherent rays from origin in narrow cone, groups of 4 form packets
+	for (int i = 0; i < RAYS; ++i) {
+		int x = i % 32;
+		int y = i / 32;
+		rays.push_back(ray(vec3(), vec3((x - 16) / 64.0, (y - 16) / 64.0, 1.0).norm()));
+	}
+};
+
+// Run f over all rays until at least 0.2s passed, returns intersections per second
+template<typename F>
+double measure(F&& f) {
+	long long intersections = 0;
+	auto start = std::chrono::steady_clock::now();
+	double elapsed = 0.0;
+
+	do {
+		f();
+		intersections += (long long) RAYS * PRIMITIVES;
+		elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	} while (elapsed < 0.2);
+
+	return intersections / elapsed;
+};
+
+// Closest hit of each ray through virtual interface
+double measure_virtual(const std::vector<SceneObject*>& objects, std::vector<int>& result) {
+	return measure([&]() {
+		for (int r = 0; r < RAYS; ++r) {
+			double t = std::numeric_limits<double>::infinity();
+			result[r] = -1;
+			for (int i = 0; i < PRIMITIVES; ++i) {
+				TraceManifold tm = objects[i]->hit(rays[r]);
+				if (tm.hit && tm.distance >= 10e-8 && tm.distance < t) {
+					t = tm.distance;
+					result[r] = i;
+				}
+			}
+		}
+	});
+};
+
+int main() {
+	create_primitives();
+
+	std::vector<int> reference(RAYS);
+	std::vector<int> result(RAYS);
+	double virtual_rate[2];
+
+	printf("%-10s %-8s %-8s %16s %10s\n", "primitive", "kernel", "mode", "intersections/s", "speedup");
+
+	for (int p = 0; p < 2; ++p) {
+		virtual_rate[p] = measure_virtual(p ? triangles_objects : spheres_objects, reference);
+		printf("%-10s %-8s %-8s %16.3e %9.2fx\n", p ? "triangle" : "sphere", "virtual", "single", virtual_rate[p], 1.0);
+
+		for (int level = simd::SCALAR; level <= simd::AVX2; ++level) {
+			simd::Kernels kernels((simd::Level) level);
+			if (kernels.level != level) {
+				printf("%-10s %-8s %-8s %16s\n", p ? "triangle" : "sphere", simd::level_name((simd::Level) level), "", "not supported");
+				continue;
+			}
+
+			// One ray against all primitives
+			double single_rate = measure([&]() {
+				for (int r = 0; r < RAYS; ++r) {
+					double t = std::numeric_limits<double>::infinity();
+					result[r] = -1;
+					if (p)
+						kernels.triangles_closest(triangles, 0, PRIMITIVES, rays[r].A, rays[r].B, t, result[r]);
+					else
+						kernels.spheres_closest(spheres, 0, PRIMITIVES, rays[r].A, rays[r].B, t, result[r]);
+				}
+			});
+			printf("%-10s %-8s %-8s %16.3e %9.2fx\n", p ? "triangle" : "sphere", simd::level_name(kernels.level), "single", single_rate, single_rate / virtual_rate[p]);
+
+			if (result != reference)
+				printf("  result mismatch with virtual hit\n");
+
+			// Packets of 4 rays against each primitive
+			double packet_rate = measure([&]() {
+				for (int r = 0; r < RAYS; r += simd::PACKET_SIZE) {
+					simd::RayPacket packet;
+					packet.count = simd::PACKET_SIZE;
+					double t[simd::PACKET_SIZE];
+					for (int k = 0; k < simd::PACKET_SIZE; ++k) {
+						packet.set(k, rays[r + k].A, rays[r + k].B);
+						t[k] = std::numeric_limits<double>::infinity();
+						result[r + k] = -1;
+					}
+
+					for (int i = 0; i < PRIMITIVES; ++i)
+						if (p)
+							kernels.triangle_packet(triangles, i, packet, t, &result[r]);
+						else
+							kernels.sphere_packet(spheres, i, packet, t, &result[r]);
+				}
+			});
+			printf("%-10s %-8s %-8s %16.3e %9.2fx\n", p ? "triangle" : "sphere", simd::level_name(kernels.level), "packet", packet_rate, packet_rate / virtual_rate[p]);
+
+			if (result != reference)
+				printf("  result mismatch with virtual hit\n");
+		}
+	}
+
+	for (SceneObject* o : spheres_objects)
+		delete o;
+	for (SceneObject* o : triangles_objects)
+		delete o;
+
+	return 0;
+};
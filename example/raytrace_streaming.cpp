@@ -0,0 +1,191 @@
+/*
+    Example renders frame into streaming PNG, RAWb & tiled outputs without frame buffer
+     and compares written images with frame rendered into memory
+
+	cpp math utilities
+    Copyright (C) 2019-3041  bitrate16
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <cstring>
+
+#include "RayTrace.h"
+#include "RayTraceRenderer.h"
+#include "RayTraceOutput.h"
+#include "lodepng.h"
+#include "rawb.h"
+
+using namespace spaint;
+using namespace cppmath;
+using namespace raytrace;
+
+#define WIDTH 1024
+#define HEIGHT 768
+#define THREAD_COUNT 4
+#define FILENAME_PNG "raytrace_streaming.png"
+#define FILENAME_BINARY "raytrace_streaming.rawb"
+#define FILENAME_TILED "raytrace_streaming.tiles"
+#define FILENAME_CONVERTED "raytrace_streaming_converted.png"
+
+// Also render POSTER x POSTER frame straight into PNG, e.g. 32768
+// #define POSTER 32768
+#define FILENAME_POSTER "raytrace_poster.png"
+
+// bash c.sh "-lpthread" example/raytrace_streaming
+
+typedef std::chrono::steady_clock timer;
+
+double seconds_since(timer::time_point start) {
+	return std::chrono::duration<double>(timer::now() - start).count();
+};
+
+long file_size(const char* filename) {
+	FILE* f = fopen(filename, "rb");
+	if (!f)
+		return -1;
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fclose(f);
+	return size;
+};
+
+void create_scene(RayTrace& rt) {
+	rt.set_background(Color(20, 20, 40));
+	RayTraceScene& scene = rt.get_scene();
+	scene.use_shadows = 1;
+
+	Plane* floor_plane = new Plane(vec3(0, -40, 0), vec3(0, 1, 0));
+	floor_plane->material.color = Color::WHITE;
+	floor_plane->material.diffuse = 1.0;
+	scene.addObject(floor_plane);
+
+	Color colors[3] = { Color::RED, Color::GREEN, Color::BLUE };
+	for (int i = 0; i < 9; ++i) {
+		Sphere* s = new Sphere(vec3(-80 + i * 20, -25, 150 + (i % 3) * 30), 15);
+		s->material.color = colors[i % 3];
+		s->material.diffuse = 0.7;
+		s->material.reflect = 0.3;
+		scene.addObject(s);
+	}
+
+	Sphere* light = new Sphere(vec3(0, 80, 100), 10);
+	light->material.color = Color::WHITE;
+	light->material.luminosity = 1.0;
+	light->material.surface_visible = 0;
+	scene.addObject(light);
+
+	scene.build();
+};
+
+bool same_png(const char* filename, const std::vector<unsigned int>& frame) {
+	unsigned char* image = nullptr;
+	unsigned width, height;
+	if (lodepng_decode32_file(&image, &width, &height, filename))
+		return 0;
+
+	bool same = width == WIDTH && height == HEIGHT && !memcmp(image, frame.data(), frame.size() * 4);
+	free(image);
+	return same;
+};
+
+int main() {
+	RayTrace rt(Camera(WIDTH, HEIGHT));
+	create_scene(rt);
+
+	std::vector<unsigned int> frame(WIDTH * HEIGHT);
+	auto start = timer::now();
+	Renderer(rt, THREAD_COUNT).render(frame.data());
+	printf("frame:     render %8.3f ms, frame buffer %zu KB\n", seconds_since(start) * 1000.0, frame.size() * 4 / 1024);
+
+	start = timer::now();
+	lodepng_encode32_file("raytrace_streaming_lodepng.png", (unsigned char*) frame.data(), WIDTH, HEIGHT);
+	printf("lodepng:   encode %8.3f ms, %ld bytes\n", seconds_since(start) * 1000.0, file_size("raytrace_streaming_lodepng.png"));
+	std::remove("raytrace_streaming_lodepng.png");
+
+	bool all_same = 1;
+
+	{
+		PngSink sink(FILENAME_PNG);
+		start = timer::now();
+		Renderer(rt, THREAD_COUNT).render(sink);
+		bool same = same_png(FILENAME_PNG, frame);
+		all_same &= same;
+		printf("png:       render %8.3f ms, %ld bytes, peak buffered %zu KB, %s\n", seconds_since(start) * 1000.0,
+			file_size(FILENAME_PNG), sink.get_peak_memory() / 1024, same ? "same image" : "different image");
+	}
+
+	{
+		RawbSink sink(FILENAME_BINARY);
+		start = timer::now();
+		Renderer(rt, THREAD_COUNT).render(sink);
+		double time = seconds_since(start);
+		rawb r(FILENAME_BINARY);
+		bool same = r.get_width() == WIDTH && r.get_height() == HEIGHT && !memcmp(r.buffer, frame.data(), frame.size() * 4);
+		all_same &= same;
+		printf("rawb:      render %8.3f ms, %ld bytes, peak buffered %zu KB, %s\n", time * 1000.0,
+			file_size(FILENAME_BINARY), sink.get_peak_memory() / 1024, same ? "same image" : "different image");
+	}
+
+	{
+		TiledSink sink(FILENAME_TILED);
+		start = timer::now();
+		Renderer(rt, THREAD_COUNT).render(sink);
+		double time = seconds_since(start);
+
+		TiledReader reader(FILENAME_TILED);
+		bool same = 1;
+		for (const Tile& t : reader.get_tiles())
+			for (int y = 0; y < t.height; ++y)
+				same &= !memcmp(reader.get_tile(t) + y * t.width, &frame[t.x + (t.y + y) * WIDTH], t.width * 4);
+		all_same &= same;
+		printf("tiled:     render %8.3f ms, %ld bytes, %s\n", time * 1000.0, file_size(FILENAME_TILED), same ? "same image" : "different image");
+
+		// Tiled file is converted into PNG band by band
+		PngSink converted(FILENAME_CONVERTED);
+		start = timer::now();
+		reader.copy(converted);
+		same = same_png(FILENAME_CONVERTED, frame);
+		all_same &= same;
+		printf("converted: encode %8.3f ms, %ld bytes, %s\n", seconds_since(start) * 1000.0, file_size(FILENAME_CONVERTED), same ? "same image" : "different image");
+	}
+
+	std::remove(FILENAME_PNG);
+	std::remove(FILENAME_BINARY);
+	std::remove(FILENAME_TILED);
+	std::remove(FILENAME_CONVERTED);
+
+#ifdef POSTER
+	{
+		rt.camera = Camera(POSTER, POSTER);
+		PngSink sink(FILENAME_POSTER);
+		Renderer renderer(rt, THREAD_COUNT);
+		renderer.on_tile = [&renderer](const Tile& t) {
+			int done = renderer.get_finished_tiles();
+			if (done % 65536 == 0)
+				printf("%d / %d\n", done, renderer.get_total_tiles());
+		};
+		start = timer::now();
+		renderer.render(sink);
+		printf("poster:    render %8.3f s, %ld bytes, peak buffered %zu KB of %zu KB frame\n", seconds_since(start), file_size(FILENAME_POSTER),
+			sink.get_peak_memory() / 1024, (size_t) POSTER * POSTER * 4 / 1024);
+	}
+#endif
+
+	return all_same ? 0 : 1;
+};
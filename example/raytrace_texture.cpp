@@ -0,0 +1,163 @@
+/*
+    Example compares procedural uv_map of UVSphere & UVPlane with textures
+     baked from the same maps and with texture loaded from PNG
+
+	cpp math utilities
+    Copyright (C) 2019-3041  bitrate16
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cmath>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <cstdlib>
+
+#include "RayTrace.h"
+#include "lodepng.h"
+
+using namespace spaint;
+using namespace cppmath;
+using namespace raytrace;
+
+#define WIDTH 300
+#define HEIGHT 300
+#define TEXTURE_SIZE 1024
+#define PNG_FILENAME "texture.png"
+// Number of timed material lookups
+#define LOOKUPS 1000000
+
+// bash c.sh "" example/raytrace_texture
+
+UVSphere* sphere;
+UVPlane* floor_plane;
+
+void create_scene(RayTrace& rt) {
+	rt.camera = Camera(WIDTH, HEIGHT);
+	rt.set_background(Color::BLACK);
+	rt.get_scene().use_shadows = 1;
+
+	floor_plane = new UVPlane(vec3(0, -50, 0), vec3(0, 1, 0));
+	floor_plane->material.diffuse = 1.0;
+	// Checker with 20 units cells, repeats every 40 units
+	floor_plane->uv_map = [](double u, double v) -> Color {
+		double su = std::sin(u * 3.14159265358979323846 / 20.0);
+		double sv = std::sin(v * 3.14159265358979323846 / 20.0);
+		return (su < 0) != (sv < 0) ? Color(220, 220, 220) : Color(40, 40, 120);
+	};
+	rt.get_scene().addObject(floor_plane);
+
+	sphere = new UVSphere(vec3(0, -10, 150), 40);
+	sphere->material.diffuse = 1.0;
+	sphere->uv_map = [](double u, double v) -> Color {
+		return Color(127 + 127 * std::sin(u * 4), 127 + 127 * std::cos(v * 6), 255 * (std::sin(u * 8 + v * 8) > 0));
+	};
+	rt.get_scene().addObject(sphere);
+
+	Sphere* light = new Sphere(vec3(-60, 80, 60), 5);
+	light->material.color = Color::WHITE;
+	light->material.luminosity = 1.0;
+	light->material.surface_visible = 0;
+	rt.get_scene().addObject(light);
+
+	rt.get_scene().build();
+};
+
+// Time of material lookups at points on sphere, as done by shading
+double lookups(const std::vector<vec3>& points) {
+	int sum = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (const vec3& p : points)
+		sum += sphere->get_material(p).color.r;
+	double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	// Keep lookups from being optimized out
+	if (sum == -1)
+		printf("%d\n", sum);
+	return time / points.size();
+};
+
+double render(RayTrace& rt, std::vector<Color>& frame) {
+	auto start = std::chrono::steady_clock::now();
+	for (int y = 0; y < HEIGHT; ++y)
+		for (int x = 0; x < WIDTH; ++x)
+			frame[x + y * WIDTH] = rt.hitColorAt(x, y);
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+};
+
+// Mean absolute difference of channels
+double difference(const std::vector<Color>& a, const std::vector<Color>& b) {
+	double sum = 0.0;
+	for (int i = 0; i < a.size(); ++i)
+		sum += std::abs(a[i].r - b[i].r) + std::abs(a[i].g - b[i].g) + std::abs(a[i].b - b[i].b);
+	return sum / (a.size() * 3.0);
+};
+
+int main() {
+	RayTrace rt;
+	create_scene(rt);
+
+	std::vector<vec3> points(LOOKUPS);
+	for (int i = 0; i < LOOKUPS; ++i) {
+		double a = i * 0.001, b = i * 0.0007;
+		points[i] = sphere->center + vec3(std::cos(a) * std::sin(b), std::cos(b), std::sin(a) * std::sin(b)) * sphere->radius;
+	}
+
+	std::vector<Color> procedural(WIDTH * HEIGHT), baked(WIDTH * HEIGHT), mipmapped(WIDTH * HEIGHT), loaded(WIDTH * HEIGHT);
+	double procedural_time = render(rt, procedural);
+	double procedural_lookup_time = lookups(points);
+
+	auto start = std::chrono::steady_clock::now();
+	sphere->bake_texture(TEXTURE_SIZE, TEXTURE_SIZE / 2);
+	floor_plane->bake_texture(TEXTURE_SIZE / 8, TEXTURE_SIZE / 8, 40.0);
+	double bake_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	double baked_time = render(rt, baked);
+	double baked_lookup_time = lookups(points);
+
+	// Blurred lookups of smaller levels
+	sphere->texture_lod = 2.5;
+	floor_plane->texture_lod = 1.5;
+	double mipmapped_time = render(rt, mipmapped);
+	sphere->texture_lod = 0.0;
+	floor_plane->texture_lod = 0.0;
+
+	// Store first level of sphere texture as PNG & load it back
+	const Texture& texture = *sphere->texture;
+	std::vector<unsigned char> image((size_t) texture.get_width() * texture.get_height() * 4);
+	for (int y = 0; y < texture.get_height(); ++y)
+		for (int x = 0; x < texture.get_width(); ++x) {
+			Color c = texture.texel(x, y);
+			unsigned char* p = &image[4 * ((size_t) y * texture.get_width() + x)];
+			p[0] = c.r;
+			p[1] = c.g;
+			p[2] = c.b;
+			p[3] = c.a;
+		}
+	lodepng::encode(PNG_FILENAME, image, texture.get_width(), texture.get_height());
+
+	std::shared_ptr<Texture> png = std::make_shared<Texture>(PNG_FILENAME);
+	png->wrap_v = TextureWrap::CLAMP;
+	sphere->texture = png;
+	double loaded_time = render(rt, loaded);
+
+	printf("procedural: %8.3f s, %6.1f ns per lookup\n", procedural_time, procedural_lookup_time * 1e9);
+	printf("bake:       %8.3f s, %d levels\n", bake_time, texture.get_level_count());
+	printf("baked:      %8.3f s, %6.1f ns per lookup, mean difference %.2f\n", baked_time, baked_lookup_time * 1e9, difference(procedural, baked));
+	printf("mipmapped:  %8.3f s, mean difference %.2f\n", mipmapped_time, difference(procedural, mipmapped));
+	printf("png:        %8.3f s, mean difference from baked %.2f\n", loaded_time, difference(baked, loaded));
+
+	return 0;
+};
@@ -0,0 +1,499 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <functional>
+
+// Streaming zlib (RFC 1950) compressor writing deflate (RFC 1951) blocks with dynamic
+//  Huffman codes. Input is passed in pieces through write(), compressed bytes are
+//  passed to output callback after each block, so memory does not depend on size of
+//  input: 32 KB window, one block of pending input & it's symbols.
+// Usage:
+//  DeflateStream z([&](const unsigned char* data, size_t size) { file.write(...); });
+//  z.write(row, row_size); ... z.finish();
+class DeflateStream {
+
+	static const int WINDOW = 32768;
+	// Number of input bytes compressed into one block
+	static const int BLOCK = 131072;
+	static const int HASH_BITS = 15;
+	static const int MIN_MATCH = 3;
+	static const int MAX_MATCH = 258;
+	// Match of this length is taken without looking for longer match at next byte
+	static const int GOOD_MATCH = 32;
+
+	std::function<void(const unsigned char*, size_t)> output;
+
+	// Last WINDOW bytes of compressed input followed by pending input
+	std::vector<unsigned char> buffer;
+	// Stream position of buffer[0]
+	uint64_t base = 0;
+	// Stream position of first pending byte
+	uint64_t position = 0;
+	// Positions below this are inserted into hash chains
+	uint64_t inserted = 0;
+	// Latest position + 1 with each hash, 0 for none
+	std::vector<uint64_t> head;
+	// Previous position + 1 with same hash, indexed by position % WINDOW
+	std::vector<uint64_t> chain;
+
+	// Symbols of current block: literal byte or 0x80000000 | (length - 3) << 16 | (distance - 1)
+	std::vector<uint32_t> symbols;
+	uint32_t literal_freq[286];
+	uint32_t distance_freq[30];
+
+	// Output bits, deflate writes from least significant bit
+	uint64_t bits = 0;
+	int bit_count = 0;
+	std::vector<unsigned char> out;
+
+	uint32_t adler_a = 1, adler_b = 0;
+	bool started = 0;
+	bool finished = 0;
+
+	static const uint16_t* length_base() {
+		static const uint16_t table[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+		return table;
+	};
+
+	static const uint8_t* length_extra() {
+		static const uint8_t table[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+		return table;
+	};
+
+	static const uint16_t* distance_base() {
+		static const uint16_t table[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+		return table;
+	};
+
+	static const uint8_t* distance_extra() {
+		static const uint8_t table[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+		return table;
+	};
+
+	// Index of length code for match length in [3, 258]
+	// 258 has own code without extra bits, so it is found as last base
+	static int length_code(int length) {
+		return std::upper_bound(length_base(), length_base() + 29, length) - length_base() - 1;
+	};
+
+	static int distance_code(int distance) {
+		return std::upper_bound(distance_base(), distance_base() + 30, distance) - distance_base() - 1;
+	};
+
+	inline void put(uint32_t value, int count) {
+		bits |= (uint64_t) value << bit_count;
+		bit_count += count;
+		while (bit_count >= 8) {
+			out.push_back(bits & 0xFF);
+			bits >>= 8;
+			bit_count -= 8;
+		}
+	};
+
+	// Code lengths of Huffman code limited to max_length bits, zero for unused symbols
+	static void build_lengths(const uint32_t* freq, int count, int max_length, uint8_t* lengths) {
+		std::vector<std::pair<uint32_t, int>> used;
+		for (int i = 0; i < count; ++i) {
+			lengths[i] = 0;
+			if (freq[i])
+				used.push_back(std::make_pair(freq[i], i));
+		}
+
+		if (used.empty())
+			return;
+		if (used.size() == 1) {
+			lengths[used[0].second] = 1;
+			return;
+		}
+
+		std::sort(used.begin(), used.end());
+
+		// Huffman tree of sorted leaves by two queues: leaves & merged nodes in order of creation
+		int n = used.size();
+		std::vector<uint64_t> weight(2 * n - 1);
+		std::vector<int> parent(2 * n - 1, 0);
+		for (int i = 0; i < n; ++i)
+			weight[i] = used[i].first;
+
+		int leaf = 0, node = n;
+		for (int next = n; next < 2 * n - 1; ++next) {
+			int pick[2];
+			for (int k = 0; k < 2; ++k)
+				if (leaf < n && (node >= next || weight[leaf] <= weight[node]))
+					pick[k] = leaf++;
+				else
+					pick[k] = node++;
+
+			weight[next] = weight[pick[0]] + weight[pick[1]];
+			parent[pick[0]] = parent[pick[1]] = next;
+		}
+
+		// Parent is created after children, so depth is known walking down from root
+		std::vector<int> depth(2 * n - 1, 0);
+		int length_count[16] = { 0 };
+		for (int i = 2 * n - 3; i >= 0; --i) {
+			depth[i] = depth[parent[i]] + 1;
+			if (i < n)
+				++length_count[std::min(depth[i], max_length)];
+		}
+
+		// Clamped lengths oversubscribe code, lengthen shorter codes until Kraft sum fits
+		uint32_t total = 0;
+		for (int i = 1; i <= max_length; ++i)
+			total += (uint32_t) length_count[i] << (max_length - i);
+		while (total > (1u << max_length)) {
+			--length_count[max_length];
+			for (int i = max_length - 1; i > 0; --i)
+				if (length_count[i]) {
+					--length_count[i];
+					length_count[i + 1] += 2;
+					break;
+				}
+			--total;
+		}
+
+		// Most frequent symbols get shortest codes
+		int i = n - 1;
+		for (int l = 1; l <= max_length; ++l)
+			for (int k = 0; k < length_count[l]; ++k)
+				lengths[used[i--].second] = l;
+	};
+
+	// Canonical codes with reversed bits, ready for put()
+	static void build_codes(const uint8_t* lengths, int count, uint16_t* codes) {
+		int length_count[16] = { 0 };
+		for (int i = 0; i < count; ++i)
+			++length_count[lengths[i]];
+		length_count[0] = 0;
+
+		int next[16] = { 0 };
+		int code = 0;
+		for (int l = 1; l < 16; ++l) {
+			code = (code + length_count[l - 1]) << 1;
+			next[l] = code;
+		}
+
+		for (int i = 0; i < count; ++i) {
+			codes[i] = 0;
+			if (!lengths[i])
+				continue;
+			int c = next[lengths[i]]++;
+			for (int b = 0; b < lengths[i]; ++b)
+				codes[i] |= ((c >> b) & 1) << (lengths[i] - 1 - b);
+		}
+	};
+
+	inline uint32_t hash(const unsigned char* p) const {
+		return ((uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16) * 2654435761u >> (32 - HASH_BITS);
+	};
+
+	// Insert positions below limit into hash chains, needs MIN_MATCH bytes after each
+	inline void insert(uint64_t limit, uint64_t end) {
+		limit = std::min(limit, end - std::min<uint64_t>(end, MIN_MATCH - 1));
+		for (; inserted < limit; ++inserted) {
+			uint32_t h = hash(&buffer[inserted - base]);
+			chain[inserted % WINDOW] = head[h];
+			head[h] = inserted + 1;
+		}
+	};
+
+	// Number of equal leading bytes, compares 8 bytes at once
+	static inline int match_length(const unsigned char* a, const unsigned char* b, int max_length) {
+		int l = 0;
+		while (l + 8 <= max_length) {
+			uint64_t x, y;
+			memcpy(&x, a + l, 8);
+			memcpy(&y, b + l, 8);
+			if (x != y) {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+				// First differing byte is lowest differing byte of little endian word
+				return l + (__builtin_ctzll(x ^ y) >> 3);
+#else
+				break;
+#endif
+			}
+			l += 8;
+		}
+		while (l < max_length && a[l] == b[l])
+			++l;
+		return l;
+	};
+
+	// Longest match for position p with data ending at end, returns length or 0
+	int find_match(uint64_t p, uint64_t end, int& distance) {
+		if (end - p < MIN_MATCH)
+			return 0;
+
+		insert(p, end);
+		int max_length = std::min<uint64_t>(MAX_MATCH, end - p);
+		const unsigned char* current = &buffer[p - base];
+		int best = MIN_MATCH - 1;
+
+		uint64_t candidate = head[hash(current)];
+		for (int tries = max_chain; candidate && tries > 0; --tries) {
+			uint64_t c = candidate - 1;
+			if (p - c > WINDOW)
+				break;
+
+			const unsigned char* previous = &buffer[c - base];
+			if (previous[best] == current[best] && previous[0] == current[0]) {
+				int l = match_length(previous, current, max_length);
+				if (l > best) {
+					best = l;
+					distance = p - c;
+					if (l == max_length)
+						break;
+				}
+			}
+
+			uint64_t next = chain[c % WINDOW];
+			// Slot was reused by newer position, chain ends here
+			if (next >= candidate)
+				break;
+			candidate = next;
+		}
+
+		return best >= MIN_MATCH ? best : 0;
+	};
+
+	void add_literal(unsigned char c) {
+		symbols.push_back(c);
+		++literal_freq[c];
+	};
+
+	void add_match(int length, int distance) {
+		symbols.push_back(0x80000000u | (uint32_t) (length - MIN_MATCH) << 16 | (distance - 1));
+		++literal_freq[257 + length_code(length)];
+		++distance_freq[distance_code(distance)];
+	};
+
+	// LZ77 of pending input up to end with one step lazy matching
+	void parse(uint64_t end) {
+		int next_length = -1, next_distance = 0;
+		uint64_t p = position;
+		while (p < end) {
+			int distance = 0;
+			int length = next_length >= 0 ? next_length : find_match(p, end, distance);
+			if (next_length >= 0)
+				distance = next_distance;
+			next_length = -1;
+
+			if (length && length < GOOD_MATCH && p + 1 < end) {
+				next_length = find_match(p + 1, end, next_distance);
+				if (next_length > length) {
+					add_literal(buffer[p - base]);
+					++p;
+					continue;
+				}
+				next_length = -1;
+			}
+
+			if (length) {
+				add_match(length, distance);
+				p += length;
+			} else {
+				add_literal(buffer[p - base]);
+				++p;
+			}
+		}
+		position = end;
+	};
+
+	void write_block(bool final) {
+		literal_freq[256] = 1;
+		// Decoders differ in accepting codes of single symbol, keep two in each
+		if (std::count_if(literal_freq, literal_freq + 286, [](uint32_t f) { return f != 0; }) < 2)
+			literal_freq[0] = 1;
+		if (std::count_if(distance_freq, distance_freq + 30, [](uint32_t f) { return f != 0; }) < 2)
+			distance_freq[distance_freq[0] ? 1 : 0] = 1;
+
+		uint8_t lengths[286 + 30];
+		build_lengths(literal_freq, 286, 15, lengths);
+		build_lengths(distance_freq, 30, 15, lengths + 286);
+
+		int literal_count = 286, distance_count = 30;
+		while (literal_count > 257 && !lengths[literal_count - 1])
+			--literal_count;
+		while (distance_count > 1 && !lengths[286 + distance_count - 1])
+			--distance_count;
+
+		// Run length encoding of both code lengths as code length symbol | extra << 8
+		uint8_t all[286 + 30];
+		memcpy(all, lengths, literal_count);
+		memcpy(all + literal_count, lengths + 286, distance_count);
+		int all_count = literal_count + distance_count;
+
+		std::vector<uint32_t> runs;
+		uint32_t run_freq[19] = { 0 };
+		for (int i = 0; i < all_count;) {
+			int run = 1;
+			while (i + run < all_count && all[i + run] == all[i])
+				++run;
+			i += run;
+
+			if (!all[i - 1]) {
+				while (run >= 11) {
+					int n = std::min(run, 138);
+					runs.push_back(18 | (n - 11) << 8);
+					run -= n;
+				}
+				if (run >= 3) {
+					runs.push_back(17 | (run - 3) << 8);
+					run = 0;
+				}
+			} else {
+				runs.push_back(all[i - 1]);
+				--run;
+				while (run >= 3) {
+					int n = std::min(run, 6);
+					runs.push_back(16 | (n - 3) << 8);
+					run -= n;
+				}
+			}
+			for (; run > 0; --run)
+				runs.push_back(all[i - 1]);
+		}
+		for (uint32_t r : runs)
+			++run_freq[r & 0xFF];
+
+		static const int ORDER[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+		uint8_t run_lengths[19];
+		uint16_t run_codes[19];
+		build_lengths(run_freq, 19, 7, run_lengths);
+		build_codes(run_lengths, 19, run_codes);
+
+		int order_count = 19;
+		while (order_count > 4 && !run_lengths[ORDER[order_count - 1]])
+			--order_count;
+
+		put(final, 1);
+		put(2, 2);
+		put(literal_count - 257, 5);
+		put(distance_count - 1, 5);
+		put(order_count - 4, 4);
+		for (int i = 0; i < order_count; ++i)
+			put(run_lengths[ORDER[i]], 3);
+
+		static const int RUN_EXTRA[3] = { 2, 3, 7 };
+		for (uint32_t r : runs) {
+			int s = r & 0xFF;
+			put(run_codes[s], run_lengths[s]);
+			if (s >= 16)
+				put(r >> 8, RUN_EXTRA[s - 16]);
+		}
+
+		uint16_t literal_codes[286], distance_codes[30];
+		build_codes(lengths, 286, literal_codes);
+		build_codes(lengths + 286, 30, distance_codes);
+
+		for (uint32_t s : symbols) {
+			if (!(s & 0x80000000u)) {
+				put(literal_codes[s], lengths[s]);
+				continue;
+			}
+
+			int length = ((s >> 16) & 0x1FF) + MIN_MATCH;
+			int distance = (s & 0xFFFF) + 1;
+			int lc = length_code(length);
+			put(literal_codes[257 + lc], lengths[257 + lc]);
+			put(length - length_base()[lc], length_extra()[lc]);
+			int dc = distance_code(distance);
+			put(distance_codes[dc], lengths[286 + dc]);
+			put(distance - distance_base()[dc], distance_extra()[dc]);
+		}
+		put(literal_codes[256], lengths[256]);
+
+		symbols.clear();
+		memset(literal_freq, 0, sizeof(literal_freq));
+		memset(distance_freq, 0, sizeof(distance_freq));
+	};
+
+	void flush_output() {
+		if (!out.empty())
+			output(out.data(), out.size());
+		out.clear();
+	};
+
+	// Compress all pending input into one block & drop history older than window
+	void compress(bool final) {
+		uint64_t end = base + buffer.size();
+		parse(end);
+		write_block(final);
+
+		// Keep positions waiting for MIN_MATCH bytes
+		uint64_t keep = std::min(end - std::min<uint64_t>(end, WINDOW), inserted);
+		if (keep > base) {
+			buffer.erase(buffer.begin(), buffer.begin() + (keep - base));
+			base = keep;
+		}
+		flush_output();
+	};
+
+public:
+
+	// Number of tried previous positions per match, higher is slower & smaller
+	int max_chain = 32;
+
+	DeflateStream(std::function<void(const unsigned char*, size_t)> output) : output(output), head((size_t) 1 << HASH_BITS, 0), chain(WINDOW, 0) {
+		memset(literal_freq, 0, sizeof(literal_freq));
+		memset(distance_freq, 0, sizeof(distance_freq));
+		buffer.reserve(WINDOW + BLOCK + MAX_MATCH);
+	};
+
+	DeflateStream(const DeflateStream&) = delete;
+	DeflateStream& operator=(const DeflateStream&) = delete;
+
+	void write(const unsigned char* data, size_t size) {
+		if (!started) {
+			// CMF: deflate with 32 KB window, FLG: check bits of default level
+			out.push_back(0x78);
+			out.push_back(0x9C);
+			started = 1;
+		}
+
+		// Adler-32 of uncompressed data, sums fit into 32 bits for 5552 bytes
+		for (size_t i = 0; i < size;) {
+			size_t n = std::min<size_t>(size - i, 5552);
+			for (size_t k = 0; k < n; ++k) {
+				adler_a += data[i + k];
+				adler_b += adler_a;
+			}
+			adler_a %= 65521;
+			adler_b %= 65521;
+			i += n;
+		}
+
+		while (size) {
+			size_t pending = base + buffer.size() - position;
+			size_t n = std::min<size_t>(size, BLOCK - pending);
+			buffer.insert(buffer.end(), data, data + n);
+			data += n;
+			size -= n;
+
+			if (base + buffer.size() - position >= BLOCK)
+				compress(0);
+		}
+	};
+
+	// Compress remaining input & write stream trailer, stream can not be written after
+	void finish() {
+		if (finished)
+			return;
+		if (!started)
+			write(nullptr, 0);
+
+		compress(1);
+		if (bit_count)
+			put(0, 8 - bit_count);
+
+		uint32_t adler = adler_b << 16 | adler_a;
+		for (int i = 3; i >= 0; --i)
+			out.push_back((adler >> (8 * i)) & 0xFF);
+		flush_output();
+		finished = 1;
+	};
+};
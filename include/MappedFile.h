@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#define MAPPED_FILE_MMAP
+#endif
+
+// Read-only view of file contents.
+// File is memory mapped when platform supports it, otherwise it is read into heap buffer.
+// File opened with copy_on_write can be changed through writable_data(), changes
+//  stay in memory of process and are never written to file.
+class MappedFile {
+
+	const char* buffer = nullptr;
+	size_t buffer_size = 0;
+	// Set when buffer is mapped and must be unmapped
+	bool mapped = 0;
+	bool writable = 0;
+
+	void release() {
+#ifdef MAPPED_FILE_MMAP
+		if (mapped && buffer)
+			munmap((void*) buffer, buffer_size);
+#endif
+		if (!mapped && buffer)
+			free((void*) buffer);
+
+		buffer = nullptr;
+		buffer_size = 0;
+		mapped = 0;
+		writable = 0;
+	};
+
+public:
+
+	MappedFile() {};
+
+	MappedFile(const std::string& filename, bool copy_on_write = 0) {
+		open(filename, copy_on_write);
+	};
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile() {
+		release();
+	};
+
+	void open(const std::string& filename, bool copy_on_write = 0) {
+		release();
+		writable = copy_on_write;
+
+#ifdef MAPPED_FILE_MMAP
+		int fd = ::open(filename.c_str(), O_RDONLY);
+		if (fd == -1)
+			throw std::runtime_error("File open failed");
+
+		struct stat st;
+		if (fstat(fd, &st) == -1) {
+			::close(fd);
+			throw std::runtime_error("File stat failed");
+		}
+
+		buffer_size = st.st_size;
+		if (buffer_size) {
+			void* p = mmap(nullptr, buffer_size, copy_on_write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p == MAP_FAILED) {
+				::close(fd);
+				buffer_size = 0;
+				throw std::runtime_error("File map failed");
+			}
+
+			// File is read once from start to end, copy-on-write files are accessed randomly
+			if (!copy_on_write)
+				madvise(p, buffer_size, MADV_SEQUENTIAL);
+			buffer = (const char*) p;
+			mapped = 1;
+		}
+
+		::close(fd);
+#else
+		FILE* file = fopen(filename.c_str(), "rb");
+		if (!file)
+			throw std::runtime_error("File open failed");
+
+		fseek(file, 0, SEEK_END);
+		long size = ftell(file);
+		fseek(file, 0, SEEK_SET);
+
+		if (size > 0) {
+			char* p = (char*) malloc(size);
+			if (!p || fread(p, 1, size, file) != (size_t) size) {
+				free(p);
+				fclose(file);
+				throw std::runtime_error("File read failed");
+			}
+			buffer = p;
+			buffer_size = size;
+		}
+
+		fclose(file);
+#endif
+	};
+
+	inline const char* data() const {
+		return buffer;
+	};
+
+	// Contents of file opened with copy_on_write, nullptr otherwise
+	inline char* writable_data() const {
+		return writable ? (char*) buffer : nullptr;
+	};
+
+	inline size_t size() const {
+		return buffer_size;
+	};
+
+	inline const char* begin() const {
+		return buffer;
+	};
+
+	inline const char* end() const {
+		return buffer + buffer_size;
+	};
+};
@@ -6,9 +6,19 @@
 #include <iostream>
 #include <functional>
 #include <algorithm>
+#include <new>
+#include <memory>
+#include <typeinfo>
 
 #include "vec3.h"
 #include "Color.h"
+#include "RayTraceBVH.h"
+#include "RayTracePrimitives.h"
+#include "RayTraceSampler.h"
+#include "RayTraceSIMD.h"
+#include "RayTraceStats.h"
+#include "RayTraceTexture.h"
+#include "RayTraceIrradiance.h"
 
 namespace raytrace {
 	
@@ -22,6 +32,8 @@ namespace raytrace {
 		// Ray direction
 		cppmath::vec3 B;
 		
+		ray() {};
+		
 		ray(const cppmath::vec3& origin, const cppmath::vec3& direction, double pwr) : A(origin), B(direction), power(pwr) {};
 		
 		ray(const cppmath::vec3& origin, const cppmath::vec3& direction) : A(origin), B(direction) {};
@@ -80,24 +92,98 @@ namespace raytrace {
 		bool luminosity_scaling = 0;
 	};
 	
+	// Non-owning view over array of points stored by an object
+	struct PointSpan {
+		const cppmath::vec3* data = nullptr;
+		size_t count = 0;
+		
+		PointSpan() {};
+		
+		PointSpan(const cppmath::vec3* data, size_t count) : data(data), count(count) {};
+		
+		PointSpan(const cppmath::vec3& point) : data(&point), count(1) {};
+		
+		PointSpan(const std::vector<cppmath::vec3>& points) : data(points.data()), count(points.size()) {};
+		
+		inline const cppmath::vec3* begin() const {
+			return data;
+		};
+		
+		inline const cppmath::vec3* end() const {
+			return data + count;
+		};
+		
+		inline size_t size() const {
+			return count;
+		};
+		
+		inline bool empty() const {
+			return count == 0;
+		};
+		
+		inline const cppmath::vec3& operator[](size_t i) const {
+			return data[i];
+		};
+	};
+	
 	class SceneObject {
 		
+		friend class RayTraceScene;
+		
+		// Set when object was changed after scene was built
+		bool changed = 0;
+		// List of changed objects of scene owning this object and id of object in it
+		std::vector<int>* scene_changes = nullptr;
+		int scene_id = -1;
+		
 	public:
 		
+		// Objects are deleted by scene through SceneObject pointer
+		virtual ~SceneObject() {};
+		
+		// Mark object as moved or changed, RayTraceScene::update() applies changes of marked objects.
+		// Called by set() & setMaterial() of built-in objects, must be called after direct change of fields.
+		inline void mark_changed() {
+			if (changed)
+				return;
+			changed = 1;
+			if (scene_changes)
+				scene_changes->push_back(scene_id);
+		};
+		
+		inline bool is_changed() {
+			return changed;
+		};
+		
 		// Must check for object hitting 
 		virtual TraceManifold hit(const ray& r) { return TraceManifold(); };
 		
 		// Must return object material at given point
 		virtual ObjectMaterial get_material(const cppmath::vec3& point) { return ObjectMaterial(); };
 		
+		// Must return 0 if no point of an object emits light, such objects are skipped
+		//  by lighting after scene is built. Unknown objects are assumed to emit.
+		virtual bool is_emissive() { return 1; };
+		
 		// Must return object center
 		virtual cppmath::vec3 get_center() { return cppmath::vec3(); };
 		
-		// Must return list of points that are used in calculating light produced by this object
-		virtual std::vector<cppmath::vec3> get_light_points(const cppmath::vec3& ray_origin) { return {}; };
+		// Must return list of points that are used in calculating light produced by this object.
+		// Points must be stored by an object and stay valid until object is changed.
+		virtual PointSpan get_light_points(const cppmath::vec3& ray_origin) { return PointSpan(); };
 		
 		// Must retirn normal at given point of object surface
 		virtual cppmath::vec3 normal_at(const cppmath::vec3& point) { return cppmath::vec3::Zero; };
+		
+		// Must return bounding box of an object, infinite box for unbounded objects
+		virtual AABB get_bounds() { return AABB::infinite(); };
+		
+		// Must check if visible surface of an object blocks the ray closer than max_distance.
+		// Used for shadow rays, should avoid building full TraceManifold and ObjectMaterial.
+		virtual bool occluded(const ray& r, double max_distance) {
+			TraceManifold tm = hit(r);
+			return tm.hit && tm.distance >= 0 && tm.distance < max_distance && get_material(tm.location).surface_visible;
+		};
 	};
 	
 	class Sphere : public SceneObject {
@@ -121,14 +207,21 @@ namespace raytrace {
 			
 			// Move light points with sphere
 			setLightSectorsCount(light_sectors_amount);
+			mark_changed();
 		};
 		
 		void setMaterial(const ObjectMaterial& material) {
 			this->material = material;
+			mark_changed();
+		};
+		
+		inline int getLightSectorsCount() {
+			return light_sectors_amount;
 		};
 		
 		void setLightSectorsCount(int lsc) {
 			light_sectors_amount = lsc <= 0 ? 1 : lsc;
+			mark_changed();
 			
 			cppmath::vec3 n = cppmath::vec3(0, 1, 0);
 			
@@ -166,6 +259,7 @@ namespace raytrace {
 		};
 		
 		TraceManifold hit(const ray& r) {
+			RAYTRACE_COUNT(tests[TEST_SPHERE]++);
 			cppmath::vec3 oc = r.origin() - center;
 			double a = cppmath::vec3::dot(r.direction(), r.direction());
 			double b = 2.0 * cppmath::vec3::dot(oc, r.direction());
@@ -193,17 +287,45 @@ namespace raytrace {
 			return material;
 		};
 		
+		bool is_emissive() {
+			return material.luminosity > 0;
+		};
+		
 		cppmath::vec3 get_center() {
 			return center;
 		};
 		
-		std::vector<cppmath::vec3> get_light_points(const cppmath::vec3& ray_origin) {
+		PointSpan get_light_points(const cppmath::vec3& ray_origin) {
 			return light_points;
 		};
 		
 		cppmath::vec3 normal_at(const cppmath::vec3& point) {
 			return (point - center).norm();
 		};
+		
+		AABB get_bounds() {
+			return AABB(center - cppmath::vec3(radius), center + cppmath::vec3(radius));
+		};
+		
+		bool occluded(const ray& r, double max_distance) {
+			if (!material.surface_visible)
+				return 0;
+			
+			RAYTRACE_COUNT(tests[TEST_SPHERE]++);
+			cppmath::vec3 oc = r.A - center;
+			double a = cppmath::vec3::dot(r.B, r.B);
+			double b = 2.0 * cppmath::vec3::dot(oc, r.B);
+			double c = cppmath::vec3::dot(oc, oc) - radius * radius;
+			double discriminant = b * b - 4.0 * a * c;
+			if (discriminant < 0)
+				return 0;
+			
+			double distance = (-b - std::sqrt(discriminant)) / (2.0 * a);
+			if (distance < 10e-8)
+				distance = (-b + std::sqrt(discriminant)) / (2.0 * a);
+			
+			return distance >= 10e-8 && distance < max_distance;
+		};
 	};
 	
 	class UVSphere : public SceneObject {
@@ -219,6 +341,11 @@ namespace raytrace {
 		
 		// Maps uv texture
 		std::function<spaint::Color(double, double)> uv_map = [](double u, double v) -> spaint::Color { return spaint::Color(0); };
+		// Texture used instead of uv_map if set. Coordinates of uv_map u in [-pi, pi]
+		//  and v in [0, pi] are mapped to [0, 1] of texture.
+		std::shared_ptr<Texture> texture;
+		// Mip level of texture lookups, fractional levels blend two levels
+		double texture_lod = 0.0;
 		
 		UVSphere(const cppmath::vec3& center, double radius) {
 			set(center, radius);
@@ -227,14 +354,21 @@ namespace raytrace {
 		void set(const cppmath::vec3& center, double radius) {
 			this->center = center;
 			this->radius = radius;
+			mark_changed();
 		};
 		
 		void setMaterial(const ObjectMaterial& material) {
 			this->material = material;
+			mark_changed();
+		};
+		
+		inline int getLightSectorsCount() {
+			return light_sectors_amount;
 		};
 		
 		void setLightSectorsCount(int lsc) {
 			light_sectors_amount = lsc <= 0 ? 1 : lsc;
+			mark_changed();
 			
 			cppmath::vec3 n = cppmath::vec3(0, 1, 0);
 			
@@ -272,6 +406,7 @@ namespace raytrace {
 		};
 		
 		TraceManifold hit(const ray& r) {
+			RAYTRACE_COUNT(tests[TEST_SPHERE]++);
 			cppmath::vec3 oc = r.origin() - center;
 			double a = cppmath::vec3::dot(r.direction(), r.direction());
 			double b = 2.0 * cppmath::vec3::dot(oc, r.direction());
@@ -295,9 +430,25 @@ namespace raytrace {
 			}
 		};
 		
+		// Evaluate uv_map once into texture of given size
+		void bake_texture(int width, int height) {
+			texture = std::make_shared<Texture>();
+			texture->wrap_v = TextureWrap::CLAMP;
+			texture->bake(uv_map, width, height, -3.14159265358979323846, 3.14159265358979323846, 0.0, 3.14159265358979323846);
+		};
+		
 		ObjectMaterial get_material(const cppmath::vec3& point) {
 			cppmath::vec3 normal = point - center;
 			
+			if (texture) {
+				double u = fast_atan2(normal.x, normal.z);
+				double v = fast_atan2(std::sqrt(normal.x * normal.x + normal.z * normal.z), normal.y);
+				
+				ObjectMaterial mat = material;
+				mat.color = texture->sample(u * (0.5 / 3.14159265358979323846) + 0.5, v * (1.0 / 3.14159265358979323846), texture_lod);
+				return mat;
+			}
+			
 			double u = std::atan2(normal.x, normal.z);
 			double v = std::atan2(std::sqrt(normal.x * normal.x + normal.z * normal.z), normal.y);
 			
@@ -307,17 +458,45 @@ namespace raytrace {
 			return mat;
 		};
 		
+		bool is_emissive() {
+			return material.luminosity > 0;
+		};
+		
 		cppmath::vec3 get_center() {
 			return center;
 		};
 	
-		std::vector<cppmath::vec3> get_light_points(const cppmath::vec3& ray_origin) {
+		PointSpan get_light_points(const cppmath::vec3& ray_origin) {
 			return light_points;
 		};
 		
 		cppmath::vec3 normal_at(const cppmath::vec3& point) {
 			return (point - center).norm();
 		};
+		
+		AABB get_bounds() {
+			return AABB(center - cppmath::vec3(radius), center + cppmath::vec3(radius));
+		};
+		
+		bool occluded(const ray& r, double max_distance) {
+			if (!material.surface_visible)
+				return 0;
+			
+			RAYTRACE_COUNT(tests[TEST_SPHERE]++);
+			cppmath::vec3 oc = r.A - center;
+			double a = cppmath::vec3::dot(r.B, r.B);
+			double b = 2.0 * cppmath::vec3::dot(oc, r.B);
+			double c = cppmath::vec3::dot(oc, oc) - radius * radius;
+			double discriminant = b * b - 4.0 * a * c;
+			if (discriminant < 0)
+				return 0;
+			
+			double distance = (-b - std::sqrt(discriminant)) / (2.0 * a);
+			if (distance < 10e-8)
+				distance = (-b + std::sqrt(discriminant)) / (2.0 * a);
+			
+			return distance >= 10e-8 && distance < max_distance;
+		};
 	};
 	
 	class Triangle : public SceneObject {
@@ -338,13 +517,16 @@ namespace raytrace {
 			C = c;
 			center = (A + B + C) / 3.0;
 			normal = cppmath::vec3::cross(B - A, C - A).norm(); 
+			mark_changed();
 		};
 		
 		void setMaterial(const ObjectMaterial& material) {
 			this->material = material;
+			mark_changed();
 		};
 		
 		TraceManifold hit(const ray& r) {
+			RAYTRACE_COUNT(tests[TEST_TRIANGLE]++);
 			TraceManifold tm;
 			
 			cppmath::vec3 ba = B - A;
@@ -383,17 +565,59 @@ namespace raytrace {
 			return material;
 		};
 		
+		bool is_emissive() {
+			return material.luminosity > 0;
+		};
+		
 		cppmath::vec3 get_center() {
 			return center;
 		};
 		
-		std::vector<cppmath::vec3> get_light_points(const cppmath::vec3& ray_origin) {
-			return {center};
+		PointSpan get_light_points(const cppmath::vec3& ray_origin) {
+			return center;
 		};
 		
 		cppmath::vec3 normal_at(const cppmath::vec3& point) {
 			return normal; 
 		};
+		
+		AABB get_bounds() {
+			AABB b;
+			b.expand(A);
+			b.expand(B);
+			b.expand(C);
+			return b;
+		};
+		
+		bool occluded(const ray& r, double max_distance) {
+			if (!material.surface_visible)
+				return 0;
+			
+			RAYTRACE_COUNT(tests[TEST_TRIANGLE]++);
+			cppmath::vec3 ba = B - A;
+			cppmath::vec3 ca = C - A;
+			cppmath::vec3 pv = cppmath::vec3::cross(r.B, ca);
+			
+			double det = cppmath::vec3::dot(ba, pv);
+			if (det < 1e-8 && det > -1e-8)
+				return 0;
+			
+			double inv_det = 1.0 / det;
+			cppmath::vec3 tv = r.A - A;
+			
+			double u = cppmath::vec3::dot(tv, pv) * inv_det;
+			if (u < 0 || u > 1)
+				return 0;
+			
+			cppmath::vec3 qv = cppmath::vec3::cross(tv, ba);
+			
+			double v = cppmath::vec3::dot(r.B, qv) * inv_det;
+			if (v < 0 || u + v > 1)
+				return 0;
+			
+			double distance = cppmath::vec3::dot(ca, qv) * inv_det;
+			return distance >= 0 && distance < max_distance;
+		};
 	};
 	
 	class Plane : public SceneObject {
@@ -423,13 +647,16 @@ namespace raytrace {
 			this->location = location;
 			this->normal = normal;
 			this->normal.norm();
+			mark_changed();
 		};
 		
 		void setMaterial(const ObjectMaterial& material) {
 			this->material = material;
+			mark_changed();
 		};
 		
 		TraceManifold hit(const ray& r) {
+			RAYTRACE_COUNT(tests[TEST_PLANE]++);
 			// Caculate normal to plane
 			TraceManifold tm;
 			tm.normal = normal;
@@ -455,19 +682,36 @@ namespace raytrace {
 			return material;
 		};
 		
+		bool is_emissive() {
+			return material.luminosity > 0;
+		};
+		
 		cppmath::vec3 get_center() {
 			return location;
 		};
 	
-		std::vector<cppmath::vec3> get_light_points(const cppmath::vec3& ray_origin) {
+		PointSpan get_light_points(const cppmath::vec3& ray_origin) {
 			// std::vector<cppmath::vec3> points(light_cone_max_angle_cos * light_cone_max_angle_cos);
 			// XXX: Generate n points on the normal circle
-			return {location};
+			return location;
 		};
 		
 		cppmath::vec3 normal_at(const cppmath::vec3& point) {
 			return normal;
 		};
+		
+		bool occluded(const ray& r, double max_distance) {
+			if (!material.surface_visible)
+				return 0;
+			
+			RAYTRACE_COUNT(tests[TEST_PLANE]++);
+			double ndd = cppmath::vec3::dot(normal, r.B);
+			if ((ndd < 0 ? -ndd : ndd) <= 10e-8)
+				return 0;
+			
+			double distance = cppmath::vec3::dot(normal, location - r.A) / ndd;
+			return distance >= 10e-8 && distance < max_distance;
+		};
 	};
 	
 	class UVPlane : public SceneObject {
@@ -478,6 +722,11 @@ namespace raytrace {
 		ObjectMaterial material;
 		// Maps uv texture
 		std::function<spaint::Color(double, double)> uv_map = [](double u, double v) -> spaint::Color { return spaint::Color(0); };
+		// Texture used instead of uv_map if set, repeated every texture_scale units along plane axes
+		std::shared_ptr<Texture> texture;
+		double texture_scale = 1.0;
+		// Mip level of texture lookups, fractional levels blend two levels
+		double texture_lod = 0.0;
 		// Points will be generated in cone with top-to-normal angle with this cosine
 		double light_cone_max_angle_cos = 0.5;
 		// Radius of cone and angle is splitten into N sectors and in each sector light point is added
@@ -499,13 +748,16 @@ namespace raytrace {
 			this->location = location;
 			this->normal = normal;
 			this->normal.norm();
+			mark_changed();
 		};
 		
 		void setMaterial(const ObjectMaterial& material) {
 			this->material = material;
+			mark_changed();
 		};
 		
 		TraceManifold hit(const ray& r) {
+			RAYTRACE_COUNT(tests[TEST_PLANE]++);
 			// Caculate normal to plane
 			TraceManifold tm;
 			tm.normal = normal;
@@ -527,6 +779,13 @@ namespace raytrace {
 			return tm;
 		};
 		
+		// Evaluate uv_map once into texture of given size, uv_map must repeat with given period on both axes
+		void bake_texture(int width, int height, double period) {
+			texture = std::make_shared<Texture>();
+			texture->bake(uv_map, width, height, 0.0, period, 0.0, period);
+			texture_scale = period;
+		};
+		
 		ObjectMaterial get_material(const cppmath::vec3& point) {
 			cppmath::vec3 u = cppmath::vec3(normal.y, -normal.x, 0).norm();
 			cppmath::vec3 v = cppmath::vec3::cross(normal, u);
@@ -534,24 +793,44 @@ namespace raytrace {
 			double v_coord = cppmath::vec3::dot(v, point);
 			
 			ObjectMaterial mat = material;
-			mat.color = uv_map(u_coord, v_coord);
+			if (texture)
+				mat.color = texture->sample(u_coord / texture_scale, v_coord / texture_scale, texture_lod);
+			else
+				mat.color = uv_map(u_coord, v_coord);
 			
 			return mat;
 		};
 		
+		bool is_emissive() {
+			return material.luminosity > 0;
+		};
+		
 		cppmath::vec3 get_center() {
 			return location;
 		};
 	
-		std::vector<cppmath::vec3> get_light_points(const cppmath::vec3& ray_origin) {
+		PointSpan get_light_points(const cppmath::vec3& ray_origin) {
 			// std::vector<cppmath::vec3> points(light_cone_max_angle_cos * light_cone_max_angle_cos);
 			// XXX: Generate n points on the normal circle
-			return {location};
+			return location;
 		};
 		
 		cppmath::vec3 normal_at(const cppmath::vec3& point) {
 			return normal;
 		};
+		
+		bool occluded(const ray& r, double max_distance) {
+			if (!material.surface_visible)
+				return 0;
+			
+			RAYTRACE_COUNT(tests[TEST_PLANE]++);
+			double ndd = cppmath::vec3::dot(normal, r.B);
+			if ((ndd < 0 ? -ndd : ndd) <= 10e-8)
+				return 0;
+			
+			double distance = cppmath::vec3::dot(normal, location - r.A) / ndd;
+			return distance >= 10e-8 && distance < max_distance;
+		};
 	};
 	
 	struct HitManifold {
@@ -559,16 +838,301 @@ namespace raytrace {
 		bool hit = 0;
 		// Summary hit color
 		spaint::Color color;
+		// Id of object seen by the ray, -1 if nothing was hit
+		int object_id = -1;
+		// Distance to visible surface seen by the ray
+		double distance = 0.0;
 	};
 	
+	class SceneFile;
+	
 	class RayTraceScene {
 		
+		friend class SceneFile;
+		
 	private:
 		
 		// Set of object on the scene
 		// Deleted automatically after destroy
 		std::vector<SceneObject*> objects;
 		
+		// Acceleration structure over objects with finite bounds
+		BVH bvh;
+		// Maps BVH primitive id to object id
+		std::vector<int> bvh_objects;
+		// Maps object id to BVH primitive id, -1 for objects out of BVH
+		std::vector<int> bvh_ids;
+		// Objects with infinite bounds that are not compiled into planes, tested on every ray
+		std::vector<int> unbounded_objects;
+		// Set when BVH matches current list of objects
+		bool bvh_built = 0;
+		// Objects marked as changed after build, applied by update()
+		std::vector<int> changed_objects;
+		
+		// Built-in primitives compiled into structure of arrays,
+		//  tested without virtual calls. Planes are tested on every ray.
+		SphereSoA spheres;
+		PlaneSoA planes;
+		TriangleSoA triangles;
+		// Memory viewed by compiled primitives of loaded scene, e.g. mapped scene file
+		std::shared_ptr<const void> compiled_storage;
+		// PrimitiveType of each object
+		std::vector<uint8_t> object_types;
+		// Index of each object in array of it's type
+		std::vector<int> object_indices;
+		
+		// Compiled primitives of BVH leaf, stored contiguous in arrays of their type
+		struct LeafRange {
+			int sphere_begin = 0, sphere_end = 0;
+			int triangle_begin = 0, triangle_end = 0;
+			// Range in leaf_generic
+			int generic_begin = 0, generic_end = 0;
+		};
+		
+		// Leaf ranges indexed by BVH node id
+		std::vector<LeafRange> leaves;
+		// Generic object ids of all leaves
+		std::vector<int> leaf_generic;
+		// Intersection kernels for spheres & triangles
+		simd::Kernels kernels = simd::Kernels::get();
+		
+		// Emitting objects, lighting visits only them after build()
+		std::vector<int> lights;
+		// Light points of emitting objects with their object and number of points of the object
+		std::vector<cppmath::vec3> light_point_locations;
+		std::vector<int> light_point_objects;
+		std::vector<int> light_point_counts;
+		// Light points distributed by power
+		AliasTable light_table;
+		
+		// Irradiance of diffuse hits reused by use_irradiance_cache, cleared when scene changes
+		IrradianceCache irradiance;
+		
+		// Point where evaluation of ray continues
+		enum RayStage {
+			// Ray limits are not checked yet
+			STAGE_TRACE,
+			// Ray waits for closest hit
+			STAGE_INTERSECT,
+			STAGE_SHADE,
+			STAGE_DIFFUSE,
+			STAGE_REFLECT,
+			STAGE_REFRACT,
+			STAGE_DONE
+		};
+		
+		// State of ray being evaluated, replaces call frame of recursive shoot()
+		struct RayFrame {
+			ray r;
+			int ignored_id;
+			int ray_depth;
+			RayStage stage = STAGE_TRACE;
+			// Set when frame waits for result of nested ray
+			bool waiting = 0;
+			
+			int closest = -1;
+			TraceManifold closest_hit;
+			ObjectMaterial material;
+			HitManifold hitm;
+			
+			// State of diffuse rays loop
+			ray l;
+			cppmath::vec3 T, B;
+			double power = 0.0;
+			double survival = 1.0;
+			double cos_ln = 0.0;
+			double u = 0.0, v = 0.0;
+			int i = 0, ui = 0, vi = 0;
+			int dimension = 0, roulette_dimension = 0;
+			// Number of random diffuse rays of this hit
+			int diffuse_count = 0;
+			int total_diffuse = 0;
+			spaint::Color summary_diffuse;
+			// Irradiance record computed by diffuse rays loop
+			bool record_irradiance = 0;
+			double irradiance_r = 0.0, irradiance_g = 0.0, irradiance_b = 0.0;
+			double inverse_distance = 0.0;
+			int irradiance_rays = 0;
+			
+			RayFrame(const ray& r, int ignored_id, int ray_depth) : r(r), ignored_id(ignored_id), ray_depth(ray_depth) {};
+		};
+		
+		// Result of advancing frame
+		enum StepResult {
+			// Frame ray needs closest hit
+			STEP_INTERSECT,
+			// Nested ray must be evaluated first
+			STEP_NESTED,
+			STEP_DONE
+		};
+		
+		// Stack of RAY_STACK_SIZE frames in caller storage
+		struct FrameArray {
+			RayFrame* frames;
+			int count = 0;
+			
+			FrameArray(RayFrame* frames) : frames(frames) {};
+			
+			inline RayFrame& top() {
+				return frames[count - 1];
+			};
+			
+			inline bool push(const ray& r, int ignored_id, int ray_depth) {
+				if (count == RAY_STACK_SIZE)
+					return 0;
+				new (&frames[count++]) RayFrame(r, ignored_id, ray_depth);
+				return 1;
+			};
+			
+			inline void pop() {
+				--count;
+			};
+			
+			inline bool empty() {
+				return !count;
+			};
+		};
+		
+		// Returns type of compiled object, exact type match because subclasses may override hit()
+		static PrimitiveType primitive_type(SceneObject* o) {
+			const std::type_info& type = typeid(*o);
+			if (type == typeid(Sphere) || type == typeid(UVSphere))
+				return PRIMITIVE_SPHERE;
+			if (type == typeid(Plane) || type == typeid(UVPlane))
+				return PRIMITIVE_PLANE;
+			if (type == typeid(Triangle))
+				return PRIMITIVE_TRIANGLE;
+			return PRIMITIVE_GENERIC;
+		};
+		
+		// Append object to array of it's type
+		void compile_object(int i) {
+			SceneObject* o = objects[i];
+			const std::type_info& type = typeid(*o);
+			
+			if (type == typeid(Sphere)) {
+				Sphere* so = (Sphere*) o;
+				object_indices[i] = spheres.add(so->center, so->radius, so->material.surface_visible, i);
+			} else if (type == typeid(UVSphere)) {
+				UVSphere* so = (UVSphere*) o;
+				object_indices[i] = spheres.add(so->center, so->radius, so->material.surface_visible, i);
+			} else if (type == typeid(Plane)) {
+				Plane* po = (Plane*) o;
+				object_indices[i] = planes.add(po->location, po->normal, po->material.surface_visible, i);
+			} else if (type == typeid(UVPlane)) {
+				UVPlane* po = (UVPlane*) o;
+				object_indices[i] = planes.add(po->location, po->normal, po->material.surface_visible, i);
+			} else if (type == typeid(Triangle)) {
+				Triangle* to = (Triangle*) o;
+				object_indices[i] = triangles.add(to->A, to->B, to->C, to->normal, to->material.surface_visible, i);
+			}
+		};
+		
+		// Copy changed object into it's place in array of it's type
+		void update_compiled(int i) {
+			SceneObject* o = objects[i];
+			const std::type_info& type = typeid(*o);
+			int k = object_indices[i];
+			
+			if (type == typeid(Sphere)) {
+				Sphere* so = (Sphere*) o;
+				spheres.set(k, so->center, so->radius, so->material.surface_visible);
+			} else if (type == typeid(UVSphere)) {
+				UVSphere* so = (UVSphere*) o;
+				spheres.set(k, so->center, so->radius, so->material.surface_visible);
+			} else if (type == typeid(Plane)) {
+				Plane* po = (Plane*) o;
+				planes.set(k, po->location, po->normal, po->material.surface_visible);
+			} else if (type == typeid(UVPlane)) {
+				UVPlane* po = (UVPlane*) o;
+				planes.set(k, po->location, po->normal, po->material.surface_visible);
+			} else if (type == typeid(Triangle)) {
+				Triangle* to = (Triangle*) o;
+				triangles.set(k, to->A, to->B, to->C, to->normal, to->material.surface_visible);
+			}
+		};
+		
+		// Finish build from compiled primitives & BVH restored by SceneFile
+		void adopt_compiled() {
+			for (SceneObject* o : objects)
+				o->changed = 0;
+			changed_objects.clear();
+			bvh_built = 1;
+			build_lights();
+			reset_irradiance();
+		};
+		
+		// Returns distance to object hit or infinity.
+		// For generic objects hit information is stored into generic_hit.
+		inline double object_distance(int i, const ray& r, TraceManifold& generic_hit) {
+			switch (object_types[i]) {
+				case PRIMITIVE_SPHERE:
+					return spheres.intersect(object_indices[i], r.A, r.B);
+				
+				case PRIMITIVE_PLANE:
+					return planes.intersect(object_indices[i], r.A, r.B);
+				
+				case PRIMITIVE_TRIANGLE: {
+					double t = triangles.intersect(object_indices[i], r.A, r.B);
+					return t >= 10e-8 ? t : std::numeric_limits<double>::infinity();
+				}
+				
+				default:
+					RAYTRACE_COUNT(tests[TEST_GENERIC]++);
+					generic_hit = objects[i]->hit(r);
+					if (generic_hit.hit && generic_hit.distance >= 10e-8)
+						return generic_hit.distance;
+					return std::numeric_limits<double>::infinity();
+			}
+		};
+		
+		// Build hit information for compiled object at given distance
+		inline TraceManifold object_manifold(int i, const ray& r, double distance) {
+			TraceManifold tm;
+			tm.hit = 1;
+			tm.distance = distance;
+			tm.location = r.point_at_parameter(distance);
+			
+			switch (object_types[i]) {
+				case PRIMITIVE_SPHERE:
+					tm.normal = (tm.location - spheres.center(object_indices[i])).norm();
+					break;
+				
+				case PRIMITIVE_PLANE:
+					tm.normal = planes.normal(object_indices[i]);
+					break;
+				
+				case PRIMITIVE_TRIANGLE:
+					tm.normal = triangles.normal(object_indices[i]);
+					break;
+			}
+			
+			return tm;
+		};
+		
+		inline bool object_occluded(int i, const ray& r, double max_distance) {
+			int k = object_indices[i];
+			
+			switch (object_types[i]) {
+				case PRIMITIVE_SPHERE:
+					return spheres.visible[k] && spheres.intersect(k, r.A, r.B) < max_distance;
+				
+				case PRIMITIVE_PLANE:
+					return planes.visible[k] && planes.intersect(k, r.A, r.B) < max_distance;
+				
+				case PRIMITIVE_TRIANGLE: {
+					if (!triangles.visible[k])
+						return 0;
+					double t = triangles.intersect(k, r.A, r.B);
+					return t >= 0 && t < max_distance;
+				}
+				
+				default:
+					RAYTRACE_COUNT(tests[TEST_GENERIC]++);
+					return objects[i]->occluded(r, max_distance);
+			}
+		};
+		
 	public:
 
 		// Minimal ray power to keep running
@@ -587,14 +1151,24 @@ namespace raytrace {
 		double diffuse_light_scale = 0.5;
 		// Enable random ray tracing in diffuse light
 		bool random_diffuse_ray = 0;
-		// Number of random diffuse rays
+		// Number of random diffuse rays, Sampler::diffuse_count replaces it for single sample
 		int random_diffuse_count = 1;
+		// Shoot random_diffuse_count cosine weighted diffuse rays instead of rotating normal.
+		// Has priority over random_diffuse_ray.
+		bool cosine_diffuse_ray = 0;
+		// Depth from which cosine weighted diffuse paths are terminated with russian roulette, -1 to disable
+		int russian_roulette_depth = 2;
+		// Minimal probability of path to survive russian roulette
+		double russian_roulette_min = 0.05;
 		// Number of horisontal angle steps in non-random diffuse ray tracing
 		int horisontal_diffuse_count = 16;
 		// Number of vertical angle steps in non-random diffuse ray tracing
 		int vertical_diffuse_count = 4;
 		// Maximal ray recursion depth
 		int MAX_RAY_DEPTH = -1;
+		// Maximal number of nested rays in evaluation of single ray, deeper rays are
+		//  dropped like rays exceeding MAX_RAY_DEPTH. Bounds memory used by shoot().
+		static const int RAY_STACK_SIZE = 64;
 		// When calculating light from many light point of a single object average summary amount of light
 		bool average_light_points = 0;
 		// Light value = cos_betwen(light_objects.normal, object.location - light_object.location)
@@ -603,341 +1177,1214 @@ namespace raytrace {
 		spaint::Color GI_color;
 		// GI Intensivity
 		double GI_intensivity = 0.0;
+		// Use BVH for ray queries after build() was called
+		bool use_bvh = 1;
+		// Sequence used for random diffuse rays
+		SampleSequence sample_sequence = SampleSequence::RANDOM;
+		// Seed of random diffuse rays, same seed gives same image
+		uint64_t seed = 0;
+		// Number of light points sampled per diffuse hit in proportion to their power,
+		//  0 evaluates every light point of every emitting object.
+		// Points are cached by build(), so light points must not depend on ray origin.
+		int light_samples = 0;
+		// update() rebuilds BVH when refitted BVH is estimated to be this
+		//  many times slower than BVH right after build
+		double max_refit_cost = 1.5;
+		// Reuse irradiance of diffuse rays of nearby hits with similar normal, see IrradianceCache.
+		// Records are computed on demand by rendering threads, so image depends on order of pixels.
+		// Non cosine diffuse rays are weighted by view direction, which is frozen in record.
+		// Samples with less random rays than random_diffuse_count only read records.
+		bool use_irradiance_cache = 0;
+		// Allowed interpolation error of irradiance cache, smaller values compute more records
+		double irradiance_error = 0.2;
+		// Limits of record radius in world units, 0 derives them from bounds of bounded objects.
+		// Takes effect on next build().
+		double irradiance_min_radius = 0.0;
+		double irradiance_max_radius = 0.0;
+		// Deepest ray using irradiance cache, -1 for any depth
+		int irradiance_max_depth = -1;
 	
 		~RayTraceScene() {
 			for (int i = 0; i < objects.size(); ++i)
 				delete objects[i];
 		};
 		
-		// Add object to list of scene objects, check for NULL
+		// Add object to list of scene objects, check for NULL.
+		// Scene falls back to linear search until build() is called again.
 		void addObject(SceneObject* o) {
-			if (o)
+			if (o) {
+				o->scene_changes = &changed_objects;
+				o->scene_id = objects.size();
 				objects.push_back(o);
+				bvh_built = 0;
+			}
 		};
 		
-		// Shoot ray into scene to probe color
-		HitManifold shoot(const ray& r, int ignored_id = -1, int ray_depth = 1) {
-			// ignored_id is used during reflection calculations to 
-			//  avoid object trace itself forever till stack overflow.
+		// Build acceleration structure over current set of objects and
+		//  compile built-in primitives into structure of arrays.
+		// Call update() after objects or their materials were changed, or rebuild() to build from scratch.
+		void build() {
+			std::vector<AABB> bounds;
+			bvh_objects.clear();
+			bvh_ids.assign(objects.size(), -1);
+			changed_objects.clear();
+			unbounded_objects.clear();
+			spheres.clear();
+			planes.clear();
+			triangles.clear();
+			object_types.assign(objects.size(), PRIMITIVE_GENERIC);
+			object_indices.assign(objects.size(), -1);
+			leaves.clear();
+			leaf_generic.clear();
 			
-			if (r.power < MIN_RAY_POWER)
-				return HitManifold();
-			
-			// Result
-			HitManifold hitm;
+			for (int i = 0; i < (int) objects.size(); ++i) {
+				SceneObject* o = objects[i];
+				object_types[i] = primitive_type(o);
+				o->changed = 0;
+				
+				// Planes are not bounded
+				if (object_types[i] == PRIMITIVE_PLANE) {
+					compile_object(i);
+					continue;
+				}
+				
+				AABB b = o->get_bounds();
+				if (b.finite()) {
+					bvh_ids[i] = bounds.size();
+					bounds.push_back(b);
+					bvh_objects.push_back(i);
+				} else {
+					unbounded_objects.push_back(i);
+					compile_object(i);
+				}
+			}
 			
-			if (MAX_RAY_DEPTH != -1 && ray_depth > MAX_RAY_DEPTH)
-				return hitm;
+			bvh.build(bounds);
+			bvh_built = 1;
 			
-			// Find closest hit
-			TraceManifold closest_hit;
-			SceneObject* closest_object;
-			int closest = -1;
+			// Store primitives in order of BVH leaves so each leaf is
+			//  contiguous range of every type and can be tested by SIMD kernels
+			const Column<BVH::Node>& nodes = bvh.get_nodes();
+			const Column<int>& indices = bvh.get_indices();
+			leaves.resize(nodes.size());
 			
-			// Collect hits on all objects
-			std::vector<TraceManifold> hits(objects.size());
-			for (int i = 0; i < objects.size(); ++i)
-				if (i == ignored_id)
+			for (int n = 0; n < (int) nodes.size(); ++n) {
+				if (!nodes[n].count)
 					continue;
-				else
-					hits[i] = objects[i]->hit(r);
 				
+				LeafRange& leaf = leaves[n];
+				int begin = nodes[n].offset;
+				int end = nodes[n].offset + nodes[n].count;
+				
+				leaf.sphere_begin = spheres.size();
+				for (int k = begin; k < end; ++k)
+					if (object_types[bvh_objects[indices[k]]] == PRIMITIVE_SPHERE)
+						compile_object(bvh_objects[indices[k]]);
+				leaf.sphere_end = spheres.size();
+				
+				leaf.triangle_begin = triangles.size();
+				for (int k = begin; k < end; ++k)
+					if (object_types[bvh_objects[indices[k]]] == PRIMITIVE_TRIANGLE)
+						compile_object(bvh_objects[indices[k]]);
+				leaf.triangle_end = triangles.size();
+				
+				leaf.generic_begin = leaf_generic.size();
+				for (int k = begin; k < end; ++k)
+					if (object_types[bvh_objects[indices[k]]] == PRIMITIVE_GENERIC)
+						leaf_generic.push_back(bvh_objects[indices[k]]);
+				leaf.generic_end = leaf_generic.size();
+			}
+			
+			// Primitives & BVH no longer view memory of loaded scene
+			compiled_storage.reset();
+			build_lights();
+			reset_irradiance();
+		};
 		
-			// XXX: Move to 1st loop
+		// Collect emitting objects and cache their light points for light sampling
+		void build_lights() {
+			lights.clear();
+			light_point_locations.clear();
+			light_point_objects.clear();
+			light_point_counts.clear();
+			std::vector<double> powers;
 			
-			int distance_closest = std::numeric_limits<double>::max();
-			for (int i = 0; i < hits.size(); ++i) {
-				if (i == ignored_id)
+			for (int i = 0; i < (int) objects.size(); ++i) {
+				if (!objects[i]->is_emissive())
 					continue;
-				else if (hits[i].hit && hits[i].distance >= 10e-8 && hits[i].distance - distance_closest < 10e-8) {
-					closest = i;
-					distance_closest = hits[i].distance;
+				lights.push_back(i);
+				
+				PointSpan points = objects[i]->get_light_points(objects[i]->get_center());
+				for (const cppmath::vec3& lp : points) {
+					ObjectMaterial m = objects[i]->get_material(lp);
+					double power = m.luminosity * (m.color.r + m.color.g + m.color.b) / (3.0 * 255.0);
+					// Objects get same share of samples regardless of number of their points
+					if (average_light_points)
+						power /= points.size();
+					if (power <= 0.0)
+						continue;
+					
+					light_point_locations.push_back(lp);
+					light_point_objects.push_back(i);
+					light_point_counts.push_back(points.size());
+					powers.push_back(power);
+				}
+			}
+			
+			light_table.build(powers);
+		};
+		
+		inline int get_object_count() {
+			return objects.size();
+		};
+		
+		inline SceneObject* get_object(int i) {
+			return objects[i];
+		};
+		
+		// Number of emitting objects found by build()
+		inline int get_light_count() {
+			return lights.size();
+		};
+		
+		void rebuild() {
+			build();
+		};
+		
+		// Apply changes of objects marked by SceneObject::mark_changed(), usually called by their set() or setMaterial().
+		// Moved objects are refitted into existing BVH in time proportional to number of
+		//  changed objects and depth of BVH. Falls back to build() if scene was not built,
+		//  object became unbounded or BVH quality dropped below max_refit_cost.
+		// Returns 1 if scene was rebuilt.
+		bool update() {
+			if (!bvh_built) {
+				build();
+				return 1;
+			}
+			
+			bool lights_changed = 0;
+			bool changed = changed_objects.size();
+			for (int k = 0; k < (int) changed_objects.size(); ++k) {
+				int i = changed_objects[k];
+				SceneObject* o = objects[i];
+				o->changed = 0;
+				
+				if (bvh_ids[i] != -1) {
+					AABB b = o->get_bounds();
+					if (!b.finite()) {
+						build();
+						return 1;
+					}
+					bvh.refit(bvh_ids[i], b);
+				} else if (object_types[i] != PRIMITIVE_PLANE && o->get_bounds().finite()) {
+					build();
+					return 1;
 				}
+				
+				update_compiled(i);
+				// Light may be turned on or off, or it's points moved
+				if (o->is_emissive() || std::binary_search(lights.begin(), lights.end(), i))
+					lights_changed = 1;
 			}
+			changed_objects.clear();
 			
-			if (closest == -1) 
-				return hitm;
+			if (bvh.get_cost() > max_refit_cost * bvh.get_build_cost()) {
+				build();
+				return 1;
+			}
 			
-			closest_hit = hits[closest];
-			closest_object = objects[closest];
+			if (lights_changed)
+				build_lights();
+			if (changed)
+				reset_irradiance();
+			return 0;
+		};
+		
+		inline bool is_built() {
+			return bvh_built;
+		};
+		
+		inline const BVH& get_bvh() {
+			return bvh;
+		};
+		
+		// Cache used by use_irradiance_cache, cleared by build() and update()
+		inline IrradianceCache& get_irradiance_cache() {
+			return irradiance;
+		};
+		
+		// Clear irradiance cache & apply irradiance parameters.
+		// Default radius limits are 1/16 and 1/1024 of diagonal of bounded objects.
+		void reset_irradiance() {
+			double extent = 1.0;
+			const Column<BVH::Node>& nodes = bvh.get_nodes();
+			if (nodes.size() && nodes[0].bounds.finite() && !nodes[0].bounds.empty())
+				extent = (nodes[0].bounds.max - nodes[0].bounds.min).len();
 			
-			hitm.hit = 1;
+			irradiance.error = irradiance_error;
+			irradiance.max_radius = irradiance_max_radius > 0.0 ? irradiance_max_radius : extent / 16.0;
+			irradiance.min_radius = irradiance_min_radius > 0.0 ? irradiance_min_radius : extent / 1024.0;
+			irradiance.clear();
+		};
+		
+		// Select intersection kernels, falls back to lower level if CPU does not support it
+		void set_simd_level(simd::Level level) {
+			kernels = simd::Kernels(level);
+		};
+		
+		inline simd::Level get_simd_level() {
+			return kernels.level;
+		};
+		
+		// Visit ids of all objects that may be crossed by the ray in [0, max_distance].
+		// visit(int id) returns 1 to stop, result is 1 if visiting was stopped.
+		template<typename F>
+		bool visit_along(const ray& r, double max_distance, F&& visit) {
+			if (!use_bvh || !bvh_built) {
+				for (int i = 0; i < (int) objects.size(); ++i)
+					if (visit(i))
+						return 1;
+				return 0;
+			}
 			
-			// If object is emitting light in this point, apply light color with luminosity scale
-			ObjectMaterial closest_material = closest_object->get_material(closest_hit.location);
+			for (int k = 0; k < planes.size(); ++k)
+				if (visit(planes.object[k]))
+					return 1;
 			
-			// if object has no surface visible, shoot ray over it
-			if (!closest_material.surface_visible) {
-				ray l(closest_hit.location + RAY_SHIFT * r.direction(), r.direction(), r.power);
-				// Throw new ray & ignore current traced object
-				return shoot(l, ignored_id, ray_depth); 
+			for (int i : unbounded_objects)
+				if (visit(i))
+					return 1;
+			
+			return bvh.traverse(r.A, r.B, max_distance, [&](int id) -> bool {
+				return visit(bvh_objects[id]);
+			});
+		};
+		
+		// Check if any visible surface blocks the ray closer than max_distance.
+		// Returns on first blocking object, ignored_a and ignored_b are skipped.
+		bool occluded(const ray& r, double max_distance, int ignored_a = -1, int ignored_b = -1) {
+			if (!use_bvh || !bvh_built) {
+				for (int i = 0; i < (int) objects.size(); ++i)
+					if (i != ignored_a && i != ignored_b && objects[i]->occluded(r, max_distance))
+						return 1;
+				return 0;
 			}
 			
-			// Calculate luminosity if object emmit light
-			if (closest_material.luminosity) {
-				hitm.color = closest_material.color;
-				hitm.color.scale(closest_material.luminosity);
-				if (closest_material.luminosity_scaling)
-					hitm.color.scale(-cppmath::vec3::cos_between(closest_hit.normal, r.direction()));
+			for (int k = 0; k < planes.size(); ++k) {
+				if (!planes.visible[k] || planes.object[k] == ignored_a || planes.object[k] == ignored_b)
+					continue;
+				if (planes.intersect(k, r.A, r.B) < max_distance)
+					return 1;
 			}
 			
-			// If traced object deffuses light from other light sources, than
-			//  calculate amount of light produced by light sources and
-			//  reflected from other light-diffusing objects.
-			if (closest_material.diffuse > 0) {
-				// Total light emitted by light emitting objects
-				spaint::Color lighting;
+			for (int i : unbounded_objects) {
+				if (i == ignored_a || i == ignored_b)
+					continue;
+				RAYTRACE_COUNT(tests[TEST_GENERIC]++);
+				if (objects[i]->occluded(r, max_distance))
+					return 1;
+			}
 			
-				// Calculate ambient lighting from light emitting objects
-				for (int i = 0; i < objects.size(); ++i) {
-					if (i == closest)
+			return bvh.traverse(r.A, r.B, max_distance, [&](int id) -> bool {
+				int i = bvh_objects[id];
+				if (i == ignored_a || i == ignored_b)
+					return 0;
+				return object_occluded(i, r, max_distance);
+			});
+		};
+		
+		// Check if object i blocks the ray closer than max_distance
+		inline bool occluded_by(int i, const ray& r, double max_distance) {
+			if (!use_bvh || !bvh_built)
+				return objects[i]->occluded(r, max_distance);
+			return object_occluded(i, r, max_distance);
+		};
+		
+		// Find closest object hit by the ray.
+		// Returns id of an object or -1 if there is no hit, closest_hit receives hit information.
+		int find_closest(const ray& r, TraceManifold& closest_hit, int ignored_id = -1) {
+			int closest = -1;
+			double distance_closest = std::numeric_limits<double>::max();
+			
+			if (!use_bvh || !bvh_built) {
+				for (int i = 0; i < (int) objects.size(); ++i) {
+					if (i == ignored_id)
 						continue;
 					
-					// Get all points of an object that can produce light
-					std::vector<cppmath::vec3> light_points = objects[i]->get_light_points(closest_hit.location);
-					
-					// Sum total lighting produced by object in it's lighting points
-					//  then divide by amount of lighting points
-					spaint::Color total_object_light;
-					
-					// Iterate over all light points & calculate total light value from object
-					for (const cppmath::vec3& lp : light_points) {
-						ray l(closest_hit.location, (lp - closest_hit.location).norm());
-						
-						// Distance to light point
-						double lp_distance = (lp - closest_hit.location).len();
-						
-						// If shadows are enabled, calculate them
-						if (use_shadows && (diffuse_light || !soft_shadows)) {
-							// Check if there is no object that will overlap light source
-							bool overlap = 0;
-							for (int j = 0; j < objects.size(); ++j) {
-								if (i == j || j == closest)
-									continue;
-								
-								TraceManifold trmo = objects[j]->hit(l);
-								ObjectMaterial tmo = objects[j]->get_material(trmo.location);
-								if (tmo.surface_visible && trmo.hit && trmo.distance >= 0 && trmo.distance < lp_distance) {
-									overlap = 1;
-									break;
-								}
-							}
-							
-							// If rays overlap some object, just do nothing
-							if (overlap)
-								continue;
-						}
-						
-						ObjectMaterial tmat = objects[i]->get_material(lp);
+					TraceManifold tm = objects[i]->hit(r);
+					if (tm.hit && tm.distance >= 10e-8 && tm.distance < distance_closest) {
+						closest = i;
+						distance_closest = tm.distance;
+						closest_hit = tm;
+					}
+				}
+				
+				return closest;
+			}
+			
+			// Set when closest object is generic and closest_hit is already filled
+			bool closest_generic = 0;
+			
+			for (int k = 0; k < planes.size(); ++k) {
+				double t = planes.intersect(k, r.A, r.B);
+				if (t < distance_closest && planes.object[k] != ignored_id) {
+					closest = planes.object[k];
+					distance_closest = t;
+				}
+			}
+			
+			for (int i : unbounded_objects) {
+				if (i == ignored_id)
+					continue;
+				
+				RAYTRACE_COUNT(tests[TEST_GENERIC]++);
+				TraceManifold tm = objects[i]->hit(r);
+				if (tm.hit && tm.distance >= 10e-8 && tm.distance < distance_closest) {
+					closest = i;
+					distance_closest = tm.distance;
+					closest_hit = tm;
+					closest_generic = 1;
+				}
+			}
+			
+			// Ignored object can not be skipped inside SIMD kernels
+			if (ignored_id != -1)
+				bvh.closest(r.A, r.B, distance_closest, [&](int id, double t_max) -> double {
+					int i = bvh_objects[id];
+					if (i == ignored_id)
+						return std::numeric_limits<double>::infinity();
 					
-						// Calculate amount of light emitted by objects[i]
-						if (tmat.luminosity > 0) {
-							spaint::Color lumine = tmat.color;
-							// Apply object color mask
-							lumine.scale_off_range(closest_material.color);
-							// Apply frag object emission value
-							lumine.scale_off_range(tmat.luminosity);
-							// Apply material light diffuse value
-							lumine.scale_off_range(closest_material.diffuse);
-							// Scale by normal between source and surface
-							lumine.scale_off_range(std::clamp(cppmath::vec3::cos_between(closest_hit.normal, lp - closest_hit.location), 0.0, 1.0));
-							if (scale_light_above_normal)
-								lumine.scale_off_range(std::clamp(-cppmath::vec3::cos_between(objects[i]->normal_at(lp), closest_hit.location - lp), 0.0, 1.0));
-							
-							// Calculate fake soft shadows
-							if (soft_shadows) {								
-								// Check for all overlapping objects & scale light 
-								//  by cos between ray to object and ray to light
-								// i.e.: Iterate over all objects and calculate total shadow value in shadow.
-								double shadow_cos = 1.0;
-								for (int j = 0; j < objects.size(); ++j) {
-									if (i == j || j == closest)
-										continue;
-									
-									TraceManifold trmo = objects[j]->hit(l);
-									ObjectMaterial tmo = objects[j]->get_material(trmo.location);
-									if (tmo.surface_visible && trmo.hit && trmo.distance >= 0 && trmo.distance < lp_distance) {
-										ObjectMaterial mato = objects[i]->get_material(trmo.location);
-										double cs = cppmath::vec3::cos_between(l.direction(), trmo.normal);
-										cs = cs < 0 ? -cs : cs;
-										cs *= cppmath::vec3::cos_between(l.direction(), (objects[i]->get_center() - l.origin()).norm());
-										cs *= (1.0 - mato.refract);
-										cs *= soft_shadows_scale;
-										shadow_cos -= cs;
-									}
-								}
-								
-								// Apply light in shadow
-								lumine.scale_off_range(std::clamp(shadow_cos, 0.0, 1.0));
-							}
-							
-							// Apply color affect on surface
-							total_object_light.add_off_range(lumine);
-						}
+					TraceManifold tm;
+					double t = object_distance(i, r, tm);
+					if (t < t_max) {
+						closest = i;
+						closest_generic = object_types[i] == PRIMITIVE_GENERIC;
+						if (closest_generic)
+							closest_hit = tm;
+						return t;
 					}
 					
-					// Scale by amount of light poimts
-					if (average_light_points)
-						total_object_light.scale(1.0 / (double) light_points.size());
+					return std::numeric_limits<double>::infinity();
+				});
+			else
+				bvh.closest_leaf(r.A, r.B, distance_closest, [&](int node_id, double& t_max) {
+					const LeafRange& leaf = leaves[node_id];
+					int k;
+					
+					if (kernels.spheres_closest(spheres, leaf.sphere_begin, leaf.sphere_end, r.A, r.B, t_max, k)) {
+						closest = spheres.object[k];
+						closest_generic = 0;
+					}
+					
+					if (kernels.triangles_closest(triangles, leaf.triangle_begin, leaf.triangle_end, r.A, r.B, t_max, k)) {
+						closest = triangles.object[k];
+						closest_generic = 0;
+					}
 					
-					// apply resulting light to surface
-					lighting += total_object_light;
+					for (int g = leaf.generic_begin; g < leaf.generic_end; ++g) {
+						RAYTRACE_COUNT(tests[TEST_GENERIC]++);
+						TraceManifold tm = objects[leaf_generic[g]]->hit(r);
+						if (tm.hit && tm.distance >= 10e-8 && tm.distance < t_max) {
+							t_max = tm.distance;
+							closest = leaf_generic[g];
+							closest_hit = tm;
+							closest_generic = 1;
+						}
+					}
+				});
+			
+			if (closest != -1 && !closest_generic)
+				closest_hit = object_manifold(closest, r, distance_closest);
+			
+			return closest;
+		};
+		
+		// Find closest objects hit by packet of up to simd::PACKET_SIZE coherent rays,
+		//  gives same result as calling find_closest() for each ray.
+		void find_closest_packet(const ray* rays, int count, TraceManifold* closest_hits, int* closest) {
+			if (!use_bvh || !bvh_built || count == 1) {
+				for (int r = 0; r < count; ++r)
+					closest[r] = find_closest(rays[r], closest_hits[r]);
+				return;
+			}
+			
+			simd::RayPacket packet;
+			packet.count = count;
+			cppmath::vec3 origins[simd::PACKET_SIZE];
+			cppmath::vec3 directions[simd::PACKET_SIZE];
+			double distance_closest[simd::PACKET_SIZE];
+			bool closest_generic[simd::PACKET_SIZE];
+			
+			for (int r = 0; r < count; ++r) {
+				packet.set(r, rays[r].A, rays[r].B);
+				origins[r] = rays[r].A;
+				directions[r] = rays[r].B;
+				distance_closest[r] = std::numeric_limits<double>::max();
+				closest_generic[r] = 0;
+				closest[r] = -1;
+			}
+			
+			for (int r = 0; r < count; ++r) {
+				for (int k = 0; k < planes.size(); ++k) {
+					double t = planes.intersect(k, rays[r].A, rays[r].B);
+					if (t < distance_closest[r]) {
+						closest[r] = planes.object[k];
+						distance_closest[r] = t;
+					}
+				}
+				
+				for (int i : unbounded_objects) {
+					RAYTRACE_COUNT(tests[TEST_GENERIC]++);
+					TraceManifold tm = objects[i]->hit(rays[r]);
+					if (tm.hit && tm.distance >= 10e-8 && tm.distance < distance_closest[r]) {
+						closest[r] = i;
+						distance_closest[r] = tm.distance;
+						closest_hits[r] = tm;
+						closest_generic[r] = 1;
+					}
 				}
+			}
+			
+			bvh.closest_packet(origins, directions, count, distance_closest, [&](int node_id) {
+				const LeafRange& leaf = leaves[node_id];
+				int hit_sphere[simd::PACKET_SIZE] = { -1, -1, -1, -1 };
+				int hit_triangle[simd::PACKET_SIZE] = { -1, -1, -1, -1 };
+				
+				for (int k = leaf.sphere_begin; k < leaf.sphere_end; ++k)
+					kernels.sphere_packet(spheres, k, packet, distance_closest, hit_sphere);
+				for (int k = leaf.triangle_begin; k < leaf.triangle_end; ++k)
+					kernels.triangle_packet(triangles, k, packet, distance_closest, hit_triangle);
+				
+				for (int r = 0; r < count; ++r) {
+					// Triangles are tested after spheres and win
+					if (hit_triangle[r] != -1) {
+						closest[r] = triangles.object[hit_triangle[r]];
+						closest_generic[r] = 0;
+					} else if (hit_sphere[r] != -1) {
+						closest[r] = spheres.object[hit_sphere[r]];
+						closest_generic[r] = 0;
+					}
 					
-				// Apply lighting in shadows and direct light
-				hitm.color += lighting;
+					for (int g = leaf.generic_begin; g < leaf.generic_end; ++g) {
+						RAYTRACE_COUNT(tests[TEST_GENERIC]++);
+						TraceManifold tm = objects[leaf_generic[g]]->hit(rays[r]);
+						if (tm.hit && tm.distance >= 10e-8 && tm.distance < distance_closest[r]) {
+							distance_closest[r] = tm.distance;
+							closest[r] = leaf_generic[g];
+							closest_hits[r] = tm;
+							closest_generic[r] = 1;
+						}
+					}
+				}
+			});
+			
+			for (int r = 0; r < count; ++r)
+				if (closest[r] != -1 && !closest_generic[r])
+					closest_hits[r] = object_manifold(closest[r], rays[r], distance_closest[r]);
+		};
+		
+		// Shoot ray into scene to probe color.
+		// Uses thread local sampler, pass Sampler explicitly for reproducible result.
+		HitManifold shoot(const ray& r, int ignored_id = -1, int ray_depth = 1) {
+			thread_local int calls = 0;
+			Sampler sampler(sample_sequence, seed);
+			sampler.start(calls++, 0);
+			return shoot(r, sampler, ignored_id, ray_depth);
+		};
+		
+		// Shoot ray into scene to probe color, all random values are taken from sampler.
+		// Nested rays are evaluated iteratively on stack of RAY_STACK_SIZE frames.
+		HitManifold shoot(const ray& r, Sampler& sampler, int ignored_id = -1, int ray_depth = 1) {
+			// ignored_id is used during reflection calculations to 
+			//  avoid object trace itself forever.
+			return evaluate(r, sampler, ignored_id, ray_depth, -1, nullptr);
+		};
+		
+		// Shoot packet of up to simd::PACKET_SIZE coherent primary rays,
+		//  closest hits are found in one BVH traversal and each ray is shaded separately.
+		// samplers are used for corresponding rays, result is same as calling shoot() for each ray.
+		void shoot_packet(const ray* rays, int count, Sampler* samplers, HitManifold* result) {
+			ray packet_rays[simd::PACKET_SIZE];
+			int packet_ids[simd::PACKET_SIZE];
+			int packet_count = 0;
+			
+			for (int r = 0; r < count; ++r) {
+				result[r] = HitManifold();
+				RAYTRACE_COUNT(rays[RAY_PRIMARY]++);
+				if (rays[r].power < MIN_RAY_POWER)
+					RAYTRACE_COUNT(power_cut++);
+				else if (MAX_RAY_DEPTH != -1 && MAX_RAY_DEPTH < 1)
+					RAYTRACE_COUNT(depth_cut++);
+				else {
+					RAYTRACE_COUNT(add_depth(1));
+					packet_rays[packet_count] = rays[r];
+					packet_ids[packet_count++] = r;
+				}
+			}
+			
+			TraceManifold closest_hits[simd::PACKET_SIZE];
+			int closest[simd::PACKET_SIZE];
+			find_closest_packet(packet_rays, packet_count, closest_hits, closest);
+			
+			for (int p = 0; p < packet_count; ++p) {
+				int r = packet_ids[p];
+				result[r] = shade(rays[r], samplers[r], closest[p], closest_hits[p], -1, 1);
+			}
+		};
+		
+		// First visible surface hit by the ray: albedo, shading normal & distance from ray origin.
+		// Objects without visible surface are passed like in shoot(). Used as noise free guides of denoising.
+		// Returns 0 if ray hits nothing visible.
+		bool first_surface(const ray& r, spaint::Color& albedo, cppmath::vec3& normal, double& distance) {
+			ray current = r;
+			for (int i = 0; i < RAY_STACK_SIZE; ++i) {
+				TraceManifold hit;
+				int closest = find_closest(current, hit);
+				if (closest == -1)
+					return 0;
 				
-				// Apply GI
-				spaint::Color GI_value = GI_color;
-				GI_value.scale(GI_intensivity);
-				GI_value.scale(closest_material.color);
-				GI_value.scale(closest_material.diffuse);
-				hitm.color += GI_value;
+				ObjectMaterial material = objects[closest]->get_material(hit.location);
+				if (material.surface_visible) {
+					albedo = material.color;
+					normal = hit.normal;
+					distance = (hit.location - r.A).len();
+					return 1;
+				}
+				
+				current = ray(hit.location + RAY_SHIFT * current.direction(), current.direction(), current.power);
+			}
+			
+			return 0;
+		};
+		
+		// Calculate color of closest object hit by the ray
+		HitManifold shade(const ray& r, Sampler& sampler, int closest, const TraceManifold& closest_hit, int ignored_id, int ray_depth) {
+			return evaluate(r, sampler, ignored_id, ray_depth, closest, &closest_hit);
+		};
+		
+		// State of ray evaluated in batches together with other rays
+		class RayPath {
+			
+			friend class RayTraceScene;
+			
+			// Frames of nested rays, last frame is evaluated
+			std::vector<RayFrame> frames;
+			HitManifold result;
+			
+			inline RayFrame& top() {
+				return frames.back();
+			};
+			
+			inline bool push(const ray& r, int ignored_id, int ray_depth) {
+				if (frames.size() == RAY_STACK_SIZE)
+					return 0;
+				frames.emplace_back(r, ignored_id, ray_depth);
+				return 1;
+			};
+			
+			inline void pop() {
+				frames.pop_back();
+			};
+			
+			inline bool empty() {
+				return frames.empty();
+			};
+			
+		public:
+			
+			// Ray waiting for closest hit
+			inline const ray& get_ray() const {
+				return frames.back().r;
+			};
+			
+			inline int get_ignored_id() const {
+				return frames.back().ignored_id;
+			};
+			
+			// Depth of waiting ray, 1 for primary ray
+			inline int get_depth() const {
+				return frames.back().ray_depth;
+			};
+			
+			inline bool finished() const {
+				return frames.empty();
+			};
+			
+			// Color of evaluated ray, valid after path is finished
+			inline const HitManifold& get_result() const {
+				return result;
+			};
+		};
+		
+		// Start evaluation of ray as path. Path is evaluated by advance_path() until it
+		//  needs closest hit of it's ray, caller finds the hit, usually for many paths
+		//  at once, and passes it to resume_path(). Result is same as shoot() with same sampler.
+		void start_path(RayPath& path, const ray& r, int ignored_id = -1, int ray_depth = 1) {
+			path.frames.clear();
+			path.frames.emplace_back(r, ignored_id, ray_depth);
+			path.result = HitManifold();
+		};
+		
+		// Evaluate path until it's ray needs closest hit.
+		// Returns 0 if path is finished and result is available.
+		inline bool advance_path(RayPath& path, Sampler& sampler) {
+			return advance(path, sampler, path.result);
+		};
+		
+		// Pass closest hit found for ray of path, closest is -1 if nothing was hit
+		inline void resume_path(RayPath& path, int closest, const TraceManifold& closest_hit) {
+			RayFrame& f = path.top();
+			f.closest = closest;
+			f.closest_hit = closest_hit;
+			f.stage = STAGE_SHADE;
+		};
+		
+	private:
+		
+		// Evaluate ray without recursion. Nested rays are pushed on fixed size stack
+		//  and finished in same order as recursive calls, so colors and sampler
+		//  dimensions match recursive evaluation exactly.
+		// closest_hit is passed when closest object is already found.
+		HitManifold evaluate(const ray& r, Sampler& sampler, int ignored_id, int ray_depth, int closest, const TraceManifold* closest_hit) {
+			alignas(RayFrame) unsigned char storage[RAY_STACK_SIZE * sizeof(RayFrame)];
+			FrameArray stack((RayFrame*) storage);
+			stack.push(r, ignored_id, ray_depth);
+			
+			if (closest_hit) {
+				stack.top().stage = STAGE_SHADE;
+				stack.top().closest = closest;
+				stack.top().closest_hit = *closest_hit;
+			}
+			
+			HitManifold result;
+			while (advance(stack, sampler, result)) {
+				RayFrame& f = stack.top();
+				f.closest = find_closest(f.r, f.closest_hit, f.ignored_id);
+				f.stage = STAGE_SHADE;
+			}
+			
+			return result;
+		};
+		
+		// Advance frames on stack until top frame needs closest hit or all frames are finished.
+		// Returns 1 if closest hit of top frame must be found, 0 when result of
+		//  bottom frame is stored into result.
+		template<typename Stack>
+		bool advance(Stack& stack, Sampler& sampler, HitManifold& result) {
+			while (1) {
+				RayFrame& f = stack.top();
+				ray next;
+				
+				switch (step(f, sampler, result, next)) {
+					case STEP_INTERSECT:
+						return 1;
 					
-				// Calculatre real diffuse light from all other objects by shooting big amount of rays
-				if (diffuse_light) {					
-					if (!random_diffuse_ray) {
-						// Shoot rays in any directions to calculate diffuse light amount from reflections of other objects
-						double u_step = 3.14159265358979323846 * 2.0 / (double) horisontal_diffuse_count;
-						double v_step = 3.14159265358979323846 / (double) vertical_diffuse_count;
-						
-						// Move rotation
-						double u = 0.0;
-						double v = 0.0;
+					case STEP_NESTED: {
+						int ignored_id = f.ignored_id;
+						int ray_depth = f.ray_depth + 1;
 						
-						// Create new temp ray with less power, a bit shifted off surface
-						ray l(closest_hit.location + RAY_SHIFT * closest_hit.normal, closest_hit.normal, r.power * closest_material.diffuse * diffuse_light_scale);
+						// Most of nested rays are dropped, check them before frame is created
+						if (dropped(next, ray_depth))
+							result = HitManifold();
+						else if (!stack.push(next, ignored_id, ray_depth)) {
+							// Stack is full, ray is dropped like ray exceeding MAX_RAY_DEPTH
+							RAYTRACE_COUNT(depth_cut++);
+							result = HitManifold();
+						}
+						break;
+					}
+					
+					case STEP_DONE:
+						result = f.hitm;
+						stack.pop();
+						if (stack.empty())
+							return 0;
+						break;
+				}
+			}
+		};
+		
+		// Run frame until it needs closest hit, nested ray or is finished.
+		// Nested ray is returned in next, it's result is passed to next call as nested.
+		StepResult step(RayFrame& f, Sampler& sampler, const HitManifold& nested, ray& next) {
+			while (1)
+				switch (f.stage) {
+					case STAGE_TRACE:
+						if (dropped(f.r, f.ray_depth)) {
+							f.stage = STAGE_DONE;
+							break;
+						}
 						
-						cppmath::vec3 E = cppmath::vec3(1.0, 1.0, 1.0);
-						cppmath::vec3 T = cppmath::vec3::cross(E, closest_hit.normal);
-						E = cppmath::vec3::cross(T, closest_hit.normal);
-						E.norm();
-						T.norm();
+						RAYTRACE_COUNT(add_depth(f.ray_depth));
+						f.stage = STAGE_INTERSECT;
+						return STEP_INTERSECT;
+					
+					case STAGE_INTERSECT:
+						return STEP_INTERSECT;
+					
+					case STAGE_SHADE:
+						if (f.closest == -1)
+							f.stage = STAGE_DONE;
+						else if (!shade_surface(f, sampler))
+							// Ray is moved over invisible surface & traced again
+							f.stage = STAGE_TRACE;
+						else if (f.material.diffuse > 0 && diffuse_light && !cached_diffuse(f)) {
+							begin_diffuse(f, sampler);
+							f.stage = STAGE_DIFFUSE;
+						} else
+							f.stage = STAGE_REFLECT;
+						break;
+					
+					case STAGE_DIFFUSE:
+						if (f.waiting) {
+							add_diffuse(f, nested);
+							f.waiting = 0;
+						}
 						
-						spaint::Color summary_diffuse;
-						int total_diffuse = 0;
+						if (next_diffuse(f, sampler, next)) {
+							RAYTRACE_COUNT(rays[RAY_DIFFUSE]++);
+							f.waiting = 1;
+							return STEP_NESTED;
+						}
 						
-						for (int vi = 0; vi < vertical_diffuse_count; ++vi)
-							for (int ui = 0; ui < horisontal_diffuse_count; ++ui) {
-								l.B = closest_hit.normal;
-								l.B = cppmath::vec3::rotateAroundVector(l.B, T, v);
-								l.B = cppmath::vec3::rotateAroundVector(l.B, closest_hit.normal, u);
-								
-								double cos_ln = cppmath::vec3::cos_between(l.direction(), closest_hit.normal);
-								if (cos_ln <= 0)
-									continue;
-								
-								HitManifold hitd = shoot(l, ignored_id, ray_depth + 1);
-								if (!hitd.hit)
-									continue;
-								
-								++total_diffuse;
-								
-								/*spaint::Color dif_res = hitd.color;
-								dif_res.scale(closest_material.color);
-								dif_res.scale(cppmath::vec3::cos_between(l.direction(), -r.direction()));
-								dif_res.scale(cos_ln);
-								summary_diffuse += dif_res;*/
-								
-								spaint::Color dif_res = hitd.color;
-								dif_res.scale_off_range(closest_material.color);
-								double cos_lmr = cppmath::vec3::cos_between(l.direction(), -r.direction());
-								dif_res.scale_off_range(cos_lmr);
-								dif_res.scale_off_range(cos_ln);
-								summary_diffuse.add_off_range(dif_res);
-							
-								u += u_step;
-								v += v_step;
+						end_diffuse(f);
+						f.stage = STAGE_REFLECT;
+						break;
+					
+					// Calculate reflections
+					case STAGE_REFLECT:
+						if (f.waiting) {
+							f.waiting = 0;
+							if (nested.hit) {
+								spaint::Color reflected = nested.color;
+								reflected.scale(f.material.reflect);
+								f.hitm.color += reflected;
 							}
+						} else if (f.material.reflect > 0) {
+							cppmath::vec3 direction = cppmath::vec3::reflect(f.r.direction(), f.closest_hit.normal);
+							next = ray(f.closest_hit.location + RAY_SHIFT * direction, direction);
+							next.power = f.r.power * f.material.reflect;
 							
-						// Scale color & apply	
-						summary_diffuse.scale_off_range(closest_material.diffuse);
-						summary_diffuse.scale_off_range(diffuse_light_scale);
-						summary_diffuse.scale(1.0 / (double) total_diffuse);
-						hitm.color += summary_diffuse;
-					} else {
-						// Shoot rays in any directions to calculate diffuse light amount from reflections of other objects
-						double u_range = 3.14159265358979323846 * 2.0;
-						double v_range = 3.14159265358979323846;
+							RAYTRACE_COUNT(rays[RAY_REFLECT]++);
+							f.waiting = 1;
+							return STEP_NESTED;
+						}
 						
-						// Move rotation
-						double u = 0.0;
-						double v = 0.0;
+						f.stage = STAGE_REFRACT;
+						break;
+					
+					// Calculate refractions
+					case STAGE_REFRACT:
+						if (f.waiting) {
+							f.waiting = 0;
+							if (nested.hit) {
+								spaint::Color refracted = nested.color;
+								refracted.scale(f.material.refract);
+								f.hitm.color += refracted;
+							}
+						} else if (f.material.refract > 0) {
+							cppmath::vec3 direction = cppmath::vec3::refract(f.r.direction(), f.closest_hit.normal, f.material.refract_val);
+							next = ray(f.closest_hit.location + RAY_SHIFT * direction, direction);
+							next.power = f.r.power * f.material.refract;
+							
+							RAYTRACE_COUNT(rays[RAY_REFRACT]++);
+							f.waiting = 1;
+							return STEP_NESTED;
+						}
 						
-						// Create new temp ray with less power, a bit shifted off surface
-						ray l(closest_hit.location + RAY_SHIFT * closest_hit.normal, closest_hit.normal, r.power * closest_material.diffuse * diffuse_light_scale);
+						f.stage = STAGE_DONE;
+						break;
+					
+					case STAGE_DONE:
+						return STEP_DONE;
+				}
+		};
+		
+		// Check if ray is below MIN_RAY_POWER or deeper than MAX_RAY_DEPTH
+		inline bool dropped(const ray& r, int ray_depth) {
+			if (r.power < MIN_RAY_POWER) {
+				RAYTRACE_COUNT(power_cut++);
+				return 1;
+			}
+			
+			if (MAX_RAY_DEPTH != -1 && ray_depth > MAX_RAY_DEPTH) {
+				RAYTRACE_COUNT(depth_cut++);
+				return 1;
+			}
+			
+			return 0;
+		};
+		
+		// Apply emission, direct lighting and GI of closest object.
+		// Returns 0 if object has no visible surface, frame ray is moved over it then.
+		bool shade_surface(RayFrame& f, Sampler& sampler) {
+			SceneObject* closest_object = objects[f.closest];
+			
+			f.hitm.hit = 1;
+			f.hitm.object_id = f.closest;
+			f.hitm.distance = f.closest_hit.distance;
+			
+			// If object is emitting light in this point, apply light color with luminosity scale
+			f.material = closest_object->get_material(f.closest_hit.location);
+			
+			// if object has no surface visible, shoot ray over it
+			if (!f.material.surface_visible) {
+				f.r = ray(f.closest_hit.location + RAY_SHIFT * f.r.direction(), f.r.direction(), f.r.power);
+				f.hitm = HitManifold();
+				RAYTRACE_COUNT(rays[RAY_PASS]++);
+				return 0;
+			}
+			
+			const ray& r = f.r;
+			int closest = f.closest;
+			const TraceManifold& closest_hit = f.closest_hit;
+			const ObjectMaterial& closest_material = f.material;
+			HitManifold& hitm = f.hitm;
+			
+			// Calculate luminosity if object emmit light
+			if (closest_material.luminosity) {
+				hitm.color = closest_material.color;
+				hitm.color.scale(closest_material.luminosity);
+				if (closest_material.luminosity_scaling)
+					hitm.color.scale(-cppmath::vec3::cos_between(closest_hit.normal, r.direction()));
+			}
+			
+			// If traced object deffuses light from other light sources, than
+			//  calculate amount of light produced by light sources and
+			//  reflected from other light-diffusing objects.
+			if (closest_material.diffuse > 0) {
+				// Total light emitted by light emitting objects
+				spaint::Color lighting;
+			
+				// Calculate ambient lighting from light emitting objects
+				if (light_samples > 0 && bvh_built && light_table.size())
+					lighting = sample_lighting(sampler, closest, closest_hit, closest_material);
+				else
+					// Only emitting objects are visited after build()
+					for (int k = 0; k < (int) (bvh_built ? lights.size() : objects.size()); ++k) {
+						int i = bvh_built ? lights[k] : k;
+						if (i == closest)
+							continue;
 						
-						cppmath::vec3 E = cppmath::vec3(1.0, 1.0, 1.0);
-						cppmath::vec3 T = cppmath::vec3::cross(E, closest_hit.normal);
-						E = cppmath::vec3::cross(T, closest_hit.normal);
-						E.norm();
-						T.norm();
+						// Get all points of an object that can produce light
+						PointSpan light_points = objects[i]->get_light_points(closest_hit.location);
 						
-						spaint::Color summary_diffuse;
-						int total_diffuse = 0;
+						// Sum total lighting produced by object in it's lighting points
+						//  then divide by amount of lighting points
+						spaint::Color total_object_light;
 						
-						for (int i = 0; i < random_diffuse_count; ++i) {
-							u = ((double) rand() / (RAND_MAX)) * u_range;
-							v = ((double) rand() / (RAND_MAX)) * v_range;
-							
-							l.B = closest_hit.normal;
-							l.B = cppmath::vec3::rotateAroundVector(l.B, T, v);
-							l.B = cppmath::vec3::rotateAroundVector(l.B, closest_hit.normal, u);
-							
-							double cos_ln = cppmath::vec3::cos_between(l.direction(), closest_hit.normal);
-							if (cos_ln <= 0)
-								continue;
-							
-							HitManifold hitd = shoot(l, ignored_id, ray_depth + 1);
-							if (!hitd.hit)
-								continue;
-							
-							++total_diffuse;
-							
-							spaint::Color dif_res = hitd.color;
-							dif_res.scale_off_range(closest_material.color);
-							dif_res.scale_off_range(cppmath::vec3::cos_between(l.direction(), -r.direction()));
-							dif_res.scale_off_range(cos_ln);
-							summary_diffuse.add_off_range(dif_res);
+						// Iterate over all light points & calculate total light value from object
+						for (const cppmath::vec3& lp : light_points) {
+							spaint::Color lumine;
+							// Apply color affect on surface
+							if (light_point(i, lp, closest, closest_hit, closest_material, lumine))
+								total_object_light.add_off_range(lumine);
 						}
-							
-						// Scale color & apply	
-						summary_diffuse.scale_off_range(closest_material.diffuse);
-						summary_diffuse.scale_off_range(diffuse_light_scale);
-						summary_diffuse.scale(1.0 / (double) total_diffuse);
-						hitm.color += summary_diffuse;
+						
+						// Scale by amount of light poimts
+						if (average_light_points && light_points.size())
+							total_object_light.scale(1.0 / (double) light_points.size());
+						
+						// apply resulting light to surface
+						lighting += total_object_light;
 					}
-				}
+				
+				// Apply lighting in shadows and direct light
+				hitm.color += lighting;
+				
+				// Apply GI
+				spaint::Color GI_value = GI_color;
+				GI_value.scale(GI_intensivity);
+				GI_value.scale(closest_material.color);
+				GI_value.scale(closest_material.diffuse);
+				hitm.color += GI_value;
 			}
 			
-			// Calculate reflections
-			if (closest_material.reflect > 0) {
-				cppmath::vec3 direction = cppmath::vec3::reflect(r.direction(), closest_hit.normal);
-				ray l(closest_hit.location + RAY_SHIFT * direction, direction);
-				l.power = r.power * closest_material.reflect;
+			return 1;
+		};
+		
+		// Light of point lp of emitting object i falling on closest hit.
+		// Returns 0 if point is shadowed or does not emit light.
+		bool light_point(int i, const cppmath::vec3& lp, int closest, const TraceManifold& closest_hit, const ObjectMaterial& closest_material, spaint::Color& lumine) {
+			ray l(closest_hit.location, (lp - closest_hit.location).norm());
+			RAYTRACE_COUNT(light_points++);
+			
+			// Distance to light point
+			double lp_distance = (lp - closest_hit.location).len();
+			
+			// If shadows are enabled, calculate them
+			if (use_shadows && (diffuse_light || !soft_shadows)) {
+				// If ray overlaps some object, just do nothing
+				RAYTRACE_COUNT(rays[RAY_SHADOW]++);
+				if (occluded(l, lp_distance, i, closest))
+					return 0;
+			}
+			
+			ObjectMaterial tmat = objects[i]->get_material(lp);
+			
+			// Calculate amount of light emitted by objects[i]
+			if (tmat.luminosity <= 0)
+				return 0;
+			
+			lumine = tmat.color;
+			// Apply object color mask
+			lumine.scale_off_range(closest_material.color);
+			// Apply frag object emission value
+			lumine.scale_off_range(tmat.luminosity);
+			// Apply material light diffuse value
+			lumine.scale_off_range(closest_material.diffuse);
+			// Scale by normal between source and surface
+			lumine.scale_off_range(std::clamp(cppmath::vec3::cos_between(closest_hit.normal, lp - closest_hit.location), 0.0, 1.0));
+			if (scale_light_above_normal)
+				lumine.scale_off_range(std::clamp(-cppmath::vec3::cos_between(objects[i]->normal_at(lp), closest_hit.location - lp), 0.0, 1.0));
+			
+			// Calculate fake soft shadows
+			if (soft_shadows) {								
+				// Check for all overlapping objects & scale light 
+				//  by cos between ray to object and ray to light
+				// i.e.: Iterate over all objects and calculate total shadow value in shadow.
+				// Stops when light is fully shadowed.
+				double shadow_cos = 1.0;
+				RAYTRACE_COUNT(rays[RAY_SHADOW]++);
+				visit_along(l, lp_distance, [&](int j) -> bool {
+					if (i == j || j == closest)
+						return 0;
+					
+					if (!occluded_by(j, l, lp_distance))
+						return 0;
+					
+					TraceManifold trmo = objects[j]->hit(l);
+					ObjectMaterial mato = objects[i]->get_material(trmo.location);
+					double cs = cppmath::vec3::cos_between(l.direction(), trmo.normal);
+					cs = cs < 0 ? -cs : cs;
+					cs *= cppmath::vec3::cos_between(l.direction(), (objects[i]->get_center() - l.origin()).norm());
+					cs *= (1.0 - mato.refract);
+					cs *= soft_shadows_scale;
+					shadow_cos -= cs;
+					
+					return shadow_cos <= 0.0;
+				});
 				
-				HitManifold hitr = shoot(l, ignored_id, ray_depth + 1);
-				if (hitr.hit) {
-					hitr.color.scale(closest_material.reflect);
-					hitm.color += hitr.color;
+				// Apply light in shadow
+				lumine.scale_off_range(std::clamp(shadow_cos, 0.0, 1.0));
+			}
+			
+			return 1;
+		};
+		
+		// Estimate lighting of closest hit from light_samples cached light points,
+		//  picked in proportion to their power. Estimate converges to sum over all points.
+		spaint::Color sample_lighting(Sampler& sampler, int closest, const TraceManifold& closest_hit, const ObjectMaterial& closest_material) {
+			spaint::Color lighting;
+			int dimension = sampler.next_dimension();
+			
+			for (int s = 0; s < light_samples; ++s) {
+				double u, v;
+				sampler.sample_2d(dimension, s, light_samples, u, v);
+				int k = light_table.sample(u, v);
+				int i = light_point_objects[k];
+				if (i == closest)
+					continue;
+				
+				spaint::Color lumine;
+				if (!light_point(i, light_point_locations[k], closest, closest_hit, closest_material, lumine))
+					continue;
+				
+				double scale = 1.0 / (light_table.pdf(k) * light_samples);
+				if (average_light_points)
+					scale /= light_point_counts[k];
+				lumine.scale_off_range(scale);
+				lighting.add_off_range(lumine);
+			}
+			
+			return lighting;
+		};
+		
+		// Check if irradiance cache is used by the frame
+		inline bool irradiance_cached(const RayFrame& f) {
+			return use_irradiance_cache && (irradiance_max_depth == -1 || f.ray_depth <= irradiance_max_depth);
+		};
+		
+		// Apply diffuse light interpolated from irradiance cache.
+		// Returns 0 if diffuse rays must be shot, their result is recorded then.
+		bool cached_diffuse(RayFrame& f) {
+			if (!irradiance_cached(f))
+				return 0;
+			
+			double r, g, b;
+			if (!irradiance.lookup(f.closest_hit.location, f.closest_hit.normal, f.ray_depth, r, g, b)) {
+				RAYTRACE_COUNT(irradiance_misses++);
+				return 0;
+			}
+			
+			RAYTRACE_COUNT(irradiance_hits++);
+			double scale = f.material.diffuse * diffuse_light_scale / 255.0;
+			spaint::Color diffuse;
+			diffuse.r = r * f.material.color.r * scale;
+			diffuse.g = g * f.material.color.g * scale;
+			diffuse.b = b * f.material.color.b * scale;
+			diffuse.a = 0;
+			f.hitm.color += diffuse;
+			return 1;
+		};
+		
+		// Prepare loop of diffuse rays
+		void begin_diffuse(RayFrame& f, Sampler& sampler) {
+			const TraceManifold& closest_hit = f.closest_hit;
+			f.diffuse_count = sampler.diffuse_count > 0 ? sampler.diffuse_count : random_diffuse_count;
+			// Records are reused by all following samples, so record of sample with
+			//  less random rays than scene requires (i.e. progressive) would freeze it's noise
+			bool random_rays = cosine_diffuse_ray || random_diffuse_ray;
+			f.record_irradiance = irradiance_cached(f) && (!random_rays || f.diffuse_count >= random_diffuse_count);
+			
+			// Create new temp ray with less power, a bit shifted off surface
+			f.l = ray(closest_hit.location + RAY_SHIFT * closest_hit.normal, closest_hit.normal, f.r.power * f.material.diffuse * diffuse_light_scale);
+			f.power = f.l.power;
+			
+			if (cosine_diffuse_ray) {
+				// Directions are distributed by cosine to normal, so
+				//  estimate is plain average of incoming light.
+				orthonormal_basis(closest_hit.normal, f.T, f.B);
+				f.dimension = sampler.next_dimension();
+				f.roulette_dimension = sampler.next_dimension();
+			} else {
+				f.T = cppmath::vec3::cross(cppmath::vec3(1.0, 1.0, 1.0), closest_hit.normal);
+				if (random_diffuse_ray)
+					f.dimension = sampler.next_dimension();
+			}
+		};
+		
+		// Find next diffuse ray to shoot, returns 0 when loop is finished
+		bool next_diffuse(RayFrame& f, Sampler& sampler, ray& next) {
+			const cppmath::vec3& normal = f.closest_hit.normal;
+			
+			if (cosine_diffuse_ray) {
+				while (f.i < f.diffuse_count) {
+					int i = f.i++;
+					
+					double u, v;
+					sampler.sample_2d(f.dimension, i, f.diffuse_count, u, v);
+					f.l.B = cosine_hemisphere(normal, f.T, f.B, u, v);
+					f.l.power = f.power;
+					
+					// Terminate path with probability based on ray power,
+					//  survived paths are scaled to keep estimate unbiased
+					f.survival = 1.0;
+					if (russian_roulette_depth != -1 && f.ray_depth >= russian_roulette_depth) {
+						f.survival = std::clamp(f.power, russian_roulette_min, 1.0);
+						if (sampler.sample_1d(f.roulette_dimension, i, f.diffuse_count) >= f.survival)
+							continue;
+						f.l.power /= f.survival;
+					}
+					
+					next = f.l;
+					return 1;
+				}
+			} else if (!random_diffuse_ray) {
+				// Shoot rays in any directions to calculate diffuse light amount from reflections of other objects
+				while (f.vi < vertical_diffuse_count) {
+					if (f.ui >= horisontal_diffuse_count) {
+						f.ui = 0;
+						++f.vi;
+						continue;
+					}
+					++f.ui;
+					
+					f.l.B = normal;
+					f.l.B = cppmath::vec3::rotateAroundVector(f.l.B, f.T, f.v);
+					f.l.B = cppmath::vec3::rotateAroundVector(f.l.B, normal, f.u);
+					
+					f.cos_ln = cppmath::vec3::cos_between(f.l.direction(), normal);
+					if (f.cos_ln <= 0)
+						continue;
+					
+					next = f.l;
+					return 1;
+				}
+			} else {
+				while (f.i < f.diffuse_count) {
+					int i = f.i++;
+					
+					sampler.sample_2d(f.dimension, i, f.diffuse_count, f.u, f.v);
+					f.u *= 3.14159265358979323846 * 2.0;
+					f.v *= 3.14159265358979323846;
+					
+					f.l.B = normal;
+					f.l.B = cppmath::vec3::rotateAroundVector(f.l.B, f.T, f.v);
+					f.l.B = cppmath::vec3::rotateAroundVector(f.l.B, normal, f.u);
+					
+					f.cos_ln = cppmath::vec3::cos_between(f.l.direction(), normal);
+					if (f.cos_ln <= 0)
+						continue;
+					
+					next = f.l;
+					return 1;
 				}
 			}
 			
-			// Calculate refractions
-			if (closest_material.refract > 0) {
-				cppmath::vec3 direction = cppmath::vec3::refract(r.direction(), closest_hit.normal, closest_material.refract_val);
-				ray l(closest_hit.location + RAY_SHIFT * direction, direction);
-				l.power = r.power * closest_material.refract;
+			return 0;
+		};
+		
+		// Add light of diffuse ray returned by next_diffuse()
+		void add_diffuse(RayFrame& f, const HitManifold& hitd) {
+			++f.irradiance_rays;
+			if (!hitd.hit)
+				return;
+			
+			spaint::Color dif_res = hitd.color;
+			dif_res.scale_off_range(f.material.color);
+			
+			double weight;
+			if (cosine_diffuse_ray) {
+				weight = 1.0 / f.survival;
+				dif_res.scale_off_range(weight);
+			} else {
+				++f.total_diffuse;
+				double view = cppmath::vec3::cos_between(f.l.direction(), -f.r.direction());
+				weight = view * f.cos_ln;
+				dif_res.scale_off_range(view);
+				dif_res.scale_off_range(f.cos_ln);
 				
-				HitManifold hitr = shoot(l, ignored_id, ray_depth + 1);
-				if (hitr.hit) {
-					hitr.color.scale(closest_material.refract);
-					hitm.color += hitr.color;
+				// Grid rotation moves only after a hit
+				if (!random_diffuse_ray) {
+					f.u += 3.14159265358979323846 * 2.0 / (double) horisontal_diffuse_count;
+					f.v += 3.14159265358979323846 / (double) vertical_diffuse_count;
 				}
 			}
 			
-			// hitm.color.scale(r.power);
-			return hitm;
+			f.summary_diffuse.add_off_range(dif_res);
+			
+			if (f.record_irradiance) {
+				f.irradiance_r += hitd.color.r * weight;
+				f.irradiance_g += hitd.color.g * weight;
+				f.irradiance_b += hitd.color.b * weight;
+				if (hitd.distance > 0.0)
+					f.inverse_distance += 1.0 / hitd.distance;
+			}
+		};
+		
+		// Scale color & apply
+		void end_diffuse(RayFrame& f) {
+			double count = cosine_diffuse_ray ? f.diffuse_count : f.total_diffuse;
+			f.summary_diffuse.scale_off_range(f.material.diffuse);
+			f.summary_diffuse.scale_off_range(diffuse_light_scale);
+			f.summary_diffuse.scale(1.0 / count);
+			f.hitm.color += f.summary_diffuse;
+			
+			if (f.record_irradiance) {
+				IrradianceRecord record;
+				record.location = f.closest_hit.location;
+				record.normal = f.closest_hit.normal;
+				if (count > 0.0) {
+					record.r = f.irradiance_r / count;
+					record.g = f.irradiance_g / count;
+					record.b = f.irradiance_b / count;
+				}
+				// Rays seeing nothing are infinitely far
+				record.radius = f.inverse_distance > 0.0 ? f.irradiance_rays / f.inverse_distance : std::numeric_limits<double>::infinity();
+				record.ray_depth = f.ray_depth;
+				irradiance.insert(record);
+			}
 		};
 	};
 	
@@ -947,14 +2394,22 @@ namespace raytrace {
 		
 		// Viewport resolution
 		int width, height;
-		// Fov in sphere screen projection
+		// Horizontal field of view of perspective projection in radians
 		double fov;
 		// Z value in flat screen projection
 		double zDistance;
 		// Used for constructing ray coords for flat screen.
 		bool flatProjection;
+		// Shoot parallel rays along direction, has priority over other projections
+		bool orthographic = 0;
+		// Width of orthographic view in world units
+		double view_width = 1.0;
 	
 		cppmath::vec3 location;
+		// View direction and up direction of image, up does not have to be orthogonal to direction.
+		// Image x axis goes from cross(up, direction) to opposite side.
+		cppmath::vec3 direction = cppmath::vec3(0, 0, 1);
+		cppmath::vec3 up = cppmath::vec3(0, 1, 0);
 	
 		Camera() {};
 		
@@ -977,16 +2432,126 @@ namespace raytrace {
 		void set_fov(double fov) {
 			this->fov = fov * (3.14159265358979323846 / 180.0);
 			this->flatProjection = 0;
+			this->orthographic = 0;
 		};
 		
 		void set_zdistance(double zDistance) {
 			this->zDistance = zDistance;
 			this->flatProjection = 1;
+			this->orthographic = 0;
+		};
+		
+		void set_orthographic(double view_width) {
+			this->view_width = view_width;
+			this->orthographic = 1;
+		};
+		
+		// Turn camera to look at target
+		void look_at(const cppmath::vec3& target, const cppmath::vec3& up = cppmath::vec3(0, 1, 0)) {
+			this->direction = (target - location).norm();
+			this->up = up;
+		};
+		
+		// Returns 1 if camera produces same rays
+		bool same_view(const Camera& c) const {
+			return width == c.width && height == c.height && fov == c.fov && flatProjection == c.flatProjection
+				&& orthographic == c.orthographic && view_width == c.view_width
+				&& location == c.location && direction == c.direction && up == c.up;
+		};
+		
+		// Offset along image x axis of column x, pixel centers are at integer coordinates
+		inline double column_offset(double x) const {
+			if (orthographic)
+				return ((width - 1) * 0.5 - x) * (view_width / width);
+			if (flatProjection)
+				return (width / 2 - x) / (double) width;
+			return ((width - 1) * 0.5 - x) * (2.0 * std::tan(fov * 0.5) / width);
+		};
+		
+		// Offset along image y axis of row y, pixels are square except in flat projection
+		inline double row_offset(double y) const {
+			if (orthographic)
+				return ((height - 1) * 0.5 - y) * (view_width / width);
+			if (flatProjection)
+				return (height / 2 - y) / (double) height;
+			return ((height - 1) * 0.5 - y) * (2.0 * std::tan(fov * 0.5) / width);
+		};
+		
+		// Orthonormal basis of view: forward, image x axis and image y axis
+		void basis(cppmath::vec3& forward, cppmath::vec3& left, cppmath::vec3& image_up) const {
+			forward = cppmath::vec3(direction).norm();
+			left = cppmath::vec3::cross(up, forward).norm();
+			image_up = cppmath::vec3::cross(forward, left);
+		};
+		
+		// Returns ray through point (x, y) of frame, computing basis for every ray
+		ray ray_at(double x, double y) const {
+			cppmath::vec3 forward, left, image_up;
+			basis(forward, left, image_up);
+			
+			ray r;
+			if (orthographic)
+				r = ray(location + image_up * row_offset(y) + left * column_offset(x), forward);
+			else
+				r = ray(location, (forward + image_up * row_offset(y) + left * column_offset(x)).norm());
+			r.power = 1.0;
+			return r;
+		};
+	};
+	
+	// Primary rays of camera with basis and per-row & per-column increments precomputed once per frame
+	class CameraRays {
+		
+		// Camera rays were computed for
+		Camera camera;
+		bool valid = 0;
+		
+		cppmath::vec3 forward;
+		// Image axis scaled by offset of each column
+		std::vector<cppmath::vec3> columns;
+		// forward + image y axis scaled by offset of each row, only image y axis part in orthographic projection
+		std::vector<cppmath::vec3> rows;
+		
+	public:
+		
+		void update(const Camera& c) {
+			if (valid && camera.same_view(c))
+				return;
+			
+			camera = c;
+			valid = 1;
+			
+			cppmath::vec3 left, image_up;
+			c.basis(forward, left, image_up);
+			
+			columns.resize(c.width);
+			for (int x = 0; x < c.width; ++x)
+				columns[x] = left * c.column_offset(x);
+			
+			rows.resize(c.height);
+			for (int y = 0; y < c.height; ++y)
+				rows[y] = c.orthographic ? image_up * c.row_offset(y) : forward + image_up * c.row_offset(y);
+		};
+		
+		inline bool matches(const Camera& c) const {
+			return valid && camera.same_view(c);
+		};
+		
+		// Ray through pixel (x, y), equals to Camera::ray_at()
+		inline ray get(int x, int y) const {
+			ray r;
+			if (camera.orthographic)
+				r = ray(camera.location + rows[y] + columns[x], forward);
+			else
+				r = ray(camera.location, (rows[y] + columns[x]).norm());
+			r.power = 1.0;
+			return r;
 		};
 	};
 	
 	class RayTrace {
 		RayTraceScene scene;
+		CameraRays camera_rays;
 		
 		// Color returned when no hit on any object
 		spaint::Color background;
@@ -1013,6 +2578,21 @@ namespace raytrace {
 	public:
 	
 		Camera camera;
+		
+		// Adaptive anti-aliasing used by Renderer: pixels that differ from neighbours
+		//  in color or in object seen get aa_grid * aa_grid extra sub-pixel samples.
+		// Cost is 1 + aa_grid * aa_grid * refined fraction primary rays per pixel, so
+		//  error of full supersampling at 1.3x cost is reached only if edges cover
+		//  less than 8% of frame. Defaults keep error within 10% of full supersampling
+		//  on edge dense frames, example/raytrace_adaptive_aa refines 21% of pixels
+		//  at 1.86 rays per pixel. Smaller aa_budget trades quality for cost.
+		bool adaptive_aa = 0;
+		// Side of sub-pixel samples grid of refined pixel
+		int aa_grid = 2;
+		// Sum of absolute channel differences with neighbour that requires refinement
+		int aa_threshold = 24;
+		// Maximal fraction of refined pixels, pixels with higher contrast are refined first
+		double aa_budget = 0.25;
 	
 		RayTrace() {};
 	
@@ -1045,30 +2625,147 @@ namespace raytrace {
 		};
 		
 		// Returns hit color on projection to camera view.
-		// Automatically transforms x, y to coordinates & hits object
-		spaint::Color hitColorAt(int x, int y) {			
+		// Automatically transforms x, y to coordinates & hits object.
+		// Random values are keyed by pixel and sample_index.
+		spaint::Color hitColorAt(int x, int y, int sample_index = 0) {
+			return trace_pixel(primary_ray(x, y), x, y, sample_index);
+		};
 		
-			cppmath::vec3 ray_direction;
+		// Same as hitColorAt(), but ray is taken from rays precomputed by update_camera() without
+		//  checking for camera change. Used by renderers, which update camera once per frame.
+		// Positive diffuse_count replaces scene random_diffuse_count for this sample.
+		spaint::Color frameColorAt(int x, int y, int sample_index = 0, int diffuse_count = 0) {
+			return trace_pixel(frame_ray(x, y), x, y, sample_index, diffuse_count);
+		};
+		
+		// Returns hit colors of count pixels starting at (x, y) in a row.
+		// Rays are traced in packets of simd::PACKET_SIZE, result equals to hitColorAt() of each pixel.
+		// object_ids optionally receive ids of objects seen by each pixel.
+		void hitColorRow(int x, int y, int count, spaint::Color* colors, int sample_index = 0, int* object_ids = nullptr) {
+			if (camera_rays.matches(camera))
+				trace_row(x, y, count, colors, sample_index, object_ids, [this](int x, int y) { return camera_rays.get(x, y); });
+			else
+				trace_row(x, y, count, colors, sample_index, object_ids, [this](int x, int y) { return camera.ray_at(x, y); });
+		};
+		
+		// Same as hitColorRow() with rays precomputed by update_camera(), see frameColorAt()
+		void frameColorRow(int x, int y, int count, spaint::Color* colors, int sample_index = 0, int* object_ids = nullptr, int diffuse_count = 0) {
+			trace_row(x, y, count, colors, sample_index, object_ids, [this](int x, int y) { return camera_rays.get(x, y); }, diffuse_count);
+		};
+		
+	private:
+		
+		spaint::Color trace_pixel(const ray& r, int x, int y, int sample_index, int diffuse_count = 0) {
+			Sampler sampler(scene.sample_sequence, scene.seed);
+			sampler.start(x, y, sample_index);
+			sampler.diffuse_count = diffuse_count;
 			
-			if (camera.flatProjection) {
-				ray_direction = cppmath::vec3((camera.width / 2 - x) / (double) camera.width, (camera.height / 2 - y) / (double) camera.height, 1.0).norm();
-				ray_direction.norm();
-			} else {
+			RAYTRACE_COUNT(rays[RAY_PRIMARY]++);
+			HitManifold hit = scene.shoot(r, sampler);
+			
+			if (hit.hit)
+				return hit.color;
+			return get_background();
+		};
+		
+		// Trace row in packets, ray_of(x, y) returns primary ray of pixel
+		template<typename RayOf>
+		void trace_row(int x, int y, int count, spaint::Color* colors, int sample_index, int* object_ids, RayOf ray_of, int diffuse_count = 0) {
+			ray rays[simd::PACKET_SIZE];
+			Sampler samplers[simd::PACKET_SIZE];
+			HitManifold hits[simd::PACKET_SIZE];
+			
+			for (int i = 0; i < count; i += simd::PACKET_SIZE) {
+				int packet_count = std::min(simd::PACKET_SIZE, count - i);
+				
+				for (int p = 0; p < packet_count; ++p) {
+					rays[p] = ray_of(x + i + p, y);
+					samplers[p] = Sampler(scene.sample_sequence, scene.seed);
+					samplers[p].start(x + i + p, y, sample_index);
+					samplers[p].diffuse_count = diffuse_count;
+				}
 				
-				// Deprecated
+				scene.shoot_packet(rays, packet_count, samplers, hits);
 				
-				/*double angle_step = fov / (double) width;
-				ray_direction = (std::tan(sx + (double) x * angle_step), std::tan(sy + (double) y * angle_step), 1.0);
-				ray_direction.z = std::sqrt(1.0 - ray_direction.x * ray_direction.x - ray_direction.y * ray_direction.y);*/
+				for (int p = 0; p < packet_count; ++p) {
+					colors[i + p] = hits[p].hit ? hits[p].color : get_background();
+					if (object_ids)
+						object_ids[i + p] = hits[p].object_id;
+				}
 			}
+		};
+		
+	public:
+		
+		// Returns hit color at point (x + dx, y + dy) of pixel (x, y), dx and dy in [-0.5, 0.5]
+		spaint::Color hitColorAt(int x, int y, double dx, double dy, int sample_index = 0) {
+			ray r = primary_ray(x + dx, y + dy);
+			Sampler sampler(scene.sample_sequence, scene.seed);
+			sampler.start(x, y, sample_index);
 			
-			ray r(camera.location, ray_direction);
-			r.power = 1.0;
-			HitManifold hit = scene.shoot(r);
+			RAYTRACE_COUNT(rays[RAY_PRIMARY]++);
+			HitManifold hit = scene.shoot(r, sampler);
 			
 			if (hit.hit)
 				return hit.color;
 			return get_background();
 		};
+		
+		// Albedo, normal & distance of first visible surface seen through center of pixel (x, y).
+		// Returns 0 if pixel sees background.
+		bool surfaceAt(int x, int y, spaint::Color& albedo, cppmath::vec3& normal, double& distance) {
+			return scene.first_surface(primary_ray(x, y), albedo, normal, distance);
+		};
+		
+		// Returns pixel color averaged over center sample and aa_grid * aa_grid sub-pixel samples
+		spaint::Color hitColorSupersampled(int x, int y, const spaint::Color& center) {
+			int grid = aa_grid > 0 ? aa_grid : 1;
+			spaint::Color sum = center;
+			
+			for (int j = 0; j < grid; ++j)
+				for (int i = 0; i < grid; ++i)
+					sum.add_off_range(hitColorAt(x, y, (i + 0.5) / grid - 0.5, (j + 0.5) / grid - 0.5, 1 + j * grid + i));
+			
+			sum.scale(1.0 / (grid * grid + 1));
+			return sum;
+		};
+		
+		// Precompute primary rays of current camera. Called by renderers at start of frame,
+		//  must be called after camera change for fast ray generation in direct calls of hitColorAt().
+		void update_camera() {
+			camera_rays.update(camera);
+		};
+		
+		// Returns ray from camera through point (x, y) of frame, pixel centers are at integer coordinates
+		ray primary_ray(double x, double y) {
+			return camera.ray_at(x, y);
+		};
+		
+		// Returns ray from camera through pixel (x, y) precomputed by last update_camera().
+		// Camera must not change after update_camera(), used per pixel by renderers.
+		inline ray frame_ray(int x, int y) const {
+			return camera_rays.get(x, y);
+		};
+		
+		// Returns ray from camera through pixel (x, y), precomputed if camera did not change after update_camera()
+		inline ray primary_ray(int x, int y) {
+			if (camera_rays.matches(camera))
+				return camera_rays.get(x, y);
+			return camera.ray_at(x, y);
+		};
+		
+		// Write rays of width * height pixels starting at (x, y) into buffer row by row
+		void primary_rays(int x, int y, int width, int height, ray* rays) {
+			if (!camera_rays.matches(camera)) {
+				for (int j = 0; j < height; ++j)
+					for (int i = 0; i < width; ++i)
+						rays[i + j * width] = camera.ray_at(x + i, y + j);
+				return;
+			}
+			
+			for (int j = 0; j < height; ++j)
+				for (int i = 0; i < width; ++i)
+					rays[i + j * width] = camera_rays.get(x + i, y + j);
+		};
 	};
 }
\ No newline at end of file
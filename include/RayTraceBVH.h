@@ -0,0 +1,631 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+
+#include "vec3.h"
+#include "RayTraceStats.h"
+#include "RayTraceColumn.h"
+
+namespace raytrace {
+
+	// Axis aligned bounding box
+	struct AABB {
+		cppmath::vec3 min = cppmath::vec3( std::numeric_limits<double>::infinity());
+		cppmath::vec3 max = cppmath::vec3(-std::numeric_limits<double>::infinity());
+
+		AABB() {};
+
+		AABB(const cppmath::vec3& min, const cppmath::vec3& max) : min(min), max(max) {};
+
+		// Box that contains whole space, used for unbounded objects (planes)
+		static AABB infinite() {
+			return AABB(cppmath::vec3(-std::numeric_limits<double>::infinity()), cppmath::vec3(std::numeric_limits<double>::infinity()));
+		};
+
+		inline bool empty() const {
+			return min.x > max.x || min.y > max.y || min.z > max.z;
+		};
+
+		inline bool finite() const {
+			return std::isfinite(min.x) && std::isfinite(min.y) && std::isfinite(min.z)
+				&& std::isfinite(max.x) && std::isfinite(max.y) && std::isfinite(max.z);
+		};
+
+		inline void expand(const cppmath::vec3& p) {
+			min.x = std::min(min.x, p.x);
+			min.y = std::min(min.y, p.y);
+			min.z = std::min(min.z, p.z);
+			max.x = std::max(max.x, p.x);
+			max.y = std::max(max.y, p.y);
+			max.z = std::max(max.z, p.z);
+		};
+
+		inline void expand(const AABB& b) {
+			min.x = std::min(min.x, b.min.x);
+			min.y = std::min(min.y, b.min.y);
+			min.z = std::min(min.z, b.min.z);
+			max.x = std::max(max.x, b.max.x);
+			max.y = std::max(max.y, b.max.y);
+			max.z = std::max(max.z, b.max.z);
+		};
+
+		inline bool operator==(const AABB& b) const {
+			return min.x == b.min.x && min.y == b.min.y && min.z == b.min.z
+				&& max.x == b.max.x && max.y == b.max.y && max.z == b.max.z;
+		};
+
+		inline cppmath::vec3 center() const {
+			return cppmath::vec3((min.x + max.x) * 0.5, (min.y + max.y) * 0.5, (min.z + max.z) * 0.5);
+		};
+
+		// Half of the surface area, used by SAH
+		inline double half_area() const {
+			if (empty())
+				return 0.0;
+			double dx = max.x - min.x;
+			double dy = max.y - min.y;
+			double dz = max.z - min.z;
+			return dx * dy + dy * dz + dz * dx;
+		};
+
+		// Slab test. inv_direction is 1.0 / ray.direction per component.
+		// Returns distance of entering the box or infinity if ray misses box in [0, t_max].
+		inline double intersect(const cppmath::vec3& origin, const cppmath::vec3& inv_direction, double t_max) const {
+			RAYTRACE_COUNT(tests[TEST_BOX]++);
+			double t0 = (min.x - origin.x) * inv_direction.x;
+			double t1 = (max.x - origin.x) * inv_direction.x;
+			double tmin = std::min(t0, t1);
+			double tmax = std::max(t0, t1);
+
+			t0 = (min.y - origin.y) * inv_direction.y;
+			t1 = (max.y - origin.y) * inv_direction.y;
+			tmin = std::max(tmin, std::min(t0, t1));
+			tmax = std::min(tmax, std::max(t0, t1));
+
+			t0 = (min.z - origin.z) * inv_direction.z;
+			t1 = (max.z - origin.z) * inv_direction.z;
+			tmin = std::max(tmin, std::min(t0, t1));
+			tmax = std::min(tmax, std::max(t0, t1));
+
+			tmin = std::max(tmin, 0.0);
+			tmax = std::min(tmax, t_max);
+
+			if (tmin <= tmax)
+				return tmin;
+			return std::numeric_limits<double>::infinity();
+		};
+	};
+
+	// Bounding volume hierarchy over set of boxes.
+	// Built with binned surface area heuristic and flattened into
+	//  depth-first array of nodes: left child of inner node is
+	//  always stored right after it, right child is referenced by index.
+	class BVH {
+
+	public:
+
+		struct Node {
+			AABB bounds;
+			// Index of first primitive in leaf or index of right child in inner node
+			int offset = 0;
+			// Number of primitives in leaf, 0 for inner node
+			int count = 0;
+		};
+
+		// Maximal number of primitives in a leaf
+		int MAX_LEAF_SIZE = 4;
+		// Number of bins used to estimate SAH cost of split
+		int SAH_BINS = 16;
+		// Cost of node traversal relative to primitive intersection
+		double TRAVERSAL_COST = 1.0;
+		// Depth after which SAH is replaced with median split to keep traversal stack bounded
+		static const int MAX_SAH_DEPTH = 64;
+		// Size of traversal stack
+		static const int STACK_SIZE = 128;
+		// Maximal number of rays in packet traversal
+		static const int PACKET_SIZE = 4;
+
+	private:
+
+		Column<Node> nodes;
+		// Primitive indices referenced by leaves
+		Column<int> indices;
+		// Bounds of primitives, kept for refit()
+		Column<AABB> prim_bounds;
+		// Parent of each node, -1 for root. Filled by first refit() of restored hierarchy.
+		std::vector<int> parents;
+		// Leaf node containing each primitive
+		std::vector<int> prim_leaves;
+		// Sum of SAH costs of nodes, updated by refit()
+		double cost_sum = 0.0;
+		// Value of get_cost() right after build
+		double build_cost = 0.0;
+
+		// Temporary data used during build
+		std::vector<cppmath::vec3> prim_centers;
+
+		struct Bin {
+			AABB bounds;
+			int count = 0;
+		};
+
+		// Build subtree on indices[begin, end) and return node index
+		int build_node(int begin, int end, int depth) {
+			int node_id = nodes.size();
+			nodes.push_back(Node());
+
+			AABB bounds;
+			AABB centroid_bounds;
+			for (int i = begin; i < end; ++i) {
+				bounds.expand(prim_bounds[indices[i]]);
+				centroid_bounds.expand(prim_centers[indices[i]]);
+			}
+			nodes[node_id].bounds = bounds;
+
+			int count = end - begin;
+			if (count <= 1) {
+				nodes[node_id].offset = begin;
+				nodes[node_id].count  = count;
+				return node_id;
+			}
+
+			// Select split axis by largest centroid extent
+			cppmath::vec3 extent = centroid_bounds.max - centroid_bounds.min;
+			int axis = 0;
+			if (extent.y > extent.x)
+				axis = 1;
+			if (extent.z > (axis == 0 ? extent.x : extent.y))
+				axis = 2;
+
+			double axis_min    = axis_of(centroid_bounds.min, axis);
+			double axis_extent = axis_of(extent, axis);
+
+			// All centroids in one point, can not split
+			if (axis_extent <= 0.0) {
+				if (count <= MAX_LEAF_SIZE) {
+					nodes[node_id].offset = begin;
+					nodes[node_id].count  = count;
+					return node_id;
+				}
+
+				int mid = begin + count / 2;
+				build_inner(node_id, begin, mid, end, depth);
+				return node_id;
+			}
+
+			// Too deep, split by median to bound depth
+			if (depth >= MAX_SAH_DEPTH) {
+				int mid = begin + count / 2;
+				std::nth_element(indices.begin() + begin, indices.begin() + mid, indices.begin() + end, [&](int a, int b) {
+					return axis_of(prim_centers[a], axis) < axis_of(prim_centers[b], axis);
+				});
+				build_inner(node_id, begin, mid, end, depth);
+				return node_id;
+			}
+
+			// Bin primitives by centroid
+			std::vector<Bin> bins(SAH_BINS);
+			double bin_scale = (double) SAH_BINS / axis_extent;
+			for (int i = begin; i < end; ++i) {
+				int b = bin_of(prim_centers[indices[i]], axis, axis_min, bin_scale);
+				bins[b].count++;
+				bins[b].bounds.expand(prim_bounds[indices[i]]);
+			}
+
+			// Sweep from right to collect suffix areas
+			std::vector<double> right_area(SAH_BINS);
+			std::vector<int> right_count(SAH_BINS);
+			AABB acc;
+			int acc_count = 0;
+			for (int i = SAH_BINS - 1; i > 0; --i) {
+				acc.expand(bins[i].bounds);
+				acc_count += bins[i].count;
+				right_area[i]  = acc.half_area();
+				right_count[i] = acc_count;
+			}
+
+			// Sweep from left and find best split
+			double best_cost = std::numeric_limits<double>::infinity();
+			int best_split = -1;
+			acc = AABB();
+			acc_count = 0;
+			for (int i = 0; i < SAH_BINS - 1; ++i) {
+				acc.expand(bins[i].bounds);
+				acc_count += bins[i].count;
+				if (acc_count == 0 || right_count[i + 1] == 0)
+					continue;
+				double cost = acc.half_area() * acc_count + right_area[i + 1] * right_count[i + 1];
+				if (cost < best_cost) {
+					best_cost  = cost;
+					best_split = i;
+				}
+			}
+
+			double leaf_cost = bounds.half_area() * count;
+			best_cost = TRAVERSAL_COST * bounds.half_area() + best_cost;
+
+			// Splitting is not profitable
+			if (count <= MAX_LEAF_SIZE && (best_split == -1 || best_cost >= leaf_cost)) {
+				nodes[node_id].offset = begin;
+				nodes[node_id].count  = count;
+				return node_id;
+			}
+
+			int mid;
+			if (best_split == -1)
+				mid = begin + count / 2;
+			else {
+				mid = std::partition(indices.begin() + begin, indices.begin() + end, [&](int p) {
+					return bin_of(prim_centers[p], axis, axis_min, bin_scale) <= best_split;
+				}) - indices.begin();
+
+				if (mid == begin || mid == end)
+					mid = begin + count / 2;
+			}
+
+			build_inner(node_id, begin, mid, end, depth);
+			return node_id;
+		};
+
+		void build_inner(int node_id, int begin, int mid, int end, int depth) {
+			build_node(begin, mid, depth + 1);
+			int right = build_node(mid, end, depth + 1);
+			nodes[node_id].offset = right;
+			nodes[node_id].count  = 0;
+		};
+
+		inline int bin_of(const cppmath::vec3& c, int axis, double axis_min, double bin_scale) const {
+			int b = (int) ((axis_of(c, axis) - axis_min) * bin_scale);
+			return b < 0 ? 0 : (b >= SAH_BINS ? SAH_BINS - 1 : b);
+		};
+
+		static inline double axis_of(const cppmath::vec3& v, int axis) {
+			return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+		};
+
+		// Cost of node not normalized by root area
+		inline double node_cost(const Node& node) const {
+			return node.bounds.half_area() * (node.count ? node.count : TRAVERSAL_COST);
+		};
+
+		// Cost of hierarchy right after build
+		void measure() {
+			cost_sum = 0.0;
+			for (int n = 0; n < (int) nodes.size(); ++n)
+				cost_sum += node_cost(nodes[n]);
+			build_cost = get_cost();
+		};
+
+		// Links used to walk from moved primitive to root
+		void link() {
+			parents.assign(nodes.size(), -1);
+			prim_leaves.assign(indices.size(), -1);
+			for (int n = 0; n < (int) nodes.size(); ++n) {
+				if (nodes[n].count)
+					for (int i = nodes[n].offset; i < nodes[n].offset + nodes[n].count; ++i)
+						prim_leaves[indices[i]] = n;
+				else {
+					parents[n + 1] = n;
+					parents[nodes[n].offset] = n;
+				}
+			}
+		};
+
+		// Recompute bounds of node from it's primitives or children.
+		// Returns 0 if bounds did not change.
+		bool refit_node(int node_id) {
+			Node& node = nodes[node_id];
+			AABB bounds;
+			if (node.count)
+				for (int i = node.offset; i < node.offset + node.count; ++i)
+					bounds.expand(prim_bounds[indices[i]]);
+			else {
+				bounds.expand(nodes[node_id + 1].bounds);
+				bounds.expand(nodes[node.offset].bounds);
+			}
+
+			if (bounds == node.bounds)
+				return 0;
+
+			cost_sum -= node_cost(node);
+			node.bounds = bounds;
+			cost_sum += node_cost(node);
+			return 1;
+		};
+
+	public:
+
+		BVH() {};
+
+		// Build hierarchy over given list of bounds.
+		// Primitive ids passed to traversal callbacks are indices in this list.
+		void build(const std::vector<AABB>& bounds) {
+			nodes.clear();
+			indices.clear();
+			parents.clear();
+
+			prim_bounds.assign(bounds.data(), bounds.data() + bounds.size());
+			prim_centers.resize(bounds.size());
+			indices.resize(bounds.size());
+			for (int i = 0; i < (int) bounds.size(); ++i) {
+				prim_centers[i] = bounds[i].center();
+				indices[i] = i;
+			}
+
+			if (bounds.size()) {
+				nodes.reserve(bounds.size() * 2);
+				build_node(0, bounds.size(), 0);
+			}
+
+			prim_centers.clear();
+			prim_centers.shrink_to_fit();
+
+			measure();
+			link();
+		};
+
+		// Use hierarchy built earlier, e.g. stored in mapped scene file, instead of building it.
+		// Arrays are viewed without copying and must stay valid until next build() or clear().
+		// stored_bounds are bounds of primitives used by refit(), may be empty if
+		//  hierarchy is never refitted.
+		// Throws std::runtime_error if nodes reference primitives out of range or
+		//  hierarchy is too deep for traversal stack.
+		void restore(Node* stored_nodes, size_t node_count, int* stored_indices, size_t index_count, AABB* stored_bounds, size_t bounds_count) {
+			// Children are stored after parent, so depth of node is known when it is visited.
+			// Traversal holds at most depth + 1 nodes on stack.
+			std::vector<int> depth(node_count, 0);
+			for (size_t n = 0; n < node_count; ++n) {
+				const Node& node = stored_nodes[n];
+				bool valid = node.count
+					? node.offset >= 0 && node.count > 0 && (size_t) node.offset + node.count <= index_count
+					: node.offset > (int) n + 1 && (size_t) node.offset < node_count && n + 1 < node_count;
+				if (!valid)
+					throw std::runtime_error("BVH node out of range");
+
+				if (node.count)
+					continue;
+				int child_depth = depth[n] + 1;
+				if (child_depth >= STACK_SIZE)
+					throw std::runtime_error("BVH is too deep");
+				depth[n + 1] = std::max(depth[n + 1], child_depth);
+				depth[node.offset] = std::max(depth[node.offset], child_depth);
+			}
+			for (size_t i = 0; i < index_count; ++i)
+				if (stored_indices[i] < 0 || (size_t) stored_indices[i] >= index_count)
+					throw std::runtime_error("BVH primitive index out of range");
+			if (bounds_count && bounds_count != index_count)
+				throw std::runtime_error("BVH primitive bounds do not match primitives");
+
+			nodes.view(stored_nodes, node_count);
+			indices.view(stored_indices, index_count);
+			prim_bounds.view(stored_bounds, bounds_count);
+			parents.clear();
+			prim_leaves.clear();
+			measure();
+		};
+
+		// Set new bounds of primitive & enlarge or shrink boxes of it's ancestors.
+		// Tree topology is kept, so time is proportional to depth of primitive, but
+		//  traversal gets slower as primitives move away from their neighbours.
+		void refit(int id, const AABB& bounds) {
+			if (parents.size() != nodes.size())
+				link();
+			prim_bounds[id] = bounds;
+			for (int n = prim_leaves[id]; n != -1 && refit_node(n); n = parents[n]);
+		};
+
+		// Expected cost of ray traversal relative to intersection of single primitive,
+		//  computed with surface area heuristic
+		inline double get_cost() const {
+			if (nodes.empty() || nodes[0].bounds.half_area() <= 0.0)
+				return 0.0;
+			return cost_sum / nodes[0].bounds.half_area();
+		};
+
+		// Cost of hierarchy right after last build()
+		inline double get_build_cost() const {
+			return build_cost;
+		};
+
+		inline void clear() {
+			nodes.clear();
+			indices.clear();
+			prim_bounds.clear();
+			parents.clear();
+			prim_leaves.clear();
+			cost_sum = build_cost = 0.0;
+		};
+
+		inline bool empty() const {
+			return nodes.empty();
+		};
+
+		inline const Column<Node>& get_nodes() const {
+			return nodes;
+		};
+
+		inline const Column<int>& get_indices() const {
+			return indices;
+		};
+
+		// Bounds of primitives kept for refit(), indexed by primitive id
+		inline const Column<AABB>& get_prim_bounds() const {
+			return prim_bounds;
+		};
+
+		// Find closest hit along the ray.
+		// intersect(int id, double t_max) must test primitive id and return
+		//  distance to hit point or infinity if there is no hit closer than t_max.
+		// Returns id of closest hit primitive or -1, t_max is updated to hit distance.
+		template<typename F>
+		int closest(const cppmath::vec3& origin, const cppmath::vec3& direction, double& t_max, F&& intersect) const {
+			int closest_id = -1;
+			closest_leaf(origin, direction, t_max, [&](int node_id, double& t) {
+				const Node& node = nodes[node_id];
+				for (int i = node.offset; i < node.offset + node.count; ++i) {
+					double ti = intersect(indices[i], t);
+					if (ti < t) {
+						t = ti;
+						closest_id = indices[i];
+					}
+				}
+			});
+			return closest_id;
+		};
+		
+		// Find closest hit along the ray testing whole leaves.
+		// leaf(int node_id, double& t_max) must test primitives of leaf node
+		//  [offset, offset + count) in get_indices() and decrease t_max on hit.
+		template<typename F>
+		void closest_leaf(const cppmath::vec3& origin, const cppmath::vec3& direction, double& t_max, F&& leaf) const {
+			if (nodes.empty())
+				return;
+
+			cppmath::vec3 inv_direction(1.0 / direction.x, 1.0 / direction.y, 1.0 / direction.z);
+
+			int stack[STACK_SIZE];
+			int stack_size = 0;
+			int node_id = 0;
+
+			if (nodes[0].bounds.intersect(origin, inv_direction, t_max) == std::numeric_limits<double>::infinity())
+				return;
+
+			while (1) {
+				const Node& node = nodes[node_id];
+
+				if (node.count)
+					leaf(node_id, t_max);
+				else {
+					// Visit closer child first
+					int left  = node_id + 1;
+					int right = node.offset;
+					double tl = nodes[left].bounds.intersect(origin, inv_direction, t_max);
+					double tr = nodes[right].bounds.intersect(origin, inv_direction, t_max);
+
+					if (tl != std::numeric_limits<double>::infinity() && tr != std::numeric_limits<double>::infinity()) {
+						if (tr < tl)
+							std::swap(left, right);
+						stack[stack_size++] = right;
+						node_id = left;
+						continue;
+					} else if (tl != std::numeric_limits<double>::infinity()) {
+						node_id = left;
+						continue;
+					} else if (tr != std::numeric_limits<double>::infinity()) {
+						node_id = right;
+						continue;
+					}
+				}
+
+				// Pop next node that is still closer than current hit
+				bool found = 0;
+				while (stack_size) {
+					node_id = stack[--stack_size];
+					if (nodes[node_id].bounds.intersect(origin, inv_direction, t_max) != std::numeric_limits<double>::infinity()) {
+						found = 1;
+						break;
+					}
+				}
+
+				if (!found)
+					return;
+			}
+		};
+		
+		// Find closest hits of packet of count coherent rays in one traversal.
+		// Node is visited when it is crossed by any ray of packet closer than it's t_max.
+		// leaf(int node_id) must test leaf primitives against all rays and decrease t_max on hits.
+		template<typename F>
+		void closest_packet(const cppmath::vec3* origins, const cppmath::vec3* directions, int count, double* t_max, F&& leaf) const {
+			if (nodes.empty() || count <= 0)
+				return;
+
+			cppmath::vec3 inv_directions[PACKET_SIZE];
+			for (int r = 0; r < count; ++r)
+				inv_directions[r] = cppmath::vec3(1.0 / directions[r].x, 1.0 / directions[r].y, 1.0 / directions[r].z);
+
+			// Closest entry distance of packet or infinity if no ray crosses the box
+			auto entry = [&](const AABB& bounds) -> double {
+				double t = std::numeric_limits<double>::infinity();
+				for (int r = 0; r < count; ++r)
+					t = std::min(t, bounds.intersect(origins[r], inv_directions[r], t_max[r]));
+				return t;
+			};
+
+			int stack[STACK_SIZE];
+			int stack_size = 0;
+			stack[stack_size++] = 0;
+
+			while (stack_size) {
+				int node_id = stack[--stack_size];
+				const Node& node = nodes[node_id];
+
+				if (entry(node.bounds) == std::numeric_limits<double>::infinity())
+					continue;
+
+				if (node.count) {
+					leaf(node_id);
+					continue;
+				}
+
+				// Push farther child first to visit closer child first
+				int left  = node_id + 1;
+				int right = node.offset;
+				if (entry(nodes[right].bounds) < entry(nodes[left].bounds))
+					std::swap(left, right);
+				stack[stack_size++] = right;
+				stack[stack_size++] = left;
+			}
+		};
+		
+		// Visit all primitives which boxes are crossed by ray in [0, t_max].
+		// visit(int id) returns 1 to stop traversal.
+		// Returns 1 if traversal was stopped by visitor.
+		template<typename F>
+		bool traverse(const cppmath::vec3& origin, const cppmath::vec3& direction, double t_max, F&& visit) const {
+			return traverse_leaf(origin, direction, t_max, [&](int node_id) -> bool {
+				const Node& node = nodes[node_id];
+				for (int i = node.offset; i < node.offset + node.count; ++i)
+					if (visit(indices[i]))
+						return 1;
+				return 0;
+			});
+		};
+		
+		// Visit all leaves which boxes are crossed by ray in [0, t_max].
+		// visit(int node_id) returns 1 to stop traversal.
+		template<typename F>
+		bool traverse_leaf(const cppmath::vec3& origin, const cppmath::vec3& direction, double t_max, F&& visit) const {
+			if (nodes.empty())
+				return 0;
+			
+			cppmath::vec3 inv_direction(1.0 / direction.x, 1.0 / direction.y, 1.0 / direction.z);
+			
+			int stack[STACK_SIZE];
+			int stack_size = 0;
+			stack[stack_size++] = 0;
+			
+			while (stack_size) {
+				int node_id = stack[--stack_size];
+				const Node& node = nodes[node_id];
+				
+				if (node.bounds.intersect(origin, inv_direction, t_max) == std::numeric_limits<double>::infinity())
+					continue;
+				
+				if (node.count) {
+					if (visit(node_id))
+						return 1;
+				} else {
+					stack[stack_size++] = node.offset;
+					stack[stack_size++] = node_id + 1;
+				}
+			}
+			
+			return 0;
+		};
+	};
+};
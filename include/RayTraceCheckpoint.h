@@ -0,0 +1,426 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <functional>
+#include <condition_variable>
+
+#include "RayTrace.h"
+#include "RayTraceRenderer.h"
+#include "RayTraceProgressive.h"
+
+namespace raytrace {
+
+	// Type of render saved in checkpoint
+	enum class CheckpointKind : uint32_t {
+		// Finished tiles of frame rendered by Renderer
+		TILES = 1,
+		// Accumulation of ProgressiveRenderer
+		ACCUMULATION = 2
+	};
+
+	// State of interrupted render.
+	// Stored in native byte order as:
+	//  HEADER := MAGIC "RTCP"[4B] + VERSION[4B] + KIND[4B] + WIDTH[4B] + HEIGHT[4B]
+	//            + TILE_SIZE[4B] + SAMPLES[4B] + KEY[8B]
+	//  TILES BODY := TILE_COUNT[4B] + DONE[1B][TILE_COUNT] + ABGR[4B][pixels of done tiles in tile order]
+	//  ACCUMULATION BODY := COUNTS[4B][WIDTH * HEIGHT] + ACCUMULATION[8B][WIDTH * HEIGHT * 3]
+	struct Checkpoint {
+
+		static const uint32_t MAGIC = 0x50435452;
+		static const uint32_t VERSION = 1;
+
+		CheckpointKind kind = CheckpointKind::TILES;
+		int width = 0, height = 0;
+		int tile_size = 0;
+		// Number of completed progressive samples
+		int samples = 0;
+		// Identifies scene & settings, checkpoint of other key is not resumed
+		uint64_t key = 0;
+
+		// Frame: done flag of each tile & pixels of done tiles in tile order
+		std::vector<uint8_t> done;
+		std::vector<unsigned int> pixels;
+
+		// Progressive: sample counts & accumulated r, g, b of each pixel
+		std::vector<uint32_t> counts;
+		std::vector<double> accumulation;
+
+		// Write into filename + ".tmp" and rename it over filename,
+		//  so crash during write keeps previous checkpoint intact.
+		void save(const std::string& filename) const {
+			std::string temporary = filename + ".tmp";
+			{
+				std::ofstream file(temporary, std::ofstream::binary | std::ofstream::trunc);
+				if (file.fail())
+					throw std::runtime_error("Checkpoint " + temporary + ": open failed");
+
+				uint32_t header[7] = { MAGIC, VERSION, (uint32_t) kind, (uint32_t) width, (uint32_t) height, (uint32_t) tile_size, (uint32_t) samples };
+				file.write((const char*) header, sizeof(header));
+				file.write((const char*) &key, sizeof(key));
+
+				if (kind == CheckpointKind::TILES) {
+					uint32_t tile_count = done.size();
+					file.write((const char*) &tile_count, sizeof(tile_count));
+					file.write((const char*) done.data(), done.size());
+					file.write((const char*) pixels.data(), pixels.size() * sizeof(unsigned int));
+				} else {
+					file.write((const char*) counts.data(), counts.size() * sizeof(uint32_t));
+					file.write((const char*) accumulation.data(), accumulation.size() * sizeof(double));
+				}
+
+				file.flush();
+				if (file.fail())
+					throw std::runtime_error("Checkpoint " + temporary + ": write failed");
+			}
+
+			if (std::rename(temporary.c_str(), filename.c_str()))
+				throw std::runtime_error("Checkpoint " + filename + ": rename failed");
+		};
+
+		// Read checkpoint, returns 0 if file does not exist.
+		// Throws std::runtime_error if file is not a valid checkpoint.
+		bool load(const std::string& filename) {
+			std::ifstream file(filename, std::ifstream::binary);
+			if (file.fail())
+				return 0;
+
+			uint32_t header[7];
+			file.read((char*) header, sizeof(header));
+			file.read((char*) &key, sizeof(key));
+			if (file.fail() || header[0] != MAGIC)
+				throw std::runtime_error("Checkpoint " + filename + ": not a checkpoint");
+			if (header[1] != VERSION)
+				throw std::runtime_error("Checkpoint " + filename + ": unsupported version");
+
+			kind = (CheckpointKind) header[2];
+			width = header[3];
+			height = header[4];
+			tile_size = header[5];
+			samples = header[6];
+			size_t pixel_count = (size_t) width * height;
+
+			if (kind == CheckpointKind::TILES) {
+				uint32_t tile_count;
+				file.read((char*) &tile_count, sizeof(tile_count));
+				if (file.fail() || tile_count > pixel_count)
+					throw std::runtime_error("Checkpoint " + filename + ": truncated");
+
+				done.resize(tile_count);
+				file.read((char*) done.data(), done.size());
+
+				// Rest of file is pixels of done tiles
+				std::streampos start = file.tellg();
+				file.seekg(0, std::ios::end);
+				size_t bytes = file.tellg() - start;
+				file.seekg(start);
+				if (file.fail() || bytes % sizeof(unsigned int) || bytes / sizeof(unsigned int) > pixel_count)
+					throw std::runtime_error("Checkpoint " + filename + ": truncated");
+
+				pixels.resize(bytes / sizeof(unsigned int));
+				file.read((char*) pixels.data(), bytes);
+			} else if (kind == CheckpointKind::ACCUMULATION) {
+				counts.resize(pixel_count);
+				accumulation.resize(pixel_count * 3);
+				file.read((char*) counts.data(), counts.size() * sizeof(uint32_t));
+				file.read((char*) accumulation.data(), accumulation.size() * sizeof(double));
+			} else
+				throw std::runtime_error("Checkpoint " + filename + ": unknown kind");
+
+			if (file.fail())
+				throw std::runtime_error("Checkpoint " + filename + ": truncated");
+			return 1;
+		};
+	};
+
+	// Renders with periodic checkpoints & resumes render from existing checkpoint.
+	// Checkpoints are written by background thread, so workers never wait for disk:
+	//  tile render saves pixels of tiles finished so far every interval seconds,
+	//  progressive render hands over copy of accumulation between samples when
+	//  interval has passed and background thread has taken previous checkpoint.
+	class Checkpointer {
+
+		std::thread thread;
+		std::mutex mutex;
+		std::condition_variable wake;
+		bool stopping = 0;
+		// Checkpoint handed over by render thread
+		Checkpoint pending;
+		bool has_pending = 0;
+		// Builds checkpoint on background thread every interval, used by tile render
+		std::function<void(Checkpoint&)> producer;
+		// First error of background thread, thrown by render after it stops
+		std::string error;
+
+		std::atomic<int> written;
+		int resumed = 0;
+
+		void loop() {
+			std::unique_lock<std::mutex> lock(mutex);
+			Checkpoint current;
+
+			while (!stopping) {
+				auto ready = [this]() {
+					return stopping || has_pending;
+				};
+
+				// Without producer thread only waits for handed over checkpoints
+				bool timeout = 0;
+				if (producer)
+					timeout = !wake.wait_for(lock, std::chrono::duration<double>(interval), ready);
+				else
+					wake.wait(lock, ready);
+
+				bool produce = 0;
+				if (has_pending) {
+					std::swap(current, pending);
+					has_pending = 0;
+				} else if (timeout && producer)
+					produce = 1;
+				else
+					continue;
+
+				lock.unlock();
+				try {
+					if (produce)
+						producer(current);
+					current.save(filename);
+					written.fetch_add(1, std::memory_order_relaxed);
+				} catch (const std::exception& e) {
+					lock.lock();
+					if (error.empty())
+						error = e.what();
+					continue;
+				}
+				lock.lock();
+			}
+		};
+
+		void start(const std::function<void(Checkpoint&)>& produce) {
+			stopping = 0;
+			has_pending = 0;
+			error.clear();
+			producer = produce;
+			thread = std::thread(&Checkpointer::loop, this);
+		};
+
+		// Stop background thread, throws error of background writes
+		void stop() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = 1;
+			}
+			wake.notify_one();
+			thread.join();
+			producer = nullptr;
+
+			if (!error.empty())
+				throw std::runtime_error(error);
+		};
+
+		// Returns 1 if checkpoint matches current render
+		bool matches(const Checkpoint& c, CheckpointKind kind, int width, int height, int tile_size) {
+			return c.kind == kind && c.key == key && c.width == width && c.height == height && c.tile_size == tile_size;
+		};
+
+	public:
+
+		// Checkpoint file, directory must exist
+		std::string filename;
+		// Minimal time between checkpoints in seconds
+		double interval = 30.0;
+		// Identifies scene & settings, checkpoint with other key is ignored and overwritten
+		uint64_t key = 0;
+		// Remove checkpoint of tile render after frame is complete
+		bool remove_finished = 1;
+
+		Checkpointer(const std::string& filename) : written(0), filename(filename) {};
+
+		Checkpointer(const std::string& filename, double interval) : written(0), filename(filename), interval(interval) {};
+
+		Checkpointer(const Checkpointer&) = delete;
+		Checkpointer& operator=(const Checkpointer&) = delete;
+
+		// Number of checkpoints written during last render
+		inline int get_written() {
+			return written.load(std::memory_order_relaxed);
+		};
+
+		// Number of tiles or samples taken from checkpoint by last render
+		inline int get_resumed() {
+			return resumed;
+		};
+
+		// Render frame into buffer of width * height ABGR pixels resuming tiles
+		//  finished by previous run. Returns 1 if frame is complete, 0 if render
+		//  was cancelled, then checkpoint contains all finished tiles.
+		// Adaptive anti-aliasing renders frame in two passes and is not supported.
+		bool render(Renderer& renderer, unsigned int* frame) {
+			RayTrace& rt = renderer.get_raytrace();
+			if (rt.adaptive_aa)
+				throw std::runtime_error("Checkpoint of adaptive anti-aliasing render is not supported");
+
+			int width = rt.get_width();
+			int height = rt.get_height();
+			std::vector<Tile> tiles = renderer.make_tiles(width, height);
+
+			// Done flags are set by workers after tile pixels are written and read by background thread
+			std::unique_ptr<std::atomic<uint8_t>[]> done(new std::atomic<uint8_t>[tiles.size()]);
+			for (int i = 0; i < (int) tiles.size(); ++i)
+				done[i].store(0, std::memory_order_relaxed);
+
+			resumed = 0;
+			written.store(0);
+			renderer.skip_tiles.assign(tiles.size(), 0);
+
+			Checkpoint loaded;
+			if (loaded.load(filename) && matches(loaded, CheckpointKind::TILES, width, height, renderer.tile_size) && loaded.done.size() == tiles.size()) {
+				size_t offset = 0;
+				for (int i = 0; i < (int) tiles.size(); ++i) {
+					if (!loaded.done[i])
+						continue;
+
+					const Tile& t = tiles[i];
+					if (offset + (size_t) t.width * t.height > loaded.pixels.size())
+						throw std::runtime_error("Checkpoint " + filename + ": truncated");
+					for (int y = t.y; y < t.y + t.height; ++y, offset += t.width)
+						std::memcpy(&frame[(size_t) y * width + t.x], &loaded.pixels[offset], t.width * sizeof(unsigned int));
+
+					done[i].store(1, std::memory_order_relaxed);
+					renderer.skip_tiles[i] = 1;
+					++resumed;
+				}
+			}
+
+			// Copy pixels of done tiles, tiles in progress are not touched
+			auto snapshot = [&](Checkpoint& c) {
+				c.kind = CheckpointKind::TILES;
+				c.width = width;
+				c.height = height;
+				c.tile_size = renderer.tile_size;
+				c.samples = 0;
+				c.key = key;
+				c.done.assign(tiles.size(), 0);
+				c.pixels.clear();
+
+				for (int i = 0; i < (int) tiles.size(); ++i) {
+					if (!done[i].load(std::memory_order_acquire))
+						continue;
+
+					const Tile& t = tiles[i];
+					c.done[i] = 1;
+					for (int y = t.y; y < t.y + t.height; ++y)
+						c.pixels.insert(c.pixels.end(), &frame[(size_t) y * width + t.x], &frame[(size_t) y * width + t.x + t.width]);
+				}
+			};
+
+			std::function<void(const Tile&)> previous_on_tile = renderer.on_tile;
+			renderer.on_tile = [&done, &previous_on_tile](const Tile& t) {
+				done[t.id].store(1, std::memory_order_release);
+				if (previous_on_tile)
+					previous_on_tile(t);
+			};
+
+			start(snapshot);
+			bool finished = 0;
+			try {
+				finished = renderer.render(frame);
+			} catch (...) {
+				renderer.on_tile = previous_on_tile;
+				renderer.skip_tiles.clear();
+				stop();
+				throw;
+			}
+			renderer.on_tile = previous_on_tile;
+			renderer.skip_tiles.clear();
+			stop();
+
+			// Workers are stopped, final state is written on calling thread
+			if (finished && remove_finished) {
+				std::remove(filename.c_str());
+			} else {
+				Checkpoint c;
+				snapshot(c);
+				c.save(filename);
+				written.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			return finished;
+		};
+
+		// Add samples until max_samples per pixel are accumulated or time budget in seconds
+		//  is exceeded, resuming accumulation of previous run. Checkpoint is kept after
+		//  render, so following run can add more samples. Returns number of accumulated samples.
+		int render(ProgressiveRenderer& progressive, int max_samples, double time_budget = 0.0) {
+			typedef std::chrono::steady_clock clock;
+			RayTrace& rt = progressive.get_renderer().get_raytrace();
+			int width = rt.get_width();
+			int height = rt.get_height();
+
+			resumed = 0;
+			written.store(0);
+
+			Checkpoint loaded;
+			if (loaded.load(filename) && matches(loaded, CheckpointKind::ACCUMULATION, width, height, 0)) {
+				progressive.restore(loaded.accumulation, loaded.counts, loaded.samples);
+				resumed = loaded.samples;
+			}
+
+			auto snapshot = [&](Checkpoint& c) {
+				c.kind = CheckpointKind::ACCUMULATION;
+				c.width = width;
+				c.height = height;
+				c.tile_size = 0;
+				c.samples = progressive.get_samples();
+				c.key = key;
+				c.counts = progressive.get_counts();
+				c.accumulation = progressive.get_accumulation();
+			};
+
+			clock::time_point deadline = clock::time_point::max();
+			if (time_budget > 0.0)
+				deadline = clock::now() + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(time_budget));
+			clock::time_point last = clock::now();
+
+			start(nullptr);
+			try {
+				while (progressive.get_samples() < max_samples && progressive.add_sample(deadline)) {
+					if (std::chrono::duration<double>(clock::now() - last).count() < interval)
+						continue;
+
+					// Skip checkpoint if previous one is not taken by background thread yet
+					std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+					if (!lock.owns_lock() || has_pending)
+						continue;
+
+					snapshot(pending);
+					has_pending = 1;
+					last = clock::now();
+					lock.unlock();
+					wake.notify_one();
+				}
+			} catch (...) {
+				stop();
+				throw;
+			}
+			stop();
+
+			Checkpoint c;
+			snapshot(c);
+			c.save(filename);
+			written.fetch_add(1, std::memory_order_relaxed);
+
+			return progressive.get_samples();
+		};
+	};
+};
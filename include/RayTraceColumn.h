@@ -0,0 +1,146 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+namespace raytrace {
+
+	// Array of plain values used by compiled primitives, BVH & mesh buffers.
+	// Owns it's values or views external memory given to view(), e.g. memory mapped
+	//  scene file, so large arrays are used without copying. Values of view can be
+	//  changed in place, operations changing size copy them into own storage first.
+	template<typename T>
+	class Column {
+
+		std::vector<T> storage;
+		T* values = nullptr;
+		size_t count = 0;
+
+		// Copy viewed values into own storage before it's size changes
+		inline void own() {
+			if (is_view())
+				storage.assign(values, values + count);
+		};
+
+		inline void update() {
+			values = storage.data();
+			count = storage.size();
+		};
+
+	public:
+
+		typedef T value_type;
+
+		Column() {};
+
+		Column(const Column& c) : storage(c.begin(), c.end()) {
+			update();
+		};
+
+		Column& operator=(const Column& c) {
+			if (this != &c) {
+				storage.assign(c.begin(), c.end());
+				update();
+			}
+			return *this;
+		};
+
+		// Use count values at given address instead of own storage, memory must stay
+		//  valid until column is cleared or assigned
+		void view(T* external, size_t external_count) {
+			storage.clear();
+			storage.shrink_to_fit();
+			values = external;
+			count = external_count;
+		};
+
+		// Returns 1 if column views external memory
+		inline bool is_view() const {
+			return count && values != storage.data();
+		};
+
+		void clear() {
+			storage.clear();
+			update();
+		};
+
+		void assign(const T* first, const T* last) {
+			storage.assign(first, last);
+			update();
+		};
+
+		void assign(size_t n, const T& value) {
+			storage.assign(n, value);
+			update();
+		};
+
+		// Take values of vector without copying
+		void assign(std::vector<T>&& v) {
+			storage = std::move(v);
+			update();
+		};
+
+		void reserve(size_t n) {
+			own();
+			storage.reserve(n);
+			update();
+		};
+
+		void resize(size_t n) {
+			own();
+			storage.resize(n);
+			update();
+		};
+
+		void push_back(const T& value) {
+			own();
+			storage.push_back(value);
+			update();
+		};
+
+		inline size_t size() const {
+			return count;
+		};
+
+		// Number of values allocated by column, 0 for view
+		inline size_t capacity() const {
+			return storage.capacity();
+		};
+
+		inline bool empty() const {
+			return !count;
+		};
+
+		inline T* data() {
+			return values;
+		};
+
+		inline const T* data() const {
+			return values;
+		};
+
+		inline T* begin() {
+			return values;
+		};
+
+		inline T* end() {
+			return values + count;
+		};
+
+		inline const T* begin() const {
+			return values;
+		};
+
+		inline const T* end() const {
+			return values + count;
+		};
+
+		inline T& operator[](size_t i) {
+			return values[i];
+		};
+
+		inline const T& operator[](size_t i) const {
+			return values[i];
+		};
+	};
+};
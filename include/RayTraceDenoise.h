@@ -0,0 +1,567 @@
+#pragma once
+
+#include <cmath>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <limits>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+#include "RayTrace.h"
+#include "RayTraceSIMD.h"
+#include "RayTraceRenderer.h"
+
+namespace raytrace {
+
+	// Edge-aware denoiser of noisy renders, e.g. few random_diffuse_count samples.
+	// Filter is a-trous wavelet (Dammertz et al.) guided by noise free albedo, normal &
+	//  depth of first visible surface, traced separately through pixel centers:
+	//  1. Color is divided by albedo, so textures are not blurred, only irradiance.
+	//  2. Each iteration filters irradiance with 3x3 B-spline kernel with taps step
+	//     pixels apart, step doubles each iteration. Tap weight drops with normal
+	//     angle, depth difference relative to depth gradient & luminance difference
+	//     relative to estimated deviation of noise, which is filtered along.
+	//  3. Result is multiplied by albedo.
+	// Rows are split between threads, AVX2 kernel filters 8 pixels at once & performs
+	//  same operations as scalar kernel.
+	// Usage:
+	//  Denoiser denoiser;
+	//  denoiser.trace_guides(renderer); // Once per camera or scene change
+	//  denoiser.denoise(frame, output);
+	class Denoiser {
+
+		// Planes of one iteration shared by kernels
+		struct Pass {
+			const float* r;
+			const float* g;
+			const float* b;
+			const float* variance;
+			float* out_r;
+			float* out_g;
+			float* out_b;
+			float* out_variance;
+			const float* nx;
+			const float* ny;
+			const float* nz;
+			const float* depth;
+			const float* gradient;
+			int width, height;
+			int step;
+			int normal_exponent;
+			float sigma_depth, sigma_luminance;
+		};
+
+		typedef void (*RowKernel)(const Pass& p, int y, int x0, int x1);
+
+		int width = 0, height = 0;
+		// Guides, depth is 0 for background
+		std::vector<float> albedo[3];
+		std::vector<float> normal[3];
+		std::vector<float> depth;
+		// Depth change per pixel
+		std::vector<float> gradient;
+		// Factors from 8 bit color to irradiance & back, albedo below one step of 8 bit color is treated as white
+		std::vector<float> inverse_albedo[3];
+		std::vector<float> modulation[3];
+		// Luminance of noisy irradiance
+		std::vector<float> luma;
+		// Irradiance & it's variance, ping-pong between iterations
+		std::vector<float> color[2][3];
+		std::vector<float> variance[2];
+
+		// B-spline kernel weights of taps [dy + 1][dx + 1]
+		static inline float tap_weight(int dx, int dy) {
+			static const float H[3] = { 0.25f, 0.5f, 0.25f };
+			return H[dx + 1] * H[dy + 1];
+		};
+
+		static inline float luminance(float r, float g, float b) {
+			return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+		};
+
+		// exp(x) for x <= 0 with relative error below 1e-6, same polynomial is used by vector kernel
+		static inline float exp_negative(float x) {
+			x = std::max(x, -80.0f);
+			float t = x * 1.44269504f;
+			float i = std::floor(t);
+			float f = t - i;
+			float p = 0.001333355f;
+			p = p * f + 0.009618129f;
+			p = p * f + 0.05550411f;
+			p = p * f + 0.2402265f;
+			p = p * f + 0.6931472f;
+			p = p * f + 1.0f;
+			uint32_t bits = (uint32_t) ((int) i + 127) << 23;
+			float scale;
+			memcpy(&scale, &bits, sizeof(float));
+			return p * scale;
+		};
+
+		// Filter one pixel, taps outside of frame are skipped
+		static inline void filter_pixel(const Pass& p, int x, int y) {
+			size_t c = (size_t) y * p.width + x;
+			float step = p.step;
+
+			float l = luminance(p.r[c], p.g[c], p.b[c]);
+			float inv_depth = 1.0f / (p.sigma_depth * (p.gradient[c] * step) + (p.depth[c] * 0.001f + 1e-6f));
+			float inv_luminance = 1.0f / (p.sigma_luminance * std::sqrt(std::max(p.variance[c], 0.0f)) + 1e-6f);
+
+			float hc = tap_weight(0, 0);
+			float sum_w = hc;
+			float sum_r = p.r[c] * hc;
+			float sum_g = p.g[c] * hc;
+			float sum_b = p.b[c] * hc;
+			float sum_v = p.variance[c] * (hc * hc);
+
+			for (int dy = -1; dy <= 1; ++dy)
+				for (int dx = -1; dx <= 1; ++dx) {
+					if (!dx && !dy)
+						continue;
+					int qx = x + dx * p.step, qy = y + dy * p.step;
+					if (qx < 0 || qy < 0 || qx >= p.width || qy >= p.height)
+						continue;
+					size_t q = (size_t) qy * p.width + qx;
+
+					float d = (p.nx[c] * p.nx[q] + p.ny[c] * p.ny[q]) + p.nz[c] * p.nz[q];
+					d = d > 0.0f ? d : 0.0f;
+					for (int i = 0; i < p.normal_exponent; ++i)
+						d = d * d;
+
+					float lq = luminance(p.r[q], p.g[q], p.b[q]);
+					float e = -(std::fabs(p.depth[c] - p.depth[q]) * inv_depth + std::fabs(l - lq) * inv_luminance);
+					float w = (tap_weight(dx, dy) * d) * exp_negative(e);
+
+					sum_w = sum_w + w;
+					sum_r = sum_r + w * p.r[q];
+					sum_g = sum_g + w * p.g[q];
+					sum_b = sum_b + w * p.b[q];
+					sum_v = sum_v + (w * w) * p.variance[q];
+				}
+
+			p.out_r[c] = sum_r / sum_w;
+			p.out_g[c] = sum_g / sum_w;
+			p.out_b[c] = sum_b / sum_w;
+			p.out_variance[c] = sum_v / (sum_w * sum_w);
+		};
+
+		static void filter_row_scalar(const Pass& p, int y, int x0, int x1) {
+			for (int x = x0; x < x1; ++x)
+				filter_pixel(p, x, y);
+		};
+
+#ifdef RAYTRACE_SIMD_X86
+
+		RAYTRACE_TARGET("avx2")
+		static inline __m256 exp_negative_avx2(__m256 x) {
+			x = _mm256_max_ps(x, _mm256_set1_ps(-80.0f));
+			__m256 t = _mm256_mul_ps(x, _mm256_set1_ps(1.44269504f));
+			__m256 i = _mm256_floor_ps(t);
+			__m256 f = _mm256_sub_ps(t, i);
+			__m256 p = _mm256_set1_ps(0.001333355f);
+			p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(0.009618129f));
+			p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(0.05550411f));
+			p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(0.2402265f));
+			p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(0.6931472f));
+			p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(1.0f));
+			__m256i bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(i), _mm256_set1_epi32(127)), 23);
+			return _mm256_mul_ps(p, _mm256_castsi256_ps(bits));
+		};
+
+		RAYTRACE_TARGET("avx2")
+		static inline __m256 luminance_avx2(__m256 r, __m256 g, __m256 b) {
+			return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(0.2126f), r), _mm256_mul_ps(_mm256_set1_ps(0.7152f), g)), _mm256_mul_ps(_mm256_set1_ps(0.0722f), b));
+		};
+
+		// Filter pixels of row in blocks of 8, remaining pixels are filtered by scalar code.
+		// Taps outside of frame are loaded as zeros, so their normal & weight are zero.
+		RAYTRACE_TARGET("avx2")
+		static void filter_row_avx2(const Pass& p, int y, int x0, int x1) {
+			const __m256 sign = _mm256_set1_ps(-0.0f);
+			const __m256 zero = _mm256_setzero_ps();
+			const __m256 step = _mm256_set1_ps((float) p.step);
+			const __m256 sigma_depth = _mm256_set1_ps(p.sigma_depth);
+			const __m256 sigma_luminance = _mm256_set1_ps(p.sigma_luminance);
+			const __m256 hc = _mm256_set1_ps(tap_weight(0, 0));
+			const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+			const __m256i width = _mm256_set1_epi32(p.width);
+
+			int x = x0;
+			for (; x + 8 <= x1; x += 8) {
+				ptrdiff_t c = (ptrdiff_t) y * p.width + x;
+				__m256 r = _mm256_loadu_ps(p.r + c);
+				__m256 g = _mm256_loadu_ps(p.g + c);
+				__m256 b = _mm256_loadu_ps(p.b + c);
+				__m256 v = _mm256_loadu_ps(p.variance + c);
+				__m256 nx = _mm256_loadu_ps(p.nx + c);
+				__m256 ny = _mm256_loadu_ps(p.ny + c);
+				__m256 nz = _mm256_loadu_ps(p.nz + c);
+				__m256 z = _mm256_loadu_ps(p.depth + c);
+
+				__m256 l = luminance_avx2(r, g, b);
+				__m256 inv_depth = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_add_ps(_mm256_mul_ps(sigma_depth, _mm256_mul_ps(_mm256_loadu_ps(p.gradient + c), step)),
+																					  _mm256_add_ps(_mm256_mul_ps(z, _mm256_set1_ps(0.001f)), _mm256_set1_ps(1e-6f))));
+				__m256 inv_luminance = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_add_ps(_mm256_mul_ps(sigma_luminance, _mm256_sqrt_ps(_mm256_max_ps(v, zero))), _mm256_set1_ps(1e-6f)));
+
+				__m256 sum_w = hc;
+				__m256 sum_r = _mm256_mul_ps(r, hc);
+				__m256 sum_g = _mm256_mul_ps(g, hc);
+				__m256 sum_b = _mm256_mul_ps(b, hc);
+				__m256 sum_v = _mm256_mul_ps(v, _mm256_mul_ps(hc, hc));
+
+				for (int dy = -1; dy <= 1; ++dy) {
+					int qy = y + dy * p.step;
+					if (qy < 0 || qy >= p.height)
+						continue;
+
+					for (int dx = -1; dx <= 1; ++dx) {
+						if (!dx && !dy)
+							continue;
+						int qx = x + dx * p.step;
+						ptrdiff_t q = (ptrdiff_t) qy * p.width + qx;
+
+						__m256 qr, qg, qb, qnx, qny, qnz, qz, qv;
+						if (qx >= 0 && qx + 8 <= p.width) {
+							qr = _mm256_loadu_ps(p.r + q);
+							qg = _mm256_loadu_ps(p.g + q);
+							qb = _mm256_loadu_ps(p.b + q);
+							qnx = _mm256_loadu_ps(p.nx + q);
+							qny = _mm256_loadu_ps(p.ny + q);
+							qnz = _mm256_loadu_ps(p.nz + q);
+							qz = _mm256_loadu_ps(p.depth + q);
+							qv = _mm256_loadu_ps(p.variance + q);
+						} else {
+							// Lanes with 0 <= qx + lane < width
+							__m256i column = _mm256_add_epi32(_mm256_set1_epi32(qx), lanes);
+							__m256i inside = _mm256_andnot_si256(_mm256_cmpgt_epi32(_mm256_setzero_si256(), column), _mm256_cmpgt_epi32(width, column));
+							qr = _mm256_maskload_ps(p.r + q, inside);
+							qg = _mm256_maskload_ps(p.g + q, inside);
+							qb = _mm256_maskload_ps(p.b + q, inside);
+							qnx = _mm256_maskload_ps(p.nx + q, inside);
+							qny = _mm256_maskload_ps(p.ny + q, inside);
+							qnz = _mm256_maskload_ps(p.nz + q, inside);
+							qz = _mm256_maskload_ps(p.depth + q, inside);
+							qv = _mm256_maskload_ps(p.variance + q, inside);
+						}
+
+						__m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, qnx), _mm256_mul_ps(ny, qny)), _mm256_mul_ps(nz, qnz));
+						d = _mm256_max_ps(d, zero);
+						for (int i = 0; i < p.normal_exponent; ++i)
+							d = _mm256_mul_ps(d, d);
+
+						__m256 lq = luminance_avx2(qr, qg, qb);
+						__m256 dz = _mm256_andnot_ps(sign, _mm256_sub_ps(z, qz));
+						__m256 dl = _mm256_andnot_ps(sign, _mm256_sub_ps(l, lq));
+						__m256 e = _mm256_xor_ps(sign, _mm256_add_ps(_mm256_mul_ps(dz, inv_depth), _mm256_mul_ps(dl, inv_luminance)));
+						__m256 w = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(tap_weight(dx, dy)), d), exp_negative_avx2(e));
+
+						sum_w = _mm256_add_ps(sum_w, w);
+						sum_r = _mm256_add_ps(sum_r, _mm256_mul_ps(w, qr));
+						sum_g = _mm256_add_ps(sum_g, _mm256_mul_ps(w, qg));
+						sum_b = _mm256_add_ps(sum_b, _mm256_mul_ps(w, qb));
+						sum_v = _mm256_add_ps(sum_v, _mm256_mul_ps(_mm256_mul_ps(w, w), qv));
+					}
+				}
+
+				_mm256_storeu_ps(p.out_r + c, _mm256_div_ps(sum_r, sum_w));
+				_mm256_storeu_ps(p.out_g + c, _mm256_div_ps(sum_g, sum_w));
+				_mm256_storeu_ps(p.out_b + c, _mm256_div_ps(sum_b, sum_w));
+				_mm256_storeu_ps(p.out_variance + c, _mm256_div_ps(sum_v, _mm256_mul_ps(sum_w, sum_w)));
+			}
+
+			filter_row_scalar(p, y, x, x1);
+		};
+
+#endif
+
+		RowKernel kernel() {
+#ifdef RAYTRACE_SIMD_X86
+			__builtin_cpu_init();
+			if (level >= simd::AVX2 && __builtin_cpu_supports("avx2"))
+				return filter_row_avx2;
+#endif
+			return filter_row_scalar;
+		};
+
+		// Flushes denormals to zero in scope. Weights of distant taps fall into denormal
+		//  range & would make arithmetic of both kernels many times slower.
+		struct FlushDenormals {
+#ifdef RAYTRACE_SIMD_X86
+			unsigned int csr;
+
+			FlushDenormals() : csr(_mm_getcsr()) {
+				_mm_setcsr(csr | 0x8040);
+			};
+
+			~FlushDenormals() {
+				_mm_setcsr(csr);
+			};
+#endif
+		};
+
+		// Run func(begin_row, end_row) on rows split between threads
+		template<typename F>
+		void parallel_rows(F func) {
+			int count = thread_count > 0 ? thread_count : std::thread::hardware_concurrency();
+			count = std::max(1, std::min(count, height));
+			auto run = [&func](int begin, int end) {
+				FlushDenormals flush;
+				func(begin, end);
+			};
+
+			if (count == 1) {
+				run(0, height);
+				return;
+			}
+
+			std::vector<std::thread> threads;
+			for (int i = 0; i < count; ++i)
+				threads.emplace_back(run, height * i / count, height * (i + 1) / count);
+			for (std::thread& t : threads)
+				t.join();
+		};
+
+	public:
+
+		// Number of filter iterations, filtered footprint spans 2^(iterations + 1) - 1 pixels
+		int iterations = 4;
+		// Normal weight is max(0, dot(n, nq))^(2^normal_exponent)
+		int normal_exponent = 7;
+		// Allowed depth difference in units of depth change over tap distance
+		float sigma_depth = 1.0f;
+		// Allowed luminance difference in units of deviation of noise
+		float sigma_luminance = 4.0f;
+		// Number of filter threads, 0 for number of hardware threads
+		int thread_count = 0;
+		// Highest instruction set used by filter
+		simd::Level level = simd::AVX2;
+
+		inline int get_width() {
+			return width;
+		};
+
+		inline int get_height() {
+			return height;
+		};
+
+		// Trace guides of current camera & scene on renderer threads
+		void trace_guides(Renderer& renderer) {
+			RayTrace& rt = renderer.get_raytrace();
+			width = rt.get_width();
+			height = rt.get_height();
+			size_t size = (size_t) width * height;
+
+			for (int i = 0; i < 3; ++i) {
+				albedo[i].assign(size, 0.0f);
+				normal[i].assign(size, 0.0f);
+			}
+			depth.assign(size, 0.0f);
+
+			renderer.run([&](const Tile& t, int) {
+				for (int y = t.y; y < t.y + t.height; ++y)
+					for (int x = t.x; x < t.x + t.width; ++x) {
+						spaint::Color a;
+						cppmath::vec3 n;
+						double distance;
+						if (!rt.get_scene().first_surface(rt.frame_ray(x, y), a, n, distance))
+							continue;
+
+						size_t i = (size_t) y * width + x;
+						albedo[0][i] = std::min(a.r, 255) / 255.0f;
+						albedo[1][i] = std::min(a.g, 255) / 255.0f;
+						albedo[2][i] = std::min(a.b, 255) / 255.0f;
+						if (n.len2() > 0.0)
+							n = n.norm();
+						normal[0][i] = n.x;
+						normal[1][i] = n.y;
+						normal[2][i] = n.z;
+						depth[i] = distance;
+					}
+			});
+
+			for (int k = 0; k < 3; ++k) {
+				inverse_albedo[k].resize(size);
+				modulation[k].resize(size);
+				for (size_t i = 0; i < size; ++i) {
+					bool white = albedo[k][i] <= 1.0f / 255.0f;
+					inverse_albedo[k][i] = white ? 1.0f / 255.0f : 1.0f / (255.0f * albedo[k][i]);
+					modulation[k][i] = white ? 255.0f : 255.0f * albedo[k][i];
+				}
+			}
+
+			// Largest depth change to neighbour pixel on same kind of surface
+			gradient.assign(size, 0.0f);
+			parallel_rows([this](int begin, int end) {
+				for (int y = begin; y < end; ++y)
+					for (int x = 0; x < width; ++x) {
+						size_t i = (size_t) y * width + x;
+						if (depth[i] == 0.0f)
+							continue;
+						float g = 0.0f;
+						if (x > 0 && depth[i - 1] != 0.0f)
+							g = std::max(g, std::fabs(depth[i] - depth[i - 1]));
+						if (x + 1 < width && depth[i + 1] != 0.0f)
+							g = std::max(g, std::fabs(depth[i] - depth[i + 1]));
+						if (y > 0 && depth[i - width] != 0.0f)
+							g = std::max(g, std::fabs(depth[i] - depth[i - width]));
+						if (y + 1 < height && depth[i + width] != 0.0f)
+							g = std::max(g, std::fabs(depth[i] - depth[i + width]));
+						gradient[i] = g;
+					}
+			});
+		};
+
+		// Guides as ABGR images: albedo, normal mapped to [0, 255] & depth scaled by farthest surface
+		void get_guides(unsigned int* albedo_image, unsigned int* normal_image, unsigned int* depth_image) {
+			float far = 0.0f;
+			for (float z : depth)
+				far = std::max(far, z);
+
+			auto pack = [](float r, float g, float b) -> unsigned int {
+				auto c = [](float v) -> unsigned int { return (unsigned int) std::min(std::max(v * 255.0f + 0.5f, 0.0f), 255.0f); };
+				return 0xFF000000u | c(b) << 16 | c(g) << 8 | c(r);
+			};
+
+			for (size_t i = 0; i < depth.size(); ++i) {
+				if (albedo_image)
+					albedo_image[i] = pack(albedo[0][i], albedo[1][i], albedo[2][i]);
+				if (normal_image)
+					normal_image[i] = depth[i] == 0.0f ? 0xFF000000u : pack(normal[0][i] * 0.5f + 0.5f, normal[1][i] * 0.5f + 0.5f, normal[2][i] * 0.5f + 0.5f);
+				if (depth_image) {
+					float z = far > 0.0f && depth[i] != 0.0f ? 1.0f - depth[i] / far : 0.0f;
+					depth_image[i] = pack(z, z, z);
+				}
+			}
+		};
+
+		// Denoise ABGR frame of guides size into output, output can be same as frame.
+		// Throws std::runtime_error if guides were not traced.
+		void denoise(const unsigned int* frame, unsigned int* output) {
+			if (!width || !height)
+				throw std::runtime_error("Denoiser guides are not traced");
+
+			size_t size = (size_t) width * height;
+			for (int k = 0; k < 2; ++k) {
+				for (int i = 0; i < 3; ++i)
+					color[k][i].resize(size);
+				variance[k].resize(size);
+			}
+
+			// Irradiance & it's luminance, albedo below one step of 8 bit color is treated as white
+			luma.resize(size);
+			parallel_rows([this, frame](int begin, int end) {
+				for (size_t i = (size_t) begin * width; i < (size_t) end * width; ++i) {
+					unsigned int pixel = frame[i];
+					float c[3] = { (float) (pixel & 0xFF), (float) ((pixel >> 8) & 0xFF), (float) ((pixel >> 16) & 0xFF) };
+					for (int k = 0; k < 3; ++k)
+						color[0][k][i] = c[k] * inverse_albedo[k][i];
+					luma[i] = luminance(color[0][0][i], color[0][1][i], color[0][2][i]);
+				}
+			});
+
+			// Initial variance of luminance is variance of 3x3 neighbourhood. Real edges of
+			//  irradiance, like shadow borders, raise it & would be blurred, so it is limited
+			//  by noise level of frame: mean over surfaces of smallest variance of 2x2 windows
+			//  containing pixel. Window on one side of edge exists for most pixels.
+			std::vector<double> row_noise(height, 0.0);
+			std::vector<int> row_surfaces(height, 0);
+
+			// Variance of 2x2 window with top left pixel (x, y)
+			std::vector<float>& windows = variance[1];
+			parallel_rows([this, &windows](int begin, int end) {
+				for (int y = begin; y < std::min(end, height - 1); ++y) {
+					const float* top = &luma[(size_t) y * width];
+					const float* bottom = top + width;
+					float* out = &windows[(size_t) y * width];
+					for (int x = 0; x + 1 < width; ++x) {
+						float m = ((top[x] + top[x + 1]) + (bottom[x] + bottom[x + 1])) * 0.25f;
+						float a = top[x] - m, b = top[x + 1] - m, c = bottom[x] - m, d = bottom[x + 1] - m;
+						out[x] = ((a * a + b * b) + (c * c + d * d)) * (1.0f / 3.0f);
+					}
+				}
+			});
+
+			parallel_rows([this, &windows, &row_noise, &row_surfaces](int begin, int end) {
+				// Sums of luminance & it's square over rows of neighbourhood by column
+				std::vector<float> column(width), column2(width);
+				for (int y = begin; y < end; ++y) {
+					int top = std::max(y - 1, 0), bottom = std::min(y + 1, height - 1);
+					float rows = bottom - top + 1;
+					std::fill(column.begin(), column.end(), 0.0f);
+					std::fill(column2.begin(), column2.end(), 0.0f);
+					for (int qy = top; qy <= bottom; ++qy) {
+						const float* l = &luma[(size_t) qy * width];
+						for (int x = 0; x < width; ++x) {
+							column[x] += l[x];
+							column2[x] += l[x] * l[x];
+						}
+					}
+
+					float* out = &variance[0][(size_t) y * width];
+					for (int x = 0; x < width; ++x) {
+						int left = std::max(x - 1, 0), right = std::min(x + 1, width - 1);
+						float sum = column[left] + (x != left ? column[x] : 0.0f) + (x != right ? column[right] : 0.0f);
+						float sum2 = column2[left] + (x != left ? column2[x] : 0.0f) + (x != right ? column2[right] : 0.0f);
+						float count = rows * (right - left + 1);
+						float mean = sum / count;
+						out[x] = std::max(sum2 / count - mean * mean, 0.0f);
+					}
+
+					if (width < 2 || height < 2)
+						continue;
+					int wy0 = std::max(y - 1, 0), wy1 = std::min(y, height - 2);
+					for (int x = 0; x < width; ++x) {
+						if (depth[(size_t) y * width + x] == 0.0f)
+							continue;
+						int wx0 = std::max(x - 1, 0), wx1 = std::min(x, width - 2);
+						const float* w0 = &windows[(size_t) wy0 * width];
+						const float* w1 = &windows[(size_t) wy1 * width];
+						row_noise[y] += std::min(std::min(w0[wx0], w0[wx1]), std::min(w1[wx0], w1[wx1]));
+						++row_surfaces[y];
+					}
+				}
+			});
+
+			double noise = 0.0;
+			long surfaces = 0;
+			for (int y = 0; y < height; ++y) {
+				noise += row_noise[y];
+				surfaces += row_surfaces[y];
+			}
+			float limit = surfaces ? noise / surfaces : 0.0f;
+			parallel_rows([this, limit](int begin, int end) {
+				for (size_t i = (size_t) begin * width; i < (size_t) end * width; ++i)
+					variance[0][i] = std::min(variance[0][i], limit);
+			});
+
+			RowKernel filter_row = kernel();
+			int source = 0;
+			for (int iteration = 0; iteration < iterations; ++iteration) {
+				int target = source ^ 1;
+				Pass p = {
+					color[source][0].data(), color[source][1].data(), color[source][2].data(), variance[source].data(),
+					color[target][0].data(), color[target][1].data(), color[target][2].data(), variance[target].data(),
+					normal[0].data(), normal[1].data(), normal[2].data(), depth.data(), gradient.data(),
+					width, height, 1 << iteration, normal_exponent, sigma_depth, sigma_luminance
+				};
+
+				parallel_rows([&p, filter_row, this](int begin, int end) {
+					for (int y = begin; y < end; ++y)
+						filter_row(p, y, 0, width);
+				});
+				source = target;
+			}
+
+			// Multiply by albedo back
+			parallel_rows([this, source, output](int begin, int end) {
+				for (size_t i = (size_t) begin * width; i < (size_t) end * width; ++i) {
+					unsigned int c[3];
+					for (int k = 0; k < 3; ++k)
+						c[k] = (unsigned int) std::min(std::max(color[source][k][i] * modulation[k][i] + 0.5f, 0.0f), 255.0f);
+					output[i] = 0xFF000000u | c[2] << 16 | c[1] << 8 | c[0];
+				}
+			});
+		};
+	};
+};
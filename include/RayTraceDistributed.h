@@ -0,0 +1,646 @@
+#pragma once
+
+#include <map>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+#include "MappedFile.h"
+#include "RayTrace.h"
+#include "RayTraceRenderer.h"
+#include "RayTraceSceneFile.h"
+
+namespace raytrace {
+
+	// Messages between DistributedRenderer & it's workers over stream socket or pipes.
+	// Stored in native byte order, so both sides must run on same platform:
+	//  MESSAGE := TYPE[4B] + FRAME[4B] + SIZE[8B] + PAYLOAD[SIZE]
+	//  SCENE payload := scene file written by SceneFile::save()
+	//  TILE payload := Tile
+	//  RESULT payload := Tile + ABGR[4B][t.width * t.height]
+	//  ERROR payload := message text
+	// Payload size is checked against limit of message type before it is allocated.
+	namespace distributed {
+
+		// Default limit of SCENE payload accepted by worker
+		static const uint64_t MAX_SCENE_SIZE = 1ull << 32;
+		// Limit of ERROR payload accepted by coordinator
+		static const uint64_t MAX_ERROR_SIZE = 1 << 16;
+
+		enum MessageType : uint32_t {
+			// Coordinator to worker
+			SCENE = 1,
+			TILE = 2,
+			QUIT = 3,
+			// Worker to coordinator
+			READY = 4,
+			RESULT = 5,
+			ERROR = 6
+		};
+
+		struct MessageHeader {
+			uint32_t type;
+			// Frame of tile, results of previous frames are ignored
+			uint32_t frame;
+			uint64_t size;
+		};
+
+		// Read exactly size bytes, returns 0 on end of stream or error
+		inline bool read_all(int fd, void* data, size_t size) {
+			char* p = (char*) data;
+			while (size) {
+				ssize_t n = ::read(fd, p, size);
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n <= 0)
+					return 0;
+				p += n;
+				size -= n;
+			}
+			return 1;
+		};
+
+		// Write all bytes, returns 0 if peer is gone. Sockets are written without
+		//  SIGPIPE, so dead worker does not kill coordinator.
+		inline bool write_all(int fd, const void* data, size_t size) {
+			const char* p = (const char*) data;
+			while (size) {
+				ssize_t n = ::send(fd, p, size, MSG_NOSIGNAL);
+				if (n < 0 && errno == ENOTSOCK)
+					n = ::write(fd, p, size);
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n <= 0)
+					return 0;
+				p += n;
+				size -= n;
+			}
+			return 1;
+		};
+
+		inline bool write_message(int fd, uint32_t type, uint32_t frame, const void* a, size_t a_size, const void* b = nullptr, size_t b_size = 0) {
+			MessageHeader header = { type, frame, a_size + b_size };
+			return write_all(fd, &header, sizeof(header)) && write_all(fd, a, a_size) && write_all(fd, b, b_size);
+		};
+
+		// Temporary file in TMPDIR or /tmp, returns it's name
+		inline std::string temporary_file(const char* prefix, int& fd) {
+			const char* directory = getenv("TMPDIR");
+			std::string name = std::string(directory && *directory ? directory : "/tmp") + "/" + prefix + "XXXXXX";
+			std::vector<char> buffer(name.begin(), name.end());
+			buffer.push_back(0);
+			fd = mkstemp(buffer.data());
+			if (fd == -1)
+				throw std::runtime_error("Temporary file " + name + ": create failed");
+			return std::string(buffer.data());
+		};
+	};
+
+	// Worker process of distributed render.
+	// Receives scene file once, loads it with SceneFile::load() & renders tiles
+	//  requested by coordinator with library renderer until QUIT or end of stream.
+	// Can run in forked process or in separate program on other host with it's
+	//  stdin & stdout connected to coordinator, e.g. through ssh.
+	// Malformed or too large message is answered with ERROR & ends serving.
+	class DistributedWorker {
+
+	public:
+
+		// Serve coordinator, scene files larger than max_scene_size bytes are rejected
+		static void serve(int in_fd, int out_fd, uint64_t max_scene_size = distributed::MAX_SCENE_SIZE) {
+			using namespace distributed;
+
+			std::unique_ptr<RayTrace> rt;
+			std::unique_ptr<Renderer> renderer;
+			std::vector<unsigned int> pixels;
+			std::vector<char> payload;
+
+			MessageHeader header;
+			while (read_all(in_fd, &header, sizeof(header))) {
+				if (header.type == QUIT)
+					return;
+
+				try {
+					if (header.type != SCENE && header.type != TILE)
+						throw std::runtime_error("Unknown message type " + std::to_string(header.type));
+					if (header.size > (header.type == SCENE ? max_scene_size : sizeof(Tile)))
+						throw std::runtime_error("Message of type " + std::to_string(header.type) + " is too large");
+
+					payload.resize(header.size);
+					if (!read_all(in_fd, payload.data(), payload.size()))
+						return;
+
+					if (header.type == SCENE) {
+						// Scene file is mapped, so it is stored into file & removed after load
+						int fd;
+						std::string filename = temporary_file("raytrace_scene_", fd);
+						bool written = write_all(fd, payload.data(), payload.size());
+						::close(fd);
+						std::vector<char>().swap(payload);
+
+						renderer.reset();
+						rt.reset(new RayTrace());
+						try {
+							if (!written)
+								throw std::runtime_error("Scene file " + filename + ": write failed");
+							SceneFile::load(filename, *rt);
+						} catch (...) {
+							std::remove(filename.c_str());
+							throw;
+						}
+						std::remove(filename.c_str());
+
+						rt->update_camera();
+						renderer.reset(new Renderer(*rt, 1));
+						if (!write_message(out_fd, READY, header.frame, nullptr, 0))
+							return;
+
+					} else if (header.type == TILE) {
+						if (!renderer)
+							throw std::runtime_error("Tile requested before scene");
+						if (payload.size() != sizeof(Tile))
+							throw std::runtime_error("Malformed tile message");
+
+						Tile t;
+						memcpy(&t, payload.data(), sizeof(Tile));
+						if (t.x < 0 || t.y < 0 || t.width <= 0 || t.height <= 0 || t.x + t.width > rt->get_width() || t.y + t.height > rt->get_height())
+							throw std::runtime_error("Tile is outside of frame");
+
+						pixels.resize((size_t) t.width * t.height);
+						renderer->trace_tile(t, pixels.data(), t.width);
+						if (!write_message(out_fd, RESULT, header.frame, &t, sizeof(Tile), pixels.data(), pixels.size() * sizeof(unsigned int)))
+							return;
+					}
+
+				} catch (const std::exception& e) {
+					std::string message = e.what();
+					write_message(out_fd, ERROR, header.frame, message.data(), message.size());
+					return;
+				}
+			}
+		};
+	};
+
+	// Coordinator of frame render spread over worker processes.
+	// Scene is serialized with SceneFile & sent once to each worker, then workers
+	//  are fed with tiles, keeping in_flight tiles queued on each worker to hide
+	//  latency. Results are assembled into frame or passed to TileSink.
+	// Rebalancing: worker which runs out of tiles renders copy of oldest tile still
+	//  rendered by other worker, first result wins, so slow or stalled worker does
+	//  not delay end of frame. Tiles of dead worker are handed out again.
+	// Workers are separate processes with own address space, connected by sockets.
+	class DistributedRenderer {
+
+		struct Worker {
+			int fd = -1;
+			// Process id of spawned worker, 0 for added connection
+			pid_t pid = 0;
+			bool alive = 1;
+			// Tiles sent & not answered yet with time of sending
+			std::deque<std::pair<int, std::chrono::steady_clock::time_point>> queue;
+			int rendered = 0;
+		};
+
+		RayTrace& rt;
+		std::vector<Worker> workers;
+		// Scene was sent to workers, cleared by send_scene() on failure
+		bool scene_sent = 0;
+		// Number of current frame, results of other frames are ignored
+		uint32_t frame_id = 0;
+		std::atomic<bool> cancelled;
+		int duplicated_tiles = 0;
+		// Limit of RESULT payload, covers largest tile of frames rendered so far
+		uint64_t max_result_size = sizeof(Tile);
+
+		// Close worker & mark it dead, it's tiles are handed out again
+		void drop(Worker& w) {
+			if (w.fd != -1)
+				::close(w.fd);
+			w.fd = -1;
+			w.alive = 0;
+		};
+
+		int alive_count() {
+			int count = 0;
+			for (const Worker& w : workers)
+				count += w.alive;
+			return count;
+		};
+
+		// Read next message of worker, returns 0 if worker is gone.
+		// Throws on ERROR message. Worker sending unknown or too large message is dropped
+		//  before payload is allocated & std::runtime_error is thrown.
+		bool receive(Worker& w, distributed::MessageHeader& header, std::vector<char>& payload) {
+			using namespace distributed;
+			if (!read_all(w.fd, &header, sizeof(header))) {
+				drop(w);
+				return 0;
+			}
+
+			uint64_t limit;
+			if (header.type == READY)
+				limit = 0;
+			else if (header.type == RESULT)
+				limit = max_result_size;
+			else if (header.type == ERROR)
+				limit = MAX_ERROR_SIZE;
+			else {
+				drop(w);
+				throw std::runtime_error("Unknown worker message type " + std::to_string(header.type));
+			}
+			if (header.size > limit) {
+				drop(w);
+				throw std::runtime_error("Worker message of type " + std::to_string(header.type) + " is too large");
+			}
+
+			payload.resize(header.size);
+			if (!read_all(w.fd, payload.data(), payload.size())) {
+				drop(w);
+				return 0;
+			}
+
+			if (header.type == ERROR)
+				throw std::runtime_error("Worker failed: " + std::string(payload.begin(), payload.end()));
+			return 1;
+		};
+
+	public:
+
+		// Tiles sent ahead to each worker
+		int in_flight = 2;
+		// Size of tile side in pixels
+		int tile_size = 32;
+
+		DistributedRenderer(RayTrace& rt) : rt(rt), cancelled(0) {};
+
+		DistributedRenderer(const DistributedRenderer&) = delete;
+		DistributedRenderer& operator=(const DistributedRenderer&) = delete;
+
+		~DistributedRenderer() {
+			for (Worker& w : workers) {
+				if (w.alive)
+					distributed::write_message(w.fd, distributed::QUIT, frame_id, nullptr, 0);
+				drop(w);
+			}
+			for (Worker& w : workers)
+				if (w.pid > 0)
+					waitpid(w.pid, nullptr, 0);
+		};
+
+		// Fork count local worker processes connected by socket pairs.
+		// Must be called before starting threads, children run only DistributedWorker::serve().
+		void spawn(int count) {
+			for (int i = 0; i < count; ++i) {
+				int fds[2];
+				if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+					throw std::runtime_error("Worker socket create failed");
+
+				fflush(nullptr);
+				pid_t pid = fork();
+				if (pid == -1) {
+					::close(fds[0]);
+					::close(fds[1]);
+					throw std::runtime_error("Worker fork failed");
+				}
+
+				if (pid == 0) {
+					// Child keeps only it's own end of connection
+					::close(fds[0]);
+					for (Worker& w : workers)
+						if (w.fd != -1)
+							::close(w.fd);
+					DistributedWorker::serve(fds[1], fds[1]);
+					_exit(0);
+				}
+
+				::close(fds[1]);
+				Worker w;
+				w.fd = fds[0];
+				w.pid = pid;
+				workers.push_back(w);
+				scene_sent = 0;
+			}
+		};
+
+		// Start worker program, e.g. { "ssh", "host", "worker", "--serve" }, connected
+		//  by it's stdin & stdout. Program must call DistributedWorker::serve(0, 1).
+		void spawn(const std::vector<std::string>& command) {
+			if (command.empty())
+				throw std::runtime_error("Empty worker command");
+
+			int fds[2];
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+				throw std::runtime_error("Worker socket create failed");
+
+			std::vector<char*> argv;
+			for (const std::string& s : command)
+				argv.push_back((char*) s.c_str());
+			argv.push_back(nullptr);
+
+			fflush(nullptr);
+			pid_t pid = fork();
+			if (pid == -1) {
+				::close(fds[0]);
+				::close(fds[1]);
+				throw std::runtime_error("Worker fork failed");
+			}
+
+			if (pid == 0) {
+				::close(fds[0]);
+				for (Worker& w : workers)
+					if (w.fd != -1)
+						::close(w.fd);
+				dup2(fds[1], 0);
+				dup2(fds[1], 1);
+				if (fds[1] > 1)
+					::close(fds[1]);
+				execvp(argv[0], argv.data());
+				_exit(127);
+			}
+
+			::close(fds[1]);
+			Worker w;
+			w.fd = fds[0];
+			w.pid = pid;
+			workers.push_back(w);
+			scene_sent = 0;
+		};
+
+		// Use already connected bidirectional stream, e.g. TCP socket to remote worker.
+		// Renderer owns fd & closes it.
+		void add_worker(int fd) {
+			Worker w;
+			w.fd = fd;
+			workers.push_back(w);
+			scene_sent = 0;
+		};
+
+		inline int get_worker_count() {
+			return alive_count();
+		};
+
+		// Number of tiles each worker finished first in last frame
+		std::vector<int> get_rendered_tiles() {
+			std::vector<int> result;
+			for (const Worker& w : workers)
+				result.push_back(w.rendered);
+			return result;
+		};
+
+		// Number of tiles sent to second worker by rebalancing in last frame
+		inline int get_duplicated_tiles() {
+			return duplicated_tiles;
+		};
+
+		// Stop running render(), can be called from any thread
+		inline void cancel() {
+			cancelled.store(1);
+		};
+
+		// Serialize scene & camera and send them to all workers, waits until workers load it.
+		// Called by render() once, must be called again after scene or camera change.
+		void send_scene() {
+			using namespace distributed;
+			scene_sent = 0;
+
+			int fd;
+			std::string filename = temporary_file("raytrace_scene_", fd);
+			::close(fd);
+
+			std::shared_ptr<MappedFile> file;
+			try {
+				SceneFile::save(filename, rt);
+				file = std::make_shared<MappedFile>(filename);
+			} catch (...) {
+				std::remove(filename.c_str());
+				throw;
+			}
+			std::remove(filename.c_str());
+
+			++frame_id;
+			for (Worker& w : workers)
+				if (w.alive && !write_message(w.fd, SCENE, frame_id, file->data(), file->size()))
+					drop(w);
+
+			MessageHeader header;
+			std::vector<char> payload;
+			for (Worker& w : workers)
+				while (w.alive && receive(w, header, payload))
+					if (header.type == READY && header.frame == frame_id)
+						break;
+
+			if (!alive_count())
+				throw std::runtime_error("No workers to render scene");
+			scene_sent = 1;
+		};
+
+		// Render frame tile by tile on workers into sink.
+		// Ordered sinks receive tiles in order of rows, results arriving early are held
+		//  & tiles are handed out only within window ahead of first missing tile.
+		// Returns 1 if frame is finished, 0 if render was cancelled.
+		// Throws std::runtime_error if worker reports error or all workers are gone.
+		bool render(TileSink& sink) {
+			using namespace distributed;
+			typedef std::chrono::steady_clock clock;
+
+			if (!scene_sent)
+				send_scene();
+
+			Renderer splitter(rt);
+			splitter.tile_size = tile_size > 0 ? tile_size : 1;
+			std::vector<Tile> tiles = splitter.make_tiles(rt.get_width(), rt.get_height());
+			for (const Tile& t : tiles)
+				max_result_size = std::max<uint64_t>(max_result_size, sizeof(Tile) + (uint64_t) t.width * t.height * sizeof(unsigned int));
+			int depth = std::max(in_flight, 1);
+
+			++frame_id;
+			cancelled.store(0);
+			duplicated_tiles = 0;
+			for (Worker& w : workers) {
+				w.queue.clear();
+				w.rendered = 0;
+			}
+
+			sink.begin(rt.get_width(), rt.get_height(), splitter.tile_size);
+
+			bool ordered = sink.ordered();
+			int tiles_per_row = (rt.get_width() + splitter.tile_size - 1) / splitter.tile_size;
+			int window = ordered ? std::max<int>(2 * tiles_per_row, 4 * workers.size() * depth) : tiles.size();
+
+			std::vector<uint8_t> done(tiles.size(), 0);
+			// Number of workers rendering each tile
+			std::vector<uint8_t> copies(tiles.size(), 0);
+			// Tiles of dead workers
+			std::deque<int> returned;
+			// Results of ordered sink waiting for earlier tiles
+			std::map<int, std::vector<unsigned int>> held;
+			int next_tile = 0, first_missing = 0, finished = 0;
+
+			// Next tile for worker: returned tile, new tile within window or copy of oldest tile of other worker
+			auto pick = [&](Worker& w) -> int {
+				while (!returned.empty()) {
+					int t = returned.front();
+					returned.pop_front();
+					if (!done[t])
+						return t;
+				}
+				if (next_tile < (int) tiles.size() && next_tile < first_missing + window)
+					return next_tile++;
+				if (!w.queue.empty())
+					return -1;
+
+				int oldest = -1;
+				clock::time_point oldest_time = clock::time_point::max();
+				for (Worker& other : workers)
+					for (auto& q : other.queue)
+						if (!done[q.first] && copies[q.first] < 2 && q.second < oldest_time) {
+							oldest = q.first;
+							oldest_time = q.second;
+						}
+				if (oldest != -1)
+					++duplicated_tiles;
+				return oldest;
+			};
+
+			MessageHeader header;
+			std::vector<char> payload;
+			std::vector<pollfd> fds;
+			std::vector<Worker*> polled;
+
+			while (finished < (int) tiles.size()) {
+				if (cancelled.load())
+					return 0;
+
+				for (Worker& w : workers)
+					while (w.alive && (int) w.queue.size() < depth) {
+						int t = pick(w);
+						if (t == -1)
+							break;
+						if (!write_message(w.fd, TILE, frame_id, &tiles[t], sizeof(Tile))) {
+							drop(w);
+							break;
+						}
+						++copies[t];
+						w.queue.push_back(std::make_pair(t, clock::now()));
+					}
+
+				// Tiles of dead workers are returned before waiting
+				for (Worker& w : workers)
+					if (!w.alive && !w.queue.empty()) {
+						for (auto& q : w.queue)
+							if (--copies[q.first] == 0 && !done[q.first])
+								returned.push_back(q.first);
+						w.queue.clear();
+					}
+				if (!alive_count())
+					throw std::runtime_error("All workers are gone");
+
+				fds.clear();
+				polled.clear();
+				for (Worker& w : workers)
+					if (w.alive && !w.queue.empty()) {
+						fds.push_back({ w.fd, POLLIN, 0 });
+						polled.push_back(&w);
+					}
+
+				// Timeout lets cancel() stop waiting
+				if (poll(fds.data(), fds.size(), 100) < 0 && errno != EINTR)
+					throw std::runtime_error("Worker poll failed");
+
+				for (int i = 0; i < (int) fds.size(); ++i) {
+					if (!fds[i].revents)
+						continue;
+
+					Worker& w = *polled[i];
+					if (!receive(w, header, payload))
+						continue;
+					if (header.type != RESULT || header.frame != frame_id)
+						continue;
+
+					Tile t;
+					if (payload.size() < sizeof(Tile))
+						throw std::runtime_error("Malformed worker result");
+					memcpy(&t, payload.data(), sizeof(Tile));
+					if (t.id < 0 || t.id >= (int) tiles.size() || payload.size() != sizeof(Tile) + (size_t) t.width * t.height * sizeof(unsigned int)
+						|| t.x != tiles[t.id].x || t.y != tiles[t.id].y || t.width != tiles[t.id].width || t.height != tiles[t.id].height)
+						throw std::runtime_error("Malformed worker result");
+
+					for (auto q = w.queue.begin(); q != w.queue.end(); ++q)
+						if (q->first == t.id) {
+							w.queue.erase(q);
+							break;
+						}
+					--copies[t.id];
+					if (done[t.id])
+						continue;
+
+					done[t.id] = 1;
+					++finished;
+					++w.rendered;
+					const unsigned int* pixels = (const unsigned int*) (payload.data() + sizeof(Tile));
+
+					if (ordered) {
+						held[t.id].assign(pixels, pixels + (size_t) t.width * t.height);
+						while (held.count(first_missing)) {
+							sink.write_tile(tiles[first_missing], held[first_missing].data());
+							held.erase(first_missing);
+							++first_missing;
+						}
+					} else {
+						sink.write_tile(t, pixels);
+						while (first_missing < (int) tiles.size() && done[first_missing])
+							++first_missing;
+					}
+				}
+			}
+
+			sink.finish();
+			return 1;
+		};
+
+		// Render frame into buffer of width * height ABGR pixels
+		bool render(unsigned int* frame) {
+			// Copies tiles into frame
+			class FrameSink : public TileSink {
+
+				unsigned int* frame;
+				int width = 0;
+
+			public:
+
+				FrameSink(unsigned int* frame) : frame(frame) {};
+
+				void begin(int width, int, int) {
+					this->width = width;
+				};
+
+				void write_tile(const Tile& t, const unsigned int* pixels) {
+					for (int y = 0; y < t.height; ++y)
+						memcpy(frame + t.x + (size_t) (t.y + y) * width, pixels + (size_t) y * t.width, t.width * sizeof(unsigned int));
+				};
+
+				void finish() {};
+			};
+
+			FrameSink sink(frame);
+			return render(sink);
+		};
+	};
+};
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <cmath>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <shared_mutex>
+#include <unordered_map>
+
+#include "vec3.h"
+
+namespace raytrace {
+
+	// Irradiance computed by diffuse rays of one hit point
+	struct IrradianceRecord {
+		cppmath::vec3 location;
+		cppmath::vec3 normal;
+		// Incoming light averaged over diffuse rays, not scaled by surface color
+		double r = 0.0, g = 0.0, b = 0.0;
+		// Harmonic mean distance to surfaces seen by diffuse rays, limits area of reuse
+		double radius = 0.0;
+		// Depth of ray that computed record, deeper rays are cut earlier by MAX_RAY_DEPTH
+		int ray_depth = 1;
+	};
+
+	// Irradiance cache over sparse world-space hash grid (Ward et al.).
+	// Record is valid for point x with normal n while
+	//  |x - xi| / Ri + sqrt(1 - dot(n, ni)) < error,
+	//  irradiance of point is average of valid records weighted by inverse of this value.
+	// Record is stored in every cell overlapped by it's area of validity, so lookup visits
+	//  one cell. Cell size is largest area of validity: error * max_radius.
+	// Cells are hashed into shards locked separately, lookups of threads share lock.
+	class IrradianceCache {
+
+		struct Shard {
+			std::shared_mutex mutex;
+			std::unordered_map<uint64_t, std::vector<IrradianceRecord>> cells;
+		};
+
+		static const int SHARD_COUNT = 64;
+
+		std::unique_ptr<Shard[]> shards;
+		std::atomic<size_t> record_count;
+		double cell_size = 1.0;
+
+		// Key of cell, coordinates are wrapped to 21 bit. Far cells with same key
+		//  only share records, that are rejected by distance.
+		inline uint64_t cell_key(int64_t x, int64_t y, int64_t z) const {
+			const uint64_t mask = (1ull << 21) - 1;
+			return ((uint64_t) x & mask) | ((uint64_t) y & mask) << 21 | ((uint64_t) z & mask) << 42;
+		};
+
+		inline int64_t cell_of(double v) const {
+			return (int64_t) std::floor(v / cell_size);
+		};
+
+		inline Shard& shard_of(uint64_t key) {
+			return shards[(key * 0x9E3779B97F4A7C15ull) >> 58];
+		};
+
+	public:
+
+		// Allowed interpolation error, smaller values compute more records
+		double error = 0.2;
+		// Limits of record radius in world units
+		double min_radius = 0.01;
+		double max_radius = 1.0;
+
+		IrradianceCache() : shards(new Shard[SHARD_COUNT]), record_count(0) {
+			cell_size = error * max_radius;
+		};
+
+		// Remove all records & apply current error and max_radius
+		void clear() {
+			for (int i = 0; i < SHARD_COUNT; ++i) {
+				std::unique_lock<std::shared_mutex> lock(shards[i].mutex);
+				shards[i].cells.clear();
+			}
+			record_count = 0;
+			cell_size = std::max(error * max_radius, 1e-12);
+		};
+
+		// Number of records computed since clear()
+		inline size_t size() const {
+			return record_count;
+		};
+
+		// Interpolate irradiance of point from valid records computed by rays
+		//  not deeper than ray_depth. Returns 0 if there is no valid record.
+		bool lookup(const cppmath::vec3& location, const cppmath::vec3& normal, int ray_depth, double& r, double& g, double& b) {
+			uint64_t key = cell_key(cell_of(location.x), cell_of(location.y), cell_of(location.z));
+			Shard& shard = shard_of(key);
+			std::shared_lock<std::shared_mutex> lock(shard.mutex);
+
+			auto cell = shard.cells.find(key);
+			if (cell == shard.cells.end())
+				return 0;
+
+			double sum_w = 0.0, sum_r = 0.0, sum_g = 0.0, sum_b = 0.0;
+			for (const IrradianceRecord& record : cell->second) {
+				if (record.ray_depth > ray_depth)
+					continue;
+
+				cppmath::vec3 offset = location - record.location;
+				// Point is in front of record, it may see surfaces record does not
+				if (cppmath::vec3::dot(offset, normal + record.normal) < -0.1 * record.radius)
+					continue;
+
+				double e = offset.len() / record.radius + std::sqrt(std::max(1.0 - cppmath::vec3::dot(normal, record.normal), 0.0));
+				if (e >= error)
+					continue;
+
+				double w = 1.0 / std::max(e, 1e-6);
+				sum_w += w;
+				sum_r += w * record.r;
+				sum_g += w * record.g;
+				sum_b += w * record.b;
+			}
+
+			if (sum_w == 0.0)
+				return 0;
+
+			r = sum_r / sum_w;
+			g = sum_g / sum_w;
+			b = sum_b / sum_w;
+			return 1;
+		};
+
+		// Insert record, radius is clamped to [min_radius, max_radius]
+		void insert(IrradianceRecord record) {
+			record.radius = std::clamp(record.radius, min_radius, max_radius);
+			double reach = error * record.radius;
+
+			int64_t x0 = cell_of(record.location.x - reach), x1 = cell_of(record.location.x + reach);
+			int64_t y0 = cell_of(record.location.y - reach), y1 = cell_of(record.location.y + reach);
+			int64_t z0 = cell_of(record.location.z - reach), z1 = cell_of(record.location.z + reach);
+
+			for (int64_t z = z0; z <= z1; ++z)
+				for (int64_t y = y0; y <= y1; ++y)
+					for (int64_t x = x0; x <= x1; ++x) {
+						uint64_t key = cell_key(x, y, z);
+						Shard& shard = shard_of(key);
+						std::unique_lock<std::shared_mutex> lock(shard.mutex);
+						shard.cells[key].push_back(record);
+					}
+
+			++record_count;
+		};
+	};
+};
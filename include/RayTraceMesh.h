@@ -0,0 +1,526 @@
+#pragma once
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <limits>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+
+#include "vec3.h"
+#include "RayTrace.h"
+#include "RayTraceBVH.h"
+#include "MappedFile.h"
+
+namespace raytrace {
+
+	// Triangle mesh with shared vertex and normal buffers.
+	// Faces are intersected through own BVH, so whole mesh is a single scene object.
+	// build() must be called after buffers were changed, load_obj() builds automatically.
+	class Mesh : public SceneObject {
+
+		BVH bvh;
+		AABB bounds;
+		cppmath::vec3 center;
+		// Area weighted average of face normals
+		cppmath::vec3 average_normal;
+		// Set when BVH matches faces
+		bool built = 0;
+		// Memory viewed by buffers & BVH of restored mesh, e.g. mapped scene file
+		std::shared_ptr<const void> storage;
+
+		// Returns signed distance to face hit or infinity, u & v receive barycentric coordinates.
+		// Matches Triangle::hit.
+		inline double intersect(int f, const ray& r, double& u, double& v) const {
+			RAYTRACE_COUNT(tests[TEST_MESH_FACE]++);
+			const cppmath::vec3& A = vertices[indices[3 * f + 0]];
+			const cppmath::vec3& B = vertices[indices[3 * f + 1]];
+			const cppmath::vec3& C = vertices[indices[3 * f + 2]];
+
+			cppmath::vec3 ba = B - A;
+			cppmath::vec3 ca = C - A;
+			cppmath::vec3 pv = cppmath::vec3::cross(r.B, ca);
+
+			double det = cppmath::vec3::dot(ba, pv);
+			if (det < 1e-8 && det > -1e-8)
+				return std::numeric_limits<double>::infinity();
+
+			double inv_det = 1.0 / det;
+			cppmath::vec3 tv = r.A - A;
+
+			u = cppmath::vec3::dot(tv, pv) * inv_det;
+			if (u < 0 || u > 1)
+				return std::numeric_limits<double>::infinity();
+
+			cppmath::vec3 qv = cppmath::vec3::cross(tv, ba);
+
+			v = cppmath::vec3::dot(r.B, qv) * inv_det;
+			if (v < 0 || u + v > 1)
+				return std::numeric_limits<double>::infinity();
+
+			return cppmath::vec3::dot(ca, qv) * inv_det;
+		};
+
+		inline cppmath::vec3 face_normal(int f) const {
+			const cppmath::vec3& A = vertices[indices[3 * f + 0]];
+			const cppmath::vec3& B = vertices[indices[3 * f + 1]];
+			const cppmath::vec3& C = vertices[indices[3 * f + 2]];
+			return cppmath::vec3::cross(B - A, C - A).norm();
+		};
+
+		// Normal at barycentric point of face, interpolated when face has vertex normals
+		inline cppmath::vec3 surface_normal(int f, double u, double v) const {
+			if (normal_indices.empty())
+				return face_normal(f);
+
+			int na = normal_indices[3 * f + 0];
+			int nb = normal_indices[3 * f + 1];
+			int nc = normal_indices[3 * f + 2];
+			if (na == -1 || nb == -1 || nc == -1)
+				return face_normal(f);
+
+			return ((1.0 - u - v) * normals[na] + u * normals[nb] + v * normals[nc]).norm();
+		};
+
+		// O B J   P A R S I N G
+
+		static inline bool is_space(char c) {
+			return c == ' ' || c == '\t' || c == '\r';
+		};
+
+		static inline void skip_spaces(const char*& p, const char* end) {
+			while (p < end && is_space(*p))
+				++p;
+		};
+
+		static bool parse_double(const char*& p, const char* end, double& value) {
+			skip_spaces(p, end);
+
+			// Fast path for decimals with up to 15 digits, such values and powers of
+			//  ten up to 1e22 are exact doubles, so single division is correctly rounded
+			static const double powers[] = {
+				1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+				1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+			};
+
+			const char* q = p;
+			bool negative = 0;
+			if (q < end && (*q == '-' || *q == '+'))
+				negative = *q++ == '-';
+
+			uint64_t mantissa = 0;
+			int digits = 0;
+			int fraction = 0;
+			while (q < end && *q >= '0' && *q <= '9') {
+				mantissa = mantissa * 10 + (*q++ - '0');
+				++digits;
+			}
+			if (q < end && *q == '.') {
+				++q;
+				while (q < end && *q >= '0' && *q <= '9') {
+					mantissa = mantissa * 10 + (*q++ - '0');
+					++digits;
+					++fraction;
+				}
+			}
+
+			if (digits > 0 && digits <= 15 && (q == end || is_space(*q))) {
+				value = (double) mantissa / powers[fraction];
+				if (negative)
+					value = -value;
+				p = q;
+				return 1;
+			}
+
+			// Mapped file is not null terminated, copy token for strtod
+			char token[64];
+			int length = 0;
+			while (p + length < end && length < 63 && !is_space(p[length]))
+				token[length] = p[length], ++length;
+			token[length] = '\0';
+
+			char* token_end;
+			value = std::strtod(token, &token_end);
+			if (token_end == token)
+				return 0;
+
+			p += token_end - token;
+			return 1;
+		};
+
+		static bool parse_int(const char*& p, const char* end, int& value) {
+			bool negative = 0;
+			if (p < end && (*p == '-' || *p == '+'))
+				negative = *p++ == '-';
+
+			if (p >= end || *p < '0' || *p > '9')
+				return 0;
+
+			long long v = 0;
+			while (p < end && *p >= '0' && *p <= '9') {
+				v = v * 10 + (*p++ - '0');
+				if (v > std::numeric_limits<int>::max())
+					return 0;
+			}
+
+			value = negative ? -v : v;
+			return 1;
+		};
+
+		// Convert 1-based or negative relative OBJ index to buffer index
+		static int resolve_index(int index, int count, int line) {
+			int i = index < 0 ? count + index : index - 1;
+			if (index == 0 || i < 0 || i >= count)
+				throw std::runtime_error("OBJ index out of range at line " + std::to_string(line));
+			return i;
+		};
+
+		// Parse face corners of `f v[/vt][/vn] ...` and add triangle fan
+		void parse_face(const char* p, const char* end, int line) {
+			int first_v = -1, first_n = -1;
+			int prev_v = -1, prev_n = -1;
+			int corners = 0;
+
+			while (1) {
+				skip_spaces(p, end);
+				if (p >= end || *p == '#')
+					break;
+
+				int v, t, n = 0;
+				if (!parse_int(p, end, v))
+					throw std::runtime_error("OBJ invalid face at line " + std::to_string(line));
+
+				if (p < end && *p == '/') {
+					++p;
+					// Texture coordinates are not used
+					if (p < end && *p != '/')
+						parse_int(p, end, t);
+					if (p < end && *p == '/') {
+						++p;
+						if (!parse_int(p, end, n))
+							throw std::runtime_error("OBJ invalid face at line " + std::to_string(line));
+					}
+				}
+
+				if (p < end && !is_space(*p))
+					throw std::runtime_error("OBJ invalid face at line " + std::to_string(line));
+
+				int vi = resolve_index(v, vertices.size(), line);
+				int ni = n ? resolve_index(n, normals.size(), line) : -1;
+
+				if (corners == 0) {
+					first_v = vi;
+					first_n = ni;
+				} else if (corners >= 2)
+					add_triangle(first_v, prev_v, vi, first_n, prev_n, ni);
+
+				prev_v = vi;
+				prev_n = ni;
+				++corners;
+			}
+
+			if (corners < 3)
+				throw std::runtime_error("OBJ face with less than 3 vertices at line " + std::to_string(line));
+		};
+
+	public:
+
+		Column<cppmath::vec3> vertices;
+		Column<cppmath::vec3> normals;
+		// Vertex indices, 3 per face
+		Column<int> indices;
+		// Normal indices, 3 per face or empty if mesh has only face normals.
+		// Face with -1 in any corner uses face normal.
+		Column<int> normal_indices;
+		ObjectMaterial material;
+
+		Mesh() {};
+
+		// Load Wavefront OBJ file
+		Mesh(const std::string& filename) {
+			load_obj(filename);
+		};
+
+		void setMaterial(const ObjectMaterial& material) {
+			this->material = material;
+			mark_changed();
+		};
+
+		void clear() {
+			vertices.clear();
+			normals.clear();
+			indices.clear();
+			normal_indices.clear();
+			bvh.clear();
+			storage.reset();
+			built = 0;
+		};
+
+		inline int add_vertex(const cppmath::vec3& v) {
+			vertices.push_back(v);
+			built = 0;
+			return vertices.size() - 1;
+		};
+
+		inline int add_normal(const cppmath::vec3& n) {
+			normals.push_back(n);
+			return normals.size() - 1;
+		};
+
+		// Add face of vertex indices with optional normal indices, -1 for no normal
+		void add_triangle(int a, int b, int c, int na = -1, int nb = -1, int nc = -1) {
+			bool has_normals = na != -1 && nb != -1 && nc != -1;
+
+			// Switch to per-corner normals on first face that has them
+			if (has_normals && normal_indices.empty())
+				normal_indices.assign(indices.size(), -1);
+
+			indices.push_back(a);
+			indices.push_back(b);
+			indices.push_back(c);
+
+			if (!normal_indices.empty()) {
+				normal_indices.push_back(na);
+				normal_indices.push_back(nb);
+				normal_indices.push_back(nc);
+			}
+
+			built = 0;
+		};
+
+		inline int face_count() const {
+			return indices.size() / 3;
+		};
+
+		inline bool is_built() const {
+			return built;
+		};
+
+		inline const BVH& get_bvh() const {
+			return bvh;
+		};
+
+		// Returns approximate number of bytes allocated by buffers and BVH, viewed memory is not counted
+		size_t get_memory_size() const {
+			return vertices.capacity() * sizeof(cppmath::vec3)
+				+ normals.capacity() * sizeof(cppmath::vec3)
+				+ indices.capacity() * sizeof(int)
+				+ normal_indices.capacity() * sizeof(int)
+				+ bvh.get_nodes().capacity() * sizeof(BVH::Node)
+				+ bvh.get_indices().capacity() * sizeof(int);
+		};
+
+		// Build BVH over faces.
+		// Faces are reordered to follow BVH leaves, so face order may change.
+		void build() {
+			int count = face_count();
+
+			std::vector<AABB> face_bounds(count);
+			bounds = AABB();
+			average_normal = cppmath::vec3();
+			for (int f = 0; f < count; ++f) {
+				const cppmath::vec3& A = vertices[indices[3 * f + 0]];
+				const cppmath::vec3& B = vertices[indices[3 * f + 1]];
+				const cppmath::vec3& C = vertices[indices[3 * f + 2]];
+				face_bounds[f].expand(A);
+				face_bounds[f].expand(B);
+				face_bounds[f].expand(C);
+				bounds.expand(face_bounds[f]);
+				average_normal += cppmath::vec3::cross(B - A, C - A);
+			}
+
+			if (count)
+				average_normal.norm();
+			center = count ? bounds.center() : cppmath::vec3();
+
+			bvh.build(face_bounds);
+			face_bounds.clear();
+			face_bounds.shrink_to_fit();
+
+			// Store faces in leaf order so leaf is range of faces
+			const Column<int>& order = bvh.get_indices();
+			std::vector<int> sorted(indices.size());
+			for (int k = 0; k < count; ++k)
+				for (int c = 0; c < 3; ++c)
+					sorted[3 * k + c] = indices[3 * order[k] + c];
+			indices.assign(std::move(sorted));
+
+			if (!normal_indices.empty()) {
+				sorted.resize(indices.size());
+				for (int k = 0; k < count; ++k)
+					for (int c = 0; c < 3; ++c)
+						sorted[3 * k + c] = normal_indices[3 * order[k] + c];
+				normal_indices.assign(std::move(sorted));
+			}
+
+			built = 1;
+		};
+
+		// Use BVH built earlier over faces that are already stored in it's leaf order,
+		//  e.g. viewed in mapped scene file, instead of calling build().
+		// BVH arrays are viewed like buffers, storage keeps viewed memory valid until clear().
+		// average_normal is normal_at() of built mesh.
+		void restore(BVH::Node* nodes, size_t node_count, int* order, size_t order_count, const cppmath::vec3& average_normal, std::shared_ptr<const void> storage) {
+			if (order_count != (size_t) face_count())
+				throw std::runtime_error("Mesh BVH does not match faces");
+
+			bvh.restore(nodes, node_count, order, order_count, nullptr, 0);
+			bounds = node_count ? nodes[0].bounds : AABB();
+			center = node_count ? bounds.center() : cppmath::vec3();
+			this->average_normal = average_normal;
+			this->storage = storage;
+			built = 1;
+		};
+
+		// Load Wavefront OBJ file replacing current geometry.
+		// File is memory mapped and parsed in place, only v, vn and f records are used,
+		//  polygons are split into triangle fans.
+		// Throws std::runtime_error on open or parse failure.
+		void load_obj(const std::string& filename) {
+			MappedFile file(filename);
+			clear();
+
+			const char* p = file.begin();
+			const char* end = file.end();
+
+			// Count records to allocate buffers once
+			size_t vertex_records = 0, normal_records = 0, face_records = 0;
+			for (const char* l = p; l < end; ) {
+				if (l + 1 < end && l[0] == 'v' && is_space(l[1]))
+					++vertex_records;
+				else if (l + 2 < end && l[0] == 'v' && l[1] == 'n' && is_space(l[2]))
+					++normal_records;
+				else if (l + 1 < end && l[0] == 'f' && is_space(l[1]))
+					++face_records;
+
+				const char* nl = (const char*) memchr(l, '\n', end - l);
+				l = nl ? nl + 1 : end;
+			}
+
+			vertices.reserve(vertex_records);
+			normals.reserve(normal_records);
+			indices.reserve(face_records * 3);
+
+			for (int line = 1; p < end; ++line) {
+				const char* nl = (const char*) memchr(p, '\n', end - p);
+				const char* line_end = nl ? nl : end;
+
+				skip_spaces(p, line_end);
+
+				if (line_end - p > 1 && p[0] == 'v' && is_space(p[1])) {
+					p += 1;
+					cppmath::vec3 v;
+					if (!parse_double(p, line_end, v.x) || !parse_double(p, line_end, v.y) || !parse_double(p, line_end, v.z))
+						throw std::runtime_error("OBJ invalid vertex at line " + std::to_string(line));
+					vertices.push_back(v);
+				} else if (line_end - p > 2 && p[0] == 'v' && p[1] == 'n' && is_space(p[2])) {
+					p += 2;
+					cppmath::vec3 n;
+					if (!parse_double(p, line_end, n.x) || !parse_double(p, line_end, n.y) || !parse_double(p, line_end, n.z))
+						throw std::runtime_error("OBJ invalid normal at line " + std::to_string(line));
+					normals.push_back(n.norm());
+				} else if (line_end - p > 1 && p[0] == 'f' && is_space(p[1]))
+					parse_face(p + 1, line_end, line);
+
+				p = nl ? nl + 1 : end;
+			}
+
+			build();
+		};
+
+		TraceManifold hit(const ray& r) {
+			TraceManifold tm;
+
+			double t_max = std::numeric_limits<double>::infinity();
+			int face = -1;
+			double face_u = 0.0, face_v = 0.0;
+
+			auto test = [&](int f, double& t) {
+				double u, v;
+				double ti = intersect(f, r, u, v);
+				if (ti >= 10e-8 && ti < t) {
+					t = ti;
+					face = f;
+					face_u = u;
+					face_v = v;
+				}
+			};
+
+			if (built)
+				bvh.closest_leaf(r.A, r.B, t_max, [&](int node_id, double& t) {
+					const BVH::Node& node = bvh.get_nodes()[node_id];
+					for (int f = node.offset; f < node.offset + node.count; ++f)
+						test(f, t);
+				});
+			else
+				for (int f = 0; f < face_count(); ++f)
+					test(f, t_max);
+
+			if (face == -1)
+				return tm;
+
+			tm.hit = 1;
+			tm.distance = t_max;
+			tm.location = r.point_at_parameter(t_max);
+			tm.normal = surface_normal(face, face_u, face_v);
+			return tm;
+		};
+
+		ObjectMaterial get_material(const cppmath::vec3& point) {
+			return material;
+		};
+
+		bool is_emissive() {
+			return material.luminosity > 0;
+		};
+
+		cppmath::vec3 get_center() {
+			return center;
+		};
+
+		PointSpan get_light_points(const cppmath::vec3& ray_origin) {
+			return center;
+		};
+
+		// Mesh has no single normal, average normal is used for light points
+		cppmath::vec3 normal_at(const cppmath::vec3& point) {
+			return average_normal;
+		};
+
+		// Builds mesh if it was changed
+		AABB get_bounds() {
+			if (!built)
+				build();
+			return bounds;
+		};
+
+		bool occluded(const ray& r, double max_distance) {
+			if (!material.surface_visible)
+				return 0;
+
+			auto test = [&](int f) -> bool {
+				double u, v;
+				double t = intersect(f, r, u, v);
+				return t >= 0 && t < max_distance;
+			};
+
+			if (!built) {
+				for (int f = 0; f < face_count(); ++f)
+					if (test(f))
+						return 1;
+				return 0;
+			}
+
+			return bvh.traverse_leaf(r.A, r.B, max_distance, [&](int node_id) -> bool {
+				const BVH::Node& node = bvh.get_nodes()[node_id];
+				for (int f = node.offset; f < node.offset + node.count; ++f)
+					if (test(f))
+						return 1;
+				return 0;
+			});
+		};
+	};
+};
@@ -0,0 +1,483 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <fstream>
+#include <exception>
+#include <stdexcept>
+#include <algorithm>
+#include <condition_variable>
+
+#include "Deflate.h"
+#include "MappedFile.h"
+#include "RayTraceRenderer.h"
+#include "lodepng.h"
+#include "rawb.h"
+
+namespace raytrace {
+
+	// Sink collecting tiles into bands & writing bands in order of rows.
+	// Band is one row of tiles, it is kept until all of it's tiles arrive. Writers of
+	//  tiles more than max_bands ahead of first unwritten band wait, so memory is
+	//  bounded by max_bands * width * tile_size pixels instead of frame size.
+	// Bands are written by worker which finished the band, one worker at a time.
+	class BandSink : public TileSink {
+
+		struct Band {
+			std::vector<unsigned int> pixels;
+			// Number of tiles not received yet
+			int remaining = 0;
+		};
+
+		std::mutex mutex;
+		std::condition_variable space;
+		std::map<int, Band> bands;
+		// Buffers of written bands reused by next bands
+		std::vector<std::vector<unsigned int>> spare;
+
+		int next_band = 0;
+		int band_count = 0;
+		int tiles_per_band = 0;
+		// Set while some worker writes bands
+		bool writing = 0;
+		bool aborted = 0;
+		// Exception of write_rows(), rethrown by finish()
+		std::exception_ptr error;
+
+		size_t buffered = 0;
+		size_t peak_buffered = 0;
+
+	protected:
+
+		int width = 0, height = 0;
+		int tile_size = 0;
+
+		// Prepare output of frame, width & height are known
+		virtual void start() = 0;
+
+		// Write count rows of width pixels starting at row y.
+		// Called in order of rows, never concurrently.
+		virtual void write_rows(const unsigned int* pixels, int y, int count) = 0;
+
+		// Complete output after last row
+		virtual void end() = 0;
+
+	public:
+
+		// Number of bands buffered before writers of following bands wait
+		int max_bands = 8;
+
+		void begin(int width, int height, int tile_size) {
+			std::unique_lock<std::mutex> lock(mutex);
+			this->width = width;
+			this->height = height;
+			this->tile_size = tile_size;
+			band_count = (height + tile_size - 1) / tile_size;
+			tiles_per_band = (width + tile_size - 1) / tile_size;
+			next_band = 0;
+			bands.clear();
+			writing = 0;
+			aborted = 0;
+			error = nullptr;
+			buffered = peak_buffered = 0;
+
+			start();
+		};
+
+		void write_tile(const Tile& t, const unsigned int* pixels) {
+			std::unique_lock<std::mutex> lock(mutex);
+			int index = t.y / tile_size;
+			space.wait(lock, [this, index] { return aborted || index < next_band + std::max(max_bands, 1); });
+			if (aborted)
+				return;
+
+			Band& band = bands[index];
+			if (band.pixels.empty()) {
+				if (!spare.empty()) {
+					band.pixels.swap(spare.back());
+					spare.pop_back();
+				}
+				band.pixels.resize((size_t) width * std::min(tile_size, height - index * tile_size));
+				band.remaining = tiles_per_band;
+
+				buffered += band.pixels.size() * sizeof(unsigned int);
+				peak_buffered = std::max(peak_buffered, buffered);
+			}
+
+			for (int y = 0; y < t.height; ++y)
+				memcpy(&band.pixels[(size_t) (t.y - index * tile_size + y) * width + t.x], pixels + (size_t) y * t.width, t.width * sizeof(unsigned int));
+
+			if (--band.remaining || index != next_band || writing)
+				return;
+
+			// Write all finished bands, other workers keep adding tiles meanwhile
+			writing = 1;
+			while (!aborted && bands.count(next_band) && !bands[next_band].remaining) {
+				std::vector<unsigned int> rows;
+				rows.swap(bands[next_band].pixels);
+				bands.erase(next_band);
+
+				lock.unlock();
+				try {
+					write_rows(rows.data(), next_band * tile_size, rows.size() / width);
+				} catch (...) {
+					lock.lock();
+					error = std::current_exception();
+					aborted = 1;
+					break;
+				}
+				lock.lock();
+
+				buffered -= rows.size() * sizeof(unsigned int);
+				if ((int) spare.size() < max_bands)
+					spare.push_back(std::move(rows));
+				++next_band;
+				space.notify_all();
+			}
+			writing = 0;
+			space.notify_all();
+		};
+
+		void finish() {
+			std::unique_lock<std::mutex> lock(mutex);
+			if (error)
+				std::rethrow_exception(error);
+			if (next_band != band_count)
+				throw std::runtime_error("Output finished before all rows were written");
+
+			spare.clear();
+			end();
+		};
+
+		void abort() {
+			std::unique_lock<std::mutex> lock(mutex);
+			aborted = 1;
+			space.notify_all();
+		};
+
+		bool ordered() {
+			return 1;
+		};
+
+		// Largest size of buffered bands in bytes during last frame
+		inline size_t get_peak_memory() {
+			return peak_buffered;
+		};
+	};
+
+	// Stream frame into RAWb file.
+	// Format: Order test: 0x01020304[4B], WIDTH[4B], HEIGHT[4B], rawb::pixel_type::ABGR[1B], ABGR[4B * WIDTH * HEIGHT]
+	class RawbSink : public BandSink {
+
+		std::string filename;
+		std::ofstream file;
+
+	protected:
+
+		void start() {
+			file.open(filename, std::ofstream::binary | std::ofstream::trunc);
+			if (file.fail())
+				throw std::runtime_error("Output " + filename + ": open failed");
+
+			uint32_t header[3] = { 0x01020304, (uint32_t) width, (uint32_t) height };
+			uint8_t pix_type = rawb::pixel_type::ABGR;
+			file.write((const char*) header, sizeof(header));
+			file.write((const char*) &pix_type, 1);
+		};
+
+		void write_rows(const unsigned int* pixels, int, int count) {
+			file.write((const char*) pixels, (size_t) width * count * sizeof(unsigned int));
+			if (file.fail())
+				throw std::runtime_error("Output " + filename + ": write failed");
+		};
+
+		void end() {
+			file.close();
+			if (file.fail())
+				throw std::runtime_error("Output " + filename + ": write failed");
+		};
+
+	public:
+
+		RawbSink(const std::string& filename) : filename(filename) {};
+	};
+
+	// Stream frame into PNG file.
+	// Rows are filtered & compressed by DeflateStream as bands arrive, compressed data
+	//  is written in IDAT chunks, so neither frame nor encoded image is kept in memory.
+	class PngSink : public BandSink {
+
+		static const size_t CHUNK_SIZE = 65536;
+
+		std::string filename;
+		std::ofstream file;
+		std::unique_ptr<DeflateStream> deflate;
+
+		// Chunk type followed by compressed data of next IDAT chunk
+		std::vector<unsigned char> chunk;
+		// Bytes of previous & current row, previous is zero for first row
+		std::vector<unsigned char> previous, current;
+		// Filtered row for each filter type, each prefixed with filter type byte
+		std::vector<unsigned char> filtered[5];
+
+		void write_chunk(const char* type, const unsigned char* data, size_t size) {
+			std::vector<unsigned char> body(type, type + 4);
+			body.insert(body.end(), data, data + size);
+			write_chunk(body);
+		};
+
+		// Body starts with chunk type
+		void write_chunk(const std::vector<unsigned char>& body) {
+			uint32_t size = body.size() - 4;
+			uint32_t crc = lodepng_crc32(body.data(), body.size());
+			unsigned char length[4] = { (unsigned char) (size >> 24), (unsigned char) (size >> 16), (unsigned char) (size >> 8), (unsigned char) size };
+			unsigned char check[4] = { (unsigned char) (crc >> 24), (unsigned char) (crc >> 16), (unsigned char) (crc >> 8), (unsigned char) crc };
+			file.write((const char*) length, 4);
+			file.write((const char*) body.data(), body.size());
+			file.write((const char*) check, 4);
+			if (file.fail())
+				throw std::runtime_error("Output " + filename + ": write failed");
+		};
+
+		void flush_idat() {
+			if (chunk.size() > 4)
+				write_chunk(chunk);
+			chunk.resize(4);
+		};
+
+		static inline int paeth(int a, int b, int c) {
+			int p = a + b - c;
+			int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+			if (pa <= pb && pa <= pc)
+				return a;
+			return pb <= pc ? b : c;
+		};
+
+		// Filter current row with each filter type & compress one with smallest sum of
+		//  absolute signed differences
+		void write_row() {
+			int bpp = alpha ? 4 : 3;
+			size_t size = current.size();
+			long best_sum = -1;
+			int best = 0;
+
+			for (int type = 0; type < 5; ++type) {
+				unsigned char* f = filtered[type].data() + 1;
+				long sum = 0;
+				for (size_t i = 0; i < size; ++i) {
+					int a = i >= (size_t) bpp ? current[i - bpp] : 0;
+					int b = previous[i];
+					int c = i >= (size_t) bpp ? previous[i - bpp] : 0;
+					int prediction = 0;
+					switch (type) {
+						case 1: prediction = a; break;
+						case 2: prediction = b; break;
+						case 3: prediction = (a + b) >> 1; break;
+						case 4: prediction = paeth(a, b, c); break;
+					}
+					f[i] = current[i] - prediction;
+					sum += std::abs((int) (signed char) f[i]);
+				}
+
+				if (best_sum < 0 || sum < best_sum) {
+					best_sum = sum;
+					best = type;
+				}
+			}
+
+			deflate->write(filtered[best].data(), filtered[best].size());
+			previous.swap(current);
+		};
+
+	protected:
+
+		void start() {
+			file.open(filename, std::ofstream::binary | std::ofstream::trunc);
+			if (file.fail())
+				throw std::runtime_error("Output " + filename + ": open failed");
+
+			static const unsigned char SIGNATURE[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+			file.write((const char*) SIGNATURE, 8);
+
+			// Width, height, bit depth 8, color type RGB or RGBA, deflate, adaptive filtering, no interlace
+			unsigned char header[13] = {
+				(unsigned char) (width >> 24), (unsigned char) (width >> 16), (unsigned char) (width >> 8), (unsigned char) width,
+				(unsigned char) (height >> 24), (unsigned char) (height >> 16), (unsigned char) (height >> 8), (unsigned char) height,
+				8, (unsigned char) (alpha ? 6 : 2), 0, 0, 0
+			};
+			write_chunk("IHDR", header, 13);
+
+			size_t row_size = (size_t) width * (alpha ? 4 : 3);
+			previous.assign(row_size, 0);
+			current.assign(row_size, 0);
+			for (int type = 0; type < 5; ++type) {
+				filtered[type].assign(row_size + 1, 0);
+				filtered[type][0] = type;
+			}
+
+			chunk.assign({ 'I', 'D', 'A', 'T' });
+			deflate.reset(new DeflateStream([this](const unsigned char* data, size_t size) {
+				chunk.insert(chunk.end(), data, data + size);
+				if (chunk.size() >= CHUNK_SIZE + 4)
+					flush_idat();
+			}));
+			deflate->max_chain = max_chain;
+		};
+
+		void write_rows(const unsigned int* pixels, int, int count) {
+			for (int r = 0; r < count; ++r) {
+				const unsigned int* row = pixels + (size_t) r * width;
+				unsigned char* c = current.data();
+				for (int x = 0; x < width; ++x) {
+					unsigned int p = row[x];
+					*c++ = p & 0xFF;
+					*c++ = (p >> 8) & 0xFF;
+					*c++ = (p >> 16) & 0xFF;
+					if (alpha)
+						*c++ = p >> 24;
+				}
+				write_row();
+			}
+		};
+
+		void end() {
+			deflate->finish();
+			deflate.reset();
+			flush_idat();
+			write_chunk("IEND", nullptr, 0);
+
+			file.close();
+			if (file.fail())
+				throw std::runtime_error("Output " + filename + ": write failed");
+		};
+
+	public:
+
+		// Store alpha channel, renderer always writes opaque pixels
+		bool alpha = 0;
+		// Compression effort, see DeflateStream::max_chain
+		int max_chain = 32;
+
+		PngSink(const std::string& filename) : filename(filename) {};
+	};
+
+	// Stream frame into tiled file, each tile is written at it's place as soon as
+	//  it is finished, so tiles need not come in order & nothing is buffered.
+	// Format, native byte order:
+	//  HEADER := MAGIC "RTTL"[4B] + VERSION[4B] + ORDER_TEST 0x01020304[4B] + WIDTH[4B] + HEIGHT[4B] + TILE_SIZE[4B]
+	//  BODY := tiles in order of Tile::id, each is t.height rows of t.width ABGR[4B] pixels
+	class TiledSink : public TileSink {
+
+		std::string filename;
+		std::ofstream file;
+		std::mutex mutex;
+		int width = 0, height = 0;
+		bool failed = 0;
+
+	public:
+
+		static const uint32_t MAGIC = 0x4C545452;
+		static const uint32_t VERSION = 1;
+		static const size_t HEADER_SIZE = 24;
+
+		// Offset of tile in file, all tiles above & left of tile have full tile size
+		static inline size_t tile_offset(const Tile& t, int width) {
+			return HEADER_SIZE + ((size_t) t.y * width + (size_t) t.x * t.height) * sizeof(unsigned int);
+		};
+
+		TiledSink(const std::string& filename) : filename(filename) {};
+
+		void begin(int width, int height, int tile_size) {
+			this->width = width;
+			this->height = height;
+			failed = 0;
+
+			file.open(filename, std::ofstream::binary | std::ofstream::trunc);
+			if (file.fail())
+				throw std::runtime_error("Output " + filename + ": open failed");
+
+			uint32_t header[6] = { MAGIC, VERSION, 0x01020304, (uint32_t) width, (uint32_t) height, (uint32_t) tile_size };
+			file.write((const char*) header, sizeof(header));
+		};
+
+		void write_tile(const Tile& t, const unsigned int* pixels) {
+			std::unique_lock<std::mutex> lock(mutex);
+			file.seekp(tile_offset(t, width));
+			file.write((const char*) pixels, (size_t) t.width * t.height * sizeof(unsigned int));
+			if (file.fail())
+				failed = 1;
+		};
+
+		void finish() {
+			file.close();
+			if (failed || file.fail())
+				throw std::runtime_error("Output " + filename + ": write failed");
+		};
+	};
+
+	// Reader of file written by TiledSink, file is mapped, so tiles are read on demand
+	class TiledReader {
+
+		MappedFile file;
+		int width = 0, height = 0;
+		int tile_size = 0;
+
+	public:
+
+		TiledReader(const std::string& filename) : file(filename) {
+			uint32_t header[6];
+			if (file.size() < sizeof(header))
+				throw std::runtime_error("Tiled file " + filename + ": file is truncated");
+			memcpy(header, file.data(), sizeof(header));
+
+			if (header[0] != TiledSink::MAGIC || header[1] != TiledSink::VERSION || header[2] != 0x01020304)
+				throw std::runtime_error("Tiled file " + filename + ": unsupported format");
+
+			width = header[3];
+			height = header[4];
+			tile_size = header[5];
+			if (tile_size <= 0 || file.size() != TiledSink::HEADER_SIZE + (size_t) width * height * sizeof(unsigned int))
+				throw std::runtime_error("Tiled file " + filename + ": file is truncated");
+		};
+
+		inline int get_width() {
+			return width;
+		};
+
+		inline int get_height() {
+			return height;
+		};
+
+		inline int get_tile_size() {
+			return tile_size;
+		};
+
+		// Tiles of frame in order of Tile::id
+		std::vector<Tile> get_tiles() {
+			std::vector<Tile> tiles;
+			for (int y = 0; y < height; y += tile_size)
+				for (int x = 0; x < width; x += tile_size)
+					tiles.push_back({ (int) tiles.size(), x, y, std::min(tile_size, width - x), std::min(tile_size, height - y) });
+			return tiles;
+		};
+
+		// Pixels of tile as t.height rows of t.width ABGR pixels
+		inline const unsigned int* get_tile(const Tile& t) {
+			return (const unsigned int*) (file.data() + TiledSink::tile_offset(t, width));
+		};
+
+		// Pass all tiles in order into sink, e.g. convert to PNG without loading frame
+		void copy(TileSink& sink) {
+			sink.begin(width, height, tile_size);
+			for (const Tile& t : get_tiles())
+				sink.write_tile(t, get_tile(t));
+			sink.finish();
+		};
+	};
+};
@@ -0,0 +1,303 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <limits>
+#include <cstdint>
+
+#include "vec3.h"
+#include "RayTraceStats.h"
+#include "RayTraceColumn.h"
+
+namespace raytrace {
+
+	// Type of compiled scene object
+	enum PrimitiveType : uint8_t {
+		// Object tested through virtual SceneObject interface
+		PRIMITIVE_GENERIC,
+		// Sphere & UVSphere
+		PRIMITIVE_SPHERE,
+		// Plane & UVPlane
+		PRIMITIVE_PLANE,
+		PRIMITIVE_TRIANGLE
+	};
+
+	// Minimal distance of hit for primitives stored in given precision.
+	// Single precision needs larger distance, so rays leaving surface do not hit it again due to rounding.
+	template<typename Scalar>
+	inline Scalar hit_epsilon();
+
+	template<>
+	inline double hit_epsilon<double>() {
+		return 10e-8;
+	};
+
+	template<>
+	inline float hit_epsilon<float>() {
+		return 1e-4f;
+	};
+
+	// Spheres stored as structure of arrays of given scalar type.
+	// Intersection in double precision matches Sphere::hit bit to bit.
+	template<typename Scalar>
+	struct SphereSoAT {
+		Column<Scalar> cx, cy, cz;
+		Column<Scalar> radius;
+		// Surface visibility, used by shadow rays
+		Column<uint8_t> visible;
+		// Scene object id
+		Column<int> object;
+
+		inline int size() const {
+			return object.size();
+		};
+
+		// Call f for every column in fixed order, used to store & load compiled primitives
+		template<typename F>
+		void for_each_column(F&& f) {
+			f(cx); f(cy); f(cz);
+			f(radius);
+			f(visible);
+			f(object);
+		};
+
+		void clear() {
+			cx.clear(); cy.clear(); cz.clear();
+			radius.clear();
+			visible.clear();
+			object.clear();
+		};
+
+		int add(const cppmath::vec3& center, double r, bool is_visible, int object_id) {
+			cx.push_back(center.x);
+			cy.push_back(center.y);
+			cz.push_back(center.z);
+			radius.push_back(r);
+			visible.push_back(is_visible);
+			object.push_back(object_id);
+			return object.size() - 1;
+		};
+
+		// Replace sphere i with moved or changed one
+		void set(int i, const cppmath::vec3& center, double r, bool is_visible) {
+			cx[i] = center.x;
+			cy[i] = center.y;
+			cz[i] = center.z;
+			radius[i] = r;
+			visible[i] = is_visible;
+		};
+
+		// Returns distance to hit point or infinity, computed in Scalar precision
+		inline double intersect(int i, const cppmath::vec3& o, const cppmath::vec3& d) const {
+			RAYTRACE_COUNT(tests[TEST_SPHERE]++);
+			Scalar dx = d.x, dy = d.y, dz = d.z;
+			Scalar ox = (Scalar) o.x - cx[i];
+			Scalar oy = (Scalar) o.y - cy[i];
+			Scalar oz = (Scalar) o.z - cz[i];
+			Scalar a = dx * dx + dy * dy + dz * dz;
+			Scalar b = Scalar(2.0) * (ox * dx + oy * dy + oz * dz);
+			Scalar c = (ox * ox + oy * oy + oz * oz) - radius[i] * radius[i];
+			Scalar discriminant = b * b - Scalar(4.0) * a * c;
+			if (discriminant < 0)
+				return std::numeric_limits<double>::infinity();
+
+			Scalar t = (-b - std::sqrt(discriminant)) / (Scalar(2.0) * a);
+			if (t < hit_epsilon<Scalar>()) {
+				t = (-b + std::sqrt(discriminant)) / (Scalar(2.0) * a);
+				if (t < hit_epsilon<Scalar>())
+					return std::numeric_limits<double>::infinity();
+			}
+			return t;
+		};
+
+		inline cppmath::vec3 center(int i) const {
+			return cppmath::vec3(cx[i], cy[i], cz[i]);
+		};
+	};
+
+	// Planes stored as structure of arrays.
+	// Intersection matches Plane::hit bit to bit.
+	struct PlaneSoA {
+		Column<double> nx, ny, nz;
+		Column<double> lx, ly, lz;
+		Column<uint8_t> visible;
+		Column<int> object;
+
+		inline int size() const {
+			return object.size();
+		};
+
+		template<typename F>
+		void for_each_column(F&& f) {
+			f(nx); f(ny); f(nz);
+			f(lx); f(ly); f(lz);
+			f(visible);
+			f(object);
+		};
+
+		void clear() {
+			nx.clear(); ny.clear(); nz.clear();
+			lx.clear(); ly.clear(); lz.clear();
+			visible.clear();
+			object.clear();
+		};
+
+		int add(const cppmath::vec3& location, const cppmath::vec3& normal, bool is_visible, int object_id) {
+			nx.push_back(normal.x);
+			ny.push_back(normal.y);
+			nz.push_back(normal.z);
+			lx.push_back(location.x);
+			ly.push_back(location.y);
+			lz.push_back(location.z);
+			visible.push_back(is_visible);
+			object.push_back(object_id);
+			return object.size() - 1;
+		};
+
+		void set(int i, const cppmath::vec3& location, const cppmath::vec3& normal, bool is_visible) {
+			nx[i] = normal.x;
+			ny[i] = normal.y;
+			nz[i] = normal.z;
+			lx[i] = location.x;
+			ly[i] = location.y;
+			lz[i] = location.z;
+			visible[i] = is_visible;
+		};
+
+		inline double intersect(int i, const cppmath::vec3& o, const cppmath::vec3& d) const {
+			RAYTRACE_COUNT(tests[TEST_PLANE]++);
+			double ndd = nx[i] * d.x + ny[i] * d.y + nz[i] * d.z;
+			if ((ndd < 0 ? -ndd : ndd) <= 10e-8)
+				return std::numeric_limits<double>::infinity();
+
+			double t = (nx[i] * (lx[i] - o.x) + ny[i] * (ly[i] - o.y) + nz[i] * (lz[i] - o.z)) / ndd;
+			if (t < 10e-8)
+				return std::numeric_limits<double>::infinity();
+			return t;
+		};
+
+		inline cppmath::vec3 normal(int i) const {
+			return cppmath::vec3(nx[i], ny[i], nz[i]);
+		};
+	};
+
+	// Triangles stored as structure of arrays of given scalar type with precomputed edges.
+	// Intersection in double precision matches Triangle::hit bit to bit.
+	template<typename Scalar>
+	struct TriangleSoAT {
+		Column<Scalar> ax, ay, az;
+		// Edge B - A
+		Column<Scalar> e1x, e1y, e1z;
+		// Edge C - A
+		Column<Scalar> e2x, e2y, e2z;
+		Column<Scalar> nx, ny, nz;
+		Column<uint8_t> visible;
+		Column<int> object;
+
+		inline int size() const {
+			return object.size();
+		};
+
+		template<typename F>
+		void for_each_column(F&& f) {
+			f(ax); f(ay); f(az);
+			f(e1x); f(e1y); f(e1z);
+			f(e2x); f(e2y); f(e2z);
+			f(nx); f(ny); f(nz);
+			f(visible);
+			f(object);
+		};
+
+		void clear() {
+			ax.clear(); ay.clear(); az.clear();
+			e1x.clear(); e1y.clear(); e1z.clear();
+			e2x.clear(); e2y.clear(); e2z.clear();
+			nx.clear(); ny.clear(); nz.clear();
+			visible.clear();
+			object.clear();
+		};
+
+		int add(const cppmath::vec3& A, const cppmath::vec3& B, const cppmath::vec3& C, const cppmath::vec3& normal, bool is_visible, int object_id) {
+			cppmath::vec3 ba = B - A;
+			cppmath::vec3 ca = C - A;
+			ax.push_back(A.x);
+			ay.push_back(A.y);
+			az.push_back(A.z);
+			e1x.push_back(ba.x);
+			e1y.push_back(ba.y);
+			e1z.push_back(ba.z);
+			e2x.push_back(ca.x);
+			e2y.push_back(ca.y);
+			e2z.push_back(ca.z);
+			nx.push_back(normal.x);
+			ny.push_back(normal.y);
+			nz.push_back(normal.z);
+			visible.push_back(is_visible);
+			object.push_back(object_id);
+			return object.size() - 1;
+		};
+
+		void set(int i, const cppmath::vec3& A, const cppmath::vec3& B, const cppmath::vec3& C, const cppmath::vec3& normal, bool is_visible) {
+			cppmath::vec3 ba = B - A;
+			cppmath::vec3 ca = C - A;
+			ax[i] = A.x;
+			ay[i] = A.y;
+			az[i] = A.z;
+			e1x[i] = ba.x;
+			e1y[i] = ba.y;
+			e1z[i] = ba.z;
+			e2x[i] = ca.x;
+			e2y[i] = ca.y;
+			e2z[i] = ca.z;
+			nx[i] = normal.x;
+			ny[i] = normal.y;
+			nz[i] = normal.z;
+			visible[i] = is_visible;
+		};
+
+		// Returns signed distance to hit point or infinity if ray misses triangle plane,
+		//  computed in Scalar precision
+		inline double intersect(int i, const cppmath::vec3& o, const cppmath::vec3& d) const {
+			RAYTRACE_COUNT(tests[TEST_TRIANGLE]++);
+			Scalar dx = d.x, dy = d.y, dz = d.z;
+			// pv = d x e2
+			Scalar px = dy * e2z[i] - dz * e2y[i];
+			Scalar py = dz * e2x[i] - dx * e2z[i];
+			Scalar pz = dx * e2y[i] - dy * e2x[i];
+
+			Scalar det = e1x[i] * px + e1y[i] * py + e1z[i] * pz;
+			if (det < Scalar(1e-8) && det > Scalar(-1e-8))
+				return std::numeric_limits<double>::infinity();
+
+			Scalar inv_det = Scalar(1.0) / det;
+			Scalar tx = (Scalar) o.x - ax[i];
+			Scalar ty = (Scalar) o.y - ay[i];
+			Scalar tz = (Scalar) o.z - az[i];
+
+			Scalar u = (tx * px + ty * py + tz * pz) * inv_det;
+			if (u < 0 || u > 1)
+				return std::numeric_limits<double>::infinity();
+
+			// qv = tv x e1
+			Scalar qx = ty * e1z[i] - tz * e1y[i];
+			Scalar qy = tz * e1x[i] - tx * e1z[i];
+			Scalar qz = tx * e1y[i] - ty * e1x[i];
+
+			Scalar v = (dx * qx + dy * qy + dz * qz) * inv_det;
+			if (v < 0 || u + v > 1)
+				return std::numeric_limits<double>::infinity();
+
+			return (e2x[i] * qx + e2y[i] * qy + e2z[i] * qz) * inv_det;
+		};
+
+		inline cppmath::vec3 normal(int i) const {
+			return cppmath::vec3(nx[i], ny[i], nz[i]);
+		};
+	};
+
+	typedef SphereSoAT<double> SphereSoA;
+	typedef TriangleSoAT<double> TriangleSoA;
+	// Single precision copies tested by float kernels
+	typedef SphereSoAT<float> SphereSoAf;
+	typedef TriangleSoAT<float> TriangleSoAf;
+};
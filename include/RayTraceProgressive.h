@@ -0,0 +1,198 @@
+#pragma once
+
+#include <cmath>
+#include <chrono>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+
+#include "RayTrace.h"
+#include "RayTraceRenderer.h"
+
+namespace raytrace {
+
+	// Operator mapping accumulated color to 8-bit output
+	enum class ToneMapping {
+		// Scale by exposure and clamp, single sample matches hitColorAt()
+		CLAMP,
+		// x / (1 + x) after exposure, keeps detail in bright regions
+		REINHARD
+	};
+
+	// Progressive renderer accumulating samples into floating point buffer.
+	// Each call of add_sample() adds one sample per pixel on worker threads, frame
+	//  can be read with resolve() at any point, so preview is available after
+	//  the first sample and is refined by following samples.
+	// Samples of pixel use consecutive sample indices, so sequence samplers
+	//  continue their sequence instead of repeating it.
+	class ProgressiveRenderer {
+
+		RayTrace& rt;
+		Renderer renderer;
+
+		int width = 0, height = 0;
+		// Sum of samples per pixel as r, g, b
+		std::vector<double> accumulation;
+		// Number of samples of each pixel, differs only in rows of interrupted sample
+		std::vector<uint32_t> counts;
+		// Number of completed samples of whole frame
+		int samples = 0;
+
+		typedef std::chrono::steady_clock clock;
+
+		// Map [0, 1] linear value to 8-bit
+		inline int map_channel(double v) const {
+			v *= exposure;
+			if (tone_mapping == ToneMapping::REINHARD)
+				v = v / (1.0 + v);
+			if (gamma != 1.0 && v > 0.0)
+				v = std::pow(v, 1.0 / gamma);
+			int c = (int) (v * 255.0 + 0.5);
+			return c < 0 ? 0 : (c > 255 ? 255 : c);
+		};
+
+	public:
+
+		ToneMapping tone_mapping = ToneMapping::CLAMP;
+		// Multiplier of accumulated color before tone mapping
+		double exposure = 1.0;
+		// Output gamma, 1 keeps values linear like hitColorAt()
+		double gamma = 1.0;
+		// Number of random diffuse rays traced per sample, replaces scene random_diffuse_count
+		//  for samples of add_sample() without changing scene. Many cheap samples converge
+		//  to same image as single sample with many rays, but first samples are fast.
+		// 0 keeps scene value.
+		int diffuse_count = 1;
+
+		ProgressiveRenderer(RayTrace& rt) : rt(rt), renderer(rt) {
+			reset();
+		};
+
+		ProgressiveRenderer(RayTrace& rt, int thread_count) : rt(rt), renderer(rt, thread_count) {
+			reset();
+		};
+
+		inline Renderer& get_renderer() {
+			return renderer;
+		};
+
+		// Clear accumulated samples, must be called after scene or camera change
+		void reset() {
+			width = rt.get_width();
+			height = rt.get_height();
+			accumulation.assign((size_t) width * height * 3, 0.0);
+			counts.assign((size_t) width * height, 0);
+			samples = 0;
+		};
+
+		// Number of samples added to every pixel
+		inline int get_samples() {
+			return samples;
+		};
+
+		// Sum of samples of pixels as r, g, b in range of [0, 255] per sample
+		inline const std::vector<double>& get_accumulation() {
+			return accumulation;
+		};
+
+		inline const std::vector<uint32_t>& get_counts() {
+			return counts;
+		};
+
+		// Continue accumulation of current frame from saved sums, counts & number of
+		//  completed samples, e.g. loaded from checkpoint. Following samples continue
+		//  sample sequence of each pixel, so result equals to uninterrupted render.
+		void restore(const std::vector<double>& saved_accumulation, const std::vector<uint32_t>& saved_counts, int saved_samples) {
+			reset();
+			if (saved_accumulation.size() != accumulation.size() || saved_counts.size() != counts.size())
+				throw std::runtime_error("Restored accumulation does not match frame size");
+
+			accumulation = saved_accumulation;
+			counts = saved_counts;
+			samples = saved_samples;
+		};
+
+		// Stop running add_sample() or render(), can be called from any thread
+		inline void cancel() {
+			renderer.cancel();
+		};
+
+		// Add one sample to every pixel.
+		// Stops at deadline after finishing current tile rows, returns 1 if sample was completed.
+		bool add_sample(clock::time_point deadline = clock::time_point::max()) {
+			if (width != rt.get_width() || height != rt.get_height())
+				reset();
+
+			bool finished = renderer.run([this, deadline](const Tile& t, int) {
+				spaint::Color row[simd::PACKET_SIZE];
+
+				for (int y = t.y; y < t.y + t.height; ++y) {
+					if (renderer.is_cancelled())
+						return;
+					if (clock::now() >= deadline) {
+						renderer.cancel();
+						return;
+					}
+
+					size_t first = (size_t) y * width + t.x;
+					// Tile row is always rendered at once, so it's pixels have same count
+					int sample_index = counts[first];
+
+					for (int x = t.x; x < t.x + t.width; x += simd::PACKET_SIZE) {
+						int count = std::min(simd::PACKET_SIZE, t.x + t.width - x);
+						rt.frameColorRow(x, y, count, row, sample_index, nullptr, diffuse_count);
+
+						for (int i = 0; i < count; ++i) {
+							size_t p = (size_t) y * width + x + i;
+							accumulation[3 * p + 0] += row[i].r;
+							accumulation[3 * p + 1] += row[i].g;
+							accumulation[3 * p + 2] += row[i].b;
+							++counts[p];
+						}
+					}
+				}
+			});
+
+			if (finished)
+				++samples;
+			return finished;
+		};
+
+		// Add samples until max_samples per pixel are accumulated or time budget in seconds
+		//  is exceeded, 0 for no time limit. Returns number of accumulated samples.
+		int render(int max_samples, double time_budget = 0.0) {
+			clock::time_point deadline = clock::time_point::max();
+			if (time_budget > 0.0)
+				deadline = clock::now() + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(time_budget));
+
+			while (samples < max_samples)
+				if (!add_sample(deadline))
+					break;
+
+			return samples;
+		};
+
+		// Returns tone mapped average color of pixel
+		spaint::Color get_color(int x, int y) {
+			size_t p = (size_t) y * width + x;
+			if (!counts[p])
+				return spaint::Color::BLACK;
+
+			double scale = 1.0 / (255.0 * counts[p]);
+			return spaint::Color(map_channel(accumulation[3 * p + 0] * scale),
+								 map_channel(accumulation[3 * p + 1] * scale),
+								 map_channel(accumulation[3 * p + 2] * scale));
+		};
+
+		// Write tone mapped frame into buffer of width * height ABGR pixels
+		void resolve(unsigned int* frame) {
+			for (int y = 0; y < height; ++y)
+				for (int x = 0; x < width; ++x) {
+					spaint::Color c = get_color(x, y);
+					c.a = 255;
+					frame[x + (size_t) y * width] = c.abgr();
+				}
+		};
+	};
+};
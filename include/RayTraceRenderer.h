@@ -0,0 +1,459 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <stdexcept>
+#include <functional>
+
+#include "RayTrace.h"
+#include "RayTraceStats.h"
+
+namespace raytrace {
+
+	// Rectangular region of a frame
+	struct Tile {
+		// Index of tile in frame, tiles are ordered by rows
+		int id;
+		int x, y;
+		int width, height;
+	};
+
+	// Receiver of finished tiles of streaming render.
+	// write_tile() is called concurrently from worker threads.
+	class TileSink {
+
+	public:
+
+		virtual ~TileSink() {};
+
+		// Called before first tile with size of frame & tile_size of renderer
+		virtual void begin(int width, int height, int tile_size) = 0;
+
+		// Pixels of tile as t.height rows of t.width ABGR pixels, valid only during call
+		virtual void write_tile(const Tile& t, const unsigned int* pixels) = 0;
+
+		// Called after all tiles were written
+		virtual void finish() = 0;
+
+		// Called when render is cancelled, must release writers waiting for tiles which never come
+		virtual void abort() {};
+
+		// Sink expecting tiles in order of rows, renderer then hands out tiles in order
+		virtual bool ordered() {
+			return 0;
+		};
+	};
+
+	// Multithreaded frame renderer.
+	// Frame is splitten into tiles, each worker owns a contiguous range of
+	//  tiles and steals from the tail of other workers ranges when it's own
+	//  range is empty. Each pixel is written by exactly one worker, so
+	//  output does not depend on number of threads.
+	class Renderer {
+
+		// Range [head, tail) of tile indices packed into single word:
+		//  owner pops from head, thieves pop from tail.
+		struct alignas(64) WorkQueue {
+			std::atomic<uint64_t> range;
+
+			WorkQueue() : range(0) {};
+
+			static inline uint64_t pack(uint32_t head, uint32_t tail) {
+				return ((uint64_t) tail << 32) | head;
+			};
+
+			inline void reset(uint32_t head, uint32_t tail) {
+				range.store(pack(head, tail), std::memory_order_relaxed);
+			};
+
+			bool pop_front(int& tile) {
+				uint64_t r = range.load(std::memory_order_acquire);
+				while (1) {
+					uint32_t head = r & 0xFFFFFFFF;
+					uint32_t tail = r >> 32;
+					if (head >= tail)
+						return 0;
+					if (range.compare_exchange_weak(r, pack(head + 1, tail), std::memory_order_acq_rel)) {
+						tile = head;
+						return 1;
+					}
+				}
+			};
+
+			bool pop_back(int& tile) {
+				uint64_t r = range.load(std::memory_order_acquire);
+				while (1) {
+					uint32_t head = r & 0xFFFFFFFF;
+					uint32_t tail = r >> 32;
+					if (head >= tail)
+						return 0;
+					if (range.compare_exchange_weak(r, pack(head, tail - 1), std::memory_order_acq_rel)) {
+						tile = tail - 1;
+						return 1;
+					}
+				}
+			};
+		};
+
+		RayTrace& rt;
+
+		std::vector<Tile> tiles;
+		// Indices of tiles rendered by current run, queues hold ranges of this list
+		std::vector<int> pending;
+		std::vector<WorkQueue> queues;
+		// Workers share single queue, so tiles finish roughly in order of rows
+		bool ordered = 0;
+		// Sink of running streaming render, aborted by cancel()
+		std::atomic<TileSink*> active_sink;
+
+		std::atomic<bool> cancelled;
+		std::atomic<int> finished_tiles;
+		// Number of pixels supersampled by last adaptive render
+		int refined_pixels = 0;
+		// Counters of workers merged after each run, empty without RAYTRACE_STATS
+		RenderStats stats;
+
+		// Take next tile for worker, steal from others if own queue is empty
+		bool next_tile(int thread_id, int& tile) {
+			int position;
+			int own = thread_id % queues.size();
+			if (queues[own].pop_front(position)) {
+				tile = pending[position];
+				return 1;
+			}
+
+			for (int i = 1; i < (int) queues.size(); ++i)
+				if (queues[(own + i) % queues.size()].pop_back(position)) {
+					tile = pending[position];
+					return 1;
+				}
+
+			return 0;
+		};
+
+	public:
+
+		// Number of worker threads, 0 for number of hardware threads
+		int thread_count = 0;
+		// Size of tile side in pixels
+		int tile_size = 32;
+		// Trace primary rays of tile rows in packets
+		bool use_packets = 1;
+		// Called from worker thread after tile is finished
+		std::function<void(const Tile&)> on_tile;
+		// Tiles with nonzero flag are skipped by run() & counted as finished, indexed by Tile::id.
+		// Used to resume interrupted render, empty renders all tiles.
+		std::vector<uint8_t> skip_tiles;
+
+		Renderer(RayTrace& rt) : rt(rt), active_sink(nullptr), cancelled(0), finished_tiles(0) {};
+
+		Renderer(RayTrace& rt, int thread_count) : rt(rt), active_sink(nullptr), cancelled(0), finished_tiles(0), thread_count(thread_count) {};
+
+		inline RayTrace& get_raytrace() {
+			return rt;
+		};
+
+		// Returns number of threads used for rendering
+		int get_thread_count() {
+			if (thread_count > 0)
+				return thread_count;
+			int n = std::thread::hardware_concurrency();
+			return n > 0 ? n : 1;
+		};
+
+		// Split frame into tiles of tile_size
+		std::vector<Tile> make_tiles(int width, int height) {
+			std::vector<Tile> result;
+			int size = tile_size > 0 ? tile_size : 1;
+
+			for (int y = 0; y < height; y += size)
+				for (int x = 0; x < width; x += size) {
+					Tile t;
+					t.id     = result.size();
+					t.x      = x;
+					t.y      = y;
+					t.width  = std::min(size, width - x);
+					t.height = std::min(size, height - y);
+					result.push_back(t);
+				}
+
+			return result;
+		};
+
+		// Request render to stop, can be called from any thread.
+		// Workers finish current tile row and exit.
+		inline void cancel() {
+			cancelled.store(1, std::memory_order_relaxed);
+			TileSink* sink = active_sink.load();
+			if (sink)
+				sink->abort();
+		};
+
+		inline bool is_cancelled() {
+			return cancelled.load(std::memory_order_relaxed);
+		};
+
+		// Number of finished tiles in current render
+		inline int get_finished_tiles() {
+			return finished_tiles.load(std::memory_order_relaxed);
+		};
+
+		inline int get_total_tiles() {
+			return tiles.size();
+		};
+
+		// Statistics of runs since last render() or reset_stats(),
+		//  collected only when compiled with RAYTRACE_STATS
+		inline const RenderStats& get_stats() {
+			return stats;
+		};
+
+		inline void reset_stats() {
+			stats.reset();
+		};
+
+		// Run func(tile, thread_id) for each tile of camera frame not marked in skip_tiles on worker threads.
+		// Blocks until all tiles are done or render is cancelled.
+		// Returns 1 if all tiles were processed, 0 if render was cancelled.
+		bool run(const std::function<void(const Tile&, int)>& func) {
+			tiles = make_tiles(rt.get_width(), rt.get_height());
+			// Workers only read precomputed camera rays
+			rt.update_camera();
+			cancelled.store(0);
+
+			pending.clear();
+			for (int i = 0; i < (int) tiles.size(); ++i)
+				if (i >= (int) skip_tiles.size() || !skip_tiles[i])
+					pending.push_back(i);
+			finished_tiles.store(tiles.size() - pending.size());
+
+			int threads_count = std::min<int>(get_thread_count(), std::max<int>(pending.size(), 1));
+
+			// Assign contiguous ranges of tiles to workers
+			int queue_count = ordered ? 1 : threads_count;
+			queues = std::vector<WorkQueue>(queue_count);
+			for (int i = 0; i < queue_count; ++i)
+				queues[i].reset(pending.size() * i / queue_count, pending.size() * (i + 1) / queue_count);
+
+#ifdef RAYTRACE_STATS
+			// Each worker counts into own stats, so hot path has no shared writes
+			std::vector<RenderStats> thread_stats(threads_count);
+#endif
+
+			auto worker = [&](int thread_id) {
+#ifdef RAYTRACE_STATS
+				RenderStats* previous_stats = current_stats_slot();
+				current_stats_slot() = &thread_stats[thread_id];
+#endif
+				int tile;
+				while (!is_cancelled() && next_tile(thread_id, tile)) {
+#ifdef RAYTRACE_STATS
+					auto start = std::chrono::steady_clock::now();
+					func(tiles[tile], thread_id);
+					thread_stats[thread_id].tiles.push_back({ tile, thread_id, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() });
+#else
+					func(tiles[tile], thread_id);
+#endif
+
+					if (is_cancelled())
+						break;
+
+					finished_tiles.fetch_add(1, std::memory_order_relaxed);
+					if (on_tile)
+						on_tile(tiles[tile]);
+				}
+#ifdef RAYTRACE_STATS
+				current_stats_slot() = previous_stats;
+#endif
+			};
+
+			std::vector<std::thread> threads;
+			for (int i = 1; i < threads_count; ++i)
+				threads.emplace_back(worker, i);
+
+			// Calling thread is worker 0
+			worker(0);
+
+			for (std::thread& t : threads)
+				t.join();
+
+#ifdef RAYTRACE_STATS
+			for (const RenderStats& s : thread_stats)
+				stats.merge(s);
+#endif
+
+			return !is_cancelled();
+		};
+
+		// Render frame into buffer of width * height ABGR pixels.
+		// Uses adaptive anti-aliasing if it is enabled in RayTrace.
+		// Returns 1 if frame is complete, 0 if render was cancelled.
+		bool render(unsigned int* frame) {
+			stats.reset();
+
+			if (rt.adaptive_aa)
+				return render_adaptive(frame);
+
+			int width = rt.get_width();
+
+			return run([this, frame, width](const Tile& t, int) {
+				trace_tile(t, frame + t.x + (size_t) t.y * width, width);
+			});
+		};
+
+		// Trace pixels of tile, row y of tile is written at out + (y - t.y) * stride.
+		// Camera rays must be precomputed by RayTrace::update_camera(), run() does it.
+		// Returns 0 if render was cancelled before tile was finished.
+		bool trace_tile(const Tile& t, unsigned int* out, size_t stride) {
+			spaint::Color row[simd::PACKET_SIZE];
+
+			for (int y = t.y; y < t.y + t.height; ++y) {
+				if (is_cancelled())
+					return 0;
+
+				unsigned int* line = out + (size_t) (y - t.y) * stride - t.x;
+				for (int x = t.x; x < t.x + t.width; x += simd::PACKET_SIZE) {
+					int count = std::min(simd::PACKET_SIZE, t.x + t.width - x);
+					if (use_packets)
+						rt.frameColorRow(x, y, count, row);
+					else
+						for (int i = 0; i < count; ++i)
+							row[i] = rt.frameColorAt(x + i, y);
+
+					for (int i = 0; i < count; ++i) {
+						row[i].a = 255;
+						line[x + i] = row[i].abgr();
+					}
+				}
+			}
+
+			return 1;
+		};
+
+		// Render frame tile by tile into sink without frame buffer, so memory is bounded
+		//  by tiles in flight & rows buffered by sink instead of frame size.
+		// Adaptive anti-aliasing compares whole frame and is not used.
+		// Returns 1 if sink was finished, 0 if render was cancelled.
+		bool render(TileSink& sink) {
+			stats.reset();
+
+			if (sink.ordered() && !skip_tiles.empty())
+				throw std::runtime_error("Tiles can not be skipped in ordered output");
+
+			int size = tile_size > 0 ? tile_size : 1;
+			sink.begin(rt.get_width(), rt.get_height(), size);
+
+			// Tile buffer of each worker
+			std::vector<std::vector<unsigned int>> buffers(get_thread_count(), std::vector<unsigned int>((size_t) size * size));
+
+			ordered = sink.ordered();
+			active_sink.store(&sink);
+			bool finished = run([this, &sink, &buffers](const Tile& t, int thread_id) {
+				unsigned int* pixels = buffers[thread_id].data();
+				if (trace_tile(t, pixels, t.width))
+					sink.write_tile(t, pixels);
+			});
+			active_sink.store(nullptr);
+			ordered = 0;
+
+			if (finished)
+				sink.finish();
+			return finished;
+		};
+
+		// Number of pixels supersampled by last adaptive render
+		inline int get_refined_pixels() {
+			return refined_pixels;
+		};
+
+		// Render frame with adaptive anti-aliasing in two passes:
+		//  first pass traces one sample per pixel and records object seen by it,
+		//  second pass supersamples pixels which differ from neighbours.
+		// Contrast with neighbour seeing other object is higher than any color
+		//  difference, so geometric edges are refined before noise and shading.
+		bool render_adaptive(unsigned int* frame) {
+			int width = rt.get_width();
+			int height = rt.get_height();
+			size_t pixels = (size_t) width * height;
+
+			std::vector<spaint::Color> colors(pixels);
+			std::vector<int> ids(pixels);
+			refined_pixels = 0;
+
+			bool finished = run([this, width, &colors, &ids](const Tile& t, int) {
+				for (int y = t.y; y < t.y + t.height; ++y) {
+					if (is_cancelled())
+						return;
+
+					size_t p = (size_t) y * width + t.x;
+					rt.frameColorRow(t.x, y, t.width, &colors[p], 0, &ids[p]);
+				}
+			});
+
+			if (!finished)
+				return 0;
+
+			// Contrast of pixel is largest difference with 4 neighbours
+			const int EDGE = 4 * 255;
+			std::vector<int> candidates;
+			std::vector<int> contrast(pixels, 0);
+			for (int y = 0; y < height; ++y)
+				for (int x = 0; x < width; ++x) {
+					size_t p = (size_t) y * width + x;
+					int c = 0;
+					size_t neighbours[4];
+					int n = 0;
+					if (x > 0)          neighbours[n++] = p - 1;
+					if (x + 1 < width)  neighbours[n++] = p + 1;
+					if (y > 0)          neighbours[n++] = p - width;
+					if (y + 1 < height) neighbours[n++] = p + width;
+
+					for (int k = 0; k < n; ++k) {
+						size_t q = neighbours[k];
+						if (ids[q] != ids[p]) {
+							c = EDGE;
+							break;
+						}
+						c = std::max(c, std::abs(colors[p].r - colors[q].r) + std::abs(colors[p].g - colors[q].g) + std::abs(colors[p].b - colors[q].b));
+					}
+
+					contrast[p] = c;
+					if (c >= rt.aa_threshold)
+						candidates.push_back(p);
+				}
+
+			// Keep only pixels with highest contrast that fit into budget
+			size_t budget = std::max(0.0, std::min(1.0, rt.aa_budget)) * pixels;
+			if (candidates.size() > budget) {
+				std::nth_element(candidates.begin(), candidates.begin() + budget, candidates.end(), [&contrast](int a, int b) {
+					return contrast[a] != contrast[b] ? contrast[a] > contrast[b] : a < b;
+				});
+				candidates.resize(budget);
+			}
+
+			std::vector<uint8_t> refine(pixels, 0);
+			for (int p : candidates)
+				refine[p] = 1;
+			refined_pixels = candidates.size();
+
+			return run([this, frame, width, &colors, &refine](const Tile& t, int) {
+				for (int y = t.y; y < t.y + t.height; ++y) {
+					if (is_cancelled())
+						return;
+
+					for (int x = t.x; x < t.x + t.width; ++x) {
+						size_t p = (size_t) y * width + x;
+						spaint::Color c = refine[p] ? rt.hitColorSupersampled(x, y, colors[p]) : colors[p];
+						c.a = 255;
+						frame[p] = c.abgr();
+					}
+				}
+			});
+		};
+	};
+};
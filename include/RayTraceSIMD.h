@@ -0,0 +1,908 @@
+#pragma once
+
+#include <cmath>
+#include <limits>
+
+#include "vec3.h"
+#include "RayTracePrimitives.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+	#include <immintrin.h>
+	#define RAYTRACE_SIMD_X86
+	#define RAYTRACE_TARGET(t) __attribute__((target(t)))
+#endif
+
+namespace raytrace {
+
+	// Intersection kernels testing one ray against block of primitives stored
+	//  in structure of arrays, or packet of rays against single primitive.
+	// Kernel is selected at runtime by supported instruction set:
+	//  AVX2 tests 4 primitives per register and 8 per iteration,
+	//  SSE tests 2 per register and 4 per iteration.
+	// Single precision kernels test twice as many primitives per register and run
+	//  about 2x faster, but are not used by RayTraceScene: BVH leaves hold few
+	//  primitives, so with double traversal & shading a render using them measured
+	//  0.96-1.18x of double precision time. They are kept for leaf heavy callers.
+	// All kernels perform same operations as scalar code of their precision
+	//  and return bit-identical distances.
+	namespace simd {
+
+		enum Level {
+			SCALAR,
+			SSE,
+			AVX2
+		};
+
+		// Maximal number of rays in packet
+		static const int PACKET_SIZE = 4;
+
+		// Packet of rays stored as structure of arrays
+		struct RayPacket {
+			double ox[PACKET_SIZE], oy[PACKET_SIZE], oz[PACKET_SIZE];
+			double dx[PACKET_SIZE], dy[PACKET_SIZE], dz[PACKET_SIZE];
+			// Same rays in single precision for float kernels
+			float fox[PACKET_SIZE], foy[PACKET_SIZE], foz[PACKET_SIZE];
+			float fdx[PACKET_SIZE], fdy[PACKET_SIZE], fdz[PACKET_SIZE];
+			// Number of valid rays
+			int count = 0;
+
+			void set(int i, const cppmath::vec3& origin, const cppmath::vec3& direction) {
+				ox[i] = origin.x;
+				oy[i] = origin.y;
+				oz[i] = origin.z;
+				dx[i] = direction.x;
+				dy[i] = direction.y;
+				dz[i] = direction.z;
+				fox[i] = origin.x;
+				foy[i] = origin.y;
+				foz[i] = origin.z;
+				fdx[i] = direction.x;
+				fdy[i] = direction.y;
+				fdz[i] = direction.z;
+			};
+		};
+
+		// Find closest primitive in [begin, end) hit closer than t.
+		// On hit t and index are updated and 1 is returned.
+		typedef bool (*SpheresClosest)(const SphereSoA& s, int begin, int end, const cppmath::vec3& o, const cppmath::vec3& d, double& t, int& index);
+		typedef bool (*TrianglesClosest)(const TriangleSoA& s, int begin, int end, const cppmath::vec3& o, const cppmath::vec3& d, double& t, int& index);
+		// Intersect packet of rays with primitive i, update t and index of rays that hit it closer
+		typedef void (*SpherePacket)(const SphereSoA& s, int i, const RayPacket& p, double* t, int* index);
+		typedef void (*TrianglePacket)(const TriangleSoA& s, int i, const RayPacket& p, double* t, int* index);
+		// Same kernels testing primitives stored in single precision
+		typedef bool (*SpheresClosestF)(const SphereSoAf& s, int begin, int end, const cppmath::vec3& o, const cppmath::vec3& d, double& t, int& index);
+		typedef bool (*TrianglesClosestF)(const TriangleSoAf& s, int begin, int end, const cppmath::vec3& o, const cppmath::vec3& d, double& t, int& index);
+		typedef void (*SpherePacketF)(const SphereSoAf& s, int i, const RayPacket& p, double* t, int* index);
+		typedef void (*TrianglePacketF)(const TriangleSoAf& s, int i, const RayPacket& p, double* t, int* index);
+
+		// S C A L A R
+
+		template<typename Scalar>
+		inline bool spheres_closest_scalar(const SphereSoAT<Scalar>& s, int begin, int end, const cppmath::vec3& o, const cppmath::vec3& d, double& t, int& index) {
+			bool found = 0;
+			for (int i = begin; i < end; ++i) {
+				double ti = s.intersect(i, o, d);
+				if (ti < t) {
+					t = ti;
+					index = i;
+					found = 1;
+				}
+			}
+			return found;
+		};
+
+		template<typename Scalar>
+		inline bool triangles_closest_scalar(const TriangleSoAT<Scalar>& s, int begin, int end, const cppmath::vec3& o, const cppmath::vec3& d, double& t, int& index) {
+			bool found = 0;
+			for (int i = begin; i < end; ++i) {
+				double ti = s.intersect(i, o, d);
+				if (ti >= hit_epsilon<Scalar>() && ti < t) {
+					t = ti;
+					index = i;
+					found = 1;
+				}
+			}
+			return found;
+		};
+
+		template<typename Scalar>
+		inline void sphere_packet_scalar(const SphereSoAT<Scalar>& s, int i, const RayPacket& p, double* t, int* index) {
+			for (int r = 0; r < p.count; ++r) {
+				double ti = s.intersect(i, cppmath::vec3(p.ox[r], p.oy[r], p.oz[r]), cppmath::vec3(p.dx[r], p.dy[r], p.dz[r]));
+				if (ti < t[r]) {
+					t[r] = ti;
+					index[r] = i;
+				}
+			}
+		};
+
+		template<typename Scalar>
+		inline void triangle_packet_scalar(const TriangleSoAT<Scalar>& s, int i, const RayPacket& p, double* t, int* index) {
+			for (int r = 0; r < p.count; ++r) {
+				double ti = s.intersect(i, cppmath::vec3(p.ox[r], p.oy[r], p.oz[r]), cppmath::vec3(p.dx[r], p.dy[r], p.dz[r]));
+				if (ti >= hit_epsilon<Scalar>() && ti < t[r]) {
+					t[r] = ti;
+					index[r] = i;
+				}
+			}
+		};
+
+		// Smallest float not less than t, float distances compared with it
+		//  are never rejected while being closer than t
+		inline float float_bound(double t) {
+			if (!(t < std::numeric_limits<float>::max()))
+				return std::numeric_limits<float>::infinity();
+			float f = (float) t;
+			return f < t ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+		};
+
+#ifdef RAYTRACE_SIMD_X86
+
+		// Pick closest lane of distances, first lane wins ties like in scalar loop
+		template<typename Lane>
+		inline bool reduce_lanes(const Lane* lanes, int count, int first, double& t, int& index) {
+			bool found = 0;
+			for (int l = 0; l < count; ++l)
+				if (lanes[l] < t) {
+					t = lanes[l];
+					index = first + l;
+					found = 1;
+				}
+			return found;
+		};
+
+		// S S E
+
+		// Sphere distances of 2 lanes, infinity on miss
+		RAYTRACE_TARGET("sse2")
+		inline __m128d sphere_sse(__m128d cx, __m128d cy, __m128d cz, __m128d r,
+								  __m128d ox, __m128d oy, __m128d oz, __m128d dx, __m128d dy, __m128d dz) {
+			const __m128d inf  = _mm_set1_pd(std::numeric_limits<double>::infinity());
+			const __m128d eps  = _mm_set1_pd(10e-8);
+			const __m128d sign = _mm_set1_pd(-0.0);
+
+			__m128d px = _mm_sub_pd(ox, cx);
+			__m128d py = _mm_sub_pd(oy, cy);
+			__m128d pz = _mm_sub_pd(oz, cz);
+
+			__m128d a = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)), _mm_mul_pd(dz, dz));
+			__m128d b = _mm_mul_pd(_mm_set1_pd(2.0), _mm_add_pd(_mm_add_pd(_mm_mul_pd(px, dx), _mm_mul_pd(py, dy)), _mm_mul_pd(pz, dz)));
+			__m128d c = _mm_sub_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(px, px), _mm_mul_pd(py, py)), _mm_mul_pd(pz, pz)), _mm_mul_pd(r, r));
+			__m128d disc = _mm_sub_pd(_mm_mul_pd(b, b), _mm_mul_pd(_mm_mul_pd(_mm_set1_pd(4.0), a), c));
+
+			__m128d hit = _mm_cmpge_pd(disc, _mm_setzero_pd());
+			__m128d sq  = _mm_sqrt_pd(_mm_and_pd(disc, hit));
+			__m128d nb  = _mm_xor_pd(b, sign);
+			__m128d a2  = _mm_mul_pd(_mm_set1_pd(2.0), a);
+			__m128d t0  = _mm_div_pd(_mm_sub_pd(nb, sq), a2);
+			__m128d t1  = _mm_div_pd(_mm_add_pd(nb, sq), a2);
+
+			// t0 < eps selects t1
+			__m128d use1 = _mm_cmplt_pd(t0, eps);
+			__m128d t = _mm_or_pd(_mm_and_pd(use1, t1), _mm_andnot_pd(use1, t0));
+			hit = _mm_and_pd(hit, _mm_cmpge_pd(t, eps));
+
+			return _mm_or_pd(_mm_and_pd(hit, t), _mm_andnot_pd(hit, inf));
+		};
+
+		RAYTRACE_TARGET("sse2")
+		inline __m128d sphere_sse_at(const SphereSoA& s, int i, __m128d ox, __m128d oy, __m128d oz, __m128d dx, __m128d dy, __m128d dz) {
+			return sphere_sse(_mm_loadu_pd(&s.cx[i]), _mm_loadu_pd(&s.cy[i]), _mm_loadu_pd(&s.cz[i]), _mm_loadu_pd(&s.radius[i]), ox, oy, oz, dx, dy, dz);
+		};
+
+		RAYTRACE_TARGET("sse2")
+		inline bool spheres_closest_sse(const SphereSoA& s, int begin, int end, const cppmath::vec3& o, const cppmath::vec3& d, double& t, int& index) {
+			__m128d ox = _mm_set1_pd(o.x), oy = _mm_set1_pd(o.y), oz = _mm_set1_pd(o.z);
+			__m128d dx = _mm_set1_pd(d.x), dy = _mm_set1_pd(d.y), dz = _mm_set1_pd(d.z);
+
+			bool found = 0;
+			alignas(16) double lanes[4];
+			int i = begin;
+			for (; i + 4 <= end; i += 4) {
+				__m128d d0 = sphere_sse_at(s, i,     ox, oy, oz, dx, dy, dz);
+				__m128d d1 = sphere_sse_at(s, i + 2, ox, oy, oz, dx, dy, dz);
+				__m128d tv = _mm_set1_pd(t);
+				// Most blocks are missed, reduce only blocks having closer hit
+				if (!_mm_movemask_pd(_mm_or_pd(_mm_cmplt_pd(d0, tv), _mm_cmplt_pd(d1, tv))))
+					continue;
+				_mm_store_pd(lanes,     d0);
+				_mm_store_pd(lanes + 2, d1);
+				found |= reduce_lanes(lanes, 4, i, t, index);
+			}
+			for (; i + 2 <= end; i += 2) {
+				_mm_store_pd(lanes, sphere_sse_at(s, i, ox, oy, oz, dx, dy, dz));
+				found |= reduce_lanes(lanes, 2, i, t, index);
+			}
+			// Tail is counted by SoA intersect
+			RAYTRACE_COUNT(tests[TEST_SPHERE] += i - begin);
+			found |= spheres_closest_scalar(s, i, end, o, d, t, index);
+			return found;
+		};
+
+		// Triangle distances of 2 lanes, infinity on miss or hit behind ray origin
+		RAYTRACE_TARGET("sse2")
+		inline __m128d triangle_sse(__m128d ax, __m128d ay, __m128d az,
+									__m128d e1x, __m128d e1y, __m128d e1z,
+									__m128d e2x, __m128d e2y, __m128d e2z,
+									__m128d ox, __m128d oy, __m128d oz, __m128d dx, __m128d dy, __m128d dz) {
+			const __m128d inf  = _mm_set1_pd(std::numeric_limits<double>::infinity());
+			const __m128d zero = _mm_setzero_pd();
+			const __m128d one  = _mm_set1_pd(1.0);
+
+			__m128d px = _mm_sub_pd(_mm_mul_pd(dy, e2z), _mm_mul_pd(dz, e2y));
+			__m128d py = _mm_sub_pd(_mm_mul_pd(dz, e2x), _mm_mul_pd(dx, e2z));
+			__m128d pz = _mm_sub_pd(_mm_mul_pd(dx, e2y), _mm_mul_pd(dy, e2x));
+
+			__m128d det = _mm_add_pd(_mm_add_pd(_mm_mul_pd(e1x, px), _mm_mul_pd(e1y, py)), _mm_mul_pd(e1z, pz));
+			__m128d miss = _mm_and_pd(_mm_cmplt_pd(det, _mm_set1_pd(1e-8)), _mm_cmpgt_pd(det, _mm_set1_pd(-1e-8)));
+
+			__m128d inv = _mm_div_pd(one, det);
+			__m128d tx = _mm_sub_pd(ox, ax);
+			__m128d ty = _mm_sub_pd(oy, ay);
+			__m128d tz = _mm_sub_pd(oz, az);
+
+			__m128d u = _mm_mul_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(tx, px), _mm_mul_pd(ty, py)), _mm_mul_pd(tz, pz)), inv);
+			miss = _mm_or_pd(miss, _mm_or_pd(_mm_cmplt_pd(u, zero), _mm_cmpgt_pd(u, one)));
+
+			__m128d qx = _mm_sub_pd(_mm_mul_pd(ty, e1z), _mm_mul_pd(tz, e1y));
+			__m128d qy = _mm_sub_pd(_mm_mul_pd(tz, e1x), _mm_mul_pd(tx, e1z));
+			__m128d qz = _mm_sub_pd(_mm_mul_pd(tx, e1y), _mm_mul_pd(ty, e1x));
+
+			__m128d v = _mm_mul_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, qx), _mm_mul_pd(dy, qy)), _mm_mul_pd(dz, qz)), inv);
+			miss = _mm_or_pd(miss, _mm_or_pd(_mm_cmplt_pd(v, zero), _mm_cmpgt_pd(_mm_add_pd(u, v), one)));
+
+			__m128d t = _mm_mul_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(e2x, qx), _mm_mul_pd(e2y, qy)), _mm_mul_pd(e2z, qz)), inv);
+			__m128d hit = _mm_andnot_pd(miss, _mm_cmpge_pd(t, _mm_set1_pd(10e-8)));
+
+			return _mm_or_pd(_mm_and_pd(hit, t), _mm_andnot_pd(hit, inf));
+		};
+
+		RAYTRACE_TARGET("sse2")
+		inline __m128d triangle_sse_at(const TriangleSoA& s, int i, __m128d ox, __m128d oy, __m128d oz, __m128d dx, __m128d dy, __m128d dz) {
+			return triangle_sse(_mm_loadu_pd(&s.ax[i]),  _mm_loadu_pd(&s.ay[i]),  _mm_loadu_pd(&s.az[i]),
+								_mm_loadu_pd(&s.e1x[i]), _mm_loadu_pd(&s.e1y[i]), _mm_loadu_pd(&s.e1z[i]),
+								_mm_loadu_pd(&s.e2x[i]), _mm_loadu_pd(&s.e2y[i]), _mm_loadu_pd(&s.e2z[i]),
+								ox, oy, oz, dx, dy, dz);
+		};
+
+		RAYTRACE_TARGET("sse2")
+		inline bool triangles_closest_sse(const TriangleSoA& s, int begin, int end, const cppmath::vec3& o, const cppmath::vec3& d, double& t, int& index) {
+			__m128d ox = _mm_set1_pd(o.x), oy = _mm_set1_pd(o.y), oz = _mm_set1_pd(o.z);
+			__m128d dx = _mm_set1_pd(d.x), dy = _mm_set1_pd(d.y), dz = _mm_set1_pd(d.z);
+
+			bool found = 0;
+			alignas(16) double lanes[4];
+			int i = begin;
+			for (; i + 4 <= end; i += 4) {
+				__m128d d0 = triangle_sse_at(s, i,     ox, oy, oz, dx, dy, dz);
+				__m128d d1 = triangle_sse_at(s, i + 2, ox, oy, oz, dx, dy, dz);
+				__m128d tv = _mm_set1_pd(t);
+				// Most blocks are missed, reduce only blocks having closer hit
+				if (!_mm_movemask_pd(_mm_or_pd(_mm_cmplt_pd(d0, tv), _mm_cmplt_pd(d1, tv))))
+					continue;
+				_mm_store_pd(lanes,     d0);
+				_mm_store_pd(lanes + 2, d1);
+				found |= reduce_lanes(lanes, 4, i, t, index);
+			}
+			for (; i + 2 <= end; i += 2) {
+				_mm_store_pd(lanes, triangle_sse_at(s, i, ox, oy, oz, dx, dy, dz));
+				found |= reduce_lanes(lanes, 2, i, t, index);
+			}
+			// Tail is counted by SoA intersect
+			RAYTRACE_COUNT(tests[TEST_TRIANGLE] += i - begin);
+			found |= triangles_closest_scalar(s, i, end, o, d, t, index);
+			return found;
+		};
+
+		// A V X 2
+
+		// Sphere distances of 4 lanes, infinity on miss
+		RAYTRACE_TARGET("avx2")
+		inline __m256d sphere_avx2(__m256d cx, __m256d cy, __m256d cz, __m256d r,
+								   __m256d ox, __m256d oy, __m256d oz, __m256d dx, __m256d dy, __m256d dz) {
+			const __m256d inf  = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+			const __m256d eps  = _mm256_set1_pd(10e-8);
+			const __m256d sign = _mm256_set1_pd(-0.0);
+
+			__m256d px = _mm256_sub_pd(ox, cx);
+			__m256d py = _mm256_sub_pd(oy, cy);
+			__m256d pz = _mm256_sub_pd(oz, cz);
+
+			__m256d a = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)), _mm256_mul_pd(dz, dz));
+			__m256d b = _mm256_mul_pd(_mm256_set1_pd(2.0), _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(px, dx), _mm256_mul_pd(py, dy)), _mm256_mul_pd(pz, dz)));
+			__m256d c = _mm256_sub_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(px, px), _mm256_mul_pd(py, py)), _mm256_mul_pd(pz, pz)), _mm256_mul_pd(r, r));
+			__m256d disc = _mm256_sub_pd(_mm256_mul_pd(b, b), _mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(4.0), a), c));
+
+			__m256d hit = _mm256_cmp_pd(disc, _mm256_setzero_pd(), _CMP_GE_OQ);
+			__m256d sq  = _mm256_sqrt_pd(_mm256_and_pd(disc, hit));
+			__m256d nb  = _mm256_xor_pd(b, sign);
+			__m256d a2  = _mm256_mul_pd(_mm256_set1_pd(2.0), a);
+			__m256d t0  = _mm256_div_pd(_mm256_sub_pd(nb, sq), a2);
+			__m256d t1  = _mm256_div_pd(_mm256_add_pd(nb, sq), a2);
+
+			__m256d t = _mm256_blendv_pd(t0, t1, _mm256_cmp_pd(t0, eps, _CMP_LT_OQ));
+			hit = _mm256_and_pd(hit, _mm256_cmp_pd(t, eps, _CMP_GE_OQ));
+
+			return _mm256_blendv_pd(inf, t, hit);
+		};
+
+		RAYTRACE_TARGET("avx2")
+		inline bool spheres_closest_avx2(const SphereSoA& s, int begin, int end, const cppmath::vec3& o, const cppmath::vec3& d, double& t, int& index) {
+			__m256d ox = _mm256_set1_pd(o.x), oy = _mm256_set1_pd(o.y), oz = _mm256_set1_pd(o.z);
+			__m256d dx = _mm256_set1_pd(d.x), dy = _mm256_set1_pd(d.y), dz = _mm256_set1_pd(d.z);
+
+			bool found = 0;
+			alignas(32) double lanes[8];
+			int i = begin;
+			for (; i + 8 <= end; i += 8) {
+				__m256d d0 = sphere_avx2(_mm256_loadu_pd(&s.cx[i]),     _mm256_loadu_pd(&s.cy[i]),     _mm256_loadu_pd(&s.cz[i]),     _mm256_loadu_pd(&s.radius[i]),     ox, oy, oz, dx, dy, dz);
+				__m256d d1 = sphere_avx2(_mm256_loadu_pd(&s.cx[i + 4]), _mm256_loadu_pd(&s.cy[i + 4]), _mm256_loadu_pd(&s.cz[i + 4]), _mm256_loadu_pd(&s.radius[i + 4]), ox, oy, oz, dx, dy, dz);
+				__m256d tv = _mm256_set1_pd(t);
+				if (!_mm256_movemask_pd(_mm256_or_pd(_mm256_cmp_pd(d0, tv, _CMP_LT_OQ), _mm256_cmp_pd(d1, tv, _CMP_LT_OQ))))
+					continue;
+				_mm256_store_pd(lanes,     d0);
+				_mm256_store_pd(lanes + 4, d1);
+				found |= reduce_lanes(lanes, 8, i, t, index);
+			}
+			for (; i + 4 <= end; i += 4) {
+				_mm256_store_pd(lanes, sphere_avx2(_mm256_loadu_pd(&s.cx[i]), _mm256_loadu_pd(&s.cy[i]), _mm256_loadu_pd(&s.cz[i]), _mm256_loadu_pd(&s.radius[i]), ox, oy, oz, dx, dy, dz));
+				found |= reduce_lanes(lanes, 4, i, t, index);
+			}
+			// Tail is counted by SoA intersect
+			RAYTRACE_COUNT(tests[TEST_SPHERE] += i - begin);
+			found |= spheres_closest_scalar(s, i, end, o, d, t, index);
+			return found;
+		};
+
+		// Triangle distances of 4 lanes, infinity on miss or hit behind ray origin
+		RAYTRACE_TARGET("avx2")
+		inline __m256d triangle_avx2(__m256d ax, __m256d ay, __m256d az,
+									 __m256d e1x, __m256d e1y, __m256d e1z,
+									 __m256d e2x, __m256d e2y, __m256d e2z,
+									 __m256d ox, __m256d oy, __m256d oz, __m256d dx, __m256d dy, __m256d dz) {
+			const __m256d inf  = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+			const __m256d zero = _mm256_setzero_pd();
+			const __m256d one  = _mm256_set1_pd(1.0);
+
+			__m256d px = _mm256_sub_pd(_mm256_mul_pd(dy, e2z), _mm256_mul_pd(dz, e2y));
+			__m256d py = _mm256_sub_pd(_mm256_mul_pd(dz, e2x), _mm256_mul_pd(dx, e2z));
+			__m256d pz = _mm256_sub_pd(_mm256_mul_pd(dx, e2y), _mm256_mul_pd(dy, e2x));
+
+			__m256d det = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e1x, px), _mm256_mul_pd(e1y, py)), _mm256_mul_pd(e1z, pz));
+			__m256d miss = _mm256_and_pd(_mm256_cmp_pd(det, _mm256_set1_pd(1e-8), _CMP_LT_OQ), _mm256_cmp_pd(det, _mm256_set1_pd(-1e-8), _CMP_GT_OQ));
+
+			__m256d inv = _mm256_div_pd(one, det);
+			__m256d tx = _mm256_sub_pd(ox, ax);
+			__m256d ty = _mm256_sub_pd(oy, ay);
+			__m256d tz = _mm256_sub_pd(oz, az);
+
+			__m256d u = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(tx, px), _mm256_mul_pd(ty, py)), _mm256_mul_pd(tz, pz)), inv);
+			miss = _mm256_or_pd(miss, _mm256_or_pd(_mm256_cmp_pd(u, zero, _CMP_LT_OQ), _mm256_cmp_pd(u, one, _CMP_GT_OQ)));
+
+			__m256d qx = _mm256_sub_pd(_mm256_mul_pd(ty, e1z), _mm256_mul_pd(tz, e1y));
+			__m256d qy = _mm256_sub_pd(_mm256_mul_pd(tz, e1x), _mm256_mul_pd(tx, e1z));
+			__m256d qz = _mm256_sub_pd(_mm256_mul_pd(tx, e1y), _mm256_mul_pd(ty, e1x));
+
+			__m256d v = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, qx), _mm256_mul_pd(dy, qy)), _mm256_mul_pd(dz, qz)), inv);
+			miss = _mm256_or_pd(miss, _mm256_or_pd(_mm256_cmp_pd(v, zero, _CMP_LT_OQ), _mm256_cmp_pd(_mm256_add_pd(u, v), one, _CMP_GT_OQ)));
+
+			__m256d t = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e2x, qx), _mm256_mul_pd(e2y, qy)), _mm256_mul_pd(e2z, qz)), inv);
+			__m256d hit = _mm256_andnot_pd(miss, _mm256_cmp_pd(t, _mm256_set1_pd(10e-8), _CMP_GE_OQ));
+
+			return _mm256_blendv_pd(inf, t, hit);
+		};
+
+		RAYTRACE_TARGET("avx2")
+		inline __m256d triangle_avx2_at(const TriangleSoA& s, int i, __m256d ox, __m256d oy, __m256d oz, __m256d dx, __m256d dy, __m256d dz) {
+			return triangle_avx2(_mm256_loadu_pd(&s.ax[i]),  _mm256_loadu_pd(&s.ay[i]),  _mm256_loadu_pd(&s.az[i]),
+								 _mm256_loadu_pd(&s.e1x[i]), _mm256_loadu_pd(&s.e1y[i]), _mm256_loadu_pd(&s.e1z[i]),
+								 _mm256_loadu_pd(&s.e2x[i]), _mm256_loadu_pd(&s.e2y[i]), _mm256_loadu_pd(&s.e2z[i]),
+								 ox, oy, oz, dx, dy, dz);
+		};
+
+		RAYTRACE_TARGET("avx2")
+		inline bool triangles_closest_avx2(const TriangleSoA& s, int begin, int end, const cppmath::vec3& o, const cppmath::vec3& d, double& t, int& index) {
+			__m256d ox = _mm256_set1_pd(o.x), oy = _mm256_set1_pd(o.y), oz = _mm256_set1_pd(o.z);
+			__m256d dx = _mm256_set1_pd(d.x), dy = _mm256_set1_pd(d.y), dz = _mm256_set1_pd(d.z);
+
+			bool found = 0;
+			alignas(32) double lanes[8];
+			int i = begin;
+			for (; i + 8 <= end; i += 8) {
+				__m256d d0 = triangle_avx2_at(s, i,     ox, oy, oz, dx, dy, dz);
+				__m256d d1 = triangle_avx2_at(s, i + 4, ox, oy, oz, dx, dy, dz);
+				__m256d tv = _mm256_set1_pd(t);
+				if (!_mm256_movemask_pd(_mm256_or_pd(_mm256_cmp_pd(d0, tv, _CMP_LT_OQ), _mm256_cmp_pd(d1, tv, _CMP_LT_OQ))))
+					continue;
+				_mm256_store_pd(lanes,     d0);
+				_mm256_store_pd(lanes + 4, d1);
+				found |= reduce_lanes(lanes, 8, i, t, index);
+			}
+			for (; i + 4 <= end; i += 4) {
+				_mm256_store_pd(lanes, triangle_avx2_at(s, i, ox, oy, oz, dx, dy, dz));
+				found |= reduce_lanes(lanes, 4, i, t, index);
+			}
+			// Tail is counted by SoA intersect
+			RAYTRACE_COUNT(tests[TEST_TRIANGLE] += i - begin);
+			found |= triangles_closest_scalar(s, i, end, o, d, t, index);
+			return found;
+		};
+
+		// Packet kernels: one primitive against 4 rays in lanes
+
+		RAYTRACE_TARGET("avx2")
+		inline void sphere_packet_avx2(const SphereSoA& s, int i, const RayPacket& p, double* t, int* index) {
+			if (p.count != PACKET_SIZE) {
+				sphere_packet_scalar(s, i, p, t, index);
+				return;
+			}
+			RAYTRACE_COUNT(tests[TEST_SPHERE] += PACKET_SIZE);
+
+			__m256d d = sphere_avx2(_mm256_set1_pd(s.cx[i]), _mm256_set1_pd(s.cy[i]), _mm256_set1_pd(s.cz[i]), _mm256_set1_pd(s.radius[i]),
+									_mm256_loadu_pd(p.ox), _mm256_loadu_pd(p.oy), _mm256_loadu_pd(p.oz),
+									_mm256_loadu_pd(p.dx), _mm256_loadu_pd(p.dy), _mm256_loadu_pd(p.dz));
+			__m256d tv = _mm256_loadu_pd(t);
+			__m256d closer = _mm256_cmp_pd(d, tv, _CMP_LT_OQ);
+			int mask = _mm256_movemask_pd(closer);
+			if (!mask)
+				return;
+
+			_mm256_storeu_pd(t, _mm256_blendv_pd(tv, d, closer));
+			for (int r = 0; r < PACKET_SIZE; ++r)
+				if (mask & (1 << r))
+					index[r] = i;
+		};
+
+		RAYTRACE_TARGET("avx2")
+		inline void triangle_packet_avx2(const TriangleSoA& s, int i, const RayPacket& p, double* t, int* index) {
+			if (p.count != PACKET_SIZE) {
+				triangle_packet_scalar(s, i, p, t, index);
+				return;
+			}
+			RAYTRACE_COUNT(tests[TEST_TRIANGLE] += PACKET_SIZE);
+
+			__m256d d = triangle_avx2(_mm256_set1_pd(s.ax[i]),  _mm256_set1_pd(s.ay[i]),  _mm256_set1_pd(s.az[i]),
+									  _mm256_set1_pd(s.e1x[i]), _mm256_set1_pd(s.e1y[i]), _mm256_set1_pd(s.e1z[i]),
+									  _mm256_set1_pd(s.e2x[i]), _mm256_set1_pd(s.e2y[i]), _mm256_set1_pd(s.e2z[i]),
+									  _mm256_loadu_pd(p.ox), _mm256_loadu_pd(p.oy), _mm256_loadu_pd(p.oz),
+									  _mm256_loadu_pd(p.dx), _mm256_loadu_pd(p.dy), _mm256_loadu_pd(p.dz));
+			__m256d tv = _mm256_loadu_pd(t);
+			__m256d closer = _mm256_cmp_pd(d, tv, _CMP_LT_OQ);
+			int mask = _mm256_movemask_pd(closer);
+			if (!mask)
+				return;
+
+			_mm256_storeu_pd(t, _mm256_blendv_pd(tv, d, closer));
+			for (int r = 0; r < PACKET_SIZE; ++r)
+				if (mask & (1 << r))
+					index[r] = i;
+		};
+
+		RAYTRACE_TARGET("sse2")
+		inline void sphere_packet_sse(const SphereSoA& s, int i, const RayPacket& p, double* t, int* index) {
+			if (p.count != PACKET_SIZE) {
+				sphere_packet_scalar(s, i, p, t, index);
+				return;
+			}
+			RAYTRACE_COUNT(tests[TEST_SPHERE] += PACKET_SIZE);
+
+			__m128d cx = _mm_set1_pd(s.cx[i]), cy = _mm_set1_pd(s.cy[i]), cz = _mm_set1_pd(s.cz[i]), r = _mm_set1_pd(s.radius[i]);
+			alignas(16) double lanes[PACKET_SIZE];
+			_mm_store_pd(lanes,     sphere_sse(cx, cy, cz, r, _mm_loadu_pd(p.ox),     _mm_loadu_pd(p.oy),     _mm_loadu_pd(p.oz),     _mm_loadu_pd(p.dx),     _mm_loadu_pd(p.dy),     _mm_loadu_pd(p.dz)));
+			_mm_store_pd(lanes + 2, sphere_sse(cx, cy, cz, r, _mm_loadu_pd(p.ox + 2), _mm_loadu_pd(p.oy + 2), _mm_loadu_pd(p.oz + 2), _mm_loadu_pd(p.dx + 2), _mm_loadu_pd(p.dy + 2), _mm_loadu_pd(p.dz + 2)));
+			for (int k = 0; k < PACKET_SIZE; ++k)
+				if (lanes[k] < t[k]) {
+					t[k] = lanes[k];
+					index[k] = i;
+				}
+		};
+
+		RAYTRACE_TARGET("sse2")
+		inline void triangle_packet_sse(const TriangleSoA& s, int i, const RayPacket& p, double* t, int* index) {
+			if (p.count != PACKET_SIZE) {
+				triangle_packet_scalar(s, i, p, t, index);
+				return;
+			}
+			RAYTRACE_COUNT(tests[TEST_TRIANGLE] += PACKET_SIZE);
+
+			__m128d ax  = _mm_set1_pd(s.ax[i]),  ay  = _mm_set1_pd(s.ay[i]),  az  = _mm_set1_pd(s.az[i]);
+			__m128d e1x = _mm_set1_pd(s.e1x[i]), e1y = _mm_set1_pd(s.e1y[i]), e1z = _mm_set1_pd(s.e1z[i]);
+			__m128d e2x = _mm_set1_pd(s.e2x[i]), e2y = _mm_set1_pd(s.e2y[i]), e2z = _mm_set1_pd(s.e2z[i]);
+			alignas(16) double lanes[PACKET_SIZE];
+			for (int k = 0; k < PACKET_SIZE; k += 2)
+				_mm_store_pd(lanes + k, triangle_sse(ax, ay, az, e1x, e1y, e1z, e2x, e2y, e2z,
+													 _mm_loadu_pd(p.ox + k), _mm_loadu_pd(p.oy + k), _mm_loadu_pd(p.oz + k),
+													 _mm_loadu_pd(p.dx + k), _mm_loadu_pd(p.dy + k), _mm_loadu_pd(p.dz + k)));
+			for (int k = 0; k < PACKET_SIZE; ++k)
+				if (lanes[k] < t[k]) {
+					t[k] = lanes[k];
+					index[k] = i;
+				}
+		};
+
+		// S S E   S I N G L E   P R E C I S I O N
+
+		// Sphere distances of 4 lanes, infinity on miss
+		RAYTRACE_TARGET("sse2")
+		inline __m128 sphere_sse_ps(__m128 cx, __m128 cy, __m128 cz, __m128 r,
+									__m128 ox, __m128 oy, __m128 oz, __m128 dx, __m128 dy, __m128 dz) {
+			const __m128 inf  = _mm_set1_ps(std::numeric_limits<float>::infinity());
+			const __m128 eps  = _mm_set1_ps(hit_epsilon<float>());
+			const __m128 sign = _mm_set1_ps(-0.0f);
+
+			__m128 px = _mm_sub_ps(ox, cx);
+			__m128 py = _mm_sub_ps(oy, cy);
+			__m128 pz = _mm_sub_ps(oz, cz);
+
+			__m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+			__m128 b = _mm_mul_ps(_mm_set1_ps(2.0f), _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, dx), _mm_mul_ps(py, dy)), _mm_mul_ps(pz, dz)));
+			__m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(px, px), _mm_mul_ps(py, py)), _mm_mul_ps(pz, pz)), _mm_mul_ps(r, r));
+			__m128 disc = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(4.0f), a), c));
+
+			__m128 hit = _mm_cmpge_ps(disc, _mm_setzero_ps());
+			__m128 sq  = _mm_sqrt_ps(_mm_and_ps(disc, hit));
+			__m128 nb  = _mm_xor_ps(b, sign);
+			__m128 a2  = _mm_mul_ps(_mm_set1_ps(2.0f), a);
+			__m128 t0  = _mm_div_ps(_mm_sub_ps(nb, sq), a2);
+			__m128 t1  = _mm_div_ps(_mm_add_ps(nb, sq), a2);
+
+			// t0 < eps selects t1
+			__m128 use1 = _mm_cmplt_ps(t0, eps);
+			__m128 t = _mm_or_ps(_mm_and_ps(use1, t1), _mm_andnot_ps(use1, t0));
+			hit = _mm_and_ps(hit, _mm_cmpge_ps(t, eps));
+
+			return _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, inf));
+		};
+
+		RAYTRACE_TARGET("sse2")
+		inline __m128 sphere_sse_ps_at(const SphereSoAf& s, int i, __m128 ox, __m128 oy, __m128 oz, __m128 dx, __m128 dy, __m128 dz) {
+			return sphere_sse_ps(_mm_loadu_ps(&s.cx[i]), _mm_loadu_ps(&s.cy[i]), _mm_loadu_ps(&s.cz[i]), _mm_loadu_ps(&s.radius[i]), ox, oy, oz, dx, dy, dz);
+		};
+
+		RAYTRACE_TARGET("sse2")
+		inline bool spheres_closest_sse_f(const SphereSoAf& s, int begin, int end, const cppmath::vec3& o, const cppmath::vec3& d, double& t, int& index) {
+			__m128 ox = _mm_set1_ps(o.x), oy = _mm_set1_ps(o.y), oz = _mm_set1_ps(o.z);
+			__m128 dx = _mm_set1_ps(d.x), dy = _mm_set1_ps(d.y), dz = _mm_set1_ps(d.z);
+
+			bool found = 0;
+			alignas(16) float lanes[8];
+			int i = begin;
+			for (; i + 8 <= end; i += 8) {
+				__m128 d0 = sphere_sse_ps_at(s, i,     ox, oy, oz, dx, dy, dz);
+				__m128 d1 = sphere_sse_ps_at(s, i + 4, ox, oy, oz, dx, dy, dz);
+				__m128 tv = _mm_set1_ps(float_bound(t));
+				// Most blocks are missed, reduce only blocks having closer hit
+				if (!_mm_movemask_ps(_mm_or_ps(_mm_cmplt_ps(d0, tv), _mm_cmplt_ps(d1, tv))))
+					continue;
+				_mm_store_ps(lanes,     d0);
+				_mm_store_ps(lanes + 4, d1);
+				found |= reduce_lanes(lanes, 8, i, t, index);
+			}
+			for (; i + 4 <= end; i += 4) {
+				_mm_store_ps(lanes, sphere_sse_ps_at(s, i, ox, oy, oz, dx, dy, dz));
+				found |= reduce_lanes(lanes, 4, i, t, index);
+			}
+			// Tail is counted by SoA intersect
+			RAYTRACE_COUNT(tests[TEST_SPHERE] += i - begin);
+			found |= spheres_closest_scalar(s, i, end, o, d, t, index);
+			return found;
+		};
+
+		// Triangle distances of 4 lanes, infinity on miss or hit behind ray origin
+		RAYTRACE_TARGET("sse2")
+		inline __m128 triangle_sse_ps(__m128 ax, __m128 ay, __m128 az,
+									  __m128 e1x, __m128 e1y, __m128 e1z,
+									  __m128 e2x, __m128 e2y, __m128 e2z,
+									  __m128 ox, __m128 oy, __m128 oz, __m128 dx, __m128 dy, __m128 dz) {
+			const __m128 inf  = _mm_set1_ps(std::numeric_limits<float>::infinity());
+			const __m128 zero = _mm_setzero_ps();
+			const __m128 one  = _mm_set1_ps(1.0f);
+
+			__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+			__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+			__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+
+			__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+			__m128 miss = _mm_and_ps(_mm_cmplt_ps(det, _mm_set1_ps(1e-8f)), _mm_cmpgt_ps(det, _mm_set1_ps(-1e-8f)));
+
+			__m128 inv = _mm_div_ps(one, det);
+			__m128 tx = _mm_sub_ps(ox, ax);
+			__m128 ty = _mm_sub_ps(oy, ay);
+			__m128 tz = _mm_sub_ps(oz, az);
+
+			__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv);
+			miss = _mm_or_ps(miss, _mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmpgt_ps(u, one)));
+
+			__m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+			__m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+			__m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+
+			__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv);
+			miss = _mm_or_ps(miss, _mm_or_ps(_mm_cmplt_ps(v, zero), _mm_cmpgt_ps(_mm_add_ps(u, v), one)));
+
+			__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv);
+			__m128 hit = _mm_andnot_ps(miss, _mm_cmpge_ps(t, _mm_set1_ps(hit_epsilon<float>())));
+
+			return _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, inf));
+		};
+
+		RAYTRACE_TARGET("sse2")
+		inline __m128 triangle_sse_ps_at(const TriangleSoAf& s, int i, __m128 ox, __m128 oy, __m128 oz, __m128 dx, __m128 dy, __m128 dz) {
+			return triangle_sse_ps(_mm_loadu_ps(&s.ax[i]),  _mm_loadu_ps(&s.ay[i]),  _mm_loadu_ps(&s.az[i]),
+								   _mm_loadu_ps(&s.e1x[i]), _mm_loadu_ps(&s.e1y[i]), _mm_loadu_ps(&s.e1z[i]),
+								   _mm_loadu_ps(&s.e2x[i]), _mm_loadu_ps(&s.e2y[i]), _mm_loadu_ps(&s.e2z[i]),
+								   ox, oy, oz, dx, dy, dz);
+		};
+
+		RAYTRACE_TARGET("sse2")
+		inline bool triangles_closest_sse_f(const TriangleSoAf& s, int begin, int end, const cppmath::vec3& o, const cppmath::vec3& d, double& t, int& index) {
+			__m128 ox = _mm_set1_ps(o.x), oy = _mm_set1_ps(o.y), oz = _mm_set1_ps(o.z);
+			__m128 dx = _mm_set1_ps(d.x), dy = _mm_set1_ps(d.y), dz = _mm_set1_ps(d.z);
+
+			bool found = 0;
+			alignas(16) float lanes[8];
+			int i = begin;
+			for (; i + 8 <= end; i += 8) {
+				__m128 d0 = triangle_sse_ps_at(s, i,     ox, oy, oz, dx, dy, dz);
+				__m128 d1 = triangle_sse_ps_at(s, i + 4, ox, oy, oz, dx, dy, dz);
+				__m128 tv = _mm_set1_ps(float_bound(t));
+				// Most blocks are missed, reduce only blocks having closer hit
+				if (!_mm_movemask_ps(_mm_or_ps(_mm_cmplt_ps(d0, tv), _mm_cmplt_ps(d1, tv))))
+					continue;
+				_mm_store_ps(lanes,     d0);
+				_mm_store_ps(lanes + 4, d1);
+				found |= reduce_lanes(lanes, 8, i, t, index);
+			}
+			for (; i + 4 <= end; i += 4) {
+				_mm_store_ps(lanes, triangle_sse_ps_at(s, i, ox, oy, oz, dx, dy, dz));
+				found |= reduce_lanes(lanes, 4, i, t, index);
+			}
+			// Tail is counted by SoA intersect
+			RAYTRACE_COUNT(tests[TEST_TRIANGLE] += i - begin);
+			found |= triangles_closest_scalar(s, i, end, o, d, t, index);
+			return found;
+		};
+
+		// Packet of 4 rays fits single register, so AVX2 uses same packet kernels
+		RAYTRACE_TARGET("sse2")
+		inline void sphere_packet_sse_f(const SphereSoAf& s, int i, const RayPacket& p, double* t, int* index) {
+			if (p.count != PACKET_SIZE) {
+				sphere_packet_scalar(s, i, p, t, index);
+				return;
+			}
+			RAYTRACE_COUNT(tests[TEST_SPHERE] += PACKET_SIZE);
+
+			alignas(16) float lanes[PACKET_SIZE];
+			_mm_store_ps(lanes, sphere_sse_ps(_mm_set1_ps(s.cx[i]), _mm_set1_ps(s.cy[i]), _mm_set1_ps(s.cz[i]), _mm_set1_ps(s.radius[i]),
+											  _mm_loadu_ps(p.fox), _mm_loadu_ps(p.foy), _mm_loadu_ps(p.foz),
+											  _mm_loadu_ps(p.fdx), _mm_loadu_ps(p.fdy), _mm_loadu_ps(p.fdz)));
+			for (int k = 0; k < PACKET_SIZE; ++k)
+				if (lanes[k] < t[k]) {
+					t[k] = lanes[k];
+					index[k] = i;
+				}
+		};
+
+		RAYTRACE_TARGET("sse2")
+		inline void triangle_packet_sse_f(const TriangleSoAf& s, int i, const RayPacket& p, double* t, int* index) {
+			if (p.count != PACKET_SIZE) {
+				triangle_packet_scalar(s, i, p, t, index);
+				return;
+			}
+			RAYTRACE_COUNT(tests[TEST_TRIANGLE] += PACKET_SIZE);
+
+			alignas(16) float lanes[PACKET_SIZE];
+			_mm_store_ps(lanes, triangle_sse_ps(_mm_set1_ps(s.ax[i]),  _mm_set1_ps(s.ay[i]),  _mm_set1_ps(s.az[i]),
+												_mm_set1_ps(s.e1x[i]), _mm_set1_ps(s.e1y[i]), _mm_set1_ps(s.e1z[i]),
+												_mm_set1_ps(s.e2x[i]), _mm_set1_ps(s.e2y[i]), _mm_set1_ps(s.e2z[i]),
+												_mm_loadu_ps(p.fox), _mm_loadu_ps(p.foy), _mm_loadu_ps(p.foz),
+												_mm_loadu_ps(p.fdx), _mm_loadu_ps(p.fdy), _mm_loadu_ps(p.fdz)));
+			for (int k = 0; k < PACKET_SIZE; ++k)
+				if (lanes[k] < t[k]) {
+					t[k] = lanes[k];
+					index[k] = i;
+				}
+		};
+
+		// A V X 2   S I N G L E   P R E C I S I O N
+
+		// Sphere distances of 8 lanes, infinity on miss
+		RAYTRACE_TARGET("avx2")
+		inline __m256 sphere_avx2_ps(__m256 cx, __m256 cy, __m256 cz, __m256 r,
+									 __m256 ox, __m256 oy, __m256 oz, __m256 dx, __m256 dy, __m256 dz) {
+			const __m256 inf  = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+			const __m256 eps  = _mm256_set1_ps(hit_epsilon<float>());
+			const __m256 sign = _mm256_set1_ps(-0.0f);
+
+			__m256 px = _mm256_sub_ps(ox, cx);
+			__m256 py = _mm256_sub_ps(oy, cy);
+			__m256 pz = _mm256_sub_ps(oz, cz);
+
+			__m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+			__m256 b = _mm256_mul_ps(_mm256_set1_ps(2.0f), _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, dx), _mm256_mul_ps(py, dy)), _mm256_mul_ps(pz, dz)));
+			__m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, px), _mm256_mul_ps(py, py)), _mm256_mul_ps(pz, pz)), _mm256_mul_ps(r, r));
+			__m256 disc = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(4.0f), a), c));
+
+			__m256 hit = _mm256_cmp_ps(disc, _mm256_setzero_ps(), _CMP_GE_OQ);
+			__m256 sq  = _mm256_sqrt_ps(_mm256_and_ps(disc, hit));
+			__m256 nb  = _mm256_xor_ps(b, sign);
+			__m256 a2  = _mm256_mul_ps(_mm256_set1_ps(2.0f), a);
+			__m256 t0  = _mm256_div_ps(_mm256_sub_ps(nb, sq), a2);
+			__m256 t1  = _mm256_div_ps(_mm256_add_ps(nb, sq), a2);
+
+			__m256 t = _mm256_blendv_ps(t0, t1, _mm256_cmp_ps(t0, eps, _CMP_LT_OQ));
+			hit = _mm256_and_ps(hit, _mm256_cmp_ps(t, eps, _CMP_GE_OQ));
+
+			return _mm256_blendv_ps(inf, t, hit);
+		};
+
+		RAYTRACE_TARGET("avx2")
+		inline __m256 sphere_avx2_ps_at(const SphereSoAf& s, int i, __m256 ox, __m256 oy, __m256 oz, __m256 dx, __m256 dy, __m256 dz) {
+			return sphere_avx2_ps(_mm256_loadu_ps(&s.cx[i]), _mm256_loadu_ps(&s.cy[i]), _mm256_loadu_ps(&s.cz[i]), _mm256_loadu_ps(&s.radius[i]), ox, oy, oz, dx, dy, dz);
+		};
+
+		RAYTRACE_TARGET("avx2")
+		inline bool spheres_closest_avx2_f(const SphereSoAf& s, int begin, int end, const cppmath::vec3& o, const cppmath::vec3& d, double& t, int& index) {
+			__m256 ox = _mm256_set1_ps(o.x), oy = _mm256_set1_ps(o.y), oz = _mm256_set1_ps(o.z);
+			__m256 dx = _mm256_set1_ps(d.x), dy = _mm256_set1_ps(d.y), dz = _mm256_set1_ps(d.z);
+
+			bool found = 0;
+			alignas(32) float lanes[16];
+			int i = begin;
+			for (; i + 16 <= end; i += 16) {
+				__m256 d0 = sphere_avx2_ps_at(s, i,     ox, oy, oz, dx, dy, dz);
+				__m256 d1 = sphere_avx2_ps_at(s, i + 8, ox, oy, oz, dx, dy, dz);
+				__m256 tv = _mm256_set1_ps(float_bound(t));
+				if (!_mm256_movemask_ps(_mm256_or_ps(_mm256_cmp_ps(d0, tv, _CMP_LT_OQ), _mm256_cmp_ps(d1, tv, _CMP_LT_OQ))))
+					continue;
+				_mm256_store_ps(lanes,     d0);
+				_mm256_store_ps(lanes + 8, d1);
+				found |= reduce_lanes(lanes, 16, i, t, index);
+			}
+			for (; i + 8 <= end; i += 8) {
+				_mm256_store_ps(lanes, sphere_avx2_ps_at(s, i, ox, oy, oz, dx, dy, dz));
+				found |= reduce_lanes(lanes, 8, i, t, index);
+			}
+			// Tail is counted by SoA intersect
+			RAYTRACE_COUNT(tests[TEST_SPHERE] += i - begin);
+			found |= spheres_closest_scalar(s, i, end, o, d, t, index);
+			return found;
+		};
+
+		// Triangle distances of 8 lanes, infinity on miss or hit behind ray origin
+		RAYTRACE_TARGET("avx2")
+		inline __m256 triangle_avx2_ps(__m256 ax, __m256 ay, __m256 az,
+									   __m256 e1x, __m256 e1y, __m256 e1z,
+									   __m256 e2x, __m256 e2y, __m256 e2z,
+									   __m256 ox, __m256 oy, __m256 oz, __m256 dx, __m256 dy, __m256 dz) {
+			const __m256 inf  = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+			const __m256 zero = _mm256_setzero_ps();
+			const __m256 one  = _mm256_set1_ps(1.0f);
+
+			__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+			__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+			__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+
+			__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+			__m256 miss = _mm256_and_ps(_mm256_cmp_ps(det, _mm256_set1_ps(1e-8f), _CMP_LT_OQ), _mm256_cmp_ps(det, _mm256_set1_ps(-1e-8f), _CMP_GT_OQ));
+
+			__m256 inv = _mm256_div_ps(one, det);
+			__m256 tx = _mm256_sub_ps(ox, ax);
+			__m256 ty = _mm256_sub_ps(oy, ay);
+			__m256 tz = _mm256_sub_ps(oz, az);
+
+			__m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), inv);
+			miss = _mm256_or_ps(miss, _mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_LT_OQ), _mm256_cmp_ps(u, one, _CMP_GT_OQ)));
+
+			__m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+			__m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+			__m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+
+			__m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inv);
+			miss = _mm256_or_ps(miss, _mm256_or_ps(_mm256_cmp_ps(v, zero, _CMP_LT_OQ), _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_GT_OQ)));
+
+			__m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), inv);
+			__m256 hit = _mm256_andnot_ps(miss, _mm256_cmp_ps(t, _mm256_set1_ps(hit_epsilon<float>()), _CMP_GE_OQ));
+
+			return _mm256_blendv_ps(inf, t, hit);
+		};
+
+		RAYTRACE_TARGET("avx2")
+		inline __m256 triangle_avx2_ps_at(const TriangleSoAf& s, int i, __m256 ox, __m256 oy, __m256 oz, __m256 dx, __m256 dy, __m256 dz) {
+			return triangle_avx2_ps(_mm256_loadu_ps(&s.ax[i]),  _mm256_loadu_ps(&s.ay[i]),  _mm256_loadu_ps(&s.az[i]),
+									_mm256_loadu_ps(&s.e1x[i]), _mm256_loadu_ps(&s.e1y[i]), _mm256_loadu_ps(&s.e1z[i]),
+									_mm256_loadu_ps(&s.e2x[i]), _mm256_loadu_ps(&s.e2y[i]), _mm256_loadu_ps(&s.e2z[i]),
+									ox, oy, oz, dx, dy, dz);
+		};
+
+		RAYTRACE_TARGET("avx2")
+		inline bool triangles_closest_avx2_f(const TriangleSoAf& s, int begin, int end, const cppmath::vec3& o, const cppmath::vec3& d, double& t, int& index) {
+			__m256 ox = _mm256_set1_ps(o.x), oy = _mm256_set1_ps(o.y), oz = _mm256_set1_ps(o.z);
+			__m256 dx = _mm256_set1_ps(d.x), dy = _mm256_set1_ps(d.y), dz = _mm256_set1_ps(d.z);
+
+			bool found = 0;
+			alignas(32) float lanes[16];
+			int i = begin;
+			for (; i + 16 <= end; i += 16) {
+				__m256 d0 = triangle_avx2_ps_at(s, i,     ox, oy, oz, dx, dy, dz);
+				__m256 d1 = triangle_avx2_ps_at(s, i + 8, ox, oy, oz, dx, dy, dz);
+				__m256 tv = _mm256_set1_ps(float_bound(t));
+				if (!_mm256_movemask_ps(_mm256_or_ps(_mm256_cmp_ps(d0, tv, _CMP_LT_OQ), _mm256_cmp_ps(d1, tv, _CMP_LT_OQ))))
+					continue;
+				_mm256_store_ps(lanes,     d0);
+				_mm256_store_ps(lanes + 8, d1);
+				found |= reduce_lanes(lanes, 16, i, t, index);
+			}
+			for (; i + 8 <= end; i += 8) {
+				_mm256_store_ps(lanes, triangle_avx2_ps_at(s, i, ox, oy, oz, dx, dy, dz));
+				found |= reduce_lanes(lanes, 8, i, t, index);
+			}
+			// Tail is counted by SoA intersect
+			RAYTRACE_COUNT(tests[TEST_TRIANGLE] += i - begin);
+			found |= triangles_closest_scalar(s, i, end, o, d, t, index);
+			return found;
+		};
+
+#endif
+
+		// Kernels selected for current CPU
+		struct Kernels {
+			Level level = SCALAR;
+			SpheresClosest spheres_closest = spheres_closest_scalar;
+			TrianglesClosest triangles_closest = triangles_closest_scalar;
+			SpherePacket sphere_packet = sphere_packet_scalar;
+			TrianglePacket triangle_packet = triangle_packet_scalar;
+			SpheresClosestF spheres_closest_f = spheres_closest_scalar;
+			TrianglesClosestF triangles_closest_f = triangles_closest_scalar;
+			SpherePacketF sphere_packet_f = sphere_packet_scalar;
+			TrianglePacketF triangle_packet_f = triangle_packet_scalar;
+
+			Kernels() {};
+
+			// Kernels for given level, falls back to lower level when not supported
+			Kernels(Level requested) {
+#ifdef RAYTRACE_SIMD_X86
+				__builtin_cpu_init();
+				if (requested >= AVX2 && __builtin_cpu_supports("avx2")) {
+					level = AVX2;
+					spheres_closest = spheres_closest_avx2;
+					triangles_closest = triangles_closest_avx2;
+					sphere_packet = sphere_packet_avx2;
+					triangle_packet = triangle_packet_avx2;
+					spheres_closest_f = spheres_closest_avx2_f;
+					triangles_closest_f = triangles_closest_avx2_f;
+					sphere_packet_f = sphere_packet_sse_f;
+					triangle_packet_f = triangle_packet_sse_f;
+				} else if (requested >= SSE && __builtin_cpu_supports("sse2")) {
+					level = SSE;
+					spheres_closest = spheres_closest_sse;
+					triangles_closest = triangles_closest_sse;
+					sphere_packet = sphere_packet_sse;
+					triangle_packet = triangle_packet_sse;
+					spheres_closest_f = spheres_closest_sse_f;
+					triangles_closest_f = triangles_closest_sse_f;
+					sphere_packet_f = sphere_packet_sse_f;
+					triangle_packet_f = triangle_packet_sse_f;
+				}
+#endif
+			};
+
+			// Best kernels supported by CPU
+			static const Kernels& get() {
+				static Kernels kernels(AVX2);
+				return kernels;
+			};
+		};
+
+		inline const char* level_name(Level level) {
+			switch (level) {
+				case AVX2:
+					return "AVX2";
+				case SSE:
+					return "SSE";
+				default:
+					return "scalar";
+			}
+		};
+	};
+};
@@ -0,0 +1,306 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#include "vec3.h"
+
+namespace raytrace {
+
+	// PCG32 random number generator (pcg-random.org).
+	// Small state, used as per-thread or per-pixel generator instead of global rand().
+	class PCG32 {
+
+		uint64_t state = 0x853c49e6748fea9bULL;
+		uint64_t inc   = 0xda3e39cb94b95bdbULL;
+
+	public:
+
+		PCG32() {};
+
+		PCG32(uint64_t seed, uint64_t sequence = 0) {
+			this->seed(seed, sequence);
+		};
+
+		void seed(uint64_t seed, uint64_t sequence = 0) {
+			state = 0;
+			inc = (sequence << 1) | 1;
+			next();
+			state += seed;
+			next();
+		};
+
+		inline uint32_t next() {
+			uint64_t old = state;
+			state = old * 6364136223846793005ULL + inc;
+			uint32_t xorshifted = ((old >> 18) ^ old) >> 27;
+			uint32_t rot = old >> 59;
+			return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+		};
+
+		// Uniform value in [0, 1)
+		inline double next_double() {
+			return next() * (1.0 / 4294967296.0);
+		};
+	};
+
+	// Sequence used by Sampler to generate sample points
+	enum class SampleSequence {
+		// Independent uniform random values
+		RANDOM,
+		// Jittered samples in grid of strata
+		STRATIFIED,
+		// Halton sequence in bases 2 and 3 with random rotation
+		HALTON,
+		// Sobol (0, 2)-sequence with random digital shift
+		SOBOL
+	};
+
+	// Generates sample points for one pixel sample.
+	// Values depend only on seed, pixel, sample index, dimension and point
+	//  index, so render output does not depend on threads & tile order.
+	// Sampler is cheap to create and should live on stack of rendering thread.
+	class Sampler {
+
+		SampleSequence sequence = SampleSequence::RANDOM;
+		uint64_t seed = 0;
+
+		// Hash of seed, pixel and sample index
+		uint64_t key = 0;
+		// Index of pixel sample
+		int sample_index = 0;
+		// Next free dimension
+		int dimension = 0;
+
+		static inline uint64_t mix(uint64_t x) {
+			x += 0x9e3779b97f4a7c15ULL;
+			x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+			return x ^ (x >> 31);
+		};
+
+		static inline double radical_inverse_3(uint32_t i) {
+			double inv = 1.0 / 3.0;
+			double f = inv;
+			double r = 0.0;
+			while (i) {
+				r += (i % 3) * f;
+				i /= 3;
+				f *= inv;
+			}
+			return r;
+		};
+
+		// Second dimension of Sobol sequence, generator matrix for polynomial x + 1
+		static inline uint32_t sobol_2(uint32_t i) {
+			uint32_t v = 1u << 31;
+			uint32_t r = 0;
+			for (; i; i >>= 1, v ^= v >> 1)
+				if (i & 1)
+					r ^= v;
+			return r;
+		};
+
+		static inline uint32_t reverse_bits(uint32_t i) {
+			i = (i << 16) | (i >> 16);
+			i = ((i & 0x00ff00ff) << 8) | ((i & 0xff00ff00) >> 8);
+			i = ((i & 0x0f0f0f0f) << 4) | ((i & 0xf0f0f0f0) >> 4);
+			i = ((i & 0x33333333) << 2) | ((i & 0xcccccccc) >> 2);
+			i = ((i & 0x55555555) << 1) | ((i & 0xaaaaaaaa) >> 1);
+			return i;
+		};
+
+		static inline double fract(double x) {
+			return x - std::floor(x);
+		};
+
+	public:
+
+		// Number of random diffuse rays per hit, replaces scene random_diffuse_count if positive
+		int diffuse_count = 0;
+
+		Sampler() {};
+
+		Sampler(SampleSequence sequence, uint64_t seed = 0) : sequence(sequence), seed(seed) {};
+
+		inline SampleSequence get_sequence() {
+			return sequence;
+		};
+
+		// Start generating points for given sample of pixel (x, y)
+		void start(int x, int y, int sample_index = 0) {
+			key = mix(seed ^ mix(((uint64_t) (uint32_t) x << 32) | (uint32_t) y) ^ mix((uint64_t) sample_index + 0x632be59bd9b4e019ULL));
+			this->sample_index = sample_index;
+			dimension = 0;
+		};
+
+		// Reserve dimension for set of correlated samples (i.e. diffuse rays of a single hit)
+		inline int next_dimension() {
+			return dimension++;
+		};
+
+		// Returns point index of count points in given dimension as (u, v) in [0, 1)^2.
+		// Points of one dimension are stratified for non-random sequences.
+		void sample_2d(int dim, int index, int count, double& u, double& v) {
+			uint64_t dim_key = mix(key ^ ((uint64_t) dim * 0xd1b54a32d192ed03ULL));
+
+			switch (sequence) {
+				case SampleSequence::STRATIFIED: {
+					// Grid of nx * ny == count strata covers whole domain,
+					//  nx is largest divisor of count not above sqrt(count)
+					int nx = std::max(1, (int) std::sqrt((double) count));
+					while (count % nx)
+						--nx;
+					int ny = count / nx;
+					PCG32 rng(dim_key, index);
+					if (nx == 1 && count > 1) {
+						// Count is prime, use Latin hypercube: one sample in every row and column,
+						//  columns are permuted by random multiplier, which is coprime with count
+						uint64_t a = 1 + (dim_key >> 32) % (count - 1);
+						u = ((a * index + dim_key % count) % count + rng.next_double()) / (double) count;
+						v = (index + rng.next_double()) / (double) count;
+						break;
+					}
+					u = ((index % nx) + rng.next_double()) / (double) nx;
+					v = ((index / nx) + rng.next_double()) / (double) ny;
+					break;
+				}
+
+				case SampleSequence::HALTON: {
+					// Consecutive pixel samples continue the sequence
+					uint32_t i = (uint32_t) sample_index * (uint32_t) count + index;
+					u = fract(reverse_bits(i) * (1.0 / 4294967296.0) + (dim_key & 0xFFFFFFFF) * (1.0 / 4294967296.0));
+					v = fract(radical_inverse_3(i) + (dim_key >> 32) * (1.0 / 4294967296.0));
+					break;
+				}
+
+				case SampleSequence::SOBOL: {
+					uint32_t i = (uint32_t) sample_index * (uint32_t) count + index;
+					u = (reverse_bits(i) ^ (uint32_t) dim_key) * (1.0 / 4294967296.0);
+					v = (sobol_2(i) ^ (uint32_t) (dim_key >> 32)) * (1.0 / 4294967296.0);
+					break;
+				}
+
+				default: {
+					PCG32 rng(dim_key, index);
+					u = rng.next_double();
+					v = rng.next_double();
+					break;
+				}
+			}
+		};
+
+		// Returns single value in [0, 1) for point index of given dimension
+		double sample_1d(int dim, int index, int count) {
+			double u, v;
+			sample_2d(dim, index, count, u, v);
+			return u;
+		};
+	};
+	
+	// Build orthonormal basis (t, b, n) around unit vector n without trigonometry
+	//  (Duff et al., Building an Orthonormal Basis, Revisited).
+	inline void orthonormal_basis(const cppmath::vec3& n, cppmath::vec3& t, cppmath::vec3& b) {
+		double sign = std::copysign(1.0, n.z);
+		double a = -1.0 / (sign + n.z);
+		double c = n.x * n.y * a;
+		t = cppmath::vec3(1.0 + sign * n.x * n.x * a, sign * c, -sign * n.x);
+		b = cppmath::vec3(c, sign + n.y * n.y * a, -n.y);
+	};
+	
+	// Map (u, v) in [0, 1)^2 to cosine weighted direction in hemisphere around n.
+	// t, b, n must be orthonormal basis, pdf of direction is cos(theta) / pi.
+	inline cppmath::vec3 cosine_hemisphere(const cppmath::vec3& n, const cppmath::vec3& t, const cppmath::vec3& b, double u, double v) {
+		double r = std::sqrt(u);
+		double phi = 2.0 * 3.14159265358979323846 * v;
+		double x = r * std::cos(phi);
+		double y = r * std::sin(phi);
+		double z = std::sqrt(std::max(0.0, 1.0 - u));
+		return cppmath::vec3(t.x * x + b.x * y + n.x * z, t.y * x + b.y * y + n.y * z, t.z * x + b.z * y + n.z * z);
+	};
+	
+	// Walker alias table for sampling discrete distribution in O(1).
+	// Built in O(n) by Vose's method from non-negative weights.
+	class AliasTable {
+		
+		// Probability of keeping bucket instead of taking it's alias
+		std::vector<double> keep;
+		std::vector<int> alias;
+		// Normalized probability of each index
+		std::vector<double> probability;
+		
+	public:
+		
+		AliasTable() {};
+		
+		AliasTable(const std::vector<double>& weights) {
+			build(weights);
+		};
+		
+		void build(const std::vector<double>& weights) {
+			int n = weights.size();
+			keep.assign(n, 1.0);
+			alias.resize(n);
+			probability.assign(n, 0.0);
+			
+			double total = 0.0;
+			for (double w : weights)
+				total += w > 0.0 ? w : 0.0;
+			
+			if (total <= 0.0) {
+				keep.clear();
+				alias.clear();
+				probability.clear();
+				return;
+			}
+			
+			std::vector<double> scaled(n);
+			std::vector<int> small, large;
+			for (int i = 0; i < n; ++i) {
+				probability[i] = (weights[i] > 0.0 ? weights[i] : 0.0) / total;
+				scaled[i] = probability[i] * n;
+				alias[i] = i;
+				(scaled[i] < 1.0 ? small : large).push_back(i);
+			}
+			
+			while (!small.empty() && !large.empty()) {
+				int s = small.back();
+				int l = large.back();
+				small.pop_back();
+				
+				keep[s] = scaled[s];
+				alias[s] = l;
+				scaled[l] -= 1.0 - scaled[s];
+				
+				if (scaled[l] < 1.0) {
+					large.pop_back();
+					small.push_back(l);
+				}
+			}
+			
+			// Remaining buckets are full up to rounding error
+			for (int i : small)
+				keep[i] = 1.0;
+			for (int i : large)
+				keep[i] = 1.0;
+		};
+		
+		// Number of entries, 0 if all weights were zero
+		inline int size() const {
+			return keep.size();
+		};
+		
+		inline double pdf(int i) const {
+			return probability[i];
+		};
+		
+		// Pick index using u to select bucket and v to choose between bucket and it's alias
+		inline int sample(double u, double v) const {
+			int n = keep.size();
+			int i = std::min((int) (u * n), n - 1);
+			return v < keep[i] ? i : alias[i];
+		};
+	};
+};
@@ -0,0 +1,802 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <typeinfo>
+#include <stdexcept>
+#include <unordered_map>
+#include <type_traits>
+
+#include "vec3.h"
+#include "Color.h"
+#include "RayTrace.h"
+#include "RayTraceBVH.h"
+#include "RayTraceMesh.h"
+#include "RayTraceTexture.h"
+#include "MappedFile.h"
+
+namespace raytrace {
+
+	// Scene stored in binary file: camera, scene settings, materials, textures, objects, meshes
+	//  and primitives & BVH compiled by RayTraceScene::build(), so loaded scene is traced
+	//  without parsing & building.
+	// File is written in native byte order & layout as header, arrays aligned to 64 bytes
+	//  and table of arrays, so mapped file is used as arrays of their type:
+	//  HEADER := MAGIC "RTSC"[4B] + VERSION[4B] + BYTE_ORDER[4B] + FLAGS[4B] + TABLE_OFFSET[8B] + ARRAY_COUNT[8B]
+	//  TABLE := (OFFSET[8B] + SIZE[8B])[ARRAY_COUNT]
+	// Arrays follow in fixed order: camera, settings, materials, textures, texels, meshes, mesh
+	//  buffers & BVHs, objects, compiled object tables, scene BVH, spheres, planes and triangles,
+	//  each primitive type stored column by column. FLAGS are reserved and written as 0.
+	// Compiled primitives of loaded scene view file mapped copy-on-write until next build(),
+	//  so update() of moved objects changes only memory of process. Other arrays are copied.
+	// Only built-in objects & Mesh can be stored, UVSphere & UVPlane must have baked texture
+	//  because uv_map is code.
+	class SceneFile {
+
+		static const uint32_t MAGIC = 0x43535452;
+		static const uint32_t VERSION = 3;
+		static const uint32_t ENDIANNESS = 0x01020304;
+		static const int ALIGNMENT = 64;
+
+		enum ObjectType : int32_t {
+			OBJECT_SPHERE = 1,
+			OBJECT_UV_SPHERE,
+			OBJECT_PLANE,
+			OBJECT_UV_PLANE,
+			OBJECT_TRIANGLE,
+			OBJECT_MESH
+		};
+
+		// Records are padded explicitly, so stored bytes do not depend on uninitialized padding
+
+		struct Header {
+			uint32_t magic;
+			uint32_t version;
+			uint32_t endianness;
+			uint32_t flags;
+			uint64_t table_offset;
+			uint64_t array_count;
+		};
+
+		struct CameraRecord {
+			double fov, zDistance, view_width;
+			double location[3], direction[3], up[3];
+			int32_t width, height;
+			uint8_t flatProjection, orthographic, pad[6];
+		};
+
+		// Settings of RayTraceScene & RayTrace
+		struct SettingsRecord {
+			double MIN_RAY_POWER, RAY_SHIFT, soft_shadows_scale, diffuse_light_scale;
+			double russian_roulette_min, GI_intensivity, max_refit_cost, aa_budget;
+			double irradiance_error, irradiance_min_radius, irradiance_max_radius;
+			uint64_t seed;
+			int32_t random_diffuse_count, russian_roulette_depth, horisontal_diffuse_count, vertical_diffuse_count;
+			int32_t MAX_RAY_DEPTH, light_samples, sample_sequence, aa_grid, aa_threshold, irradiance_max_depth;
+			int32_t GI_color[4], background[4];
+			uint8_t soft_shadows, use_shadows, diffuse_light, random_diffuse_ray, cosine_diffuse_ray;
+			uint8_t average_light_points, scale_light_above_normal, use_bvh, adaptive_aa;
+			uint8_t use_irradiance_cache, pad[6];
+		};
+
+		struct MaterialRecord {
+			double opacity, reflect, refract, refract_val, diffuse, diffuse_reflect, luminosity;
+			int32_t color[4];
+			uint8_t surface_visible, luminosity_scaling, pad[6];
+		};
+
+		struct TextureRecord {
+			// Offset of level 0 texels in array of all texels
+			uint64_t texel_begin;
+			int32_t width, height;
+			uint8_t wrap_u, wrap_v, pad[6];
+		};
+
+		// Ranges of mesh in arrays of all meshes, faces are in order of BVH leaves
+		struct MeshRecord {
+			double average_normal[3];
+			uint64_t vertex_begin, vertex_count;
+			uint64_t normal_begin, normal_count;
+			uint64_t index_begin, index_count;
+			uint64_t normal_index_begin, normal_index_count;
+			uint64_t node_begin, node_count;
+		};
+
+		struct ObjectRecord {
+			// Center & radius of spheres, location & normal of planes, vertices of triangle
+			double geometry[9];
+			double light_cone_max_angle_cos;
+			double texture_scale, texture_lod;
+			int32_t type;
+			int32_t material;
+			// Index in textures or -1
+			int32_t texture;
+			// Light sectors of spheres, 0 if UVSphere has no light points,
+			//  light cone split number of planes or index of mesh
+			int32_t parameter;
+		};
+
+		static_assert(sizeof(cppmath::vec3) == 3 * sizeof(double), "vec3 must be stored as 3 doubles");
+
+		// Writes arrays aligned to ALIGNMENT and collects table of their offsets & sizes
+		struct Writer {
+			FILE* file;
+			uint64_t offset = 0;
+			std::vector<uint64_t> table;
+
+			Writer(FILE* file) : file(file) {};
+
+			void write(const void* data, size_t size) {
+				if (size && fwrite(data, 1, size, file) != size)
+					throw std::runtime_error("Scene file write failed");
+				offset += size;
+			};
+
+			void align() {
+				static const char zeros[ALIGNMENT] = { 0 };
+				write(zeros, (ALIGNMENT - offset % ALIGNMENT) % ALIGNMENT);
+			};
+
+			// Start array written by following append() calls
+			void begin() {
+				align();
+				table.push_back(offset);
+				table.push_back(0);
+			};
+
+			template<typename T>
+			void append(const T* data, size_t count) {
+				write(data, count * sizeof(T));
+				table.back() += count * sizeof(T);
+			};
+
+			template<typename T>
+			void array(const T* data, size_t count) {
+				begin();
+				append(data, count);
+			};
+
+			// Array of std::vector or Column
+			template<typename C>
+			void array(const C& c) {
+				array(c.data(), c.size());
+			};
+
+			template<typename T>
+			void record(const T& r) {
+				array(&r, 1);
+			};
+		};
+
+		// Returns arrays of mapped file in order they were written
+		struct Reader {
+			char* data;
+			size_t size;
+			const uint64_t* table;
+			size_t array_count;
+			size_t next = 0;
+
+			template<typename T>
+			T* array(size_t& count) {
+				if (next >= array_count)
+					throw std::runtime_error("Scene file is truncated");
+
+				uint64_t offset = table[2 * next + 0];
+				uint64_t bytes  = table[2 * next + 1];
+				++next;
+				if (offset > size || bytes > size - offset || bytes % sizeof(T) || offset % alignof(T))
+					throw std::runtime_error("Scene file array is out of range");
+
+				count = bytes / sizeof(T);
+				return (T*) (data + offset);
+			};
+
+			template<typename T>
+			std::vector<T> vector() {
+				size_t count;
+				T* p = array<T>(count);
+				return std::vector<T>(p, p + count);
+			};
+
+			template<typename T>
+			const T& record() {
+				size_t count;
+				T* p = array<T>(count);
+				if (count != 1)
+					throw std::runtime_error("Scene file record is malformed");
+				return *p;
+			};
+		};
+
+		static inline void check(bool condition) {
+			if (!condition)
+				throw std::runtime_error("Scene file is malformed");
+		};
+
+		static inline void store_vec3(double* dst, const cppmath::vec3& v) {
+			dst[0] = v.x;
+			dst[1] = v.y;
+			dst[2] = v.z;
+		};
+
+		static inline cppmath::vec3 load_vec3(const double* src) {
+			return cppmath::vec3(src[0], src[1], src[2]);
+		};
+
+		static inline void store_color(int32_t* dst, const spaint::Color& c) {
+			dst[0] = c.r;
+			dst[1] = c.g;
+			dst[2] = c.b;
+			dst[3] = c.a;
+		};
+
+		static inline spaint::Color load_color(const int32_t* src) {
+			return spaint::Color(src[0], src[1], src[2], src[3]);
+		};
+
+		static MaterialRecord store_material(const ObjectMaterial& m) {
+			MaterialRecord r;
+			memset(&r, 0, sizeof(r));
+			r.opacity = m.opacity;
+			r.reflect = m.reflect;
+			r.refract = m.refract;
+			r.refract_val = m.refract_val;
+			r.diffuse = m.diffuse;
+			r.diffuse_reflect = m.diffuse_reflect;
+			r.luminosity = m.luminosity;
+			store_color(r.color, m.color);
+			r.surface_visible = m.surface_visible;
+			r.luminosity_scaling = m.luminosity_scaling;
+			return r;
+		};
+
+		static ObjectMaterial load_material(const MaterialRecord& r) {
+			ObjectMaterial m;
+			m.opacity = r.opacity;
+			m.reflect = r.reflect;
+			m.refract = r.refract;
+			m.refract_val = r.refract_val;
+			m.diffuse = r.diffuse;
+			m.diffuse_reflect = r.diffuse_reflect;
+			m.luminosity = r.luminosity;
+			m.color = load_color(r.color);
+			m.surface_visible = r.surface_visible;
+			m.luminosity_scaling = r.luminosity_scaling;
+			return m;
+		};
+
+		static CameraRecord store_camera(const Camera& c) {
+			CameraRecord r;
+			memset(&r, 0, sizeof(r));
+			r.fov = c.fov;
+			r.zDistance = c.zDistance;
+			r.view_width = c.view_width;
+			store_vec3(r.location, c.location);
+			store_vec3(r.direction, c.direction);
+			store_vec3(r.up, c.up);
+			r.width = c.width;
+			r.height = c.height;
+			r.flatProjection = c.flatProjection;
+			r.orthographic = c.orthographic;
+			return r;
+		};
+
+		static Camera load_camera(const CameraRecord& r) {
+			Camera c(r.width, r.height);
+			c.fov = r.fov;
+			c.zDistance = r.zDistance;
+			c.view_width = r.view_width;
+			c.location = load_vec3(r.location);
+			c.direction = load_vec3(r.direction);
+			c.up = load_vec3(r.up);
+			c.flatProjection = r.flatProjection;
+			c.orthographic = r.orthographic;
+			return c;
+		};
+
+		static SettingsRecord store_settings(RayTrace& rt) {
+			RayTraceScene& s = rt.get_scene();
+			SettingsRecord r;
+			memset(&r, 0, sizeof(r));
+			r.MIN_RAY_POWER = s.MIN_RAY_POWER;
+			r.RAY_SHIFT = s.RAY_SHIFT;
+			r.soft_shadows_scale = s.soft_shadows_scale;
+			r.diffuse_light_scale = s.diffuse_light_scale;
+			r.russian_roulette_min = s.russian_roulette_min;
+			r.GI_intensivity = s.GI_intensivity;
+			r.max_refit_cost = s.max_refit_cost;
+			r.aa_budget = rt.aa_budget;
+			r.irradiance_error = s.irradiance_error;
+			r.irradiance_min_radius = s.irradiance_min_radius;
+			r.irradiance_max_radius = s.irradiance_max_radius;
+			r.seed = s.seed;
+			r.random_diffuse_count = s.random_diffuse_count;
+			r.russian_roulette_depth = s.russian_roulette_depth;
+			r.horisontal_diffuse_count = s.horisontal_diffuse_count;
+			r.vertical_diffuse_count = s.vertical_diffuse_count;
+			r.MAX_RAY_DEPTH = s.MAX_RAY_DEPTH;
+			r.light_samples = s.light_samples;
+			r.sample_sequence = (int32_t) s.sample_sequence;
+			r.aa_grid = rt.aa_grid;
+			r.aa_threshold = rt.aa_threshold;
+			r.irradiance_max_depth = s.irradiance_max_depth;
+			store_color(r.GI_color, s.GI_color);
+			store_color(r.background, rt.get_background());
+			r.soft_shadows = s.soft_shadows;
+			r.use_shadows = s.use_shadows;
+			r.diffuse_light = s.diffuse_light;
+			r.random_diffuse_ray = s.random_diffuse_ray;
+			r.cosine_diffuse_ray = s.cosine_diffuse_ray;
+			r.average_light_points = s.average_light_points;
+			r.scale_light_above_normal = s.scale_light_above_normal;
+			r.use_bvh = s.use_bvh;
+			r.adaptive_aa = rt.adaptive_aa;
+			r.use_irradiance_cache = s.use_irradiance_cache;
+			return r;
+		};
+
+		static void load_settings(const SettingsRecord& r, RayTrace& rt) {
+			RayTraceScene& s = rt.get_scene();
+			s.MIN_RAY_POWER = r.MIN_RAY_POWER;
+			s.RAY_SHIFT = r.RAY_SHIFT;
+			s.soft_shadows_scale = r.soft_shadows_scale;
+			s.diffuse_light_scale = r.diffuse_light_scale;
+			s.russian_roulette_min = r.russian_roulette_min;
+			s.GI_intensivity = r.GI_intensivity;
+			s.max_refit_cost = r.max_refit_cost;
+			rt.aa_budget = r.aa_budget;
+			s.irradiance_error = r.irradiance_error;
+			s.irradiance_min_radius = r.irradiance_min_radius;
+			s.irradiance_max_radius = r.irradiance_max_radius;
+			s.seed = r.seed;
+			s.random_diffuse_count = r.random_diffuse_count;
+			s.russian_roulette_depth = r.russian_roulette_depth;
+			s.horisontal_diffuse_count = r.horisontal_diffuse_count;
+			s.vertical_diffuse_count = r.vertical_diffuse_count;
+			s.MAX_RAY_DEPTH = r.MAX_RAY_DEPTH;
+			s.light_samples = r.light_samples;
+			s.sample_sequence = (SampleSequence) r.sample_sequence;
+			rt.aa_grid = r.aa_grid;
+			rt.aa_threshold = r.aa_threshold;
+			s.irradiance_max_depth = r.irradiance_max_depth;
+			s.GI_color = load_color(r.GI_color);
+			rt.set_background(load_color(r.background));
+			s.soft_shadows = r.soft_shadows;
+			s.use_shadows = r.use_shadows;
+			s.diffuse_light = r.diffuse_light;
+			s.random_diffuse_ray = r.random_diffuse_ray;
+			s.cosine_diffuse_ray = r.cosine_diffuse_ray;
+			s.average_light_points = r.average_light_points;
+			s.scale_light_above_normal = r.scale_light_above_normal;
+			s.use_bvh = r.use_bvh;
+			rt.adaptive_aa = r.adaptive_aa;
+			s.use_irradiance_cache = r.use_irradiance_cache;
+		};
+
+		template<typename SoA>
+		static void write_columns(Writer& w, SoA& soa) {
+			soa.for_each_column([&w](auto& column) {
+				w.array(column.data(), column.size());
+			});
+		};
+
+		// Make columns view arrays of mapped file, all columns must have same size
+		template<typename SoA>
+		static void view_columns(Reader& r, SoA& soa) {
+			size_t size = 0;
+			bool first = 1;
+			soa.for_each_column([&](auto& column) {
+				typedef typename std::remove_reference<decltype(column)>::type::value_type T;
+				size_t count;
+				T* values = r.array<T>(count);
+				check(first || count == size);
+				first = 0;
+				size = count;
+				column.view(values, count);
+			});
+		};
+
+		// Check that compiled primitives reference objects of their type
+		template<typename SoA>
+		static void check_compiled(const SoA& soa, const RayTraceScene& scene, PrimitiveType type) {
+			for (int k = 0; k < soa.size(); ++k) {
+				int i = soa.object[k];
+				check(i >= 0 && i < (int) scene.objects.size() && scene.object_types[i] == type && scene.object_indices[i] == k);
+			}
+		};
+
+	public:
+
+		// Write camera, settings & objects of rt and it's scene compiled by build().
+		// Pending changes of objects are applied by RayTraceScene::update() first.
+		// File is replaced atomically through temporary file.
+		// Throws std::runtime_error on write failure or on object that can not be stored.
+		static void save(const std::string& filename, RayTrace& rt) {
+			RayTraceScene& scene = rt.get_scene();
+			scene.update();
+
+			std::vector<MaterialRecord> materials;
+			std::unordered_map<std::string, int> material_ids;
+			std::vector<TextureRecord> textures;
+			std::vector<uint8_t> texels;
+			std::unordered_map<const Texture*, int> texture_ids;
+			std::vector<MeshRecord> meshes;
+			std::vector<ObjectRecord> objects(scene.objects.size());
+
+			auto material_id = [&](const ObjectMaterial& m) -> int {
+				MaterialRecord r = store_material(m);
+				std::string key((const char*) &r, sizeof(r));
+				auto it = material_ids.find(key);
+				if (it != material_ids.end())
+					return it->second;
+				materials.push_back(r);
+				return material_ids[key] = materials.size() - 1;
+			};
+
+			auto texture_id = [&](const std::shared_ptr<Texture>& t, const char* type) -> int {
+				if (!t || t->empty())
+					throw std::runtime_error(std::string(type) + " without texture can not be saved, uv_map must be baked");
+				auto it = texture_ids.find(t.get());
+				if (it != texture_ids.end())
+					return it->second;
+
+				TextureRecord r;
+				memset(&r, 0, sizeof(r));
+				r.texel_begin = texels.size();
+				r.width = t->get_width();
+				r.height = t->get_height();
+				r.wrap_u = (uint8_t) t->wrap_u;
+				r.wrap_v = (uint8_t) t->wrap_v;
+				texels.insert(texels.end(), t->get_texels(), t->get_texels() + 4 * (size_t) r.width * r.height);
+				textures.push_back(r);
+				return texture_ids[t.get()] = textures.size() - 1;
+			};
+
+			// Mesh buffers are written after their records, so records collect offsets first
+			std::vector<Mesh*> mesh_objects;
+			MeshRecord next_mesh;
+			memset(&next_mesh, 0, sizeof(next_mesh));
+
+			for (int i = 0; i < (int) scene.objects.size(); ++i) {
+				SceneObject* o = scene.objects[i];
+				const std::type_info& type = typeid(*o);
+				ObjectRecord& r = objects[i];
+				memset(&r, 0, sizeof(r));
+				r.texture = -1;
+				r.texture_scale = 1.0;
+
+				if (type == typeid(Sphere)) {
+					Sphere* so = (Sphere*) o;
+					r.type = OBJECT_SPHERE;
+					store_vec3(r.geometry, so->center);
+					r.geometry[3] = so->radius;
+					r.parameter = so->getLightSectorsCount();
+					r.material = material_id(so->material);
+				} else if (type == typeid(UVSphere)) {
+					UVSphere* so = (UVSphere*) o;
+					r.type = OBJECT_UV_SPHERE;
+					store_vec3(r.geometry, so->center);
+					r.geometry[3] = so->radius;
+					r.parameter = so->get_light_points(so->center).empty() ? 0 : so->getLightSectorsCount();
+					r.texture = texture_id(so->texture, "UVSphere");
+					r.texture_lod = so->texture_lod;
+					r.material = material_id(so->material);
+				} else if (type == typeid(Plane)) {
+					Plane* po = (Plane*) o;
+					r.type = OBJECT_PLANE;
+					store_vec3(r.geometry, po->location);
+					store_vec3(r.geometry + 3, po->normal);
+					r.light_cone_max_angle_cos = po->light_cone_max_angle_cos;
+					r.parameter = po->light_cone_split_number;
+					r.material = material_id(po->material);
+				} else if (type == typeid(UVPlane)) {
+					UVPlane* po = (UVPlane*) o;
+					r.type = OBJECT_UV_PLANE;
+					store_vec3(r.geometry, po->location);
+					store_vec3(r.geometry + 3, po->normal);
+					r.light_cone_max_angle_cos = po->light_cone_max_angle_cos;
+					r.parameter = po->light_cone_split_number;
+					r.texture = texture_id(po->texture, "UVPlane");
+					r.texture_scale = po->texture_scale;
+					r.texture_lod = po->texture_lod;
+					r.material = material_id(po->material);
+				} else if (type == typeid(Triangle)) {
+					Triangle* to = (Triangle*) o;
+					r.type = OBJECT_TRIANGLE;
+					store_vec3(r.geometry, to->A);
+					store_vec3(r.geometry + 3, to->B);
+					store_vec3(r.geometry + 6, to->C);
+					r.material = material_id(to->material);
+				} else if (type == typeid(Mesh)) {
+					Mesh* mo = (Mesh*) o;
+					if (!mo->is_built())
+						mo->build();
+					r.type = OBJECT_MESH;
+					r.parameter = meshes.size();
+					r.material = material_id(mo->material);
+
+					MeshRecord m = next_mesh;
+					store_vec3(m.average_normal, mo->normal_at(mo->get_center()));
+					m.vertex_count = mo->vertices.size();
+					m.normal_count = mo->normals.size();
+					m.index_count = mo->indices.size();
+					m.normal_index_count = mo->normal_indices.size();
+					m.node_count = mo->get_bvh().get_nodes().size();
+					meshes.push_back(m);
+					mesh_objects.push_back(mo);
+
+					next_mesh.vertex_begin += m.vertex_count;
+					next_mesh.normal_begin += m.normal_count;
+					next_mesh.index_begin += m.index_count;
+					next_mesh.normal_index_begin += m.normal_index_count;
+					next_mesh.node_begin += m.node_count;
+				} else
+					throw std::runtime_error(std::string("Scene object of type ") + type.name() + " can not be saved");
+			}
+
+			std::string temporary = filename + ".tmp";
+			FILE* file = fopen(temporary.c_str(), "wb");
+			if (!file)
+				throw std::runtime_error("Scene file open failed");
+
+			try {
+				Writer w(file);
+				Header header;
+				memset(&header, 0, sizeof(header));
+				w.write(&header, sizeof(header));
+
+				w.record(store_camera(rt.camera));
+				w.record(store_settings(rt));
+				w.array(materials);
+				w.array(textures);
+				w.array(texels);
+
+				// Buffers of all meshes are concatenated, one array per buffer type
+				w.array(meshes);
+				auto concatenate = [&](auto get) {
+					w.begin();
+					for (Mesh* m : mesh_objects)
+						w.append(get(m).data(), get(m).size());
+				};
+				concatenate([](Mesh* m) -> const Column<cppmath::vec3>& { return m->vertices; });
+				concatenate([](Mesh* m) -> const Column<cppmath::vec3>& { return m->normals; });
+				concatenate([](Mesh* m) -> const Column<int>& { return m->indices; });
+				concatenate([](Mesh* m) -> const Column<int>& { return m->normal_indices; });
+				concatenate([](Mesh* m) -> const Column<BVH::Node>& { return m->get_bvh().get_nodes(); });
+				concatenate([](Mesh* m) -> const Column<int>& { return m->get_bvh().get_indices(); });
+
+				w.array(objects);
+				w.array(scene.object_types);
+				w.array(scene.object_indices);
+				w.array(scene.bvh_objects);
+				w.array(scene.bvh_ids);
+				w.array(scene.unbounded_objects);
+				w.array(scene.leaves);
+				w.array(scene.leaf_generic);
+				w.array(scene.bvh.get_nodes());
+				w.array(scene.bvh.get_indices());
+				w.array(scene.bvh.get_prim_bounds());
+
+				write_columns(w, scene.spheres);
+				write_columns(w, scene.planes);
+				write_columns(w, scene.triangles);
+
+				w.align();
+				header.magic = MAGIC;
+				header.version = VERSION;
+				header.endianness = ENDIANNESS;
+				header.flags = 0;
+				header.table_offset = w.offset;
+				header.array_count = w.table.size() / 2;
+				w.write(w.table.data(), w.table.size() * sizeof(uint64_t));
+
+				if (fseek(file, 0, SEEK_SET) || fwrite(&header, sizeof(header), 1, file) != 1)
+					throw std::runtime_error("Scene file write failed");
+			} catch (...) {
+				fclose(file);
+				std::remove(temporary.c_str());
+				throw;
+			}
+
+			if (fclose(file) || std::rename(temporary.c_str(), filename.c_str())) {
+				std::remove(temporary.c_str());
+				throw std::runtime_error("Scene file write failed");
+			}
+		};
+
+		// Load camera, settings & objects into rt with empty scene, scene is ready for
+		//  rendering without build(). Compiled primitives view mapped file, which stays
+		//  mapped until next build() or destruction of scene.
+		// Throws std::runtime_error if file can not be read, is malformed or scene is not empty.
+		static void load(const std::string& filename, RayTrace& rt) {
+			RayTraceScene& scene = rt.get_scene();
+			if (scene.get_object_count())
+				throw std::runtime_error("Scene file can be loaded only into empty scene");
+
+			std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>(filename, 1);
+			if (file->size() < sizeof(Header))
+				throw std::runtime_error("Scene file is truncated");
+
+			const Header& header = *(const Header*) file->data();
+			if (header.magic != MAGIC || header.endianness != ENDIANNESS)
+				throw std::runtime_error("Not a scene file or it was written on platform with other byte order");
+			if (header.version != VERSION)
+				throw std::runtime_error("Unsupported scene file version");
+			if (header.table_offset % sizeof(uint64_t) || header.table_offset > file->size()
+				|| header.array_count > (file->size() - header.table_offset) / (2 * sizeof(uint64_t)))
+				throw std::runtime_error("Scene file is truncated");
+
+			Reader r;
+			r.data = file->writable_data();
+			r.size = file->size();
+			r.table = (const uint64_t*) (file->data() + header.table_offset);
+			r.array_count = header.array_count;
+
+			rt.camera = load_camera(r.record<CameraRecord>());
+			load_settings(r.record<SettingsRecord>(), rt);
+
+			std::vector<ObjectMaterial> materials;
+			for (const MaterialRecord& m : r.vector<MaterialRecord>())
+				materials.push_back(load_material(m));
+
+			std::vector<TextureRecord> texture_records = r.vector<TextureRecord>();
+			size_t texel_count;
+			const uint8_t* texels = r.array<uint8_t>(texel_count);
+			std::vector<std::shared_ptr<Texture>> textures;
+			for (const TextureRecord& t : texture_records) {
+				check(t.width > 0 && t.height > 0 && t.texel_begin <= texel_count
+					&& 4 * (uint64_t) t.width * t.height <= texel_count - t.texel_begin);
+				std::shared_ptr<Texture> texture = std::make_shared<Texture>();
+				texture->set(t.width, t.height, texels + t.texel_begin);
+				texture->wrap_u = (TextureWrap) t.wrap_u;
+				texture->wrap_v = (TextureWrap) t.wrap_v;
+				textures.push_back(texture);
+			}
+
+			size_t mesh_count, vertex_count, normal_count, index_count, normal_index_count, node_count, order_count;
+			const MeshRecord* meshes = r.array<MeshRecord>(mesh_count);
+			cppmath::vec3* vertices = r.array<cppmath::vec3>(vertex_count);
+			cppmath::vec3* normals = r.array<cppmath::vec3>(normal_count);
+			int* indices = r.array<int>(index_count);
+			int* normal_indices = r.array<int>(normal_index_count);
+			BVH::Node* nodes = r.array<BVH::Node>(node_count);
+			int* orders = r.array<int>(order_count);
+
+			size_t object_count;
+			const ObjectRecord* objects = r.array<ObjectRecord>(object_count);
+			for (size_t i = 0; i < object_count; ++i) {
+				const ObjectRecord& o = objects[i];
+				check(o.material >= 0 && o.material < (int) materials.size());
+				check(o.texture >= -1 && o.texture < (int) textures.size());
+				const ObjectMaterial& material = materials[o.material];
+				std::shared_ptr<Texture> texture = o.texture == -1 ? nullptr : textures[o.texture];
+
+				switch (o.type) {
+					case OBJECT_SPHERE: {
+						Sphere* so = new Sphere(load_vec3(o.geometry), o.geometry[3]);
+						if (o.parameter != 1)
+							so->setLightSectorsCount(o.parameter);
+						so->material = material;
+						scene.addObject(so);
+						break;
+					}
+
+					case OBJECT_UV_SPHERE: {
+						UVSphere* so = new UVSphere(load_vec3(o.geometry), o.geometry[3]);
+						if (o.parameter)
+							so->setLightSectorsCount(o.parameter);
+						so->texture = texture;
+						so->texture_lod = o.texture_lod;
+						so->material = material;
+						scene.addObject(so);
+						break;
+					}
+
+					case OBJECT_PLANE: {
+						Plane* po = new Plane(load_vec3(o.geometry), load_vec3(o.geometry + 3));
+						po->light_cone_max_angle_cos = o.light_cone_max_angle_cos;
+						po->light_cone_split_number = o.parameter;
+						po->material = material;
+						scene.addObject(po);
+						break;
+					}
+
+					case OBJECT_UV_PLANE: {
+						UVPlane* po = new UVPlane(load_vec3(o.geometry), load_vec3(o.geometry + 3));
+						po->light_cone_max_angle_cos = o.light_cone_max_angle_cos;
+						po->light_cone_split_number = o.parameter;
+						po->texture = texture;
+						po->texture_scale = o.texture_scale;
+						po->texture_lod = o.texture_lod;
+						po->material = material;
+						scene.addObject(po);
+						break;
+					}
+
+					case OBJECT_TRIANGLE: {
+						Triangle* to = new Triangle(load_vec3(o.geometry), load_vec3(o.geometry + 3), load_vec3(o.geometry + 6));
+						to->material = material;
+						scene.addObject(to);
+						break;
+					}
+
+					case OBJECT_MESH: {
+						check(o.parameter >= 0 && (size_t) o.parameter < mesh_count);
+						const MeshRecord& m = meshes[o.parameter];
+						check(m.vertex_begin <= vertex_count && m.vertex_count <= vertex_count - m.vertex_begin);
+						check(m.normal_begin <= normal_count && m.normal_count <= normal_count - m.normal_begin);
+						check(m.index_begin <= index_count && m.index_count <= index_count - m.index_begin && m.index_count % 3 == 0);
+						check(m.normal_index_begin <= normal_index_count && m.normal_index_count <= normal_index_count - m.normal_index_begin);
+						check(m.normal_index_count == 0 || m.normal_index_count == m.index_count);
+						check(m.node_begin <= node_count && m.node_count <= node_count - m.node_begin);
+						check(m.index_begin / 3 + m.index_count / 3 <= order_count);
+
+						for (uint64_t k = 0; k < m.index_count; ++k)
+							check(indices[m.index_begin + k] >= 0 && (uint64_t) indices[m.index_begin + k] < m.vertex_count);
+						for (uint64_t k = 0; k < m.normal_index_count; ++k)
+							check(normal_indices[m.normal_index_begin + k] >= -1 && normal_indices[m.normal_index_begin + k] < (int64_t) m.normal_count);
+
+						Mesh* mo = new Mesh();
+						mo->vertices.view(vertices + m.vertex_begin, m.vertex_count);
+						mo->normals.view(normals + m.normal_begin, m.normal_count);
+						mo->indices.view(indices + m.index_begin, m.index_count);
+						mo->normal_indices.view(normal_indices + m.normal_index_begin, m.normal_index_count);
+						mo->restore(nodes + m.node_begin, m.node_count, orders + m.index_begin / 3, m.index_count / 3, load_vec3(m.average_normal), file);
+						mo->material = material;
+						scene.addObject(mo);
+						break;
+					}
+
+					default:
+						throw std::runtime_error("Scene file contains object of unknown type");
+				}
+			}
+
+			// Compiled state of built scene
+			int objects_size = scene.objects.size();
+			scene.object_types = r.vector<uint8_t>();
+			scene.object_indices = r.vector<int>();
+			scene.bvh_objects = r.vector<int>();
+			scene.bvh_ids = r.vector<int>();
+			scene.unbounded_objects = r.vector<int>();
+			scene.leaves = r.vector<RayTraceScene::LeafRange>();
+			scene.leaf_generic = r.vector<int>();
+
+			size_t bvh_node_count, bvh_index_count, bvh_bounds_count;
+			BVH::Node* bvh_nodes = r.array<BVH::Node>(bvh_node_count);
+			int* bvh_indices = r.array<int>(bvh_index_count);
+			AABB* bvh_bounds = r.array<AABB>(bvh_bounds_count);
+			check(bvh_index_count == scene.bvh_objects.size() && bvh_bounds_count == bvh_index_count && scene.leaves.size() == bvh_node_count);
+			scene.bvh.restore(bvh_nodes, bvh_node_count, bvh_indices, bvh_index_count, bvh_bounds, bvh_bounds_count);
+
+			view_columns(r, scene.spheres);
+			view_columns(r, scene.planes);
+			view_columns(r, scene.triangles);
+			scene.compiled_storage = file;
+
+			// Tables must describe loaded objects, so traversal never leaves arrays
+			check(scene.object_types.size() == (size_t) objects_size && scene.object_indices.size() == (size_t) objects_size && scene.bvh_ids.size() == (size_t) objects_size);
+			for (int i : scene.bvh_objects)
+				check(i >= 0 && i < objects_size);
+			for (int i : scene.unbounded_objects)
+				check(i >= 0 && i < objects_size && scene.object_types[i] != PRIMITIVE_PLANE);
+			for (int i : scene.leaf_generic)
+				check(i >= 0 && i < objects_size && scene.object_types[i] == PRIMITIVE_GENERIC);
+			for (const RayTraceScene::LeafRange& l : scene.leaves)
+				check(l.sphere_begin >= 0 && l.sphere_begin <= l.sphere_end && l.sphere_end <= scene.spheres.size()
+					&& l.triangle_begin >= 0 && l.triangle_begin <= l.triangle_end && l.triangle_end <= scene.triangles.size()
+					&& l.generic_begin >= 0 && l.generic_begin <= l.generic_end && l.generic_end <= (int) scene.leaf_generic.size());
+			check_compiled(scene.spheres, scene, PRIMITIVE_SPHERE);
+			check_compiled(scene.planes, scene, PRIMITIVE_PLANE);
+			check_compiled(scene.triangles, scene, PRIMITIVE_TRIANGLE);
+			for (int i = 0; i < objects_size; ++i)
+				check(scene.object_types[i] == RayTraceScene::primitive_type(scene.objects[i]));
+
+			scene.adopt_compiled();
+		};
+	};
+};
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+
+// Render statistics are compiled only with -DRAYTRACE_STATS,
+//  otherwise RAYTRACE_COUNT expands to nothing and has no cost.
+#ifdef RAYTRACE_STATS
+	#define RAYTRACE_COUNT(expr) (raytrace::current_stats().expr)
+#else
+	#define RAYTRACE_COUNT(expr)
+#endif
+
+namespace raytrace {
+
+	// Kind of traced ray
+	enum RayKind {
+		RAY_PRIMARY,
+		RAY_SHADOW,
+		RAY_REFLECT,
+		RAY_REFRACT,
+		RAY_DIFFUSE,
+		// Ray continued through object without visible surface
+		RAY_PASS,
+		RAY_KIND_COUNT
+	};
+
+	// Kind of intersection test
+	enum TestKind {
+		TEST_SPHERE,
+		TEST_PLANE,
+		TEST_TRIANGLE,
+		TEST_MESH_FACE,
+		// Objects of user classes tested through SceneObject interface
+		TEST_GENERIC,
+		// Bounding box of BVH node
+		TEST_BOX,
+		TEST_KIND_COUNT
+	};
+
+	// Counters of a single thread, merged after frame is finished
+	struct alignas(64) RenderStats {
+
+		// Wall time of tile
+		struct TileTime {
+			int id;
+			int thread;
+			double seconds;
+		};
+
+		static const int DEPTH_BINS = 32;
+
+		uint64_t rays[RAY_KIND_COUNT] = {};
+		uint64_t tests[TEST_KIND_COUNT] = {};
+		// Number of rays shot at each depth, last bin counts all deeper rays
+		uint64_t depth[DEPTH_BINS] = {};
+		// Rays dropped by MIN_RAY_POWER
+		uint64_t power_cut = 0;
+		// Rays dropped by MAX_RAY_DEPTH
+		uint64_t depth_cut = 0;
+		// Light points tested by soft shadows
+		uint64_t light_points = 0;
+		// Diffuse hits interpolated from irradiance cache & hits that computed new record
+		uint64_t irradiance_hits = 0;
+		uint64_t irradiance_misses = 0;
+		std::vector<TileTime> tiles;
+
+		void reset() {
+			*this = RenderStats();
+		};
+
+		inline void add_depth(int ray_depth) {
+			++depth[ray_depth < DEPTH_BINS - 1 ? (ray_depth < 0 ? 0 : ray_depth) : DEPTH_BINS - 1];
+		};
+
+		void merge(const RenderStats& s) {
+			for (int i = 0; i < RAY_KIND_COUNT; ++i)
+				rays[i] += s.rays[i];
+			for (int i = 0; i < TEST_KIND_COUNT; ++i)
+				tests[i] += s.tests[i];
+			for (int i = 0; i < DEPTH_BINS; ++i)
+				depth[i] += s.depth[i];
+			power_cut += s.power_cut;
+			depth_cut += s.depth_cut;
+			light_points += s.light_points;
+			irradiance_hits += s.irradiance_hits;
+			irradiance_misses += s.irradiance_misses;
+			tiles.insert(tiles.end(), s.tiles.begin(), s.tiles.end());
+		};
+
+		uint64_t total_rays() const {
+			uint64_t total = 0;
+			for (int i = 0; i < RAY_KIND_COUNT; ++i)
+				total += rays[i];
+			return total;
+		};
+
+		std::string to_json() const {
+			static const char* ray_names[RAY_KIND_COUNT] = { "primary", "shadow", "reflect", "refract", "diffuse", "pass" };
+			static const char* test_names[TEST_KIND_COUNT] = { "sphere", "plane", "triangle", "mesh_face", "generic", "box" };
+
+			std::string json = "{\n\t\"rays\": {";
+			for (int i = 0; i < RAY_KIND_COUNT; ++i)
+				json += std::string(i ? ", " : " ") + "\"" + ray_names[i] + "\": " + std::to_string(rays[i]);
+			json += " },\n\t\"tests\": {";
+			for (int i = 0; i < TEST_KIND_COUNT; ++i)
+				json += std::string(i ? ", " : " ") + "\"" + test_names[i] + "\": " + std::to_string(tests[i]);
+
+			// Trim empty tail of depth histogram
+			int depth_count = DEPTH_BINS;
+			while (depth_count > 1 && !depth[depth_count - 1])
+				--depth_count;
+			json += " },\n\t\"depth\": [";
+			for (int i = 0; i < depth_count; ++i)
+				json += std::string(i ? ", " : " ") + std::to_string(depth[i]);
+
+			json += " ],\n\t\"power_cut\": " + std::to_string(power_cut);
+			json += ",\n\t\"depth_cut\": " + std::to_string(depth_cut);
+			json += ",\n\t\"light_points\": " + std::to_string(light_points);
+			json += ",\n\t\"irradiance\": { \"hits\": " + std::to_string(irradiance_hits) + ", \"misses\": " + std::to_string(irradiance_misses) + " }";
+
+			double total = 0.0, longest = 0.0;
+			json += ",\n\t\"tiles\": [";
+			for (int i = 0; i < (int) tiles.size(); ++i) {
+				char buffer[128];
+				snprintf(buffer, sizeof(buffer), "%s\n\t\t{ \"id\": %d, \"thread\": %d, \"ms\": %.3f }", i ? "," : "", tiles[i].id, tiles[i].thread, tiles[i].seconds * 1000.0);
+				json += buffer;
+				total += tiles[i].seconds;
+				longest = tiles[i].seconds > longest ? tiles[i].seconds : longest;
+			}
+
+			char buffer[128];
+			snprintf(buffer, sizeof(buffer), "%s],\n\t\"tile_ms\": { \"total\": %.3f, \"max\": %.3f }\n}\n", tiles.size() ? "\n\t" : " ", total * 1000.0, longest * 1000.0);
+			json += buffer;
+			return json;
+		};
+	};
+
+	// Slot with stats of current thread, set by Renderer for it's workers
+	inline RenderStats*& current_stats_slot() {
+		thread_local RenderStats* slot = nullptr;
+		return slot;
+	};
+
+	// Stats of current thread, threads not owned by Renderer count into own thread local stats
+	inline RenderStats& current_stats() {
+		RenderStats*& slot = current_stats_slot();
+		if (!slot) {
+			thread_local RenderStats local;
+			slot = &local;
+		}
+		return *slot;
+	};
+};
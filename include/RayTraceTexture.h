@@ -0,0 +1,265 @@
+#pragma once
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+#include <functional>
+
+#include "Color.h"
+#include "lodepng.h"
+
+namespace raytrace {
+
+	// Polynomial approximation of std::atan2, absolute error is below 2e-6 radians.
+	// Used for texture coordinates, where error is much smaller than a texel.
+	inline double fast_atan2(double y, double x) {
+		double ax = x < 0 ? -x : x;
+		double ay = y < 0 ? -y : y;
+		if (ax == 0.0 && ay == 0.0)
+			return 0.0;
+
+		// atan of ratio in [0, 1]
+		double a = (ax < ay ? ax / ay : ay / ax);
+		double s = a * a;
+		double r = a * (0.99997726 + s * (-0.33262347 + s * (0.19354346 + s * (-0.11643287 + s * (0.05265332 + s * -0.01172120)))));
+
+		if (ay > ax)
+			r = 1.57079632679489661923 - r;
+		if (x < 0)
+			r = 3.14159265358979323846 - r;
+		return y < 0 ? -r : r;
+	};
+
+	// Addressing of texture coordinates outside of [0, 1]
+	enum class TextureWrap {
+		REPEAT,
+		CLAMP
+	};
+
+	// RGBA texture with chain of mip levels, each level is half size of previous one.
+	// Texture is loaded from PNG or baked once from procedural uv_map, so shading
+	//  reads texels instead of calling std::function for every point.
+	// Coordinates are in [0, 1] over whole texture, texel centers are at (i + 0.5) / size.
+	class Texture {
+
+		struct Level {
+			int width = 0, height = 0;
+			// 4 bytes per texel as r, g, b, a
+			std::vector<uint8_t> texels;
+		};
+
+		std::vector<Level> levels;
+
+		static inline int wrap(int i, int size, TextureWrap mode) {
+			if (mode == TextureWrap::CLAMP)
+				return i < 0 ? 0 : (i >= size ? size - 1 : i);
+			i %= size;
+			return i < 0 ? i + size : i;
+		};
+
+		static inline int floor_int(double x) {
+			int i = (int) x;
+			return i - (x < i);
+		};
+
+		// Split texel coordinate into first texel index, next texel index
+		//  and weight of next texel with 8 bits of precision
+		static inline int texel_coord(double x, int size, TextureWrap mode, int& i0, int& i1) {
+			if (mode == TextureWrap::REPEAT) {
+				// Coordinates may be far from [0, 1], bring them into range of int first
+				if (!(x > -1e9 && x < 1e9))
+					x = std::isfinite(x) ? std::fmod(x, (double) size) : 0.0;
+				int i = floor_int(x);
+				int w = (int) ((x - i) * 256.0);
+				i -= floor_int(i * (1.0 / size)) * size;
+				i0 = i < 0 ? i + size : (i >= size ? i - size : i);
+				i1 = i0 + 1 == size ? 0 : i0 + 1;
+				return w;
+			}
+
+			x = x > 0.0 ? (x < size - 1 ? x : size - 1) : 0.0;
+			i0 = (int) x;
+			i1 = i0 + 1 == size ? i0 : i0 + 1;
+			return (int) ((x - i0) * 256.0);
+		};
+
+		// Bilinear lookup in level, result is r, g, b, a in [0, 255] with 8 bits of fraction
+		void bilinear(const Level& l, double u, double v, int* out) const {
+			int x0, x1, y0, y1;
+			int tx = texel_coord(u * l.width - 0.5, l.width, wrap_u, x0, x1);
+			int ty = texel_coord(v * l.height - 0.5, l.height, wrap_v, y0, y1);
+
+			const uint8_t* t00 = &l.texels[4 * ((size_t) y0 * l.width + x0)];
+			const uint8_t* t10 = &l.texels[4 * ((size_t) y0 * l.width + x1)];
+			const uint8_t* t01 = &l.texels[4 * ((size_t) y1 * l.width + x0)];
+			const uint8_t* t11 = &l.texels[4 * ((size_t) y1 * l.width + x1)];
+
+			for (int c = 0; c < 4; ++c) {
+				int top    = t00[c] * (256 - tx) + t10[c] * tx;
+				int bottom = t01[c] * (256 - tx) + t11[c] * tx;
+				out[c] = (top * (256 - ty) + bottom * ty + 128) >> 8;
+			}
+		};
+
+		static inline spaint::Color to_color(const int* c) {
+			return spaint::Color((c[0] + 128) >> 8, (c[1] + 128) >> 8, (c[2] + 128) >> 8, (c[3] + 128) >> 8);
+		};
+
+	public:
+
+		TextureWrap wrap_u = TextureWrap::REPEAT;
+		TextureWrap wrap_v = TextureWrap::REPEAT;
+
+		Texture() {};
+
+		// Load PNG file with mip levels
+		Texture(const std::string& filename) {
+			load_png(filename);
+		};
+
+		// Load PNG file & build mip levels, throws std::runtime_error if file can not be decoded
+		void load_png(const std::string& filename) {
+			std::vector<unsigned char> image;
+			unsigned width, height;
+			unsigned error = lodepng::decode(image, width, height, filename);
+			if (error)
+				throw std::runtime_error("PNG " + filename + ": " + lodepng_error_text(error));
+
+			set(width, height, image.data());
+		};
+
+		// Copy width * height RGBA texels & build mip levels
+		void set(int width, int height, const uint8_t* rgba) {
+			if (width <= 0 || height <= 0)
+				throw std::runtime_error("Texture size must be positive");
+
+			levels.assign(1, Level());
+			levels[0].width = width;
+			levels[0].height = height;
+			levels[0].texels.assign(rgba, rgba + (size_t) width * height * 4);
+			build_mipmaps();
+		};
+
+		// Evaluate map once at every texel center & build mip levels.
+		// Texture coordinate [0, 1] corresponds to map coordinate [min, max] on both axes.
+		void bake(const std::function<spaint::Color(double, double)>& map, int width, int height, double u_min, double u_max, double v_min, double v_max) {
+			if (width <= 0 || height <= 0)
+				throw std::runtime_error("Texture size must be positive");
+
+			levels.assign(1, Level());
+			Level& l = levels[0];
+			l.width = width;
+			l.height = height;
+			l.texels.resize((size_t) width * height * 4);
+
+			for (int y = 0; y < height; ++y)
+				for (int x = 0; x < width; ++x) {
+					spaint::Color c = map(u_min + (x + 0.5) / width * (u_max - u_min), v_min + (y + 0.5) / height * (v_max - v_min));
+					c.normalize();
+					uint8_t* t = &l.texels[4 * ((size_t) y * width + x)];
+					t[0] = c.r;
+					t[1] = c.g;
+					t[2] = c.b;
+					t[3] = c.a;
+				}
+
+			build_mipmaps();
+		};
+
+		// Rebuild levels after first one with 2x2 box filter
+		void build_mipmaps() {
+			levels.resize(1);
+
+			while (levels.back().width > 1 || levels.back().height > 1) {
+				const Level& src = levels.back();
+				Level dst;
+				dst.width = std::max(1, src.width / 2);
+				dst.height = std::max(1, src.height / 2);
+				dst.texels.resize((size_t) dst.width * dst.height * 4);
+
+				for (int y = 0; y < dst.height; ++y)
+					for (int x = 0; x < dst.width; ++x) {
+						int x0 = std::min(2 * x, src.width - 1), x1 = std::min(2 * x + 1, src.width - 1);
+						int y0 = std::min(2 * y, src.height - 1), y1 = std::min(2 * y + 1, src.height - 1);
+						for (int c = 0; c < 4; ++c) {
+							int sum = src.texels[4 * ((size_t) y0 * src.width + x0) + c] + src.texels[4 * ((size_t) y0 * src.width + x1) + c]
+									+ src.texels[4 * ((size_t) y1 * src.width + x0) + c] + src.texels[4 * ((size_t) y1 * src.width + x1) + c];
+							dst.texels[4 * ((size_t) y * dst.width + x) + c] = (sum + 2) / 4;
+						}
+					}
+
+				levels.push_back(std::move(dst));
+			}
+		};
+
+		inline bool empty() const {
+			return levels.empty();
+		};
+
+		inline int get_width() const {
+			return levels.empty() ? 0 : levels[0].width;
+		};
+
+		inline int get_height() const {
+			return levels.empty() ? 0 : levels[0].height;
+		};
+
+		inline int get_level_count() const {
+			return levels.size();
+		};
+
+		// RGBA texels of level, 4 bytes per texel row by row
+		inline const uint8_t* get_texels(int level = 0) const {
+			return levels[level].texels.data();
+		};
+
+		// Level of detail for lookup covering footprint of given size in texture coordinates
+		inline double get_lod(double footprint) const {
+			double texels = footprint * std::max(get_width(), get_height());
+			return texels > 1.0 ? std::log2(texels) : 0.0;
+		};
+
+		// Texel of level without filtering
+		spaint::Color texel(int x, int y, int level = 0) const {
+			const Level& l = levels[level];
+			const uint8_t* t = &l.texels[4 * ((size_t) wrap(y, l.height, wrap_v) * l.width + wrap(x, l.width, wrap_u))];
+			return spaint::Color(t[0], t[1], t[2], t[3]);
+		};
+
+		// Bilinear lookup in first level
+		spaint::Color sample(double u, double v) const {
+			if (levels.empty())
+				return spaint::Color(0);
+
+			int c[4];
+			bilinear(levels[0], u, v, c);
+			return to_color(c);
+		};
+
+		// Trilinear lookup blending bilinear lookups of two nearest levels
+		spaint::Color sample(double u, double v, double lod) const {
+			if (levels.empty())
+				return spaint::Color(0);
+			if (lod <= 0.0)
+				return sample(u, v);
+
+			int last = levels.size() - 1;
+			int a[4], b[4];
+			if (lod >= last) {
+				bilinear(levels[last], u, v, a);
+				return to_color(a);
+			}
+
+			int level = (int) lod;
+			int t = (int) ((lod - level) * 256.0);
+			bilinear(levels[level], u, v, a);
+			bilinear(levels[level + 1], u, v, b);
+			for (int c = 0; c < 4; ++c)
+				a[c] = (a[c] * (256 - t) + b[c] * t + 128) >> 8;
+			return to_color(a);
+		};
+	};
+};
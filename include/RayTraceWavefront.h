@@ -0,0 +1,177 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#include "RayTrace.h"
+#include "RayTraceRenderer.h"
+
+namespace raytrace {
+
+	// Renderer tracing rays of tile in waves instead of one pixel at a time.
+	// All primary rays of tile form the first wave. Closest hits of a wave are
+	//  found together, rays are sorted by depth and direction so packets of
+	//  neighbouring rays share BVH traversal and SIMD kernels. Hits are then
+	//  shaded grouped by object, and nested reflection, refraction and diffuse
+	//  rays of all pixels form the next wave.
+	// Each pixel keeps it's own path state and sampler, so image is same as
+	//  rendered by Renderer.
+	class WavefrontRenderer {
+
+		// State of tile being rendered by one worker, reused between tiles
+		struct TileState {
+			std::vector<RayTraceScene::RayPath> paths;
+			std::vector<Sampler> samplers;
+			// Primary rays of tile
+			std::vector<ray> rays;
+			// Paths waiting for closest hit
+			std::vector<int> wave;
+			std::vector<int> next_wave;
+			// Sort key of each path in wave
+			std::vector<uint32_t> keys;
+			std::vector<int> closest;
+			std::vector<TraceManifold> closest_hits;
+		};
+
+		RayTrace& rt;
+		Renderer renderer;
+		std::vector<TileState> states;
+
+		// Group rays by depth first, then by direction octant
+		static inline uint32_t ray_key(const RayTraceScene::RayPath& path) {
+			const ray& r = path.get_ray();
+			uint32_t octant = (r.B.x < 0 ? 1 : 0) | (r.B.y < 0 ? 2 : 0) | (r.B.z < 0 ? 4 : 0);
+			return ((uint32_t) path.get_depth() << 3) | octant;
+		};
+
+		// Find closest hits of all rays in wave
+		void intersect(TileState& s) {
+			RayTraceScene& scene = rt.get_scene();
+			std::vector<int>& wave = s.wave;
+
+			for (int p : wave)
+				s.keys[p] = ray_key(s.paths[p]);
+			std::stable_sort(wave.begin(), wave.end(), [&s](int a, int b) {
+				return s.keys[a] < s.keys[b];
+			});
+
+			ray rays[simd::PACKET_SIZE];
+			TraceManifold hits[simd::PACKET_SIZE];
+			int closest[simd::PACKET_SIZE];
+
+			for (int i = 0; i < (int) wave.size(); ) {
+				// Packet of rays with same key, packets can not skip ignored object
+				int count = 0;
+				for (; i + count < (int) wave.size() && count < simd::PACKET_SIZE; ++count) {
+					const RayTraceScene::RayPath& path = s.paths[wave[i + count]];
+					if (s.keys[wave[i + count]] != s.keys[wave[i]] || path.get_ignored_id() != -1)
+						break;
+					rays[count] = path.get_ray();
+				}
+
+				if (!count) {
+					int p = wave[i++];
+					s.closest[p] = scene.find_closest(s.paths[p].get_ray(), s.closest_hits[p], s.paths[p].get_ignored_id());
+					continue;
+				}
+
+				scene.find_closest_packet(rays, count, hits, closest);
+				for (int k = 0; k < count; ++k) {
+					int p = wave[i + k];
+					s.closest[p] = closest[k];
+					s.closest_hits[p] = hits[k];
+				}
+				i += count;
+			}
+		};
+
+		void write_pixel(const Tile& t, int p, const RayTraceScene::RayPath& path, unsigned int* frame) {
+			const HitManifold& hit = path.get_result();
+			spaint::Color c = hit.hit ? hit.color : rt.get_background();
+			c.a = 255;
+			frame[t.x + p % t.width + (size_t) (t.y + p / t.width) * rt.get_width()] = c.abgr();
+		};
+
+		void render_tile(const Tile& t, TileState& s, unsigned int* frame) {
+			RayTraceScene& scene = rt.get_scene();
+			int pixels = t.width * t.height;
+
+			if ((int) s.paths.size() < pixels) {
+				s.paths.resize(pixels);
+				s.samplers.resize(pixels);
+				s.rays.resize(pixels);
+				s.keys.resize(pixels);
+				s.closest.resize(pixels);
+				s.closest_hits.resize(pixels);
+			}
+
+			rt.primary_rays(t.x, t.y, t.width, t.height, s.rays.data());
+
+			s.wave.clear();
+			for (int p = 0; p < pixels; ++p) {
+				int x = t.x + p % t.width;
+				int y = t.y + p / t.width;
+
+				s.samplers[p] = Sampler(scene.sample_sequence, scene.seed);
+				s.samplers[p].start(x, y, 0);
+
+				RAYTRACE_COUNT(rays[RAY_PRIMARY]++);
+				scene.start_path(s.paths[p], s.rays[p]);
+				if (scene.advance_path(s.paths[p], s.samplers[p]))
+					s.wave.push_back(p);
+				else
+					write_pixel(t, p, s.paths[p], frame);
+			}
+
+			while (!s.wave.empty()) {
+				if (renderer.is_cancelled())
+					return;
+
+				intersect(s);
+
+				// Shade hits of same object together, materials & light points stay in cache
+				std::stable_sort(s.wave.begin(), s.wave.end(), [&s](int a, int b) {
+					return s.closest[a] < s.closest[b];
+				});
+
+				s.next_wave.clear();
+				for (int p : s.wave) {
+					scene.resume_path(s.paths[p], s.closest[p], s.closest_hits[p]);
+					if (scene.advance_path(s.paths[p], s.samplers[p]))
+						s.next_wave.push_back(p);
+					else
+						write_pixel(t, p, s.paths[p], frame);
+				}
+
+				s.wave.swap(s.next_wave);
+			}
+		};
+
+	public:
+
+		WavefrontRenderer(RayTrace& rt) : rt(rt), renderer(rt) {};
+
+		WavefrontRenderer(RayTrace& rt, int thread_count) : rt(rt), renderer(rt, thread_count) {};
+
+		// Underlying tile scheduler, holds tile size, thread count, progress & stats
+		inline Renderer& get_renderer() {
+			return renderer;
+		};
+
+		inline void cancel() {
+			renderer.cancel();
+		};
+
+		// Render frame into buffer of width * height ABGR pixels.
+		// Returns 1 if frame is complete, 0 if render was cancelled.
+		bool render(unsigned int* frame) {
+			renderer.reset_stats();
+			states.resize(renderer.get_thread_count());
+
+			return renderer.run([this, frame](const Tile& t, int thread_id) {
+				render_tile(t, states[thread_id], frame);
+			});
+		};
+	};
+};